@@ -15,14 +15,20 @@ typedef struct entry_s {
   char *fname;           // file name
   char varname[32];      // C variable name
   int sz;
+  int z, x, y;           // tile coordinates, z is -1 for other files
 } entry_t;
 
+// tiles of zoom levels below this go to the dense tile table
+#define MAXTILEZOOM 10
+
 typedef struct index_s {
   entry_t *head, *tail;
   char *ipath;
   char *opath;
   char *prefix;
   int cnt;
+  int ntiles;            // entries in the tile table
+  int tilezooms;         // zoom levels of the tile table
 } index_t;
 
 // forward
@@ -118,9 +124,76 @@ char *rmprefix( char *pfx, char *s )
   return s;
 }
 
+// tells if 'name' is a tile 'tiles/z/x/y.pbf' of the tile table and gets
+// its coordinates, tiles outside of the XYZ grid stay in the hash table
+int tile_name( char *name, int *z, int *x, int *y )
+{
+  char buf[64];
+  
+  if ( sscanf( name, "tiles/%d/%d/%d.pbf", z, x, y ) != 3 ) {
+    return 0;
+  }
+  // numbers must be written as world.c parses them
+  snprintf( buf, sizeof(buf), "tiles/%d/%d/%d.pbf", *z, *x, *y );
+  if ( strcmp( buf, name ) ) {
+    return 0;
+  }
+  return (*z >= 0) && (*z < MAXTILEZOOM) && (*x >= 0) && (*y >= 0) && !(*x >> *z) && !(*y >> *z);
+}
+
+// tile table has an entry per tile of each zoom level up to the highest
+// one found : zoom level z starts at entry (4^z-1)/3 and tile x,y is at
+// entry y*2^z+x of its level. Missing tiles have no data.
+int index_tiles( index_t *index )
+{
+  entry_t **tab, *ent;
+  int i, n;
+  char path[256];
+  FILE *fout;
+
+  n = ((1 << (2 * index->tilezooms)) - 1) / 3;
+  tab = (entry_t**) emalloc( (n + 1) * sizeof(entry_t*));
+  for( ent = index->head; ent; ent = ent->next ) {
+    if ( ent->z >= 0 ) {
+      tab[((1 << (2 * ent->z)) - 1) / 3 + (ent->y << ent->z) + ent->x] = ent;
+    }
+  }
+
+  snprintf( path, sizeof(path), "%s/__tiles__.c", index->opath );
+  fout = dofopen( path, "w" );
+
+  for( ent = index->head; ent; ent = ent->next ) {
+    if ( ent->z >= 0 ) {
+      fprintf( fout, "extern char %s[];\n", ent->varname );
+    }
+  }
+  
+  fputs( "struct { char *data; int sz; }  __arch__tiles__[] = {\n", fout );
+  for( i = 0; i < n; ++i ) {
+    if ( tab[i] ) {
+      fprintf( fout, " { %s, %d },\n", tab[i]->varname, tab[i]->sz );
+    }
+    else {
+      fprintf( fout, " { (char*)0, 0 },\n" );
+    }
+  }
+  if ( n == 0 ) {
+    fprintf( fout, " { (char*)0, 0 },\n" );
+  }
+  fputs( "};\n", fout );
+
+  fprintf( fout, "int __arch__tilezooms__ = %d;\n", index->tilezooms );
+  fprintf( fout, "// tile count : %d\n", index->ntiles );
+
+  fclose(fout);
+  free( tab );
+  return 0;
+}
+
+// hash table of files holds all but the tiles of the tile table
 int index_hash( index_t *index )
 {
-  uint32_t h, p = prime( index->cnt );
+  uint32_t h, p = prime( index->cnt - index->ntiles );
   entry_t **tab, *ent;
   int i, e, me = 0;
   char path[256];
@@ -129,6 +202,7 @@ int index_hash( index_t *index )
   tab = (entry_t**) emalloc( p * sizeof(entry_t*));
 
   for( ent = index->head; ent; ent = ent->next ) {
+    if ( ent->z >= 0 ) continue;
     h = hash(p, rmprefix(index->prefix, ent->fname));
     e = 0;
     while( tab[h] ) { e++; h++; if ( h >= p ) h = 0; }
@@ -140,6 +214,7 @@ int index_hash( index_t *index )
   fout = dofopen( path, "w" );
 
   for( ent = index->head; ent; ent = ent->next ) {
+    if ( ent->z >= 0 ) continue;
     fprintf( fout, "extern char %s[];\n", ent->varname );
   }
   
@@ -157,10 +232,10 @@ int index_hash( index_t *index )
   fputs( "};\n", fout );
 
   fprintf( fout, "int __arch__prime__ = %d;\n", p );
-  fprintf( fout, "int __arch__count__ = %d;\n", index->cnt );
+  fprintf( fout, "int __arch__count__ = %d;\n", index->cnt - index->ntiles );
   
   fprintf( fout, "// hastable size : %d\n", p );
-  fprintf( fout, "// elt count     : %d\n", index->cnt );
+  fprintf( fout, "// elt count     : %d\n", index->cnt - index->ntiles );
   fprintf( fout, "// max excursion : %d\n", me );
 
   fclose(fout);
@@ -179,6 +254,8 @@ void index_free( index_t *index )
 
   index->head = index->tail = NULL;
   index->cnt = 0;
+  index->ntiles = 0;
+  index->tilezooms = 0;
 }
 
 entry_t *index_add( index_t *index, char *path )
@@ -195,6 +272,16 @@ entry_t *index_add( index_t *index, char *path )
     exit(1);
   }
 
+  // tiles go to the tile table
+  ent->z = -1;
+  if ( tile_name( rmprefix( index->prefix, ent->fname ), &ent->z, &ent->x, &ent->y ) ) {
+    index->ntiles++;
+    if ( ent->z >= index->tilezooms ) index->tilezooms = ent->z + 1;
+  }
+  else {
+    ent->z = -1;
+  }
+
   ent->next = NULL;
   if ( index->tail ) {
     index->tail->next = ent;
@@ -468,6 +555,8 @@ int main( int argc, char **argv )
     index.opath = opath;
     index.prefix = prefix;
     index.cnt = 0;
+    index.ntiles = 0;
+    index.tilezooms = 0;
 
     // remove trailing /
     len = strlen(ipath)-1;
@@ -483,6 +572,7 @@ int main( int argc, char **argv )
     walkdir( idir, ipath, &index);
     index_arch( &index );
     index_hash( &index );
+    index_tiles( &index );
     index_free( &index );
     closedir( idir );
   }
@@ -25,6 +25,56 @@ extern struct {
 extern int __arch__prime__;
 extern int __arch__count__;
 
+// tiles 'tiles/z/x/y.pbf' by zoom level, row and column, see mkarch.c
+extern struct {
+  char *data;
+  int sz;
+}  __arch__tiles__[];
+
+extern int __arch__tilezooms__;
+
+/* --------------------------------------------------------------------------
+ *  Parses a decimal number of 'k', returns -1 if there is none. Numbers
+ *  don't start with 0 unless they are 0.
+ * --------------------------------------------------------------------------*/
+static int arch_num( char **k, char *end )
+{
+  int v = 0, n = 0;
+  while( (*k < end) && (**k >= '0') && (**k <= '9') && (n < 9) && ((n == 0) || (v > 0)) ) {
+    v = 10 * v + (*(*k)++ - '0');
+    n++;
+  }
+  return n ? v : -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Looks up tile 'tiles/z/x/y.pbf' in the tile table. Returns its size
+ *  or -1 if 'k' doesn't name a tile of the table, data is NULL if the
+ *  tile is missing.
+ * --------------------------------------------------------------------------*/
+int arch_tile( char *k, int len, char **data )
+{
+  char *end = k + len;
+  int z, x, y, i;
+
+  *data = NULL;
+  if ( (len < 6) || memcmp( k, "tiles/", 6 ) ) {
+    return -1;
+  }
+  k += 6;
+  if ( ((z = arch_num( &k, end )) < 0) || (k == end) || (*k++ != '/') ||
+       ((x = arch_num( &k, end )) < 0) || (k == end) || (*k++ != '/') ||
+       ((y = arch_num( &k, end )) < 0) || (end - k != 4) || memcmp( k, ".pbf", 4 ) ) {
+    return -1;
+  }
+  if ( (z >= __arch__tilezooms__) || (x >> z) || (y >> z) ) {
+    return -1;
+  }
+  i = ((1 << (2 * z)) - 1) / 3 + (y << z) + x;
+  *data = __arch__tiles__[i].data;
+  return __arch__tiles__[i].sz;
+}
+
 char *arch_data( char *k )
 {
   uint32_t h = hash( __arch__prime__, k );
@@ -32,7 +82,7 @@ char *arch_data( char *k )
     if ( !strcmp( __arch__index__[h].key, k) ) {
       return __arch__index__[h].data;
     }
-    ++h; if ( h > __arch__prime__ ) h = 0;
+    ++h; if ( h >= __arch__prime__ ) h = 0;
   }
   return NULL;
 }
@@ -46,7 +96,7 @@ char *arch_data_len( char *k, int len )
     if ( !strncmp( __arch__index__[h].key, k, len) ) {
       return __arch__index__[h].data;
     }
-    ++h; if ( h > __arch__prime__ ) h = 0;
+    ++h; if ( h >= __arch__prime__ ) h = 0;
   }
   return NULL;
 }
@@ -58,7 +108,7 @@ int arch_size( char *k )
     if ( !strcmp( __arch__index__[h].key, k) ) {
       return __arch__index__[h].sz;
     }
-    ++h; if ( h > __arch__prime__ ) h = 0;
+    ++h; if ( h >= __arch__prime__ ) h = 0;
   }
   return -1;
 }
@@ -71,7 +121,7 @@ int arch_size_len( char *k, int len )
     if ( !strncmp( __arch__index__[h].key, k, len) ) {
       return __arch__index__[h].sz;
     }
-    ++h; if ( h > __arch__prime__ ) h = 0;
+    ++h; if ( h >= __arch__prime__ ) h = 0;
   }
   return -1;
 }
@@ -301,7 +351,7 @@ char *http_rm_percent( char *path, int len )
 void http_reply( cnx_t *cnx )
 {
   char *data, *mtype, *k;
-  int l;
+  int l, len;
 
   
   if ( cnx->urlp.field_set & (1 << UF_QUERY) ) {
@@ -325,12 +375,16 @@ void http_reply( cnx_t *cnx )
     l = strlen(k);
     fprintf( stderr, "URL %.*s\n", l, k );
     
-    data = arch_data_len( k, l);
+    // tiles are found by coordinates, other files by name
+    len = arch_tile( k, l, &data );
+    if ( len < 0 ) {
+      data = arch_data_len( k, l);
+      len = arch_size_len( k, l);
+    }
 		       
     if ( data ) {
       mtype = http_mimetype(k,l);
       if ( cnx->parser.method == HTTP_GET ) {
-	int len = arch_size_len( k, l);
 	if ( !strcmp( k, "tiles/tiles.json") ) {
 	  http_reply_tiles( cnx, mtype, data, len );
 	}
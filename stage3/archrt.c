@@ -181,7 +181,8 @@ static char *cache_uncompress (struct arch_cache_s *e)
   logger("uncompressing %s\n", e->elem->key);
 
   ulen = (e->elem->ratio*e->elem->sz)>>3;
-  e->udata = (char*) malloc (ulen);
+  // one more byte to end text members with a null character
+  e->udata = (char*) malloc (ulen + 1);
   if (e->udata == NULL) {
     perror ("cache_uncompress: malloc()");
     exit(1);
@@ -194,6 +195,7 @@ static char *cache_uncompress (struct arch_cache_s *e)
     exit (1);
   }
   e->usz = ulen;
+  e->udata[ulen] = 0;
 
   return e->udata;
 }
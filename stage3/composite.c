@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json.h>
+
+#include "composite.h"
+#include "source.h"
+#include "mbtiles.h"
+#include "mvt.h"
+
+extern void logger(const char *fmt, ...);
+
+typedef struct composite_s {
+  char *paths;                // copy of path, split on '+'
+  source_t *srcs[COMPOSITE_MAX];
+  int nsrcs;
+  mvtbuf_t raw;               // concatenated layers
+  mvtbuf_t out;               // composited tile
+  struct json_object *tiles;  // tiles.json object
+  char *tiles_json;
+  int tjlen;
+} composite_t;
+
+/* --------------------------------------------------------------------------
+ *  Open the sources of 'a+b+...' path
+ * --------------------------------------------------------------------------*/
+void *composite_open( char *path )
+{
+  struct json_object *tj;
+  enum json_tokener_error error;
+  composite_t *c;
+  char *p, *save = NULL;
+
+  c = (composite_t*) calloc( 1, sizeof(composite_t));
+  if ( c ) c->paths = strdup( path );
+  if ( (c == NULL) || (c->paths == NULL) ) {
+    fputs( "composite: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  c->tiles = mbtiles_meta_new();
+  json_object_object_add( c->tiles, "name", json_object_new_string( path ));
+  
+  for( p = strtok_r( c->paths, "+", &save ); p; p = strtok_r( NULL, "+", &save )) {
+    if ( c->nsrcs == COMPOSITE_MAX ) {
+      fprintf( stderr, "composite: at most %d sources can be composited.\n", COMPOSITE_MAX );
+      composite_close( c );
+      return NULL;
+    }
+    c->srcs[c->nsrcs] = source_open( p );
+    if ( c->srcs[c->nsrcs] == NULL ) {
+      composite_close( c );
+      return NULL;
+    }
+    tj = json_tokener_parse_verbose( source_tiles_json( c->srcs[c->nsrcs], NULL ), &error );
+    if ( error != json_tokener_success ) {
+      fprintf( stderr, "%s: failed to parse tiles.json: %s\n",
+	       p, json_tokener_error_desc( error ));
+      composite_close( c );
+      return NULL;
+    }
+    mbtiles_meta_merge( c->tiles, tj );
+    json_object_put( tj );
+    c->nsrcs++;
+  }
+  
+  logger( "composite '%s' : %d sources\n", path, c->nsrcs );
+  return (void*) c;
+}
+
+/* --------------------------------------------------------------------------
+ *  Close composite and its sources
+ * --------------------------------------------------------------------------*/
+void composite_close( void *h )
+{
+  composite_t *c = (composite_t*) h;
+  int i;
+
+  if ( c == NULL ) return;
+  for( i = 0; i < c->nsrcs; ++i ) {
+    source_close( c->srcs[i] );
+  }
+  json_object_put( c->tiles );
+  mvt_free( &c->raw );
+  mvt_free( &c->out );
+  free( c->paths );
+  free( c );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile from all sources and merges them
+ *  A tile found in a single source is returned as is. Otherwise tiles are
+ *  inflated, concatenated without decoding and compressed again as a
+ *  single gzip member: HTTP clients don't reliably handle multi-member
+ *  gzip streams. Returned data is valid until next call.
+ * --------------------------------------------------------------------------*/
+char *composite_read( void *h, int z, int x, int y, int *len )
+{
+  composite_t *c = (composite_t*) h;
+  char *data[COMPOSITE_MAX];
+  int lens[COMPOSITE_MAX];
+  int i, n = 0;
+
+  for( i = 0; i < c->nsrcs; ++i ) {
+    data[n] = source_read_quiet( c->srcs[i], z, x, y, lens + n );
+    if ( data[n] && (lens[n] > 0) ) {
+      n++;
+    }
+  }
+
+  if ( n == 0 ) {
+    return NULL;
+  }
+  if ( n == 1 ) {
+    *len = lens[0];
+    return data[0];
+  }
+
+  c->raw.len = 0;
+  for( i = 0; i < n; ++i ) {
+    if ( mvt_append( &c->raw, data[i], lens[i] ) < 0 ) {
+      fprintf( stderr, "composite: bad tile %d/%d/%d\n", z, x, y );
+      return NULL;
+    }
+  }
+  if ( mvt_gzip( &c->out, c->raw.data, c->raw.len, COMPOSITE_LEVEL ) < 0 ) {
+    return NULL;
+  }
+  logger( "composite: %d/%d/%d merged from %d tiles, %d bytes\n", z, x, y, n, c->out.len );
+  *len = c->out.len;
+  return c->out.data;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' merging sources properties
+ * --------------------------------------------------------------------------*/
+char *composite_tiles_json( void *h, int *len )
+{
+  composite_t *c = (composite_t*) h;
+  if ( c->tiles_json == NULL ) {
+    c->tiles_json = mbtiles_meta_json( c->tiles, &c->tjlen );
+  }
+  if ( len != NULL ) {
+    *len = c->tjlen;
+  }
+  return c->tiles_json;
+}
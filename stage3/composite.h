@@ -0,0 +1,21 @@
+#ifndef __COMPOSITE_H__
+#define __COMPOSITE_H__
+
+/* --------------------------------------------------------------------------
+ *  Composite of vector tile sources given as 'a.mbtiles+b.mbtiles'.
+ *  When several sources hold a tile, their layers are concatenated in
+ *  a single tile, layers of the last source being drawn on top.
+ * --------------------------------------------------------------------------*/
+
+// max number of composited sources
+#define COMPOSITE_MAX 8
+
+// compression level of composited tiles
+#define COMPOSITE_LEVEL 6
+
+void *composite_open( char *path );
+void  composite_close( void *h );
+char *composite_read( void *h, int z, int x, int y, int *len );
+char *composite_tiles_json( void *h, int *len );
+
+#endif
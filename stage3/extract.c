@@ -0,0 +1,535 @@
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <json.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#include "extract.h"
+#include "source.h"
+
+typedef struct xtile_s {
+  int x, y, len;              // XYZ row, followed by 'len' bytes of data
+} xtile_t;
+
+typedef struct xjob_s {
+  int z, x0, x1, y0, y1;      // XYZ rows
+  char *buf;                  // tiles read
+  size_t len, size;
+  int ntiles;
+  int err;
+} xjob_t;
+
+typedef struct xrange_s {
+  int x0[30], x1[30], y0[30], y1[30];
+  int z0, z1;
+} xrange_t;
+
+typedef struct extract_s {
+  xjob_t *jobs;               // jobs of current batch
+  int njobs, next;
+  pthread_mutex_t lock;
+  int z, x, y;                // next job to make
+  xrange_t r;
+} extract_t;
+
+typedef struct xreader_s {
+  pthread_t th;
+  source_t *src;
+  extract_t *x;
+} xreader_t;
+
+/* --------------------------------------------------------------------------
+ *  Parses extract specification 'west,south,east,north,z0-z1', the
+ *  range of zoom levels can be a single zoom level
+ * --------------------------------------------------------------------------*/
+static int extract_spec( char *spec, double *b, int *z0, int *z1 )
+{
+  char c;
+  int n;
+
+  n = sscanf( spec, "%lf,%lf,%lf,%lf,%d-%d%c", b, b+1, b+2, b+3, z0, z1, &c );
+  if ( n == 5 ) {
+    *z1 = *z0;
+  }
+  else if ( n != 6 ) {
+    fprintf( stderr, "invalid extract '%s', expecting 'west,south,east,north,z0-z1'.\n", spec );
+    return -1;
+  }
+  // bounds crossing the antimeridian are not handled
+  if ( (b[0] < -180.0) || (b[2] > 180.0) || (b[1] < -90.0) || (b[3] > 90.0) ||
+       (b[0] >= b[2]) || (b[1] >= b[3]) ) {
+    fprintf( stderr, "invalid extract bounding box '%s'.\n", spec );
+    return -1;
+  }
+  if ( (*z0 < 0) || (*z1 > 29) || (*z0 > *z1) ) {
+    fprintf( stderr, "invalid extract zoom levels '%s', expecting 0 to 29.\n", spec );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Restricts bounding box and zoom levels of extract to the ones of
+ *  the map. Returns -1 when nothing is left.
+ * --------------------------------------------------------------------------*/
+static int extract_clip( source_t *src, double *b, int *z0, int *z1 )
+{
+  struct json_object *tj, *v;
+  enum json_tokener_error error;
+  double mb[4];
+  int i;
+
+  tj = json_tokener_parse_verbose( source_tiles_json( src, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    return 0;
+  }
+  if ( (json_object_object_get_ex( tj, "minzoom", &v ) == TRUE) && (json_object_get_int( v ) > *z0) ) {
+    *z0 = json_object_get_int( v );
+  }
+  if ( (json_object_object_get_ex( tj, "maxzoom", &v ) == TRUE) && (json_object_get_int( v ) < *z1) ) {
+    *z1 = json_object_get_int( v );
+  }
+  if ( (json_object_object_get_ex( tj, "bounds", &v ) == TRUE) && (json_object_array_length( v ) == 4) ) {
+    for( i = 0; i < 4; ++i ) {
+      mb[i] = json_object_get_double( json_object_array_get_idx( v, i ));
+    }
+    if ( (mb[0] < mb[2]) && (mb[1] < mb[3]) ) {
+      b[0] = fmax( b[0], mb[0] );
+      b[1] = fmax( b[1], mb[1] );
+      b[2] = fmin( b[2], mb[2] );
+      b[3] = fmin( b[3], mb[3] );
+    }
+  }
+  json_object_put( tj );
+
+  if ( (*z0 > *z1) || (b[0] >= b[2]) || (b[1] >= b[3]) ) {
+    fprintf( stderr, "extract doesn't intersect map.\n" );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Computes columns and rows of tiles inside bounding box at each
+ *  zoom level, rows are counted from the north
+ * --------------------------------------------------------------------------*/
+static void extract_range( xrange_t *r, double *b, int z0, int z1 )
+{
+  double lat, n;
+  int z;
+
+  r->z0 = z0;
+  r->z1 = z1;
+  for( z = z0; z <= z1; ++z ) {
+    n = (double) (1 << z);
+    r->x0[z] = (int) floor( (b[0] + 180.0) / 360.0 * n );
+    r->x1[z] = (int) floor( (b[2] + 180.0) / 360.0 * n );
+    lat = fmin( fmax( b[3], -85.0511 ), 85.0511 ) * M_PI / 180.0;
+    r->y0[z] = (int) floor( (1.0 - asinh( tan( lat )) / M_PI) / 2.0 * n );
+    lat = fmin( fmax( b[1], -85.0511 ), 85.0511 ) * M_PI / 180.0;
+    r->y1[z] = (int) floor( (1.0 - asinh( tan( lat )) / M_PI) / 2.0 * n );
+    if ( r->x0[z] < 0 ) r->x0[z] = 0;
+    if ( r->y0[z] < 0 ) r->y0[z] = 0;
+    if ( r->x1[z] >= n ) r->x1[z] = n - 1;
+    if ( r->y1[z] >= n ) r->y1[z] = n - 1;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Makes next read job : a band of columns scanned at once holding at
+ *  most EXTRACT_JOBTILES tiles, tall columns are split in several jobs.
+ *  Returns 0 when all tiles have been read.
+ * --------------------------------------------------------------------------*/
+static int extract_nextjob( extract_t *x, xjob_t *j )
+{
+  xrange_t *r = &x->r;
+  int rows, band;
+
+  if ( x->z > r->z1 ) {
+    return 0;
+  }
+  rows = r->y1[x->z] - x->y + 1;
+  band = (rows < EXTRACT_JOBTILES) ? EXTRACT_JOBTILES / rows : 1;
+  j->z = x->z;
+  j->x0 = x->x;
+  j->x1 = x->x + band - 1;
+  if ( j->x1 > r->x1[x->z] ) j->x1 = r->x1[x->z];
+  j->y0 = x->y;
+  j->y1 = (rows > EXTRACT_JOBTILES) ? x->y + EXTRACT_JOBTILES - 1 : r->y1[x->z];
+  j->len = 0;
+  j->ntiles = 0;
+  j->err = 0;
+
+  if ( j->y1 < r->y1[x->z] ) {
+    x->y = j->y1 + 1;
+  }
+  else if ( j->x1 < r->x1[x->z] ) {
+    x->x = j->x1 + 1;
+    x->y = r->y0[x->z];
+  }
+  else if ( ++x->z <= r->z1 ) {
+    x->x = r->x0[x->z];
+    x->y = r->y0[x->z];
+  }
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Appends a tile read to the buffer of its job
+ * --------------------------------------------------------------------------*/
+static void extract_ontile( void *arg, int z, int x, int y, char *data, int len )
+{
+  xjob_t *j = (xjob_t*) arg;
+  xtile_t t;
+  size_t sz;
+  char *p;
+
+  if ( j->err ) return;
+  sz = sizeof(t) + len;
+  if ( j->len + sz > j->size ) {
+    size_t nsize = j->size ? j->size : 65536;
+    while( nsize < j->len + sz ) nsize *= 2;
+    p = realloc( j->buf, nsize );
+    if ( p == NULL ) {
+      j->err = 1;
+      return;
+    }
+    j->buf = p;
+    j->size = nsize;
+  }
+  t.x = x;
+  t.y = y;
+  t.len = len;
+  memcpy( j->buf + j->len, &t, sizeof(t) );
+  memcpy( j->buf + j->len + sizeof(t), data, len );
+  j->len += sz;
+  j->ntiles++;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reader thread : scans tiles of jobs of current batch
+ * --------------------------------------------------------------------------*/
+static void *extract_read( void *arg )
+{
+  xreader_t *rd = (xreader_t*) arg;
+  extract_t *x = rd->x;
+  xjob_t *j;
+  int i;
+
+  for(;;) {
+    pthread_mutex_lock( &x->lock );
+    i = x->next++;
+    pthread_mutex_unlock( &x->lock );
+    if ( i >= x->njobs ) break;
+    j = x->jobs + i;
+    if ( source_scan( rd->src, j->z, j->x0, j->y0, j->x1, j->y1, extract_ontile, j ) < 0 ) {
+      j->err = 1;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Runs SQL statements on extracted file, returns -1 on error
+ * --------------------------------------------------------------------------*/
+static int extract_exec( sqlite3 *db, char *sql )
+{
+  char *err = NULL;
+
+  if ( sqlite3_exec( db, sql, NULL, NULL, &err ) != SQLITE_OK ) {
+    fprintf( stderr, "SQL error: %s\n", err );
+    sqlite3_free( err );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a metadata row to extracted file
+ * --------------------------------------------------------------------------*/
+static int extract_meta( sqlite3 *db, const char *name, const char *value )
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  rc = sqlite3_prepare_v2( db, "INSERT INTO metadata (name, value) VALUES (?1, ?2)", -1, &stmt, NULL );
+  if ( rc != SQLITE_OK ) {
+    fprintf( stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db) );
+    return -1;
+  }
+  sqlite3_bind_text( stmt, 1, name, -1, SQLITE_STATIC );
+  sqlite3_bind_text( stmt, 2, value, -1, SQLITE_STATIC );
+  rc = sqlite3_step( stmt );
+  sqlite3_finalize( stmt );
+  if ( rc != SQLITE_DONE ) {
+    fprintf( stderr, "Failed to write metadata: %s\n", sqlite3_errmsg(db) );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Copies metadata of map to extracted file, except the ones changed
+ *  by the extract. Metadata of mbtiles files are copied as is, the
+ *  ones of other maps are made from their tiles.json.
+ * --------------------------------------------------------------------------*/
+static int extract_copymeta( sqlite3 *db, source_t *src )
+{
+  struct json_object *tj, *v, *val;
+  struct json_object_iterator it, end;
+  enum json_tokener_error error;
+  sqlite3_stmt *stmt;
+  const char *key;
+  char *skip[] = { "tilejson", "tiles", "scheme", "bounds", "center", "minzoom", "maxzoom", NULL };
+  int i, rc = 0;
+
+  if ( !strcmp( src->ops->name, "mbtiles" ) ) {
+    if ( sqlite3_prepare_v2( db, "ATTACH DATABASE ?1 AS src", -1, &stmt, NULL ) != SQLITE_OK ) {
+      fprintf( stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db) );
+      return -1;
+    }
+    sqlite3_bind_text( stmt, 1, src->path, -1, SQLITE_STATIC );
+    rc = sqlite3_step( stmt );
+    sqlite3_finalize( stmt );
+    if ( rc != SQLITE_DONE ) {
+      fprintf( stderr, "Cannot attach '%s': %s\n", src->path, sqlite3_errmsg(db) );
+      return -1;
+    }
+    rc = extract_exec( db, "INSERT INTO metadata (name, value) SELECT name, value FROM src.metadata "
+		       "WHERE name NOT IN ('bounds', 'center', 'minzoom', 'maxzoom')" );
+    if ( extract_exec( db, "DETACH DATABASE src" ) < 0 ) rc = -1;
+    return rc;
+  }
+
+  tj = json_tokener_parse_verbose( source_tiles_json( src, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    return 0;
+  }
+  end = json_object_iter_end( tj );
+  for( it = json_object_iter_begin( tj ); !json_object_iter_equal( &it, &end ); json_object_iter_next( &it ) ) {
+    key = json_object_iter_peek_name( &it );
+    val = json_object_iter_peek_value( &it );
+    for( i = 0; skip[i] && strcmp( skip[i], key ); ++i );
+    if ( skip[i] ) continue;
+    if ( !strcmp( key, "vector_layers" ) ) {
+      // mbtiles keep layers of vector tiles in 'json' metadata
+      v = json_object_new_object();
+      json_object_object_add( v, key, json_object_get( val ));
+      rc = extract_meta( db, "json", json_object_to_json_string_ext( v, JSON_C_TO_STRING_PLAIN ));
+      json_object_put( v );
+    }
+    else if ( json_object_is_type( val, json_type_string ) ) {
+      rc = extract_meta( db, key, json_object_get_string( val ));
+    }
+    else if ( json_object_is_type( val, json_type_int ) || json_object_is_type( val, json_type_double ) ) {
+      rc = extract_meta( db, key, json_object_to_json_string( val ));
+    }
+    if ( rc < 0 ) break;
+  }
+  json_object_put( tj );
+  return rc;
+}
+
+/* --------------------------------------------------------------------------
+ *  Writes tiles of a batch of jobs in a single transaction.
+ *  Returns the number of tiles written or -1 on error.
+ * --------------------------------------------------------------------------*/
+static int extract_write( sqlite3 *db, sqlite3_stmt *stmt, xjob_t *jobs, int njobs, int *nz )
+{
+  xtile_t t;
+  size_t off;
+  int i, k, rc, n = 0;
+
+  if ( extract_exec( db, "BEGIN" ) < 0 ) {
+    return -1;
+  }
+  for( i = 0; i < njobs; ++i ) {
+    xjob_t *j = jobs + i;
+    for( off = 0, k = 0; k < j->ntiles; ++k ) {
+      memcpy( &t, j->buf + off, sizeof(t) );
+      off += sizeof(t);
+      sqlite3_reset( stmt );
+      sqlite3_bind_int( stmt, 1, j->z );
+      sqlite3_bind_int( stmt, 2, t.x );
+      sqlite3_bind_int( stmt, 3, (1 << j->z) - 1 - t.y );
+      sqlite3_bind_blob( stmt, 4, j->buf + off, t.len, SQLITE_STATIC );
+      off += t.len;
+      rc = sqlite3_step( stmt );
+      if ( rc != SQLITE_DONE ) {
+	fprintf( stderr, "Failed to write tile: %s\n", sqlite3_errmsg(db) );
+	sqlite3_reset( stmt );
+	extract_exec( db, "ROLLBACK" );
+	return -1;
+      }
+    }
+    nz[j->z] += j->ntiles;
+    n += j->ntiles;
+  }
+  sqlite3_reset( stmt );
+  if ( extract_exec( db, "COMMIT" ) < 0 ) {
+    return -1;
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Extracts tiles of map 'path' inside bounding box and zoom levels of
+ *  'spec' to new mbtiles file 'opath'. Returns -1 on error.
+ * --------------------------------------------------------------------------*/
+int extract_mbtiles( char *path, char *spec, char *opath )
+{
+  extract_t x;
+  xreader_t *readers = NULL;
+  xjob_t *jobs = NULL;
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+  struct timespec t0, t1;
+  struct stat st;
+  double b[4];
+  char buf[256];
+  int i, z, z0, z1, nrd, njobs, n, rc = -1;
+  int nz[30];
+  unsigned long long total = 0;
+
+  if ( extract_spec( spec, b, &z0, &z1 ) < 0 ) {
+    return -1;
+  }
+  if ( stat( opath, &st ) == 0 ) {
+    fprintf( stderr, "output file '%s' already exists.\n", opath );
+    return -1;
+  }
+
+  nrd = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( nrd <= 0 ) nrd = 1;
+  if ( nrd > EXTRACT_READERS ) nrd = EXTRACT_READERS;
+  readers = calloc( nrd, sizeof(xreader_t) );
+  njobs = 2 * nrd;
+  jobs = calloc( njobs, sizeof(xjob_t) );
+  if ( (readers == NULL) || (jobs == NULL) ) {
+    fputs( "memory allocation error.\n", stderr );
+    goto done;
+  }
+
+  // every reader has its own handle on the map
+  for( i = 0; i < nrd; ++i ) {
+    readers[i].src = source_open( path );
+    if ( readers[i].src == NULL ) {
+      goto done;
+    }
+    readers[i].x = &x;
+  }
+  if ( extract_clip( readers[0].src, b, &z0, &z1 ) < 0 ) {
+    goto done;
+  }
+
+  memset( &x, 0, sizeof(x) );
+  memset( nz, 0, sizeof(nz) );
+  pthread_mutex_init( &x.lock, NULL );
+  extract_range( &x.r, b, z0, z1 );
+  x.z = z0;
+  x.x = x.r.x0[z0];
+  x.y = x.r.y0[z0];
+  x.jobs = jobs;
+
+  if ( sqlite3_open( opath, &db ) != SQLITE_OK ) {
+    fprintf( stderr, "Cannot open database: %s\n", sqlite3_errmsg(db) );
+    goto done;
+  }
+  // page size must be set before the first table is made, the unique
+  // index is made once all tiles are written
+  snprintf( buf, sizeof(buf), "PRAGMA page_size = %d;", EXTRACT_PAGESIZE );
+  if ( (extract_exec( db, buf ) < 0) ||
+       (extract_exec( db, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;"
+		      "CREATE TABLE metadata (name text, value text);"
+		      "CREATE TABLE tiles (zoom_level integer, tile_column integer, "
+		      "tile_row integer, tile_data blob);" ) < 0) ) {
+    goto done;
+  }
+  if ( sqlite3_prepare_v2( db, "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) "
+			   "VALUES (?1, ?2, ?3, ?4)", -1, &stmt, NULL ) != SQLITE_OK ) {
+    fprintf( stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db) );
+    goto done;
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  for(;;) {
+    for( x.njobs = 0; (x.njobs < njobs) && extract_nextjob( &x, jobs + x.njobs ); x.njobs++ );
+    if ( x.njobs == 0 ) break;
+    x.next = 0;
+    for( i = 0; i < nrd; ++i ) {
+      if ( pthread_create( &readers[i].th, NULL, extract_read, readers + i ) ) {
+	perror( "pthread_create" );
+	exit(1);
+      }
+    }
+    for( i = 0; i < nrd; ++i ) {
+      pthread_join( readers[i].th, NULL );
+    }
+    for( i = 0; i < x.njobs; ++i ) {
+      if ( jobs[i].err ) {
+	fprintf( stderr, "Failed to read tiles of zoom level %d.\n", jobs[i].z );
+	goto done;
+      }
+      total += jobs[i].len - jobs[i].ntiles * sizeof(xtile_t);
+    }
+    if ( extract_write( db, stmt, jobs, x.njobs, nz ) < 0 ) {
+      goto done;
+    }
+  }
+  sqlite3_finalize( stmt );
+  stmt = NULL;
+
+  if ( extract_copymeta( db, readers[0].src ) < 0 ) {
+    goto done;
+  }
+  snprintf( buf, sizeof(buf), "%d", z0 );
+  if ( extract_meta( db, "minzoom", buf ) < 0 ) goto done;
+  snprintf( buf, sizeof(buf), "%d", z1 );
+  if ( extract_meta( db, "maxzoom", buf ) < 0 ) goto done;
+  snprintf( buf, sizeof(buf), "%.6f,%.6f,%.6f,%.6f", b[0], b[1], b[2], b[3] );
+  if ( extract_meta( db, "bounds", buf ) < 0 ) goto done;
+  snprintf( buf, sizeof(buf), "%.6f,%.6f,%d", (b[0] + b[2]) / 2.0, (b[1] + b[3]) / 2.0, z0 );
+  if ( extract_meta( db, "center", buf ) < 0 ) goto done;
+
+  if ( extract_exec( db, "CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row)" ) < 0 ) {
+    goto done;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+  for( n = 0, z = z0; z <= z1; ++z ) {
+    printf( "zoom %2d: %d tiles, columns %d-%d, rows %d-%d\n", z, nz[z],
+	    x.r.x0[z], x.r.x1[z], x.r.y0[z], x.r.y1[z] );
+    n += nz[z];
+  }
+  printf( "%d tiles, %llu bytes extracted to '%s' in %.2f s using %d readers\n", n, total, opath,
+	  (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9, nrd );
+  rc = 0;
+
+ done:
+  if ( stmt ) sqlite3_finalize( stmt );
+  if ( db ) {
+    sqlite3_close( db );
+    if ( rc < 0 ) unlink( opath );
+  }
+  for( i = 0; jobs && (i < njobs); ++i ) {
+    free( jobs[i].buf );
+  }
+  free( jobs );
+  for( i = 0; readers && (i < nrd); ++i ) {
+    if ( readers[i].src ) source_close( readers[i].src );
+  }
+  free( readers );
+  return rc;
+}
@@ -0,0 +1,22 @@
+#ifndef __EXTRACT_H__
+#define __EXTRACT_H__
+
+/* --------------------------------------------------------------------------
+ *  Extract of the tiles of a map inside a bounding box and a range of
+ *  zoom levels into a new mbtiles file. Tile ranges are read by range
+ *  scans of parallel readers, each one with its own handle on the map,
+ *  and written in map order by batched transactions.
+ * --------------------------------------------------------------------------*/
+
+// max number of parallel readers
+#define EXTRACT_READERS 8
+
+// tiles in the columns band scanned by a single read job
+#define EXTRACT_JOBTILES 1024
+
+// page size of extracted mbtiles files
+#define EXTRACT_PAGESIZE 16384
+
+int extract_mbtiles( char *path, char *spec, char *opath );
+
+#endif
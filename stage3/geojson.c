@@ -0,0 +1,1004 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <json.h>
+
+#include "geojson.h"
+#include "mbtiles.h"
+#include "mvt.h"
+
+// externals
+extern void logger(const char *fmt, ...);
+
+// max latitude of web mercator
+#define MERC_MAXLAT 85.0511287798066
+
+/* --------------------------------------------------------------------------
+ *  Geometry in world units, from 0 to 1 starting at the north west
+ *  corner. Points are x, y and importance : the distance at which
+ *  Douglas-Peucker keeps the point, squared. Ends of lines and points
+ *  made by clipping have importance 1 and are always kept.
+ *  Geometries lying whole in a tile are shared with its children.
+ * --------------------------------------------------------------------------*/
+typedef struct gj_geom_s {
+  int ref;
+  int type;                   // MVT_POINT, MVT_LINESTRING or MVT_POLYGON
+  int npts, nparts;
+  double *p;
+  int *part;                  // first point of parts, nparts+1 entries
+  char *outer;                // 1 for exterior rings
+  double min[2], max[2];      // bounding box
+} gj_geom_t;
+
+typedef struct gj_feature_s {
+  gj_geom_t *g;
+  struct json_object *props;  // belongs to the parsed document
+  uint64_t id;                // 0 when unset
+} gj_feature_t;
+
+// growable list of features
+typedef struct gj_list_s {
+  gj_feature_t *f;
+  int n, size;
+} gj_list_t;
+
+/* --------------------------------------------------------------------------
+ *  Tile of the tree. Features are released once the tile is split,
+ *  the encoded tile is kept.
+ * --------------------------------------------------------------------------*/
+typedef struct gj_tile_s {
+  uint64_t id;
+  gj_feature_t *feats;        // clipped to tile and buffer, NULL once split
+  int nfeats;
+  char *data;                 // encoded tile, NULL if empty
+  int len, built;
+  struct gj_tile_s *next;     // hash chain
+} gj_tile_t;
+
+// geometry being built
+typedef struct gj_builder_s {
+  int type;
+  double *p;
+  int npts, psize;
+  int *part;
+  char *outer;
+  int nparts, partsize;
+} gj_builder_t;
+
+/* --------------------------------------------------------------------------
+ *  geojson handle
+ * --------------------------------------------------------------------------*/
+typedef struct geojson_s {
+  char *name;                 // layer name
+  struct json_object *doc;    // parsed file
+  gj_tile_t **hash;           // tiles by id
+  int hsize, ntiles;
+  gj_builder_t b;
+  gj_list_t col, cell;        // clipping lists
+  int *stack, stacksize;      // Douglas-Peucker ranking
+  mvtgeom_t geom;
+  mvtlayer_t mvt;
+  mvtbuf_t raw, gz;
+  mbtiles_meta_t meta;
+  struct json_object *fields; // property types of 'vector_layers'
+  char *tiles_json;
+  int tjlen;
+} geojson_t;
+
+/* --------------------------------------------------------------------------
+ *  Grows array 'p' of '*sz' elements of 'esz' bytes to hold 'n' elements
+ * --------------------------------------------------------------------------*/
+static void *gj_grow( void *p, int *sz, int n, int esz )
+{
+  if ( n > *sz ) {
+    int s = *sz ? *sz : 64;
+    while( s < n ) s *= 2;
+    p = realloc( p, (size_t) s * esz );
+    if ( p == NULL ) {
+      fputs( "geojson: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    *sz = s;
+  }
+  return p;
+}
+
+/* --------------------------------------------------------------------------
+ *  Starts building a geometry
+ * --------------------------------------------------------------------------*/
+static void gj_begin( gj_builder_t *b, int type )
+{
+  b->type = type;
+  b->npts = b->nparts = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Starts a new part, 'outer' tells exterior rings
+ * --------------------------------------------------------------------------*/
+static void gj_part( gj_builder_t *b, int outer )
+{
+  int sz = b->partsize;
+
+  b->part = (int*) gj_grow( b->part, &b->partsize, b->nparts + 2, sizeof(int));
+  b->outer = (char*) gj_grow( b->outer, &sz, b->nparts + 2, 1 );
+  b->part[b->nparts] = b->npts;
+  b->outer[b->nparts] = outer;
+  b->nparts++;
+  b->part[b->nparts] = b->npts;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a point to the current part
+ * --------------------------------------------------------------------------*/
+static void gj_point( gj_builder_t *b, double x, double y, double imp )
+{
+  b->p = (double*) gj_grow( b->p, &b->psize, 3 * b->npts + 3, sizeof(double));
+  b->p[3 * b->npts] = x;
+  b->p[3 * b->npts + 1] = y;
+  b->p[3 * b->npts + 2] = imp;
+  b->npts++;
+  b->part[b->nparts] = b->npts;
+}
+
+/* --------------------------------------------------------------------------
+ *  Drops the current part when it has less than 'min' points
+ * --------------------------------------------------------------------------*/
+static void gj_endpart( gj_builder_t *b, int min )
+{
+  if ( (b->nparts > 0) && (b->npts - b->part[b->nparts - 1] < min) ) {
+    b->nparts--;
+    b->npts = b->part[b->nparts];
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the built geometry in a single allocation, NULL if it is
+ *  empty
+ * --------------------------------------------------------------------------*/
+static gj_geom_t *gj_end( gj_builder_t *b )
+{
+  gj_geom_t *g;
+  int i;
+
+  if ( b->npts == 0 ) {
+    return NULL;
+  }
+  g = (gj_geom_t*) malloc( sizeof(gj_geom_t) + 3 * b->npts * sizeof(double) +
+			   (b->nparts + 1) * sizeof(int) + b->nparts );
+  if ( g == NULL ) {
+    fputs( "geojson: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  g->ref = 1;
+  g->type = b->type;
+  g->npts = b->npts;
+  g->nparts = b->nparts;
+  g->p = (double*) (g + 1);
+  g->part = (int*) (g->p + 3 * b->npts);
+  g->outer = (char*) (g->part + b->nparts + 1);
+  memcpy( g->p, b->p, 3 * b->npts * sizeof(double));
+  memcpy( g->part, b->part, (b->nparts + 1) * sizeof(int));
+  memcpy( g->outer, b->outer, b->nparts );
+
+  g->min[0] = g->max[0] = g->p[0];
+  g->min[1] = g->max[1] = g->p[1];
+  for( i = 1; i < g->npts; ++i ) {
+    if ( g->p[3 * i] < g->min[0] ) g->min[0] = g->p[3 * i];
+    if ( g->p[3 * i] > g->max[0] ) g->max[0] = g->p[3 * i];
+    if ( g->p[3 * i + 1] < g->min[1] ) g->min[1] = g->p[3 * i + 1];
+    if ( g->p[3 * i + 1] > g->max[1] ) g->max[1] = g->p[3 * i + 1];
+  }
+  return g;
+}
+
+/* --------------------------------------------------------------------------
+ *  Releases a reference to a geometry
+ * --------------------------------------------------------------------------*/
+static void gj_unref( gj_geom_t *g )
+{
+  if ( --g->ref == 0 ) {
+    free( g );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Appends a feature to a list
+ * --------------------------------------------------------------------------*/
+static void gj_push( gj_list_t *l, gj_geom_t *g, struct json_object *props, uint64_t id )
+{
+  l->f = (gj_feature_t*) gj_grow( l->f, &l->size, l->n + 1, sizeof(gj_feature_t));
+  l->f[l->n].g = g;
+  l->f[l->n].props = props;
+  l->f[l->n].id = id;
+  l->n++;
+}
+
+/* --------------------------------------------------------------------------
+ *  Releases the features of a list and empties it
+ * --------------------------------------------------------------------------*/
+static void gj_release( gj_list_t *l )
+{
+  int i;
+
+  for( i = 0; i < l->n; ++i ) {
+    gj_unref( l->f[i].g );
+  }
+  l->n = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Squared distance of point p to segment a-b
+ * --------------------------------------------------------------------------*/
+static double gj_segdist2( double *p, double *a, double *b )
+{
+  double dx = b[0] - a[0], dy = b[1] - a[1], t, x, y;
+
+  t = dx * dx + dy * dy;
+  if ( t > 0 ) {
+    t = ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / t;
+    if ( t < 0 ) t = 0;
+    if ( t > 1 ) t = 1;
+  }
+  x = a[0] + t * dx - p[0];
+  y = a[1] + t * dy - p[1];
+  return x * x + y * y;
+}
+
+/* --------------------------------------------------------------------------
+ *  Ranks the points of the current part by Douglas-Peucker : each
+ *  point gets the distance at which it is kept. Points closer than the
+ *  tolerance of the max zoom level are never kept.
+ * --------------------------------------------------------------------------*/
+static void gj_rank( geojson_t *j )
+{
+  gj_builder_t *b = &j->b;
+  double *p = b->p, d, dmax, tol;
+  int s = b->part[b->nparts - 1], e = b->npts - 1, i, a, c, imax, sp = 0;
+
+  if ( e <= s ) {
+    return;
+  }
+  p[3 * s + 2] = p[3 * e + 2] = 1;
+  tol = MVT_SIMPLIFY / ldexp( MVT_EXTENT, GEOJSON_MAXZOOM );
+  tol *= tol;
+
+  j->stack = (int*) gj_grow( j->stack, &j->stacksize, 2 * (e - s + 1), sizeof(int));
+  j->stack[sp++] = s;
+  j->stack[sp++] = e;
+  while( sp > 0 ) {
+    c = j->stack[--sp];
+    a = j->stack[--sp];
+    dmax = tol;
+    imax = -1;
+    for( i = a + 1; i < c; ++i ) {
+      d = gj_segdist2( p + 3 * i, p + 3 * a, p + 3 * c );
+      if ( d > dmax ) {
+	dmax = d;
+	imax = i;
+      }
+    }
+    if ( imax >= 0 ) {
+      p[3 * imax + 2] = dmax;
+      j->stack[sp++] = a;
+      j->stack[sp++] = imax;
+      j->stack[sp++] = imax;
+      j->stack[sp++] = c;
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a GeoJSON position to the current part, in world units
+ * --------------------------------------------------------------------------*/
+static int gj_position( geojson_t *j, struct json_object *pos )
+{
+  double lon, lat, y;
+
+  if ( !json_object_is_type( pos, json_type_array ) || (json_object_array_length( pos ) < 2) ) {
+    return 0;
+  }
+  lon = json_object_get_double( json_object_array_get_idx( pos, 0 ));
+  lat = json_object_get_double( json_object_array_get_idx( pos, 1 ));
+
+  // bounds of data
+  if ( j->meta.nbounds == 0 ) {
+    j->meta.bounds[0] = j->meta.bounds[2] = lon;
+    j->meta.bounds[1] = j->meta.bounds[3] = lat;
+    j->meta.nbounds = 4;
+  }
+  if ( lon < j->meta.bounds[0] ) j->meta.bounds[0] = lon;
+  if ( lat < j->meta.bounds[1] ) j->meta.bounds[1] = lat;
+  if ( lon > j->meta.bounds[2] ) j->meta.bounds[2] = lon;
+  if ( lat > j->meta.bounds[3] ) j->meta.bounds[3] = lat;
+
+  if ( lat > MERC_MAXLAT ) lat = MERC_MAXLAT;
+  if ( lat < -MERC_MAXLAT ) lat = -MERC_MAXLAT;
+  y = 0.5 - log( tan( M_PI / 4 + lat * M_PI / 360.0 )) / (2 * M_PI);
+  gj_point( &j->b, lon / 360.0 + 0.5, y, 0 );
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a line or a ring given as an array of positions as a part,
+ *  rings are stored without their closing position
+ * --------------------------------------------------------------------------*/
+static void gj_line( geojson_t *j, struct json_object *a, int ring, int outer )
+{
+  gj_builder_t *b = &j->b;
+  int i, n, s;
+
+  if ( !json_object_is_type( a, json_type_array )) {
+    return;
+  }
+  gj_part( b, outer );
+  s = b->npts;
+  n = json_object_array_length( a );
+  for( i = 0; i < n; ++i ) {
+    gj_position( j, json_object_array_get_idx( a, i ));
+  }
+  n = b->npts;
+  if ( ring && (n - s > 1) && (b->p[3 * s] == b->p[3 * n - 3]) && (b->p[3 * s + 1] == b->p[3 * n - 2]) ) {
+    b->npts--;
+    b->part[b->nparts] = b->npts;
+  }
+  gj_endpart( b, ring ? 3 : 2 );
+  if ( b->npts > s ) {
+    gj_rank( j );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds the rings of a polygon, holes of a dropped exterior ring are
+ *  dropped too
+ * --------------------------------------------------------------------------*/
+static void gj_polygon( geojson_t *j, struct json_object *a )
+{
+  int i, n, nparts;
+
+  if ( !json_object_is_type( a, json_type_array )) {
+    return;
+  }
+  n = json_object_array_length( a );
+  for( i = 0; i < n; ++i ) {
+    nparts = j->b.nparts;
+    gj_line( j, json_object_array_get_idx( a, i ), 1, i == 0 );
+    if ( (i == 0) && (j->b.nparts == nparts) ) {
+      return;
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Records the type of properties for 'vector_layers' of tiles.json,
+ *  the first type seen wins
+ * --------------------------------------------------------------------------*/
+static void gj_fields( geojson_t *j, struct json_object *props )
+{
+  struct json_object_iterator it, end;
+  const char *key, *type;
+
+  if ( !json_object_is_type( props, json_type_object )) {
+    return;
+  }
+  it = json_object_iter_begin( props );
+  end = json_object_iter_end( props );
+  for( ; !json_object_iter_equal( &it, &end ); json_object_iter_next( &it ) ) {
+    key = json_object_iter_peek_name( &it );
+    if ( json_object_object_get_ex( j->fields, key, NULL )) {
+      continue;
+    }
+    switch( json_object_get_type( json_object_iter_peek_value( &it ))) {
+    case json_type_null:
+      continue;
+    case json_type_boolean:
+      type = "Boolean";
+      break;
+    case json_type_int:
+    case json_type_double:
+      type = "Number";
+      break;
+    default:
+      type = "String";
+    }
+    json_object_object_add( j->fields, key, json_object_new_string( type ));
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds the features of GeoJSON geometry 'geom' to list 'l'. Parts of
+ *  multi geometries are kept in a single feature, members of
+ *  collections become features of their own.
+ * --------------------------------------------------------------------------*/
+static void gj_geometry( geojson_t *j, gj_list_t *l, struct json_object *geom,
+			 struct json_object *props, uint64_t id )
+{
+  struct json_object *o, *c;
+  const char *type;
+  gj_geom_t *g;
+  int i, n, multi;
+
+  if ( !json_object_object_get_ex( geom, "type", &o ) || !(type = json_object_get_string( o )) ) {
+    return;
+  }
+  if ( !strcmp( type, "GeometryCollection" )) {
+    if ( json_object_object_get_ex( geom, "geometries", &c ) && json_object_is_type( c, json_type_array )) {
+      n = json_object_array_length( c );
+      for( i = 0; i < n; ++i ) {
+	gj_geometry( j, l, json_object_array_get_idx( c, i ), props, id );
+      }
+    }
+    return;
+  }
+  if ( !json_object_object_get_ex( geom, "coordinates", &c ) || !json_object_is_type( c, json_type_array )) {
+    return;
+  }
+
+  multi = !strncmp( type, "Multi", 5 );
+  if ( multi ) type += 5;
+  n = multi ? json_object_array_length( c ) : 1;
+  if ( !strcmp( type, "Point" )) {
+    gj_begin( &j->b, MVT_POINT );
+    for( i = 0; i < n; ++i ) {
+      gj_part( &j->b, 0 );
+      gj_position( j, multi ? json_object_array_get_idx( c, i ) : c );
+      gj_endpart( &j->b, 1 );
+    }
+  }
+  else if ( !strcmp( type, "LineString" )) {
+    gj_begin( &j->b, MVT_LINESTRING );
+    for( i = 0; i < n; ++i ) {
+      gj_line( j, multi ? json_object_array_get_idx( c, i ) : c, 0, 0 );
+    }
+  }
+  else if ( !strcmp( type, "Polygon" )) {
+    gj_begin( &j->b, MVT_POLYGON );
+    for( i = 0; i < n; ++i ) {
+      gj_polygon( j, multi ? json_object_array_get_idx( c, i ) : c );
+    }
+  }
+  else {
+    return;
+  }
+
+  if ( (g = gj_end( &j->b )) ) {
+    gj_push( l, g, props, id );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a Feature to list 'l', only unsigned integer ids are kept
+ * --------------------------------------------------------------------------*/
+static void gj_feature( geojson_t *j, gj_list_t *l, struct json_object *f )
+{
+  struct json_object *geom, *props = NULL, *o;
+  uint64_t id = 0;
+
+  if ( !json_object_object_get_ex( f, "geometry", &geom ) || (geom == NULL) ) {
+    return;
+  }
+  if ( json_object_object_get_ex( f, "properties", &props )) {
+    gj_fields( j, props );
+  }
+  if ( json_object_object_get_ex( f, "id", &o ) && json_object_is_type( o, json_type_int ) &&
+       (json_object_get_int64( o ) > 0) ) {
+    id = (uint64_t) json_object_get_int64( o );
+  }
+  gj_geometry( j, l, geom, props, id );
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the tile with 'id', NULL if it is not in the tree
+ * --------------------------------------------------------------------------*/
+static gj_tile_t *gj_find( geojson_t *j, uint64_t id )
+{
+  gj_tile_t *t;
+
+  for( t = j->hash[(id ^ (id >> 29)) % j->hsize]; t; t = t->next ) {
+    if ( t->id == id ) break;
+  }
+  return t;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a tile to the tree with the features of list 'l', the list
+ *  is emptied
+ * --------------------------------------------------------------------------*/
+static gj_tile_t *gj_tile_new( geojson_t *j, uint64_t id, gj_list_t *l )
+{
+  gj_tile_t *t, **h, *n;
+  int i, k;
+
+  // hash table doubles when it is full
+  if ( j->ntiles >= j->hsize ) {
+    k = j->hsize ? 2 * j->hsize : 1024;
+    h = (gj_tile_t**) calloc( k, sizeof(gj_tile_t*));
+    if ( h == NULL ) {
+      fputs( "geojson: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    for( i = 0; i < j->hsize; ++i ) {
+      for( t = j->hash[i]; t; t = n ) {
+	n = t->next;
+	t->next = h[(t->id ^ (t->id >> 29)) % k];
+	h[(t->id ^ (t->id >> 29)) % k] = t;
+      }
+    }
+    free( j->hash );
+    j->hash = h;
+    j->hsize = k;
+  }
+
+  t = (gj_tile_t*) calloc( 1, sizeof(gj_tile_t));
+  if ( t ) {
+    t->feats = (gj_feature_t*) malloc( l->n * sizeof(gj_feature_t));
+  }
+  if ( (t == NULL) || (t->feats == NULL) ) {
+    fputs( "geojson: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  t->id = id;
+  memcpy( t->feats, l->f, l->n * sizeof(gj_feature_t));
+  t->nfeats = l->n;
+  l->n = 0;
+  t->next = j->hash[(id ^ (id >> 29)) % j->hsize];
+  j->hash[(id ^ (id >> 29)) % j->hsize] = t;
+  j->ntiles++;
+  return t;
+}
+
+/* --------------------------------------------------------------------------
+ *  Clips the ring of the 'n' points starting at point 's' of the
+ *  builder to one side of a line (Sutherland-Hodgman) : coordinate
+ *  'axis' must be above 'v', or below when 'below' is set. Returns the
+ *  number of points left, stored at the same place.
+ * --------------------------------------------------------------------------*/
+static int gj_clip_ring( gj_builder_t *b, int s, int n, int axis, double v, int below )
+{
+  double *in, *out, *a, *c, r;
+  int i, m = 0, ina, inc;
+
+  b->p = (double*) gj_grow( b->p, &b->psize, 3 * (s + 3 * n), sizeof(double));
+  in = b->p + 3 * s;
+  out = in + 3 * n;
+  for( i = 0; i < n; ++i ) {
+    a = in + 3 * ((i + n - 1) % n);
+    c = in + 3 * i;
+    ina = below ? (a[axis] <= v) : (a[axis] >= v);
+    inc = below ? (c[axis] <= v) : (c[axis] >= v);
+    if ( ina != inc ) {
+      r = (v - a[axis]) / (c[axis] - a[axis]);
+      out[3 * m + axis] = v;
+      out[3 * m + 1 - axis] = a[1 - axis] + r * (c[1 - axis] - a[1 - axis]);
+      out[3 * m + 2] = 1;
+      m++;
+    }
+    if ( inc ) {
+      memcpy( out + 3 * m, c, 3 * sizeof(double));
+      m++;
+    }
+  }
+  memmove( in, out, 3 * m * sizeof(double));
+  return m;
+}
+
+/* --------------------------------------------------------------------------
+ *  Clips the features of list 'in' to the band k1..k2 of coordinate
+ *  'axis' into list 'out'. Features inside the band are shared.
+ * --------------------------------------------------------------------------*/
+static void gj_clip( geojson_t *j, gj_list_t *in, gj_list_t *out, double k1, double k2, int axis )
+{
+  gj_builder_t *b = &j->b;
+  gj_geom_t *g;
+  double *a, *c, d, t0, t1, ta, tb;
+  int i, k, p, s, e, n, open, keep;
+
+  for( i = 0; i < in->n; ++i ) {
+    g = in->f[i].g;
+    if ( (g->min[axis] >= k1) && (g->max[axis] <= k2) ) {
+      g->ref++;
+      gj_push( out, g, in->f[i].props, in->f[i].id );
+      continue;
+    }
+    if ( (g->max[axis] < k1) || (g->min[axis] > k2) ) {
+      continue;
+    }
+
+    gj_begin( b, g->type );
+    keep = 1;
+    for( p = 0; p < g->nparts; ++p ) {
+      s = g->part[p];
+      e = g->part[p + 1];
+      switch( g->type ) {
+      case MVT_POINT:
+	gj_part( b, 0 );
+	for( k = s; k < e; ++k ) {
+	  a = g->p + 3 * k;
+	  if ( (a[axis] >= k1) && (a[axis] <= k2) ) {
+	    gj_point( b, a[0], a[1], a[2] );
+	  }
+	}
+	gj_endpart( b, 1 );
+	break;
+      case MVT_LINESTRING:
+	// pieces of lines start and end with kept points
+	open = 0;
+	for( k = s; k + 1 < e; ++k ) {
+	  a = g->p + 3 * k;
+	  c = a + 3;
+	  d = c[axis] - a[axis];
+	  t0 = 0;
+	  t1 = 1;
+	  if ( d != 0 ) {
+	    ta = (k1 - a[axis]) / d;
+	    tb = (k2 - a[axis]) / d;
+	    if ( ta > tb ) { t0 = ta; ta = tb; tb = t0; }
+	    t0 = (ta > 0) ? ta : 0;
+	    t1 = (tb < 1) ? tb : 1;
+	  }
+	  else if ( (a[axis] < k1) || (a[axis] > k2) ) {
+	    t0 = 1;
+	    t1 = 0;
+	  }
+	  if ( t0 > t1 ) {
+	    open = 0;
+	    continue;
+	  }
+	  if ( !open || (t0 > 0) ) {
+	    gj_endpart( b, 2 );
+	    gj_part( b, 0 );
+	    gj_point( b, a[0] + t0 * (c[0] - a[0]), a[1] + t0 * (c[1] - a[1]), 1 );
+	  }
+	  gj_point( b, a[0] + t1 * (c[0] - a[0]), a[1] + t1 * (c[1] - a[1]), (t1 < 1) ? 1 : c[2] );
+	  open = (t1 >= 1);
+	}
+	gj_endpart( b, 2 );
+	break;
+      case MVT_POLYGON:
+	if ( g->outer[p] ) {
+	  keep = 1;
+	}
+	if ( !keep ) {
+	  break;
+	}
+	gj_part( b, g->outer[p] );
+	n = b->npts;
+	b->p = (double*) gj_grow( b->p, &b->psize, 3 * (n + e - s), sizeof(double));
+	memcpy( b->p + 3 * n, g->p + 3 * s, 3 * (e - s) * sizeof(double));
+	k = gj_clip_ring( b, n, e - s, axis, k1, 0 );
+	k = gj_clip_ring( b, n, k, axis, k2, 1 );
+	b->npts = n + k;
+	b->part[b->nparts] = b->npts;
+	gj_endpart( b, 3 );
+	if ( g->outer[p] && (b->npts == n) ) {
+	  keep = 0;
+	}
+	break;
+      }
+    }
+    if ( (g = gj_end( b )) ) {
+      gj_push( out, g, in->f[i].props, in->f[i].id );
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds the properties of a feature as tags of the current feature,
+ *  objects and arrays are encoded as JSON strings
+ * --------------------------------------------------------------------------*/
+static void gj_tags( geojson_t *j, struct json_object *props )
+{
+  struct json_object_iterator it, end;
+  struct json_object *v;
+  const char *s;
+  char *key;
+
+  if ( !json_object_is_type( props, json_type_object )) {
+    return;
+  }
+  it = json_object_iter_begin( props );
+  end = json_object_iter_end( props );
+  for( ; !json_object_iter_equal( &it, &end ); json_object_iter_next( &it ) ) {
+    key = (char*) json_object_iter_peek_name( &it );
+    v = json_object_iter_peek_value( &it );
+    switch( json_object_get_type( v )) {
+    case json_type_null:
+      break;
+    case json_type_boolean:
+      mvt_layer_bool( &j->mvt, key, json_object_get_boolean( v ));
+      break;
+    case json_type_int:
+      mvt_layer_int( &j->mvt, key, json_object_get_int64( v ));
+      break;
+    case json_type_double:
+      mvt_layer_double( &j->mvt, key, json_object_get_double( v ));
+      break;
+    case json_type_string:
+      mvt_layer_string( &j->mvt, key, (char*) json_object_get_string( v ), json_object_get_string_len( v ));
+      break;
+    default:
+      s = json_object_to_json_string_ext( v, JSON_C_TO_STRING_PLAIN );
+      mvt_layer_string( &j->mvt, key, (char*) s, strlen( s ));
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Encodes a tile from its features, keeping the points whose
+ *  importance is above the tolerance of the tile zoom level
+ * --------------------------------------------------------------------------*/
+static void gj_encode( geojson_t *j, gj_tile_t *t )
+{
+  gj_feature_t *f;
+  gj_geom_t *g;
+  double scale, ox, oy, tol, *p;
+  int i, k, n;
+
+  scale = ldexp( MVT_EXTENT, TILEZ( t->id ));
+  ox = (double) TILEX( t->id ) * MVT_EXTENT;
+  oy = (double) TILEY( t->id ) * MVT_EXTENT;
+  tol = MVT_SIMPLIFY / scale;
+  tol *= tol;
+
+  j->mvt.name = j->name;
+  for( i = 0; i < t->nfeats; ++i ) {
+    f = t->feats + i;
+    g = f->g;
+    mvt_geom_reset( &j->geom, g->type );
+    for( k = 0; k < g->nparts; ++k ) {
+      mvt_geom_part( &j->geom, g->outer[k] );
+      for( n = g->part[k]; n < g->part[k + 1]; ++n ) {
+	p = g->p + 3 * n;
+	if ( (g->type == MVT_POINT) || (p[2] > tol) ) {
+	  mvt_geom_point( &j->geom, p[0] * scale - ox, p[1] * scale - oy );
+	}
+      }
+    }
+    if ( j->geom.npts > 0 ) {
+      gj_tags( j, f->props );
+      mvt_layer_feature( &j->mvt, f->id, &j->geom );
+    }
+  }
+  j->raw.len = 0;
+  mvt_layer_end( &j->mvt, &j->raw );
+
+  t->built = 1;
+  if ( (j->raw.len > 0) && (mvt_gzip( &j->gz, j->raw.data, j->raw.len, GEOJSON_LEVEL ) == 0) ) {
+    t->data = (char*) malloc( j->gz.len );
+    if ( t->data == NULL ) {
+      fputs( "geojson: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    memcpy( t->data, j->gz.data, j->gz.len );
+    t->len = j->gz.len;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Splits a tile : its features are clipped to each child and its
+ *  buffer, children without feature are not made. The tile is encoded
+ *  first, its features are released.
+ * --------------------------------------------------------------------------*/
+static void gj_split( geojson_t *j, gj_tile_t *t )
+{
+  gj_list_t l;
+  double size, buf;
+  int z = TILEZ( t->id ) + 1, x = 2 * TILEX( t->id ), y = 2 * TILEY( t->id ), i, k, n = 0;
+
+  if ( !t->built ) {
+    gj_encode( j, t );
+  }
+
+  size = ldexp( 1, -z );
+  buf = size * MVT_BUFFER / MVT_EXTENT;
+  l.f = t->feats;
+  l.n = l.size = t->nfeats;
+  for( i = 0; i < 2; ++i ) {
+    gj_clip( j, &l, &j->col, (x + i) * size - buf, (x + i + 1) * size + buf, 0 );
+    for( k = 0; k < 2; ++k ) {
+      gj_clip( j, &j->col, &j->cell, (y + k) * size - buf, (y + k + 1) * size + buf, 1 );
+      if ( j->cell.n > 0 ) {
+	gj_tile_new( j, TILEID( z, x + i, y + k ), &j->cell );
+	n++;
+      }
+    }
+    gj_release( &j->col );
+  }
+  gj_release( &l );
+  free( t->feats );
+  t->feats = NULL;
+  t->nfeats = 0;
+  logger( "geojson: tile %d/%d/%d split in %d tiles, %d tiles in tree\n",
+	  z - 1, x / 2, y / 2, n, j->ntiles );
+}
+
+/* --------------------------------------------------------------------------
+ *  Loads GeoJSON file : a FeatureCollection, a Feature or a geometry.
+ *  The root tile holds all the features.
+ * --------------------------------------------------------------------------*/
+void *geojson_open( char *path )
+{
+  struct json_object *o, *a, *vl, *l;
+  geojson_t *j;
+  gj_list_t root = { NULL, 0, 0 };
+  const char *type;
+  char *p;
+  int i, n;
+
+  o = json_object_from_file( path );
+  if ( o == NULL ) {
+    fprintf( stderr, "Cannot parse GeoJSON file '%s'.\n", path );
+    return NULL;
+  }
+  if ( !json_object_object_get_ex( o, "type", &a ) || !(type = json_object_get_string( a )) ) {
+    fprintf( stderr, "File '%s' isn't a GeoJSON file.\n", path );
+    json_object_put( o );
+    return NULL;
+  }
+
+  j = (geojson_t*) calloc( 1, sizeof(geojson_t));
+  if ( j == NULL ) {
+    fputs( "geojson: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  j->doc = o;
+  j->fields = json_object_new_object();
+
+  if ( !strcmp( type, "FeatureCollection" )) {
+    if ( json_object_object_get_ex( o, "features", &a ) && json_object_is_type( a, json_type_array )) {
+      n = json_object_array_length( a );
+      for( i = 0; i < n; ++i ) {
+	gj_feature( j, &root, json_object_array_get_idx( a, i ));
+      }
+    }
+  }
+  else if ( !strcmp( type, "Feature" )) {
+    gj_feature( j, &root, o );
+  }
+  else {
+    gj_geometry( j, &root, o, NULL, 0 );
+  }
+  if ( root.n == 0 ) {
+    fprintf( stderr, "GeoJSON file '%s' has no feature.\n", path );
+    free( root.f );
+    json_object_put( j->fields );
+    j->fields = NULL;
+    geojson_close( j );
+    return NULL;
+  }
+
+  // layer named after the file
+  p = strrchr( path, '/' );
+  j->name = strdup( p ? p + 1 : path );
+  if ( j->name == NULL ) {
+    fputs( "geojson: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  if ( (p = strrchr( j->name, '.' )) && (p != j->name) ) {
+    *p = 0;
+  }
+
+  j->meta.minzoom = 0;
+  j->meta.maxzoom = GEOJSON_MAXZOOM;
+  mbtiles_meta_set( &j->meta, "name", j->name );
+  mbtiles_meta_set( &j->meta, "format", "pbf" );
+  vl = json_object_new_array();
+  l = json_object_new_object();
+  json_object_object_add( l, "id", json_object_new_string( j->name ));
+  json_object_object_add( l, "fields", j->fields );
+  json_object_object_add( l, "minzoom", json_object_new_int( 0 ));
+  json_object_object_add( l, "maxzoom", json_object_new_int( GEOJSON_MAXZOOM ));
+  json_object_array_add( vl, l );
+  j->meta.vector_layers = vl;
+  j->fields = NULL;
+
+  logger( "geojson: %d features loaded from '%s'\n", root.n, path );
+  gj_tile_new( j, TILEID( 0, 0, 0 ), &root );
+  free( root.f );
+  return (void*) j;
+}
+
+/* --------------------------------------------------------------------------
+ *  Close GeoJSON source, tiles and features are released
+ * --------------------------------------------------------------------------*/
+void geojson_close( void *h )
+{
+  geojson_t *j = (geojson_t*) h;
+  gj_tile_t *t, *n;
+  int i, k;
+
+  if ( j == NULL ) return;
+  for( i = 0; i < j->hsize; ++i ) {
+    for( t = j->hash[i]; t; t = n ) {
+      n = t->next;
+      for( k = 0; k < t->nfeats; ++k ) {
+	gj_unref( t->feats[k].g );
+      }
+      free( t->feats );
+      free( t->data );
+      free( t );
+    }
+  }
+  free( j->hash );
+  free( j->b.p );
+  free( j->b.part );
+  free( j->b.outer );
+  free( j->col.f );
+  free( j->cell.f );
+  free( j->stack );
+  mvt_geom_free( &j->geom );
+  mvt_layer_free( &j->mvt );
+  mvt_free( &j->raw );
+  mvt_free( &j->gz );
+  mbtiles_meta_clear( &j->meta );
+  json_object_put( j->doc );
+  free( j->name );
+  free( j->tiles_json );
+  free( j );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile. Missing tiles are made by splitting their nearest
+ *  ancestor down to them, a tile whose ancestor was split without
+ *  making it is empty.
+ *  Returned data belongs to the handle.
+ * --------------------------------------------------------------------------*/
+char *geojson_read( void *h, int z, int x, int y, int *len )
+{
+  geojson_t *j = (geojson_t*) h;
+  gj_tile_t *t;
+  int pz;
+
+  *len = 0;
+  if ( !TILEVALID( z, x, y ) || (z > GEOJSON_MAXZOOM) ) {
+    return NULL;
+  }
+
+  t = gj_find( j, TILEID( z, x, y ));
+  if ( t == NULL ) {
+    for( pz = z - 1; pz >= 0; --pz ) {
+      if ( (t = gj_find( j, TILEID( pz, x >> (z - pz), y >> (z - pz) ))) ) break;
+    }
+    while( t && (TILEZ( t->id ) < z) && t->feats ) {
+      gj_split( j, t );
+      pz = TILEZ( t->id ) + 1;
+      t = gj_find( j, TILEID( pz, x >> (z - pz), y >> (z - pz) ));
+    }
+    if ( (t == NULL) || (TILEZ( t->id ) < z) ) {
+      logger( "No feature in tile %d/%d/%d\n", z, x, y );
+      return NULL;
+    }
+  }
+
+  if ( !t->built ) {
+    gj_encode( j, t );
+  }
+  *len = t->len;
+  return t->data;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json', its single layer lists the types of
+ *  feature properties
+ * --------------------------------------------------------------------------*/
+char *geojson_tiles_json( void *h, int *len )
+{
+  geojson_t *j = (geojson_t*) h;
+
+  if ( j->tiles_json == NULL ) {
+    struct json_object *o = mbtiles_meta_object( &j->meta );
+    j->tiles_json = strdup( mbtiles_meta_json( o, &j->tjlen ));
+    json_object_put( o );
+    if ( j->tiles_json == NULL ) {
+      fputs( "geojson: memory allocation error.\n", stderr );
+      exit(1);
+    }
+  }
+
+  if ( len != NULL ) {
+    *len = j->tjlen;
+  }
+  return j->tiles_json;
+}
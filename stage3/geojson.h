@@ -0,0 +1,23 @@
+#ifndef __GEOJSON_H__
+#define __GEOJSON_H__
+
+/* --------------------------------------------------------------------------
+ *  GeoJSON file served as vector tiles of a single layer. Features are
+ *  loaded once in a tile tree : a tile is split in its four children
+ *  the first time one of its descendants is requested, features being
+ *  clipped to each child and its buffer. Vertices are ranked once by
+ *  Douglas-Peucker, each zoom level keeps those above its tolerance.
+ * --------------------------------------------------------------------------*/
+
+// zoom levels of tiles
+#define GEOJSON_MAXZOOM 14
+
+// compression level of tiles
+#define GEOJSON_LEVEL 6
+
+void *geojson_open( char *path );
+void  geojson_close( void *h );
+char *geojson_read( void *h, int z, int x, int y, int *len );
+char *geojson_tiles_json( void *h, int *len );
+
+#endif
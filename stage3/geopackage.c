@@ -1,111 +1,927 @@
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
-#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <json.h>
 
-#define GPKG_APPID_1_2 0x47504B47   /* this is ASCII for "GPKG" */
-#define GPKG_APPID_1_0 0x47503130   /* this is ASCII for "GP10" */
+#include "geopackage.h"
+#include "mbtiles.h"
+#include "mvt.h"
+
+// externals
+extern void logger(const char *fmt, ...);
+
+// half of the web mercator world extent in meters
+#define MERC_HALF 20037508.342789244
+
+// max latitude of web mercator
+#define MERC_MAXLAT 85.0511287798066
+
+/* --------------------------------------------------------------------------
+ *  Tile matrix level mapped to an XYZ zoom level : XYZ tile x/y is
+ *  tile 'x - dx' / 'y - dy' of the matrix. Tile matrix rows are counted
+ *  from the north like XYZ rows.
+ * --------------------------------------------------------------------------*/
+typedef struct gpkg_level_s {
+  int zoom;                   // 'zoom_level' of tile table, -1 if none
+  int dx, dy;                 // XYZ tile of matrix top left tile
+  int width, height;          // matrix size in tiles
+} gpkg_level_t;
+
+/* --------------------------------------------------------------------------
+ *  Feature table served as a vector tile layer named after the table.
+ *  Query columns are the row id, then the table columns.
+ * --------------------------------------------------------------------------*/
+typedef struct gpkg_layer_s {
+  char *table;
+  char *query;                // features of a bounding box, by R-tree
+  int geographic;             // coordinates are longitudes / latitudes
+  int small;                  // small features are kept (points)
+  int ncols;                  // query columns
+  int gcol, pkcol;            // geometry and primary key columns
+  char **cols;                // query column names
+} gpkg_layer_t;
+
+/* --------------------------------------------------------------------------
+ *  Thread encoding layers, worker 0 is the thread reading tiles and
+ *  uses the main connection
+ * --------------------------------------------------------------------------*/
+typedef struct gpkg_worker_s {
+  struct gpkg_s *g;
+  sqlite3 *db;
+  sqlite3_stmt **stmts;       // layer queries, prepared on first use
+  mvtgeom_t geom, tmp;
+  mvtlayer_t mvt;
+  pthread_t th;
+} gpkg_worker_t;
+
+/* --------------------------------------------------------------------------
+ *  geopackage handle
+ * --------------------------------------------------------------------------*/
+typedef struct gpkg_s {
+  sqlite3 *db;
+  char *path;
+  char *table;                // tile table
+  sqlite3_stmt *stmt;         // tile query by matrix coordinates
+  sqlite3_stmt *scanstmt;     // tiles query by zoom level and ranges
+  gpkg_level_t level[30];     // indexed by XYZ zoom level
+  mbtiles_meta_t meta;
+  char *tiles_json;
+  int tjlen;
+
+  // feature tables, served when there is no tile table
+  gpkg_layer_t *layers;
+  int nlayers;
+  gpkg_worker_t *workers;
+  int nworkers;
+  mvtbuf_t *out;              // encoded layers of current tile
+  mvtbuf_t tile, gz;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;        // signals workers a tile to encode
+  pthread_cond_t done;        // signals all layers are encoded
+  int z, x, y;                // current tile
+  int next, ndone;            // next layer to encode, layers encoded
+  int quit;
+} gpkg_t;
+
+/* --------------------------------------------------------------------------
+ *  Coordinate transform from table coordinates to tile units
+ * --------------------------------------------------------------------------*/
+typedef struct gpkg_xform_s {
+  double scale;               // tile units per meter
+  double ox, oy;              // tile origin in tile units
+  int geographic;
+} gpkg_xform_t;
+
+/* --------------------------------------------------------------------------
+ *  Well-known binary reader
+ * --------------------------------------------------------------------------*/
+typedef struct gpkg_wkb_s {
+  unsigned char *p, *end;
+  int le;                     // little endian
+} gpkg_wkb_t;
 
 /* --------------------------------------------------------------------------
- *  Check existence of table and its columns
+ *  Returns non zero if table or view exists
  * --------------------------------------------------------------------------*/
-static int sqlut_check_table (sqlite3 *db, char *tname, ...)
+static int sqlut_has_table( sqlite3 *db, char *tname )
 {
   sqlite3_stmt *stmt;
-  char *colnam1, *colnam2;
-  char  query[128];
-  int rc, res = 0;
+  int res = 0;
+
+#define QUERY "SELECT 1 FROM sqlite_master WHERE type IN ('table', 'view') AND name = ?1"
+  if ( sqlite3_prepare_v2( db, QUERY, strlen(QUERY), &stmt, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+    return 0;
+  }
+#undef QUERY
+  sqlite3_bind_text( stmt, 1, tname, -1, SQLITE_STATIC );
+  res = (sqlite3_step( stmt ) == SQLITE_ROW);
+  sqlite3_finalize( stmt );
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  Check existence of table and of the given columns, the list of
+ *  columns ends with NULL
+ * --------------------------------------------------------------------------*/
+static int sqlut_check_table( sqlite3 *db, char *tname, ... )
+{
+  sqlite3_stmt *stmt;
+  char *colnam, query[128];
+  int rc, found, res = 1;
   va_list va;
-  
-  snprintf( query, sizeof(query),  "pragma table_info(%s);", tname);
-  query[ sizeof(query)-1 ] = 0;
 
+  snprintf( query, sizeof(query), "SELECT 1 FROM pragma_table_info('%s') WHERE name = ?1", tname );
   rc = sqlite3_prepare_v2( db, query, strlen(query), &stmt, NULL);
   if ( rc != SQLITE_OK ) {
-    fprintf(stderr, "Cannot prepare query '%s': %s\n", QUERY, sqlite3_errmsg(db));
+    fprintf(stderr, "Cannot prepare query '%s': %s\n", query, sqlite3_errmsg(db));
     return 0;
   }
-  
-  va_start(va, tname);
-  res = 1;
-  while ( sqlite3_step( stmt ) == SQLITE_ROW ) {
-    colnam1 = sqlite3_column_bytes( stmt, 1 );
-    colnam2 = va_arg(va, char*);
-    if (colnam2 == NULL) {
-      fprintf( stderr, "Table '%s' contains extra column '%s'.\n",
-	       tname, colnam1);
-    }
-    if (strcmp( colnam1, colnam2)) {
-      fprintf( stderr, "Table '%s' does not contain column '%s' ('%s' seen instead).\n",
-	       tname, colnam2, colnam1);
-      res = 0;
-      break;
-    }
-  }
-  if (res) {
-    colnam2 = va_arg(va, char*);
-    if (colnam2 != NULL) {
-      fprintf( stderr, "Table '%s' doesn't contain expect column '%s'.\n",
-	       tname, colnam2);
+
+  va_start( va, tname );
+  while( res && (colnam = va_arg( va, char* )) ) {
+    sqlite3_reset( stmt );
+    sqlite3_bind_text( stmt, 1, colnam, -1, SQLITE_STATIC );
+    found = (sqlite3_step( stmt ) == SQLITE_ROW);
+    if ( !found ) {
+      fprintf( stderr, "Table '%s' doesn't contain expected column '%s'.\n", tname, colnam );
       res = 0;
     }
   }
-  
-  sqlite3_reset( stmt );
-  sqlite3_finalize( stmt );
-  va_end(va);
+  va_end( va );
 
+  sqlite3_finalize( stmt );
   return res;
 }
 
 /* --------------------------------------------------------------------------
  *  Retrieve pragma value
  * --------------------------------------------------------------------------*/
-static int sqlut_get_value( sqlite3 db, char *name, int *pval)
+static int sqlut_get_value( sqlite3 *db, char *name, int *pval )
 {
   sqlite3_stmt *stmt;
-  char  query[64];
-  int rc, res = 0;
+  char query[64];
+  int rc, v = 0, res = 0;
 
-  snprintf( query, sizeof(query),  "pragma %s;", name);
-  query[ sizeof(query)-1 ] = 0;
+  snprintf( query, sizeof(query), "pragma %s;", name );
 
   rc = sqlite3_prepare_v2( db, query, strlen(query), &stmt, NULL);
   if ( rc != SQLITE_OK ) {
-    fprintf(stderr, "Cannot prepare query '%s': %s\n", QUERY, sqlite3_errmsg(db));
-    return res;
+    fprintf(stderr, "Cannot prepare query '%s': %s\n", query, sqlite3_errmsg(db));
+    return 0;
   }
 
   while ( sqlite3_step( stmt ) == SQLITE_ROW ) {
     res++;
-    rc = sqlite3_column_int(stmt, 0);
+    v = sqlite3_column_int( stmt, 0 );
   }
   res = (res == 1);
-  if (res) {
-    *pval = rc;
+  if ( res ) {
+    *pval = v;
   }
-  
-  sqlite3_reset( stmt );
+
   sqlite3_finalize( stmt );
   return res;
 }
 
 /* --------------------------------------------------------------------------
- *  Open geopackage sqlite database and returns a handle to it
- *  The handle is a prepared statement used to query tile data
+ *  Runs a query returning text, '*pval' is set to an allocated copy of
+ *  the first value. Returns the number of rows.
  * --------------------------------------------------------------------------*/
-void *gpkg_open( char *path )
+static int sqlut_get_text( sqlite3 *db, char *query, char **pval )
+{
+  sqlite3_stmt *stmt;
+  const unsigned char *v;
+  int rc, res = 0;
+
+  rc = sqlite3_prepare_v2( db, query, strlen(query), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query '%s': %s\n", query, sqlite3_errmsg(db));
+    return 0;
+  }
+  while ( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    if ( (res++ == 0) && (v = sqlite3_column_text( stmt, 0 )) ) {
+      *pval = strdup( (char*) v );
+    }
+  }
+  sqlite3_finalize( stmt );
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  Converts web mercator coordinates to longitude / latitude
+ * --------------------------------------------------------------------------*/
+static void gpkg_lonlat( double x, double y, double *lon, double *lat )
+{
+  *lon = x / MERC_HALF * 180.0;
+  *lat = atan( sinh( y / MERC_HALF * M_PI )) * 180.0 / M_PI;
+}
+
+/* --------------------------------------------------------------------------
+ *  Maps tile matrix levels of tile table to XYZ zoom levels. 'mset'
+ *  holds the tile matrix set bounds. Levels whose tiles don't match
+ *  XYZ tiles are skipped. Returns the number of mapped levels.
+ * --------------------------------------------------------------------------*/
+static int gpkg_levels( gpkg_t *g, double *mset )
+{
+  sqlite3_stmt *stmt;
+  gpkg_level_t *l;
+  double ext, ey, zf, fx, fy;
+  int rc, z, zoom, n = 0;
+
+  for( z = 0; z < 30; ++z ) {
+    g->level[z].zoom = -1;
+  }
+
+#define QUERY "SELECT zoom_level, matrix_width, matrix_height, tile_width, tile_height, " \
+    "pixel_x_size, pixel_y_size FROM gpkg_tile_matrix WHERE table_name = ?1 ORDER BY zoom_level"
+  rc = sqlite3_prepare_v2( g->db, QUERY, strlen(QUERY), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(g->db));
+    return 0;
+  }
+#undef QUERY
+  sqlite3_bind_text( stmt, 1, g->table, -1, SQLITE_STATIC );
+
+  while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    zoom = sqlite3_column_int( stmt, 0 );
+    ext = sqlite3_column_int( stmt, 3 ) * sqlite3_column_double( stmt, 5 );
+    ey = sqlite3_column_int( stmt, 4 ) * sqlite3_column_double( stmt, 6 );
+
+    // tile extent gives the zoom level, top left corner the offsets
+    zf = (ext > 0) ? log2( 2 * MERC_HALF / ext ) : -1;
+    z = (int) lround( zf );
+    fx = (mset[0] + MERC_HALF) / ext;
+    fy = (MERC_HALF - mset[3]) / ext;
+    if ( (z < 0) || (z > 29) || (fabs( zf - z ) > 1e-3) || (fabs( ey - ext ) > 1e-3 * ext) ||
+	 (fabs( fx - lround( fx )) > 1e-3) || (fabs( fy - lround( fy )) > 1e-3) ) {
+      fprintf( stderr, "Tile matrix level %d of '%s' isn't aligned on web mercator tiles, skipped.\n",
+	       zoom, g->table );
+      continue;
+    }
+    l = g->level + z;
+    if ( l->zoom >= 0 ) {
+      fprintf( stderr, "Tile matrix levels %d and %d of '%s' have the same resolution, %d skipped.\n",
+	       l->zoom, zoom, g->table, zoom );
+      continue;
+    }
+    l->zoom = zoom;
+    l->dx = (int) lround( fx );
+    l->dy = (int) lround( fy );
+    l->width = sqlite3_column_int( stmt, 1 );
+    l->height = sqlite3_column_int( stmt, 2 );
+    logger( "gpkg: level %d -> zoom %d, offset %d,%d\n", zoom, z, l->dx, l->dy );
+    if ( (g->meta.minzoom < 0) || (z < g->meta.minzoom) ) g->meta.minzoom = z;
+    if ( z > g->meta.maxzoom ) g->meta.maxzoom = z;
+    n++;
+  }
+  sqlite3_finalize( stmt );
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Sets metadata of tile table from 'gpkg_contents', format is guessed
+ *  from the first tile
+ * --------------------------------------------------------------------------*/
+static void gpkg_load_meta( gpkg_t *g, sqlite3_stmt *stmt, double *mset )
 {
+  sqlite3_stmt *tstmt;
+  unsigned char *d;
   char query[256];
+  double b[4];
+  int i, n;
+
+  mbtiles_meta_set( &g->meta, "name", (char*) sqlite3_column_text( stmt, 1 ));
+  if ( g->meta.name == NULL ) {
+    mbtiles_meta_set( &g->meta, "name", g->table );
+  }
+  mbtiles_meta_set( &g->meta, "description", (char*) sqlite3_column_text( stmt, 2 ));
+
+  // contents bounds are optional, matrix set bounds are used instead
+  for( i = 0; i < 4; ++i ) {
+    b[i] = (sqlite3_column_type( stmt, 3 + i ) == SQLITE_NULL) ?
+      mset[i] : sqlite3_column_double( stmt, 3 + i );
+  }
+  gpkg_lonlat( b[0], b[1], g->meta.bounds, g->meta.bounds + 1 );
+  gpkg_lonlat( b[2], b[3], g->meta.bounds + 2, g->meta.bounds + 3 );
+  g->meta.nbounds = 4;
+
+  snprintf( query, sizeof(query), "SELECT tile_data FROM \"%s\" LIMIT 1", g->table );
+  if ( sqlite3_prepare_v2( g->db, query, strlen(query), &tstmt, NULL) == SQLITE_OK ) {
+    if ( sqlite3_step( tstmt ) == SQLITE_ROW ) {
+      d = (unsigned char*) sqlite3_column_blob( tstmt, 0 );
+      n = sqlite3_column_bytes( tstmt, 0 );
+      if ( (n >= 4) && !memcmp( d, "\x89PNG", 4 ) ) {
+	mbtiles_meta_set( &g->meta, "format", "png" );
+      }
+      else if ( (n >= 2) && (d[0] == 0xff) && (d[1] == 0xd8) ) {
+	mbtiles_meta_set( &g->meta, "format", "jpg" );
+      }
+      else if ( (n >= 12) && !memcmp( d, "RIFF", 4 ) && !memcmp( d + 8, "WEBP", 4 ) ) {
+	mbtiles_meta_set( &g->meta, "format", "webp" );
+      }
+      else {
+	mbtiles_meta_set( &g->meta, "format", "pbf" );
+      }
+    }
+    sqlite3_finalize( tstmt );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Serves the first tile table in web mercator having levels aligned
+ *  on XYZ tiles. The zoom level mapping is computed once and the tile
+ *  query is prepared. Returns 0 if there is no such table.
+ * --------------------------------------------------------------------------*/
+static int gpkg_open_tiles( gpkg_t *g )
+{
+  char query[256];
+  sqlite3_stmt *stmt;
+  double mset[4];
+  int i, rc;
+
+#define QUERY "SELECT c.table_name, c.identifier, c.description, c.min_x, c.min_y, c.max_x, c.max_y, " \
+    "m.min_x, m.min_y, m.max_x, m.max_y FROM gpkg_contents c " \
+    "JOIN gpkg_tile_matrix_set m ON m.table_name = c.table_name " \
+    "JOIN gpkg_spatial_ref_sys s ON s.srs_id = m.srs_id " \
+    "WHERE c.data_type = 'tiles' AND upper(s.organization) = 'EPSG' " \
+    "AND s.organization_coordsys_id IN (3857, 900913) ORDER BY c.table_name"
+  rc = sqlite3_prepare_v2( g->db, QUERY, strlen(QUERY), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(g->db));
+    return 0;
+  }
+#undef QUERY
+  while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    free( g->table );
+    g->table = strdup( (char*) sqlite3_column_text( stmt, 0 ));
+    if ( g->table == NULL ) {
+      fputs( "gpkg_open: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    if ( strchr( g->table, '"' ) ) {
+      continue;
+    }
+    for( i = 0; i < 4; ++i ) {
+      mset[i] = sqlite3_column_double( stmt, 7 + i );
+    }
+    if ( gpkg_levels( g, mset ) > 0 ) {
+      gpkg_load_meta( g, stmt, mset );
+      break;
+    }
+  }
+  rc = (g->meta.minzoom >= 0);
+  sqlite3_finalize( stmt );
+  if ( !rc ) {
+    free( g->table );
+    g->table = NULL;
+    return 0;
+  }
+  logger( "gpkg: serving table '%s', zoom levels %d to %d\n", g->table, g->meta.minzoom, g->meta.maxzoom );
+
+  snprintf( query, sizeof(query), "SELECT tile_data FROM \"%s\" WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3", g->table );
+  rc = sqlite3_prepare_v2( g->db, query, strlen(query), &g->stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(g->db));
+    return 0;
+  }
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds feature table 'table' as a layer, its features are queried
+ *  through R-tree index 'rtree'. The layer description is added to
+ *  'vl', the 'vector_layers' of tiles.json. Returns 0 on error.
+ * --------------------------------------------------------------------------*/
+static int gpkg_add_layer( gpkg_t *g, char *table, char *geom, char *type, char *rtree,
+			   int geographic, struct json_object *vl )
+{
+  struct json_object *o, *fields;
   sqlite3_stmt *stmt;
+  gpkg_layer_t *l;
+  char query[1024], *pk = NULL, decl[64];
+  const char *d;
+  int i, j, rc;
+
+  // features smaller than '?5' are skipped
+  snprintf( query, sizeof(query), "SELECT t.rowid, t.* FROM \"%s\" r JOIN \"%s\" t ON t.rowid = r.id "
+	    "WHERE r.maxx >= ?1 AND r.minx <= ?3 AND r.maxy >= ?2 AND r.miny <= ?4 AND "
+	    "(r.maxx - r.minx >= ?5 OR r.maxy - r.miny >= ?5)", rtree, table );
+  rc = sqlite3_prepare_v2( g->db, query, strlen(query), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Feature table '%s' can't be queried: %s\n", table, sqlite3_errmsg(g->db));
+    return 0;
+  }
+
+  g->layers = (gpkg_layer_t*) realloc( g->layers, (g->nlayers + 1) * sizeof(gpkg_layer_t));
+  if ( g->layers == NULL ) {
+    fputs( "gpkg_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  l = g->layers + g->nlayers++;
+  memset( l, 0, sizeof(gpkg_layer_t));
+  l->table = strdup( table );
+  l->query = strdup( query );
+  l->geographic = geographic;
+  // the R-tree doesn't tell points, tables which may hold points keep small
+  // features. Type names are upper case.
+  l->small = (type == NULL) || strstr( type, "POINT" ) || !strncmp( type, "GEOMETRY", 8 );
+  l->ncols = sqlite3_column_count( stmt );
+  l->gcol = l->pkcol = -1;
+  l->cols = (char**) calloc( l->ncols, sizeof(char*));
+  if ( (l->table == NULL) || (l->query == NULL) || (l->cols == NULL) ) {
+    fputs( "gpkg_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+
+  // the primary key is the row id, it is not an attribute
+  snprintf( query, sizeof(query), "SELECT name FROM pragma_table_info('%s') WHERE pk > 0", table );
+  if ( sqlut_get_text( g->db, query, &pk ) != 1 ) {
+    free( pk );
+    pk = NULL;
+  }
+
+  fields = json_object_new_object();
+  for( i = 1; i < l->ncols; ++i ) {
+    l->cols[i] = strdup( sqlite3_column_name( stmt, i ));
+    if ( l->cols[i] == NULL ) {
+      fputs( "gpkg_open: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    if ( (l->gcol < 0) && !strcasecmp( l->cols[i], geom )) {
+      l->gcol = i;
+      continue;
+    }
+    if ( (l->pkcol < 0) && pk && !strcasecmp( l->cols[i], pk )) {
+      l->pkcol = i;
+      continue;
+    }
+    // field type from declared type, like sqlite column affinity
+    d = sqlite3_column_decltype( stmt, i );
+    for( j = 0; d && d[j] && (j < (int) sizeof(decl) - 1); ++j ) {
+      decl[j] = toupper( d[j] );
+    }
+    decl[j] = 0;
+    if ( strstr( decl, "INT" ) || strstr( decl, "REAL" ) || strstr( decl, "FLOA" ) ||
+	 strstr( decl, "DOUB" ) || strstr( decl, "NUM" )) {
+      json_object_object_add( fields, l->cols[i], json_object_new_string( "Number" ));
+    }
+    else if ( strstr( decl, "BOOL" )) {
+      json_object_object_add( fields, l->cols[i], json_object_new_string( "Boolean" ));
+    }
+    else {
+      json_object_object_add( fields, l->cols[i], json_object_new_string( "String" ));
+    }
+  }
+  free( pk );
+  sqlite3_finalize( stmt );
+
+  o = json_object_new_object();
+  json_object_object_add( o, "id", json_object_new_string( table ));
+  json_object_object_add( o, "fields", fields );
+  json_object_object_add( o, "minzoom", json_object_new_int( 0 ));
+  json_object_object_add( o, "maxzoom", json_object_new_int( GPKG_MAXZOOM ));
+  json_object_array_add( vl, o );
+
+  logger( "gpkg: layer '%s', geometry '%s' in %s\n", table, geom, geographic ? "EPSG:4326" : "EPSG:3857" );
+  return (l->gcol > 0);
+}
+
+/* --------------------------------------------------------------------------
+ *  Serves feature tables in EPSG:4326 or EPSG:3857 having an R-tree
+ *  index as layers of vector tiles. Returns the number of layers.
+ * --------------------------------------------------------------------------*/
+static int gpkg_open_features( gpkg_t *g )
+{
+  struct json_object *vl;
+  sqlite3_stmt *stmt;
+  char *table, *geom, rtree[256], *p;
+  double b[4], ll[4];
+  int i, rc, geographic;
+
+  vl = json_object_new_array();
+#define QUERY "SELECT c.table_name, gc.column_name, s.organization_coordsys_id, " \
+    "c.min_x, c.min_y, c.max_x, c.max_y, gc.geometry_type_name FROM gpkg_contents c " \
+    "JOIN gpkg_geometry_columns gc ON gc.table_name = c.table_name " \
+    "JOIN gpkg_spatial_ref_sys s ON s.srs_id = gc.srs_id " \
+    "WHERE c.data_type = 'features' AND upper(s.organization) = 'EPSG' " \
+    "AND s.organization_coordsys_id IN (4326, 3857, 900913) ORDER BY c.table_name"
+  rc = sqlite3_prepare_v2( g->db, QUERY, strlen(QUERY), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(g->db));
+    json_object_put( vl );
+    return 0;
+  }
+#undef QUERY
+  while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    table = (char*) sqlite3_column_text( stmt, 0 );
+    geom = (char*) sqlite3_column_text( stmt, 1 );
+    geographic = (sqlite3_column_int( stmt, 2 ) == 4326);
+    if ( (table == NULL) || (geom == NULL) || strpbrk( table, "\"'" ) || strchr( geom, '"' )) {
+      continue;
+    }
+    snprintf( rtree, sizeof(rtree), "rtree_%s_%s", table, geom );
+    if ( !sqlut_has_table( g->db, rtree )) {
+      fprintf( stderr, "Feature table '%s' has no R-tree index, skipped.\n", table );
+      continue;
+    }
+    if ( !gpkg_add_layer( g, table, geom, (char*) sqlite3_column_text( stmt, 7 ), rtree, geographic, vl )) {
+      continue;
+    }
+
+    // bounds are the union of contents bounds
+    for( i = 0; i < 4; ++i ) {
+      if ( sqlite3_column_type( stmt, 3 + i ) == SQLITE_NULL ) break;
+      b[i] = sqlite3_column_double( stmt, 3 + i );
+    }
+    if ( i < 4 ) {
+      continue;
+    }
+    if ( geographic ) {
+      memcpy( ll, b, sizeof(ll));
+    }
+    else {
+      gpkg_lonlat( b[0], b[1], ll, ll + 1 );
+      gpkg_lonlat( b[2], b[3], ll + 2, ll + 3 );
+    }
+    if ( g->meta.nbounds == 0 ) {
+      memcpy( g->meta.bounds, ll, sizeof(ll));
+      g->meta.nbounds = 4;
+    }
+    for( i = 0; i < 2; ++i ) {
+      if ( ll[i] < g->meta.bounds[i] ) g->meta.bounds[i] = ll[i];
+      if ( ll[i + 2] > g->meta.bounds[i + 2] ) g->meta.bounds[i + 2] = ll[i + 2];
+    }
+  }
+  sqlite3_finalize( stmt );
+
+  if ( g->nlayers == 0 ) {
+    json_object_put( vl );
+    return 0;
+  }
+
+  // named after the file
+  p = strrchr( g->path, '/' );
+  p = strdup( p ? p + 1 : g->path );
+  if ( p == NULL ) {
+    fputs( "gpkg_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  if ( strrchr( p, '.' )) {
+    *strrchr( p, '.' ) = 0;
+  }
+  mbtiles_meta_set( &g->meta, "name", p );
+  free( p );
+  mbtiles_meta_set( &g->meta, "format", "pbf" );
+  g->meta.minzoom = 0;
+  g->meta.maxzoom = GPKG_MAXZOOM;
+  g->meta.vector_layers = vl;
+  return g->nlayers;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads an unsigned 32 bits integer of well-known binary
+ * --------------------------------------------------------------------------*/
+static int gpkg_wkb_u32( gpkg_wkb_t *r, uint32_t *v )
+{
+  unsigned char *p = r->p;
+
+  if ( r->end - p < 4 ) return 0;
+  *v = r->le ? (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24)) :
+    (((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+  r->p += 4;
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads 'n' coordinates of a point of well-known binary, the first two
+ *  are transformed to tile units and added to geometry
+ * --------------------------------------------------------------------------*/
+static int gpkg_wkb_point( gpkg_wkb_t *r, int n, gpkg_xform_t *t, mvtgeom_t *g )
+{
+  double c[2], lat;
+  uint64_t u;
+  int i, j;
+
+  if ( r->end - r->p < 8 * n ) return 0;
+  for( i = 0; i < 2; ++i ) {
+    for( u = 0, j = 0; j < 8; ++j ) {
+      u |= (uint64_t) r->p[r->le ? j : 7 - j] << (8 * j);
+    }
+    memcpy( c + i, &u, sizeof(double));
+    r->p += 8;
+  }
+  r->p += 8 * (n - 2);
+
+  if ( t->geographic ) {
+    lat = c[1];
+    if ( lat > MERC_MAXLAT ) lat = MERC_MAXLAT;
+    if ( lat < -MERC_MAXLAT ) lat = -MERC_MAXLAT;
+    c[0] = c[0] * MERC_HALF / 180.0;
+    c[1] = log( tan( M_PI / 4 + lat * M_PI / 360.0 )) * MERC_HALF / M_PI;
+  }
+  mvt_geom_point( g, (c[0] + MERC_HALF) * t->scale - t->ox, (MERC_HALF - c[1]) * t->scale - t->oy );
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a well-known binary geometry into 'g' in tile units. Multi
+ *  geometries become parts, geometries of a collection whose type
+ *  differs from the first one are skipped. Returns 0 on error.
+ * --------------------------------------------------------------------------*/
+static int gpkg_wkb( gpkg_wkb_t *r, gpkg_xform_t *t, mvtgeom_t *g, int depth )
+{
+  uint32_t type, n, m, i, j;
+  int ncoord, mtype, npts, nparts;
+
+  if ( (depth > 4) || (r->p >= r->end) ) return 0;
+  r->le = (*r->p++ == 1);
+  if ( !gpkg_wkb_u32( r, &type )) return 0;
+
+  // ISO dimensions (1000 Z, 2000 M, 3000 ZM) or extended flags
+  if ( type & 0xc0000000 ) {
+    ncoord = 2 + !!(type & 0x80000000) + !!(type & 0x40000000);
+    type &= 0xff;
+  }
+  else {
+    ncoord = 2 + ((type / 1000) == 3) + ((type / 1000) != 0);
+    type %= 1000;
+  }
+  if ( (type < 1) || (type > 7) ) return 0;
+  if ( type >= 4 ) {
+    if ( !gpkg_wkb_u32( r, &n )) return 0;
+    for( i = 0; i < n; ++i ) {
+      if ( !gpkg_wkb( r, t, g, depth + 1 )) return 0;
+    }
+    return 1;
+  }
+
+  // parts of another type are read then dropped
+  mtype = type;
+  if ( g->type == 0 ) g->type = mtype;
+  npts = g->npts;
+  nparts = g->nparts;
+
+  if ( type == 1 ) {
+    mvt_geom_part( g, 0 );
+    if ( !gpkg_wkb_point( r, ncoord, t, g )) return 0;
+    // empty points have NAN coordinates
+    if ( isnan( g->xy[2 * npts] ) || isnan( g->xy[2 * npts + 1] )) {
+      g->npts = npts;
+      g->nparts = nparts;
+    }
+  }
+  else {
+    m = 1;
+    if ( (type == 3) && !gpkg_wkb_u32( r, &m )) return 0;
+    for( j = 0; j < m; ++j ) {
+      if ( !gpkg_wkb_u32( r, &n )) return 0;
+      if ( (uint64_t) n * 8 * ncoord > (uint64_t) (r->end - r->p) ) return 0;
+      mvt_geom_part( g, (type == 3) && (j == 0) );
+      for( i = 0; i < n; ++i ) {
+	if ( !gpkg_wkb_point( r, ncoord, t, g )) return 0;
+      }
+      // rings are closed implicitly
+      if ( (type == 3) && (n > 1) ) {
+	g->npts--;
+	g->part[g->nparts] = g->npts;
+      }
+    }
+  }
+  if ( g->type != mtype ) {
+    g->npts = npts;
+    g->nparts = nparts;
+  }
+  else if ( g->nparts > 0 ) {
+    g->part[g->nparts] = g->npts;
+  }
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a GeoPackage binary geometry : a header possibly followed by an
+ *  envelope, then well-known binary. Returns 0 when the geometry is
+ *  empty or invalid.
+ * --------------------------------------------------------------------------*/
+static int gpkg_geometry( unsigned char *d, int len, gpkg_xform_t *t, mvtgeom_t *g )
+{
+  static int envsz[8] = { 0, 32, 48, 48, 64, -1, -1, -1 };
+  gpkg_wkb_t r;
+  int env;
+
+  mvt_geom_reset( g, 0 );
+  if ( (d == NULL) || (len < 8) || (d[0] != 'G') || (d[1] != 'P') ) return 0;
+  // empty and extended geometries are skipped
+  if ( d[3] & 0x30 ) return 0;
+  env = envsz[(d[3] >> 1) & 7];
+  if ( (env < 0) || (8 + env >= len) ) return 0;
+  r.p = d + 8 + env;
+  r.end = d + len;
+  return gpkg_wkb( &r, t, g, 0 ) && (g->npts > 0);
+}
+
+/* --------------------------------------------------------------------------
+ *  Encodes layer 'i' of tile z/x/y into 'out' : features of the tile
+ *  and of its buffer are found by the R-tree index, clipped to the
+ *  buffer, simplified and quantized.
+ * --------------------------------------------------------------------------*/
+static void gpkg_encode( gpkg_worker_t *w, int i, int z, int x, int y, mvtbuf_t *out )
+{
+  gpkg_layer_t *l = w->g->layers + i;
+  sqlite3_stmt *stmt;
+  gpkg_xform_t t;
+  double b[4], min;
+  int c, rc;
+
+  out->len = 0;
+  if ( w->stmts[i] == NULL ) {
+    rc = sqlite3_prepare_v2( w->db, l->query, strlen(l->query), w->stmts + i, NULL);
+    if ( rc != SQLITE_OK ) {
+      fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(w->db));
+      return;
+    }
+  }
+  stmt = w->stmts[i];
+
+  t.scale = ldexp( MVT_EXTENT, z ) / (2 * MERC_HALF);
+  t.ox = (double) x * MVT_EXTENT;
+  t.oy = (double) y * MVT_EXTENT;
+  t.geographic = l->geographic;
+
+  // tile and buffer bounds, features below half a tile unit are skipped
+  b[0] = (t.ox - MVT_BUFFER) / t.scale - MERC_HALF;
+  b[1] = MERC_HALF - (t.oy + MVT_EXTENT + MVT_BUFFER) / t.scale;
+  b[2] = (t.ox + MVT_EXTENT + MVT_BUFFER) / t.scale - MERC_HALF;
+  b[3] = MERC_HALF - (t.oy - MVT_BUFFER) / t.scale;
+  min = l->small ? 0 : 0.5 / t.scale;
+  if ( l->geographic ) {
+    gpkg_lonlat( b[0], b[1], b, b + 1 );
+    gpkg_lonlat( b[2], b[3], b + 2, b + 3 );
+    min = min / MERC_HALF * 180.0;
+    if ( b[1] <= -MERC_MAXLAT + 1e-9 ) b[1] = -90;
+    if ( b[3] >= MERC_MAXLAT - 1e-9 ) b[3] = 90;
+  }
+
+  sqlite3_reset( stmt );
+  for( c = 0; c < 4; ++c ) {
+    sqlite3_bind_double( stmt, c + 1, b[c] );
+  }
+  sqlite3_bind_double( stmt, 5, min );
+
+  w->mvt.name = l->table;
+  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
+    if ( !gpkg_geometry( (unsigned char*) sqlite3_column_blob( stmt, l->gcol ),
+			 sqlite3_column_bytes( stmt, l->gcol ), &t, &w->geom )) {
+      continue;
+    }
+    mvt_geom_clip( &w->geom, &w->tmp, -MVT_BUFFER, MVT_EXTENT + MVT_BUFFER );
+    mvt_geom_simplify( &w->geom, MVT_SIMPLIFY );
+    if ( w->geom.npts == 0 ) {
+      continue;
+    }
+    for( c = 1; c < l->ncols; ++c ) {
+      if ( (c == l->gcol) || (c == l->pkcol) ) continue;
+      switch( sqlite3_column_type( stmt, c )) {
+      case SQLITE_INTEGER:
+	mvt_layer_int( &w->mvt, l->cols[c], sqlite3_column_int64( stmt, c ));
+	break;
+      case SQLITE_FLOAT:
+	mvt_layer_double( &w->mvt, l->cols[c], sqlite3_column_double( stmt, c ));
+	break;
+      case SQLITE_TEXT:
+	mvt_layer_string( &w->mvt, l->cols[c], (char*) sqlite3_column_text( stmt, c ),
+			  sqlite3_column_bytes( stmt, c ));
+	break;
+      }
+    }
+    mvt_layer_feature( &w->mvt, (uint64_t) sqlite3_column_int64( stmt, 0 ), &w->geom );
+  }
+  if ( rc != SQLITE_DONE ) {
+    fprintf(stderr, "Failed to query features of '%s': %s\n", l->table, sqlite3_errmsg(w->db));
+  }
+  sqlite3_reset( stmt );
+  mvt_layer_end( &w->mvt, out );
+}
+
+/* --------------------------------------------------------------------------
+ *  Encodes layers of the current tile until none is left, called with
+ *  the lock held
+ * --------------------------------------------------------------------------*/
+static void gpkg_take( gpkg_worker_t *w )
+{
+  gpkg_t *g = w->g;
+  int i, z, x, y;
+
+  while( g->next < g->nlayers ) {
+    i = g->next++;
+    z = g->z;
+    x = g->x;
+    y = g->y;
+    pthread_mutex_unlock( &g->lock );
+    gpkg_encode( w, i, z, x, y, g->out + i );
+    pthread_mutex_lock( &g->lock );
+    if ( ++g->ndone == g->nlayers ) {
+      pthread_cond_signal( &g->done );
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Worker thread, waits for tiles to encode
+ * --------------------------------------------------------------------------*/
+static void *gpkg_work( void *arg )
+{
+  gpkg_worker_t *w = (gpkg_worker_t*) arg;
+  gpkg_t *g = w->g;
+
+  pthread_mutex_lock( &g->lock );
+  while( !g->quit ) {
+    if ( g->next < g->nlayers ) {
+      gpkg_take( w );
+    }
+    else {
+      pthread_cond_wait( &g->cond, &g->lock );
+    }
+  }
+  pthread_mutex_unlock( &g->lock );
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Starts the threads encoding layers, one per CPU but no more than
+ *  layers. Each one has its own read only connection.
+ * --------------------------------------------------------------------------*/
+static void gpkg_start_workers( gpkg_t *g )
+{
+  gpkg_worker_t *w;
+  int i, n;
+
+  n = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( n > g->nlayers ) n = g->nlayers;
+  if ( n > GPKG_MAXWORKERS ) n = GPKG_MAXWORKERS;
+  if ( n < 1 ) n = 1;
+
+  g->workers = (gpkg_worker_t*) calloc( n, sizeof(gpkg_worker_t));
+  g->out = (mvtbuf_t*) calloc( g->nlayers, sizeof(mvtbuf_t));
+  if ( (g->workers == NULL) || (g->out == NULL) ) {
+    fputs( "gpkg_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  pthread_mutex_init( &g->lock, NULL );
+  pthread_cond_init( &g->cond, NULL );
+  pthread_cond_init( &g->done, NULL );
+  g->next = g->nlayers;
+
+  for( i = 0; i < n; ++i ) {
+    w = g->workers + i;
+    w->g = g;
+    w->stmts = (sqlite3_stmt**) calloc( g->nlayers, sizeof(sqlite3_stmt*));
+    if ( w->stmts == NULL ) {
+      fputs( "gpkg_open: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    if ( i == 0 ) {
+      w->db = g->db;
+    }
+    else if ( sqlite3_open_v2( g->path, &w->db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK ) {
+      fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(w->db));
+      sqlite3_close( w->db );
+      free( w->stmts );
+      break;
+    }
+    else if ( pthread_create( &w->th, NULL, gpkg_work, w )) {
+      perror( "pthread_create" );
+      sqlite3_close( w->db );
+      free( w->stmts );
+      break;
+    }
+    g->nworkers++;
+  }
+  logger( "gpkg: %d layers encoded by %d threads\n", g->nlayers, g->nworkers );
+}
+
+/* --------------------------------------------------------------------------
+ *  Open geopackage sqlite database and returns a handle to it
+ *  A tile table in web mercator is served if there is one, otherwise
+ *  indexed feature tables are.
+ * --------------------------------------------------------------------------*/
+void *gpkg_open( char *path )
+{
   sqlite3 *db;
-  int rc, application_id = 0, user_version = 0;
+  gpkg_t *g;
+  int rc, application_id = 0;
 
   // open database
-  rc = sqlite3_open( path, &db );
+  rc = sqlite3_open_v2( path, &db, SQLITE_OPEN_READONLY, NULL );
   if ( rc != SQLITE_OK ) {
     fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
     sqlite3_close(db);
@@ -114,192 +930,293 @@ void *gpkg_open( char *path )
 
   // check metadata
   rc = sqlut_get_value( db, "application_id", &application_id );
-  if (!rc) {
+  if ( !rc || ((application_id != GPKG_APPID_1_2) && (application_id != GPKG_APPID_1_1) &&
+	       (application_id != GPKG_APPID_1_0)) ) {
     fprintf( stderr, "File '%s' doesn't contain valid geopackage data.\n", path);
     fprintf( stderr, "Pragma 'application_id' not found.\n");
     sqlite3_close(db);
     return NULL;
   }
-  
-  if (application_id == GPKG_APPID_1_2) {
-    rc = sqlut_get_value( db, "user_version", &user_version );
-    if (!rc) {
-      fprintf( stderr, "File '%s' doesn't contain valid geopackage data.\n", path);
-      fprintf( stderr, "Pragma 'user_version' not found.\n");
-      sqlite3_close(db);
-      return NULL;
-    }
-  }
-
-  rc = sqlut_check_table (db, "gpkg_contents",
-			  "table_name",
-			  "data_type",
-			  "identifier",
-			  "description",
-			  "last_change",
-			  "min_x", "min_y", "max_x", "max_y",
-			  "srs_id",
-			  NULL);
-  if (!rc) {
+
+  rc = sqlut_check_table( db, "gpkg_contents",
+			  "table_name", "data_type", "identifier", "description",
+			  "min_x", "min_y", "max_x", "max_y", "srs_id",
+			  NULL ) &&
+    sqlut_check_table( db, "gpkg_spatial_ref_sys",
+		       "srs_id", "organization", "organization_coordsys_id",
+		       NULL );
+  if ( !rc ) {
     fprintf( stderr, "File '%s' doesn't contain valid geopackage data.\n", path);
     sqlite3_close(db);
     return NULL;
   }
-  
-  rc = sqlut_check_table (db, "gpkg_spatial_ref_sys",
-			  "srs_name",
-			  "srs_id",
-			  "organization",
-			  "organization_coordsys_id",
-			  "definition",
-			  "description",
-			  NULL);
-  if (!rc) {
-    fprintf( stderr, "File '%s' doesn't contain valid geopackage data.\n", path);
-    sqlite3_close(db);
-    return NULL;
+
+  g = (gpkg_t*) calloc( 1, sizeof(gpkg_t));
+  if ( g == NULL ) {
+    fputs( "gpkg_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  g->db = db;
+  g->path = strdup( path );
+  if ( g->path == NULL ) {
+    fputs( "gpkg_open: memory allocation error.\n", stderr );
+    exit(1);
   }
-  
+  g->meta.minzoom = g->meta.maxzoom = -1;
 
-  // prepare statement
-  snprintf( query, sizeof(query), "SELECT tile_data FROM %s WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3", tname );
-  rc = sqlite3_prepare_v2( db, query, query, &stmt, NULL);
-  if ( rc != SQLITE_OK ) {
-    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
-    sqlite3_close(db);
+  // tile matrix tables are optional when there are only features
+  rc = sqlut_has_table( db, "gpkg_tile_matrix_set" ) && sqlut_has_table( db, "gpkg_tile_matrix" ) &&
+    sqlut_check_table( db, "gpkg_tile_matrix_set",
+		       "table_name", "srs_id", "min_x", "min_y", "max_x", "max_y",
+		       NULL ) &&
+    sqlut_check_table( db, "gpkg_tile_matrix",
+		       "table_name", "zoom_level", "matrix_width", "matrix_height",
+		       "tile_width", "tile_height", "pixel_x_size", "pixel_y_size",
+		       NULL ) &&
+    gpkg_open_tiles( g );
+  if ( rc ) {
+    return (void*) g;
+  }
+
+  rc = sqlut_has_table( db, "gpkg_geometry_columns" ) &&
+    sqlut_check_table( db, "gpkg_geometry_columns", "table_name", "column_name",
+		       "geometry_type_name", "srs_id", NULL ) &&
+    gpkg_open_features( g );
+  if ( !rc ) {
+    fprintf( stderr, "File '%s' has no tile table in web mercator (EPSG:3857) "
+	     "nor indexed feature table.\n", path);
+    gpkg_close( g );
     return NULL;
   }
-#undef QUERY
-  
-  return (void*) stmt;
+  gpkg_start_workers( g );
+
+  return (void*) g;
 }
 
 /* --------------------------------------------------------------------------
- *  Generates 'tiles/tiles.json' from 'gpkg_contents' table of mbtiles
+ *  Close geopackage, threads encoding layers are stopped first
  * --------------------------------------------------------------------------*/
-char *gpkg_tiles_json( void *dbh, int *len )
+void gpkg_close( void *h )
 {
-  static char *data = NULL;
-  static int  dlen = 0;
-
-  if ( data == NULL ) {
-    sqlite3 *db = sqlite3_db_handle( dbh );
-    sqlite3_stmt *stmt;
-    struct json_object *o, *a;
-    char *k, *v, *s, *format = NULL, url[64];
-    double d;
-    int i, rc;
-
-#define QUERY "SELECT * FROM gpkg_contents"
-    rc = sqlite3_prepare_v2( db, QUERY, strlen(QUERY), &stmt, NULL);
-    if ( rc != SQLITE_OK ) {
-      fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
-      sqlite3_close(db);
-      return NULL;
-    }
-#undef QUERY
-    
-    o = json_object_new_object();
+  gpkg_t *g = (gpkg_t*) h;
+  gpkg_worker_t *w;
+  int i, j;
 
-    json_object_object_add( o, "tilejson", json_object_new_string("2.0.0") );
-    
-    while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
-      k = (char *) sqlite3_column_text( stmt, 0 );
-      v = (char *) sqlite3_column_text( stmt, 1 );
+  if ( g == NULL ) return;
 
-      if ( !strcmp(k, "name") ) {
-	json_object_object_add( o, k, json_object_new_string(v));
+  if ( g->workers ) {
+    pthread_mutex_lock( &g->lock );
+    g->quit = 1;
+    pthread_cond_broadcast( &g->cond );
+    pthread_mutex_unlock( &g->lock );
+    for( i = 0; i < g->nworkers; ++i ) {
+      w = g->workers + i;
+      if ( i > 0 ) {
+	pthread_join( w->th, NULL );
       }
-      if ( !strcmp(k, "attribution") ) {
-	json_object_object_add( o, k, json_object_new_string(v));
+      for( j = 0; j < g->nlayers; ++j ) {
+	sqlite3_finalize( w->stmts[j] );
       }
-      if ( !strcmp(k, "description") ) {
-	json_object_object_add( o, k, json_object_new_string(v));
+      free( w->stmts );
+      if ( i > 0 ) {
+	sqlite3_close( w->db );
       }
-      if ( !strcmp(k, "version") ) {
-	json_object_object_add( o, k, json_object_new_string(v));
-      }
-      if ( !strcmp(k, "format") ) {
-	json_object_object_add( o, k, json_object_new_string(v));
-	if ( !strcmp(v, "jpg") ) format = "jpg";
-	if ( !strcmp(v, "png") ) format = "png";
-	if ( !strcmp(v, "pbf") ) format = "pbf";
-      }
-      if ( !strcmp(k, "minzoom") || !strcmp(k, "maxzoom") ) {
-	long d;
-	s = skip(v);
-	d = strtol( s, &s, 10 );
-	json_object_object_add( o, k, json_object_new_int(d));
-      }
-      if ( !strcmp(k, "bounds") ) {
-	struct json_object* a;
-	a = json_object_new_array();
-	for( s = v, i = 0; (*s != 0) && (i < 4); ++i ) {
-	  s = skip(s);
-	  d = strtod(s, &s);
-	  json_object_array_add( a, json_object_new_double(d));
-	}
-	if ( i < 4 ) {
-	  fprintf( stderr, "unable to parse map bounds.\n" );
-	  exit(1);
-	}
-	json_object_object_add( o, k, a );
-      }
-      if ( !strcmp(k, "center") ) {
-	struct json_object* a;
-	a = json_object_new_array();
-	for( s = v, i = 0; (*s != 0) && (i < 3); ++i ) {
-	  s = skip(s);
-	  d = strtod(s, &s);
-	  json_object_array_add( a, json_object_new_double(d));
-	}
-	if ( i < 3 ) {
-	  fprintf( stderr, "unable to parse map bounds.\n" );
-	  exit(1);
+      mvt_geom_free( &w->geom );
+      mvt_geom_free( &w->tmp );
+      mvt_layer_free( &w->mvt );
+    }
+    free( g->workers );
+    pthread_mutex_destroy( &g->lock );
+    pthread_cond_destroy( &g->cond );
+    pthread_cond_destroy( &g->done );
+  }
+  for( i = 0; i < g->nlayers; ++i ) {
+    for( j = 1; j < g->layers[i].ncols; ++j ) {
+      free( g->layers[i].cols[j] );
+    }
+    free( g->layers[i].cols );
+    free( g->layers[i].table );
+    free( g->layers[i].query );
+    if ( g->out ) {
+      mvt_free( g->out + i );
+    }
+  }
+  free( g->layers );
+  free( g->out );
+  mvt_free( &g->tile );
+  mvt_free( &g->gz );
+
+  sqlite3_finalize( g->stmt );
+  sqlite3_finalize( g->scanstmt );
+  sqlite3_close( g->db );
+  mbtiles_meta_clear( &g->meta );
+  free( g->path );
+  free( g->table );
+  free( g->tiles_json );
+  free( g );
+}
+
+/* --------------------------------------------------------------------------
+ *  Makes a vector tile from feature tables. Layers are shared between
+ *  the calling thread and the workers, then concatenated in table
+ *  order and compressed. Returns NULL when the tile has no feature.
+ * --------------------------------------------------------------------------*/
+static char *gpkg_read_features( gpkg_t *g, int z, int x, int y, int *len )
+{
+  int i;
+
+  if ( z > GPKG_MAXZOOM ) {
+    return NULL;
+  }
+
+  pthread_mutex_lock( &g->lock );
+  g->z = z;
+  g->x = x;
+  g->y = y;
+  g->next = g->ndone = 0;
+  pthread_cond_broadcast( &g->cond );
+  gpkg_take( g->workers );
+  while( g->ndone < g->nlayers ) {
+    pthread_cond_wait( &g->done, &g->lock );
+  }
+  pthread_mutex_unlock( &g->lock );
+
+  g->tile.len = 0;
+  for( i = 0; i < g->nlayers; ++i ) {
+    mvt_append( &g->tile, g->out[i].data, g->out[i].len );
+  }
+  if ( g->tile.len == 0 ) {
+    logger( "No feature in tile %d/%d/%d\n", z, x, y );
+    return NULL;
+  }
+  if ( mvt_gzip( &g->gz, g->tile.data, g->tile.len, GPKG_LEVEL ) < 0 ) {
+    return NULL;
+  }
+  *len = g->gz.len;
+  return g->gz.data;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile
+ *  Returned data belongs to the handle and is valid until next read.
+ * --------------------------------------------------------------------------*/
+char *gpkg_read( void *h, int z, int x, int y, int *len )
+{
+  gpkg_t *g = (gpkg_t*) h;
+  gpkg_level_t *l;
+
+  *len = 0;
+  if ( !TILEVALID( z, x, y ) ) {
+    return NULL;
+  }
+  if ( g->nlayers > 0 ) {
+    return gpkg_read_features( g, z, x, y, len );
+  }
+  l = g->level + z;
+  x -= l->dx;
+  y -= l->dy;
+  if ( (l->zoom < 0) || (x < 0) || (y < 0) || (x >= l->width) || (y >= l->height) ) {
+    return NULL;
+  }
+
+  sqlite3_reset( g->stmt );
+  sqlite3_bind_int( g->stmt, 1, l->zoom );
+  sqlite3_bind_int( g->stmt, 2, x );
+  sqlite3_bind_int( g->stmt, 3, y );
+  if ( sqlite3_step( g->stmt ) == SQLITE_ROW ) {
+    char *data = (char*) sqlite3_column_blob( g->stmt, 0 );
+    *len = sqlite3_column_bytes( g->stmt, 0 );
+    return data;
+  }
+  logger( "No tile %d/%d/%d\n", z, x + l->dx, y + l->dy );
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Calls 'fn' for each tile of zoom level 'z' in columns x0..x1 and
+ *  rows y0..y1 with its data, using a single range scan ordered by
+ *  column then row. Vector tiles made from features are made one by one.
+ *  Returns the number of tiles or -1 on error.
+ * --------------------------------------------------------------------------*/
+int gpkg_scan( void *h, int z, int x0, int y0, int x1, int y1,
+	       void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg )
+{
+  gpkg_t *g = (gpkg_t*) h;
+  gpkg_level_t *l;
+  char *data, query[256];
+  int x, y, rc, len, n = 0;
+
+  // vector tiles are made one by one
+  if ( g->nlayers > 0 ) {
+    for( x = x0; x <= x1; ++x ) {
+      for( y = y0; y <= y1; ++y ) {
+	if ( (data = gpkg_read( h, z, x, y, &len )) ) {
+	  fn( arg, z, x, y, data, len );
+	  n++;
 	}
-	json_object_object_add( o, k, a );
       }
-      if ( !strcmp(k, "json") ) {
-	enum json_tokener_error error;
-	struct json_object *so, *layers;
-	json_bool jb;
-	
-	so = json_tokener_parse_verbose( v, &error );
-	if ( error != json_tokener_success ) {
-	  fprintf( stderr, "failed to parse metadata json field: %s\n",
-		   json_tokener_error_desc( error ));
-	  exit(1);
-	}
+    }
+    return n;
+  }
 
-	jb = json_object_object_get_ex( so, "vector_layers", &layers );
-	if ( jb == TRUE ) {
-	  json_object_object_add( o, "vector_layers", json_object_get(layers));
-	}
-	else {
-	  fprintf( stderr, "Missing field 'vector_layers'.\n");
-	}
+  if ( (z < 0) || (z > 29) || (g->level[z].zoom < 0) ) {
+    return 0;
+  }
+  if ( g->scanstmt == NULL ) {
+    snprintf( query, sizeof(query), "SELECT tile_column, tile_row, tile_data FROM \"%s\" "
+	      "WHERE zoom_level = ?1 AND tile_column BETWEEN ?2 AND ?3 AND tile_row BETWEEN ?4 AND ?5 "
+	      "ORDER BY tile_column, tile_row", g->table );
+    rc = sqlite3_prepare_v2( g->db, query, strlen(query), &g->scanstmt, NULL);
+    if ( rc != SQLITE_OK ) {
+      fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(g->db));
+      return -1;
+    }
+  }
 
-	// free the subobject
-	json_object_put(so);
-      }
+  l = g->level + z;
+  sqlite3_reset( g->scanstmt );
+  sqlite3_bind_int( g->scanstmt, 1, l->zoom );
+  sqlite3_bind_int( g->scanstmt, 2, x0 - l->dx );
+  sqlite3_bind_int( g->scanstmt, 3, x1 - l->dx );
+  sqlite3_bind_int( g->scanstmt, 4, y0 - l->dy );
+  sqlite3_bind_int( g->scanstmt, 5, y1 - l->dy );
+  while( (rc = sqlite3_step( g->scanstmt )) == SQLITE_ROW ) {
+    // blob must be fetched before its size
+    data = (char*) sqlite3_column_blob( g->scanstmt, 2 );
+    len = sqlite3_column_bytes( g->scanstmt, 2 );
+    fn( arg, z, sqlite3_column_int( g->scanstmt, 0 ) + l->dx,
+	sqlite3_column_int( g->scanstmt, 1 ) + l->dy, data, len );
+    n++;
+  }
+  sqlite3_reset( g->scanstmt );
+
+  if ( rc != SQLITE_DONE ) {
+    fprintf(stderr, "Failed to scan tiles: %s\n", sqlite3_errmsg(g->db));
+    return -1;
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' from 'gpkg_contents' entry of the tile
+ *  table and its zoom levels
+ * --------------------------------------------------------------------------*/
+char *gpkg_tiles_json( void *h, int *len )
+{
+  gpkg_t *g = (gpkg_t*) h;
+
+  if ( g->tiles_json == NULL ) {
+    struct json_object *o = mbtiles_meta_object( &g->meta );
+    g->tiles_json = strdup( mbtiles_meta_json( o, &g->tjlen ));
+    json_object_put( o );
+    if ( g->tiles_json == NULL ) {
+      fputs( "gpkg_tiles_json: memory allocation error.\n", stderr );
+      exit(1);
     }
+  }
 
-    sqlite3_reset( stmt );
-    sqlite3_finalize( stmt );
-
-    // add the "tiles" property
-    // @todo : diff between raster and vectorial
-    a = json_object_new_array();
-    sprintf( url, "http://127.0.0.1:%d/tiles/{z}/{x}/{y}.%s", g_port, format );
-    json_object_array_add( a, json_object_new_string(url));
-    json_object_object_add( o, "tiles", a );
-    
-    data = (char*) json_object_to_json_string_ext( o, JSON_C_TO_STRING_PRETTY );
-    dlen = strlen(data);
-  }
-  
   if ( len != NULL ) {
-    *len = dlen;
+    *len = g->tjlen;
   }
-  return data;
+  return g->tiles_json;
 }
@@ -0,0 +1,35 @@
+#ifndef __GEOPACKAGE_H__
+#define __GEOPACKAGE_H__
+
+/* --------------------------------------------------------------------------
+ *  GeoPackage tiles. The first tile table whose tile matrix set is in
+ *  web mercator is served, tile matrix levels aligned on the XYZ grid
+ *  are mapped to XYZ zoom levels.
+ *  Without tile table, feature tables having an R-tree index are served
+ *  as the layers of vector tiles made on the fly. Layers of a tile are
+ *  encoded in parallel by worker threads, each with its own connection.
+ * --------------------------------------------------------------------------*/
+
+// sqlite application id, stored big endian at this offset of the file
+#define GPKG_APPID_OFFSET 68
+#define GPKG_APPID_1_2 0x47504B47   /* this is ASCII for "GPKG" */
+#define GPKG_APPID_1_1 0x47503131   /* this is ASCII for "GP11" */
+#define GPKG_APPID_1_0 0x47503130   /* this is ASCII for "GP10" */
+
+// zoom levels of vector tiles made from feature tables
+#define GPKG_MAXZOOM 14
+
+// compression level of vector tiles
+#define GPKG_LEVEL 6
+
+// max number of threads encoding layers, the calling thread included
+#define GPKG_MAXWORKERS 8
+
+void *gpkg_open( char *path );
+void  gpkg_close( void *h );
+char *gpkg_read( void *h, int z, int x, int y, int *len );
+char *gpkg_tiles_json( void *h, int *len );
+int   gpkg_scan( void *h, int z, int x0, int y0, int x1, int y1,
+		 void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg );
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __HILBERT_H__
+#define __HILBERT_H__
+
+#include <stdint.h>
+
+/* --------------------------------------------------------------------------
+ *  Position of tile x/y along the Hilbert curve filling the 2^z x 2^z
+ *  grid of zoom level z.
+ * --------------------------------------------------------------------------*/
+static inline uint64_t hilbert( int z, uint32_t x, uint32_t y )
+{
+  uint64_t d = 0;
+  uint32_t rx, ry, s, t, n = 1u << z;
+
+  for( s = n/2; s > 0; s /= 2 ) {
+    rx = (x & s) > 0;
+    ry = (y & s) > 0;
+    d += (uint64_t) s * s * ((3 * rx) ^ ry);
+    // rotate quadrant
+    if ( ry == 0 ) {
+      if ( rx == 1 ) {
+	x = n - 1 - x;
+	y = n - 1 - y;
+      }
+      t = x; x = y; y = t;
+    }
+  }
+  return d;
+}
+
+#endif
@@ -0,0 +1,497 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <json.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#include "layerfilter.h"
+#include "mvt.h"
+
+extern void logger(const char *fmt, ...);
+
+// max number of style sources pointing to the same map
+#define LF_MAXSOURCES 16
+
+#define ISGZIP(d,l) (((l) >= 2) && ((unsigned char)(d)[0] == 0x1f) && ((unsigned char)(d)[1] == 0x8b))
+
+typedef struct layerfilter_s {
+  source_t *base;
+  char *names[LAYERFILTER_MAXLAYERS]; // source layers drawn by the style
+  int nnames;
+  int set[30];                // layer set of zoom levels, 0 keeps all layers
+  uint64_t masks[31];         // drawn layers of each set
+  int nsets;
+  uint64_t mask;              // drawn layers of tile being walked
+  mvtbuf_t raw;               // inflated tile
+  mvtbuf_t keep;              // kept layers
+  mvtbuf_t out;               // filtered tile
+  int nlayers, nkept;
+} layerfilter_t;
+
+// scan of base source tiles
+typedef struct lfscan_s {
+  layerfilter_t *lf;
+  void (*fn)( void *arg, int z, int x, int y, char *data, int len );
+  void *arg;
+} lfscan_t;
+
+static source_ops_t layerfilter_ops;
+static layerfilter_stats_t g_stats;
+
+/* --------------------------------------------------------------------------
+ *  Tells if the url of a style source is the tiles.json or a tile url
+ *  of map 'name', 'first' is set for the map also served below /tiles/
+ * --------------------------------------------------------------------------*/
+static int layerfilter_url( const char *url, char *name, int first )
+{
+  char pat[160];
+  const char *p;
+
+  snprintf( pat, sizeof(pat), "tiles/%s/", name );
+  if ( (p = strstr( url, pat )) != NULL ) {
+    p += strlen( pat );
+    if ( !strcmp( p, "tiles.json" ) || !strncmp( p, "{z}/", 4 ) ) {
+      return 1;
+    }
+  }
+  if ( first ) {
+    if ( ((p = strstr( url, "tiles/tiles.json" )) != NULL) && !strcmp( p, "tiles/tiles.json" ) ) {
+      return 1;
+    }
+    if ( strstr( url, "tiles/{z}/" ) != NULL ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Tells if a style source points to the map, sets the zoom offset
+ *  between its tiles and the map zoom level
+ * --------------------------------------------------------------------------*/
+static int layerfilter_match( struct json_object *s, char *name, int first, int *off )
+{
+  struct json_object *v;
+  int i, tilesize = LAYERFILTER_TILESIZE;
+
+  if ( (json_object_object_get_ex( s, "type", &v ) != TRUE) ||
+       strcmp( json_object_get_string( v ), "vector" ) ) {
+    return 0;
+  }
+  if ( json_object_object_get_ex( s, "tileSize", &v ) == TRUE ) {
+    tilesize = json_object_get_int( v );
+  }
+  if ( tilesize <= 0 ) {
+    return 0;
+  }
+  // tiles of zoom level z are drawn from map zoom level z - off
+  *off = (int) lround( log2( (double) LAYERFILTER_TILESIZE / tilesize ));
+
+  if ( (json_object_object_get_ex( s, "url", &v ) == TRUE) &&
+       layerfilter_url( json_object_get_string( v ), name, first ) ) {
+    return 1;
+  }
+  if ( json_object_object_get_ex( s, "tiles", &v ) == TRUE ) {
+    for( i = 0; i < json_object_array_length( v ); ++i ) {
+      if ( layerfilter_url( json_object_get_string( json_object_array_get_idx( v, i )), name, first ) ) {
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns index of source layer 'name', -1 if it isn't drawn
+ * --------------------------------------------------------------------------*/
+static int layerfilter_find( layerfilter_t *lf, const char *name, int len )
+{
+  int i;
+  for( i = 0; i < lf->nnames; ++i ) {
+    if ( !strncmp( lf->names[i], name, len ) && (lf->names[i][len] == 0) ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Finds the source layers drawn by the style at each zoom level of the
+ *  map. Layers hidden by their 'visibility' are kept as the viewer page
+ *  can show them. Returns -1 when tiles can't be filtered.
+ * --------------------------------------------------------------------------*/
+static int layerfilter_layers( layerfilter_t *lf, struct json_object *style, char *name, int first,
+			       int minzoom, int maxzoom, uint64_t *masks )
+{
+  struct json_object *sources, *layers, *l, *v;
+  struct json_object_iterator it, end;
+  const char *ids[LF_MAXSOURCES];
+  int offs[LF_MAXSOURCES];
+  int i, k, z, n, li, nsrcs = 0;
+  double lmin, lmax, lo, hi;
+
+  memset( masks, 0, 30 * sizeof(uint64_t));
+  if ( (json_object_object_get_ex( style, "sources", &sources ) != TRUE) ||
+       (json_object_object_get_ex( style, "layers", &layers ) != TRUE) ) {
+    return -1;
+  }
+
+  end = json_object_iter_end( sources );
+  for( it = json_object_iter_begin( sources ); !json_object_iter_equal( &it, &end ); json_object_iter_next( &it ) ) {
+    if ( (nsrcs < LF_MAXSOURCES) &&
+	 layerfilter_match( json_object_iter_peek_value( &it ), name, first, offs + nsrcs ) ) {
+      ids[nsrcs++] = json_object_iter_peek_name( &it );
+    }
+  }
+  if ( nsrcs == 0 ) {
+    return -1;
+  }
+
+  n = json_object_array_length( layers );
+  for( i = 0; i < n; ++i ) {
+    l = json_object_array_get_idx( layers, i );
+    if ( json_object_object_get_ex( l, "source", &v ) != TRUE ) {
+      continue;
+    }
+    for( k = 0; (k < nsrcs) && strcmp( ids[k], json_object_get_string( v )); ++k );
+    if ( (k == nsrcs) || (json_object_object_get_ex( l, "source-layer", &v ) != TRUE) ) {
+      continue;
+    }
+    li = layerfilter_find( lf, json_object_get_string( v ), json_object_get_string_len( v ));
+    if ( li < 0 ) {
+      if ( lf->nnames == LAYERFILTER_MAXLAYERS ) {
+	fprintf( stderr, "'%s' : style draws more than %d source layers, layer filter disabled.\n",
+		 name, LAYERFILTER_MAXLAYERS );
+	return -1;
+      }
+      lf->names[lf->nnames] = strdup( json_object_get_string( v ));
+      if ( lf->names[lf->nnames] == NULL ) {
+	fputs( "layerfilter: memory allocation error.\n", stderr );
+	exit(1);
+      }
+      li = lf->nnames++;
+    }
+
+    // layers are drawn from their min zoom up to, excluding, their max zoom
+    lmin = 0.0;
+    lmax = 24.0;
+    if ( json_object_object_get_ex( l, "minzoom", &v ) == TRUE ) {
+      lmin = json_object_get_double( v );
+    }
+    if ( json_object_object_get_ex( l, "maxzoom", &v ) == TRUE ) {
+      lmax = json_object_get_double( v );
+    }
+
+    // tiles of the max zoom level are drawn at all deeper map zoom levels
+    for( z = minzoom; z <= maxzoom; ++z ) {
+      lo = z - offs[k];
+      hi = (z == maxzoom) ? 1e9 : lo + 1.0;
+      if ( (lmin < hi) && (lmax > lo) ) {
+	masks[z] |= 1ULL << li;
+      }
+    }
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Wraps vector source 'base' of map 'name' so that its tiles only hold
+ *  the layers drawn by 'style'. Sources which are not vector, or whose
+ *  tiles keep all their layers, are returned unchanged.
+ * --------------------------------------------------------------------------*/
+source_t *layerfilter_source( source_t *base, struct json_object *style, char *name, int first )
+{
+  struct json_object *tj, *v, *a;
+  enum json_tokener_error error;
+  layerfilter_t *lf;
+  source_t *src;
+  uint64_t masks[30], all = 0;
+  const char *format = "";
+  int i, z, minzoom = 0, maxzoom = 29, known = 0, nfiltered = 0;
+
+  if ( style == NULL ) {
+    return base;
+  }
+  tj = json_tokener_parse_verbose( source_tiles_json( base, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    return base;
+  }
+  if ( json_object_object_get_ex( tj, "format", &v ) == TRUE ) {
+    format = json_object_get_string( v );
+  }
+  if ( strcmp( format, "pbf" ) && (json_object_object_get_ex( tj, "vector_layers", &v ) != TRUE) ) {
+    json_object_put( tj );
+    return base;
+  }
+  if ( json_object_object_get_ex( tj, "minzoom", &v ) == TRUE ) {
+    minzoom = json_object_get_int( v );
+  }
+  if ( json_object_object_get_ex( tj, "maxzoom", &v ) == TRUE ) {
+    maxzoom = json_object_get_int( v );
+  }
+  if ( minzoom < 0 ) minzoom = 0;
+  if ( maxzoom > 29 ) maxzoom = 29;
+
+  lf = (layerfilter_t*) calloc( 1, sizeof(layerfilter_t));
+  src = (source_t*) calloc( 1, sizeof(source_t));
+  if ( (lf == NULL) || (src == NULL) ) {
+    fputs( "layerfilter: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  if ( layerfilter_layers( lf, style, name, first, minzoom, maxzoom, masks ) < 0 ) {
+    goto keep;
+  }
+
+  // zoom levels drawing all the layers announced by the source are
+  // left alone
+  if ( (json_object_object_get_ex( tj, "vector_layers", &a ) == TRUE) && json_object_array_length( a ) ) {
+    known = 1;
+    for( i = 0; i < json_object_array_length( a ); ++i ) {
+      if ( json_object_object_get_ex( json_object_array_get_idx( a, i ), "id", &v ) != TRUE ) {
+	continue;
+      }
+      z = layerfilter_find( lf, json_object_get_string( v ), json_object_get_string_len( v ));
+      if ( z < 0 ) {
+	known = 0;
+	break;
+      }
+      all |= 1ULL << z;
+    }
+  }
+  for( z = 0; z < 30; ++z ) {
+    if ( (z < minzoom) || (z > maxzoom) || (known && ((masks[z] & all) == all)) ) {
+      continue;
+    }
+    for( i = 1; (i <= lf->nsets) && (lf->masks[i] != masks[z]); ++i );
+    if ( i > lf->nsets ) {
+      lf->masks[++lf->nsets] = masks[z];
+    }
+    lf->set[z] = i;
+    nfiltered++;
+  }
+  if ( nfiltered == 0 ) {
+    goto keep;
+  }
+  json_object_put( tj );
+
+  lf->base = base;
+  src->path = base->path;
+  src->ops = &layerfilter_ops;
+  src->h = lf;
+  logger( "layerfilter '%s' : %d source layers drawn, %d zoom levels filtered\n",
+	  name, lf->nnames, nfiltered );
+  return src;
+
+ keep:
+  for( i = 0; i < lf->nnames; ++i ) {
+    free( lf->names[i] );
+  }
+  free( lf );
+  free( src );
+  json_object_put( tj );
+  return base;
+}
+
+/* --------------------------------------------------------------------------
+ *  Keeps a layer of walked tile when the style draws it
+ * --------------------------------------------------------------------------*/
+static void layerfilter_onlayer( void *arg, mvtinfo_t *l )
+{
+  layerfilter_t *lf = (layerfilter_t*) arg;
+  int i;
+
+  lf->nlayers++;
+  i = l->name ? layerfilter_find( lf, l->name, l->namelen ) : -1;
+  if ( (i >= 0) && (lf->mask & (1ULL << i)) ) {
+    mvt_append( &lf->keep, l->data, l->len );
+    lf->nkept++;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Drops the layers of a tile which are not in layer set 's'. Tiles
+ *  keeping all their layers and malformed tiles are returned as is,
+ *  others are compressed again when they were. Returned data is valid
+ *  until next call.
+ * --------------------------------------------------------------------------*/
+static char *layerfilter_apply( layerfilter_t *lf, int s, char *data, int *len )
+{
+  if ( (data == NULL) || (*len == 0) || (s == 0) ) {
+    return data;
+  }
+
+  lf->raw.len = 0;
+  lf->keep.len = 0;
+  lf->nlayers = lf->nkept = 0;
+  lf->mask = lf->masks[s];
+  if ( (mvt_append( &lf->raw, data, *len ) < 0) ||
+       (mvt_walk( lf->raw.data, lf->raw.len, layerfilter_onlayer, lf ) < 0) ) {
+    return data;
+  }
+  g_stats.tiles++;
+  g_stats.inbytes += *len;
+  if ( lf->nkept == lf->nlayers ) {
+    g_stats.outbytes += *len;
+    return data;
+  }
+  g_stats.filtered++;
+  g_stats.layers += lf->nlayers - lf->nkept;
+
+  if ( lf->keep.len == 0 ) {
+    // a tile without layers is an empty message
+    *len = 0;
+    return "";
+  }
+  if ( ISGZIP( data, *len ) ) {
+    if ( mvt_gzip( &lf->out, lf->keep.data, lf->keep.len, LAYERFILTER_LEVEL ) < 0 ) {
+      g_stats.outbytes += *len;
+      return data;
+    }
+    data = lf->out.data;
+    *len = lf->out.len;
+  }
+  else {
+    data = lf->keep.data;
+    *len = lf->keep.len;
+  }
+  g_stats.outbytes += *len;
+  return data;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile and drops the layers not drawn at its zoom level
+ * --------------------------------------------------------------------------*/
+static char *layerfilter_read( void *h, int z, int x, int y, int *len )
+{
+  layerfilter_t *lf = (layerfilter_t*) h;
+  char *data;
+
+  data = source_read( lf->base, z, x, y, len );
+  if ( (z < 0) || (z > 29) ) {
+    return data;
+  }
+  return layerfilter_apply( lf, lf->set[z], data, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Tiles of filtered zoom levels are cached by coordinates : the id of
+ *  a base tile, shared by zoom levels drawing different layers, has no
+ *  room left for the layer set. Ids only identify unfiltered tiles.
+ * --------------------------------------------------------------------------*/
+static int layerfilter_tile_id( void *h, int z, int x, int y, uint64_t *id )
+{
+  layerfilter_t *lf = (layerfilter_t*) h;
+  int rc;
+
+  rc = source_tile_id( lf->base, z, x, y, id );
+  if ( (rc <= 0) || (z < 0) || (z > 29) || (lf->set[z] == 0) ) {
+    return rc;
+  }
+  return -1;
+}
+
+static char *layerfilter_read_id( void *h, uint64_t id, int *len )
+{
+  return source_read_id( ((layerfilter_t*) h)->base, id, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Scans tiles of base source, filtering them on the fly
+ * --------------------------------------------------------------------------*/
+static void layerfilter_onscan( void *arg, int z, int x, int y, char *data, int len )
+{
+  lfscan_t *sc = (lfscan_t*) arg;
+
+  data = layerfilter_apply( sc->lf, sc->lf->set[z], data, &len );
+  sc->fn( sc->arg, z, x, y, data, len );
+}
+
+static int layerfilter_scan( void *h, int z, int x0, int y0, int x1, int y1,
+			     void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg )
+{
+  layerfilter_t *lf = (layerfilter_t*) h;
+  lfscan_t sc;
+
+  if ( (z < 0) || (z > 29) || (lf->set[z] == 0) ) {
+    return source_scan( lf->base, z, x0, y0, x1, y1, fn, arg );
+  }
+  sc.lf = lf;
+  sc.fn = fn;
+  sc.arg = arg;
+  return source_scan( lf->base, z, x0, y0, x1, y1, layerfilter_onscan, &sc );
+}
+
+/* --------------------------------------------------------------------------
+ *  Tile files are sent as is only for zoom levels keeping all layers
+ * --------------------------------------------------------------------------*/
+static int layerfilter_tile_fd( void *h, int z, int x, int y, int *fd, int *len )
+{
+  layerfilter_t *lf = (layerfilter_t*) h;
+
+  if ( (z < 0) || (z > 29) || lf->set[z] ) {
+    return -1;
+  }
+  return source_tile_fd( lf->base, z, x, y, fd, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Other source operations
+ * --------------------------------------------------------------------------*/
+static void layerfilter_close( void *h )
+{
+  layerfilter_t *lf = (layerfilter_t*) h;
+  int i;
+
+  for( i = 0; i < lf->nnames; ++i ) {
+    free( lf->names[i] );
+  }
+  mvt_free( &lf->raw );
+  mvt_free( &lf->keep );
+  mvt_free( &lf->out );
+  source_close( lf->base );
+  free( lf );
+}
+
+static char *layerfilter_tiles_json( void *h, int *len )
+{
+  return source_tiles_json( ((layerfilter_t*) h)->base, len );
+}
+
+static int layerfilter_index( void *h )
+{
+  return source_index( ((layerfilter_t*) h)->base );
+}
+
+static int layerfilter_shared( void *h, uint64_t **ids )
+{
+  return source_shared( ((layerfilter_t*) h)->base, ids );
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns counters of walked and filtered tiles
+ * --------------------------------------------------------------------------*/
+layerfilter_stats_t *layerfilter_stats()
+{
+  return &g_stats;
+}
+
+static source_ops_t layerfilter_ops = {
+  "layerfilter",
+  NULL,
+  layerfilter_close,
+  layerfilter_read,
+  layerfilter_tiles_json,
+  layerfilter_tile_id,
+  layerfilter_read_id,
+  layerfilter_index,
+  layerfilter_shared,
+  layerfilter_scan,
+  layerfilter_tile_fd
+};
@@ -0,0 +1,34 @@
+#ifndef __LAYERFILTER_H__
+#define __LAYERFILTER_H__
+
+#include <json.h>
+
+#include "source.h"
+
+/* --------------------------------------------------------------------------
+ *  Layer filtering : layers of vector tiles which no layer of the
+ *  served style draws at the zoom level of the tile are dropped before
+ *  tiles are cached. Layers are walked without decoding features.
+ * --------------------------------------------------------------------------*/
+
+// max number of source layers referenced by the style for a map
+#define LAYERFILTER_MAXLAYERS 64
+
+// compression level of filtered tiles
+#define LAYERFILTER_LEVEL 6
+
+// default tile size of vector sources in styles
+#define LAYERFILTER_TILESIZE 512
+
+typedef struct layerfilter_stats_s {
+  unsigned long tiles;        // tiles walked
+  unsigned long filtered;     // tiles which lost layers
+  unsigned long layers;       // layers dropped
+  unsigned long long inbytes; // size of walked tiles
+  unsigned long long outbytes;
+} layerfilter_stats_t;
+
+source_t *layerfilter_source( source_t *base, struct json_object *style, char *name, int first );
+layerfilter_stats_t *layerfilter_stats();
+
+#endif
@@ -1,8 +1,11 @@
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include <json.h>
 
@@ -13,20 +16,60 @@
 #endif
 
 #include "archrt.h"
+#include "mbtiles.h"
+#include "source.h"
 
 // externals
 extern int g_port;
+extern void logger(const char *fmt, ...);
+
+// max number of shared tiles reported by mbtiles_shared()
+#define MAXSHARED 16
+
+/* --------------------------------------------------------------------------
+ *  In memory index entry : maps a packed tile id to the rowid of the
+ *  row holding tile data ('tiles' table or 'images' table)
+ * --------------------------------------------------------------------------*/
+typedef struct tileidx_s {
+  uint64_t id;
+  sqlite3_int64 rowid;
+} tileidx_t;
+
+/* --------------------------------------------------------------------------
+ *  mbtiles handle
+ * --------------------------------------------------------------------------*/
+typedef struct mbtiles_s {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;       // tile query by coordinates
+  sqlite3_stmt *idstmt;     // tile id query by coordinates
+  sqlite3_stmt *scanstmt;   // tiles query by zoom level and ranges
+  char *table;              // table holding 'tile_data' column
+  int normalized;           // 'map' / 'images' schema
+  tileidx_t *idx;           // sorted index, NULL if not built
+  int nidx;
+  sqlite3_blob *blob;       // incremental blob I/O handle
+  char *buf;                // tile data read with 'blob'
+  int bufsz;
+  uint64_t shared[MAXSHARED]; // ids of most referenced tiles
+  int nshared;
+  char *path;
+  mbtiles_meta_t meta;      // parsed 'metadata' table
+  time_t mtime;             // file state when metadata was read
+  off_t size;
+  char *tiles_json;
+  int tjlen;
+} mbtiles_t;
 
 // forward
-char *mbtiles_read( void *s, int z, int x, int y, int *len );
-char *mbtile_auto_style_json( void *dbh, int *len );
+static int mbtiles_has_table( sqlite3 *db, char *name );
+static void mbtiles_load_meta( mbtiles_t *m );
 
 /* --------------------------------------------------------------------------
  *  Open mbtiles sqlite database and returns a handle to it
- *  The handle is a prepared statement used to query tile data
  * --------------------------------------------------------------------------*/
 void *mbtiles_open( char *path )
 {
+  mbtiles_t *m;
   sqlite3_stmt *stmt;
   sqlite3 *db;
   int rc;
@@ -51,8 +94,33 @@ void *mbtiles_open( char *path )
     return NULL;
   }
 #undef QUERY
-  
-  return (void*) stmt;
+
+  m = (mbtiles_t*) calloc( 1, sizeof(mbtiles_t));
+  if ( m == NULL ) {
+    fputs( "mbtiles_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  m->db = db;
+  m->stmt = stmt;
+  m->path = strdup( path );
+  if ( m->path == NULL ) {
+    fputs( "mbtiles_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+
+  // find out which table holds tile data
+  if ( mbtiles_has_table( db, "map" ) && mbtiles_has_table( db, "images" ) ) {
+    // normalized schema : 'tiles' is a view over 'map' and 'images'
+    m->table = "images";
+    m->normalized = 1;
+  }
+  else if ( mbtiles_has_table( db, "tiles" ) ) {
+    m->table = "tiles";
+  }
+
+  m->meta.minzoom = m->meta.maxzoom = -1;
+  mbtiles_load_meta( m );
+  return (void*) m;
 }
 
 /* --------------------------------------------------------------------------
@@ -60,20 +128,357 @@ void *mbtiles_open( char *path )
  * --------------------------------------------------------------------------*/
 void mbtiles_close( void *dbh )
 {
-  sqlite3 *db = sqlite3_db_handle( dbh );
-  sqlite3_reset( dbh );
-  sqlite3_finalize( dbh );
-  sqlite3_close( db );
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  if ( m == NULL ) return;
+  if ( m->blob ) sqlite3_blob_close( m->blob );
+  sqlite3_reset( m->stmt );
+  sqlite3_finalize( m->stmt );
+  sqlite3_finalize( m->idstmt );
+  sqlite3_finalize( m->scanstmt );
+  sqlite3_close( m->db );
+  free( m->idx );
+  free( m->buf );
+  free( m->path );
+  free( m->tiles_json );
+  mbtiles_meta_clear( &m->meta );
+  free( m );
+}
+
+/* --------------------------------------------------------------------------
+ *  Tells if 'name' is a table of the database
+ * --------------------------------------------------------------------------*/
+static int mbtiles_has_table( sqlite3 *db, char *name )
+{
+  sqlite3_stmt *stmt;
+  int rc, res = 0;
+  
+#define QUERY "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?1"
+  rc = sqlite3_prepare_v2( db, QUERY, strlen(QUERY), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+    return 0;
+  }
+#undef QUERY
+  sqlite3_bind_text( stmt, 1, name, -1, SQLITE_STATIC );
+  res = (sqlite3_step( stmt ) == SQLITE_ROW);
+  sqlite3_finalize( stmt );
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  qsort / bsearch comparison function for index entries
+ * --------------------------------------------------------------------------*/
+static int tileidx_cmp( const void *a, const void *b )
+{
+  uint64_t ia = ((tileidx_t*) a)->id;
+  uint64_t ib = ((tileidx_t*) b)->id;
+  return (ia > ib) - (ia < ib);
+}
+
+/* --------------------------------------------------------------------------
+ *  qsort comparison function for rowids
+ * --------------------------------------------------------------------------*/
+static int rowid_cmp( const void *a, const void *b )
+{
+  sqlite3_int64 ra = *(sqlite3_int64*) a;
+  sqlite3_int64 rb = *(sqlite3_int64*) b;
+  return (ra > rb) - (ra < rb);
+}
+
+/* --------------------------------------------------------------------------
+ *  Find the tiles of normalized databases which are referenced by
+ *  many coordinates (typically ocean or empty land tiles) using the
+ *  in memory index. Keeps the ids of the MAXSHARED most referenced.
+ * --------------------------------------------------------------------------*/
+static void mbtiles_find_shared( mbtiles_t *m )
+{
+  sqlite3_int64 *r;
+  int cnt[MAXSHARED];
+  int i, j, k, c, ndup = 0, nblob = 0;
+
+  r = (sqlite3_int64*) malloc( (m->nidx + 1) * sizeof(sqlite3_int64));
+  if ( r == NULL ) {
+    fputs( "mbtiles_find_shared: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  for( i = 0; i < m->nidx; ++i ) {
+    r[i] = m->idx[i].rowid;
+  }
+  qsort( r, m->nidx, sizeof(sqlite3_int64), rowid_cmp );
+
+  m->nshared = 0;
+  for( i = 0; i < m->nidx; i = j ) {
+    for( j = i + 1; (j < m->nidx) && (r[j] == r[i]); ++j );
+    c = j - i;
+    nblob++;
+    if ( c < 2 ) continue;
+    ndup += c - 1;
+    // insertion in array sorted by decreasing count
+    for( k = m->nshared; (k > 0) && (cnt[k-1] < c); --k ) {
+      if ( k < MAXSHARED ) {
+	cnt[k] = cnt[k-1];
+	m->shared[k] = m->shared[k-1];
+      }
+    }
+    if ( k < MAXSHARED ) {
+      cnt[k] = c;
+      m->shared[k] = r[i];
+      if ( m->nshared < MAXSHARED ) m->nshared++;
+    }
+  }
+  free(r);
+  
+  logger( "%d tiles reference %d distinct blobs, %d duplicates\n", m->nidx, nblob, ndup );
+  for( i = 0; i < m->nshared; ++i ) {
+    logger( "  tile id %lld referenced %d times\n", (long long) m->shared[i], cnt[i] );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Build in memory index of tiles
+ *  Each tile coordinates are mapped to the rowid of the row holding its
+ *  data. Tiles are then read with incremental blob I/O which bypasses
+ *  the SQL engine and the 'tiles' view join of normalized databases.
+ *  Returns the number of indexed tiles, -1 if the index can't be built.
+ * --------------------------------------------------------------------------*/
+int mbtiles_index( void *dbh )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  sqlite3_stmt *stmt;
+  char *query;
+  int rc, n = 0, sz = 0;
+
+  if ( m->normalized ) {
+    query = "SELECT map.zoom_level, map.tile_column, map.tile_row, images.rowid "
+      "FROM map JOIN images ON images.tile_id = map.tile_id";
+  }
+  else if ( m->table ) {
+    query = "SELECT zoom_level, tile_column, tile_row, rowid FROM tiles";
+  }
+  else {
+    fprintf( stderr, "Unknown mbtiles schema, tiles won't be indexed.\n" );
+    return -1;
+  }
+
+  rc = sqlite3_prepare_v2( m->db, query, strlen(query), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(m->db));
+    return -1;
+  }
+
+  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
+    if ( n == sz ) {
+      sz = sz ? 2*sz : 4096;
+      m->idx = (tileidx_t*) realloc( m->idx, sz * sizeof(tileidx_t));
+      if ( m->idx == NULL ) {
+	fputs( "mbtiles_index: memory allocation error.\n", stderr );
+	exit(1);
+      }
+    }
+    m->idx[n].id = TILEID( sqlite3_column_int( stmt, 0 ),
+			   sqlite3_column_int( stmt, 1 ),
+			   sqlite3_column_int( stmt, 2 ));
+    m->idx[n].rowid = sqlite3_column_int64( stmt, 3 );
+    n++;
+  }
+  sqlite3_finalize( stmt );
+
+  if ( rc != SQLITE_DONE ) {
+    fprintf(stderr, "Failed to index tiles: %s\n", sqlite3_errmsg(m->db));
+    free( m->idx );
+    m->idx = NULL;
+    return -1;
+  }
+
+  qsort( m->idx, n, sizeof(tileidx_t), tileidx_cmp );
+  m->nidx = n;
+
+  // check incremental blob I/O is usable (fails on WITHOUT ROWID tables)
+  if ( n > 0 ) {
+    rc = sqlite3_blob_open( m->db, "main", m->table, "tile_data", m->idx[0].rowid, 0, &m->blob );
+    if ( rc != SQLITE_OK ) {
+      fprintf(stderr, "Cannot use blob I/O on table '%s': %s\n", m->table, sqlite3_errmsg(m->db));
+      sqlite3_blob_close( m->blob );
+      m->blob = NULL;
+      free( m->idx );
+      m->idx = NULL;
+      m->nidx = 0;
+      return -1;
+    }
+  }
+  
+  logger( "indexed %d tiles of table '%s'\n", n, m->table );
+
+  if ( m->normalized ) {
+    mbtiles_find_shared( m );
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads tile data from row 'rowid' of the table holding tile data
+ *  using incremental blob I/O
+ * --------------------------------------------------------------------------*/
+static char *mbtiles_read_rowid( mbtiles_t *m, sqlite3_int64 rowid, int *len )
+{
+  int rc, n;
+
+  if ( m->blob ) {
+    rc = sqlite3_blob_reopen( m->blob, rowid );
+  }
+  else {
+    rc = sqlite3_blob_open( m->db, "main", m->table, "tile_data", rowid, 0, &m->blob );
+    if ( rc != SQLITE_OK ) {
+      sqlite3_blob_close( m->blob );
+      m->blob = NULL;
+    }
+  }
+  if ( rc != SQLITE_OK ) {
+    fprintf( stderr, "Failed to open tile blob %lld : %s\n", (long long) rowid, sqlite3_errmsg(m->db));
+    *len = 0;
+    return NULL;
+  }
+
+  n = sqlite3_blob_bytes( m->blob );
+  if ( n > m->bufsz ) {
+    free( m->buf );
+    m->bufsz = n + n/4;
+    m->buf = (char*) malloc( m->bufsz );
+    if ( m->buf == NULL ) {
+      fputs( "mbtiles_read: memory allocation error.\n", stderr );
+      exit(1);
+    }
+  }
+  
+  rc = sqlite3_blob_read( m->blob, m->buf, n, 0 );
+  if ( rc != SQLITE_OK ) {
+    fprintf( stderr, "Failed to read tile blob %lld : %s\n", (long long) rowid, sqlite3_errmsg(m->db));
+    *len = 0;
+    return NULL;
+  }
+
+  *len = n;
+  return m->buf;
+}
+
+/* --------------------------------------------------------------------------
+ *  Search in memory index, 'y' is a TMS row number.
+ * --------------------------------------------------------------------------*/
+static tileidx_t *mbtiles_idx_search( mbtiles_t *m, int z, int x, int y )
+{
+  tileidx_t key;
+  key.id = TILEID( z, x, y );
+  return (tileidx_t*) bsearch( &key, m->idx, m->nidx, sizeof(tileidx_t), tileidx_cmp );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile using in memory index and blob I/O
+ *  'y' is a TMS row number.
+ * --------------------------------------------------------------------------*/
+static char *mbtiles_read_idx( mbtiles_t *m, int z, int x, int y, int *len )
+{
+  tileidx_t *e = mbtiles_idx_search( m, z, x, y );
+  if ( e == NULL ) {
+    logger( "No tile %d/%d/%d\n", z, x, y );
+    *len = 0;
+    return NULL;
+  }
+  return mbtiles_read_rowid( m, e->rowid, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Retrieve tile id : the rowid of the row holding tile data.
+ *  In normalized databases all the coordinates sharing the same
+ *  image get the same id, so it can be used as a cache key or an ETag.
+ *  Returns 1 if found, 0 if the tile doesn't exist and -1 if tiles
+ *  can't be identified with this database.
+ * --------------------------------------------------------------------------*/
+int mbtiles_tile_id( void *dbh, int z, int x, int y, uint64_t *id )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  int rc;
+
+  if ( m->table == NULL ) {
+    return -1;
+  }
+  if ( !TILEVALID( z, x, y ) ) {
+    return 0;
+  }
+  
+  y = (1 << z) - 1 - y;
+  if ( m->idx ) {
+    tileidx_t *e = mbtiles_idx_search( m, z, x, y );
+    if ( e == NULL ) return 0;
+    *id = (uint64_t) e->rowid;
+    return 1;
+  }
+
+  if ( m->idstmt == NULL ) {
+    char *query;
+    if ( m->normalized ) {
+      query = "SELECT images.rowid FROM map JOIN images ON images.tile_id = map.tile_id "
+	"WHERE map.zoom_level = ?1 AND map.tile_column = ?2 AND map.tile_row = ?3";
+    }
+    else {
+      query = "SELECT rowid FROM tiles WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3";
+    }
+    rc = sqlite3_prepare_v2( m->db, query, strlen(query), &m->idstmt, NULL);
+    if ( rc != SQLITE_OK ) {
+      fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(m->db));
+      m->table = NULL;
+      return -1;
+    }
+  }
+
+  sqlite3_reset( m->idstmt );
+  sqlite3_bind_int( m->idstmt, 1, z );
+  sqlite3_bind_int( m->idstmt, 2, x );
+  sqlite3_bind_int( m->idstmt, 3, y );
+  if ( sqlite3_step( m->idstmt ) == SQLITE_ROW ) {
+    *id = (uint64_t) sqlite3_column_int64( m->idstmt, 0 );
+    return 1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile given its id
+ * --------------------------------------------------------------------------*/
+char *mbtiles_read_id( void *dbh, uint64_t id, int *len )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  return mbtiles_read_rowid( m, (sqlite3_int64) id, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the ids of the tiles referenced by many coordinates,
+ *  most referenced first. Only available once the index is built.
+ * --------------------------------------------------------------------------*/
+int mbtiles_shared( void *dbh, uint64_t **ids )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  *ids = m->shared;
+  return m->nshared;
 }
 
 /* --------------------------------------------------------------------------
  *  Reads a tile
+ *  Returned data belongs to the handle and is valid until next read.
  * --------------------------------------------------------------------------*/
 char *mbtiles_read( void *dbh, int z, int x, int y, int *len )
 {
-  static char *blob = NULL;
-  sqlite3_stmt *stmt = (sqlite3_stmt*) dbh;
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  sqlite3_stmt *stmt = m->stmt;
   int rc;
+
+  if ( !TILEVALID( z, x, y ) ) {
+    *len = 0;
+    return NULL;
+  }
+  y = (1 << z) - 1 - y;
+  if ( m->idx ) {
+    return mbtiles_read_idx( m, z, x, y, len );
+  }
   
   rc = sqlite3_reset( stmt );
   if ( rc != SQLITE_OK ) {
@@ -88,7 +493,6 @@ char *mbtiles_read( void *dbh, int z, int x, int y, int *len )
   if ( rc != SQLITE_OK ) {
     fprintf( stderr, "Failed to bind column.\n" );
   }
-  y = (1 << z) - 1 - y;
   rc = sqlite3_bind_int( stmt, 3, y);
   if ( rc != SQLITE_OK ) {
     fprintf( stderr, "Failed to bind column.\n" );
@@ -99,13 +503,109 @@ char *mbtiles_read( void *dbh, int z, int x, int y, int *len )
     return (char*) sqlite3_column_blob( stmt, 0);
   }
   else {
-    sqlite3 *db = sqlite3_db_handle( stmt );
-    fprintf( stderr, "Failed to retreive tile %d/%d/%d : %s\n", z,x,y, sqlite3_errmsg(db));
+    fprintf( stderr, "Failed to retreive tile %d/%d/%d : %s\n", z,x,y, sqlite3_errmsg(m->db));
     *len = 0;
     return NULL;
   }
 }
 
+/* --------------------------------------------------------------------------
+ *  Calls 'fn' for each tile of zoom level 'z' in columns x0..x1 and
+ *  rows y0..y1 with its data, using a single range scan of the tiles
+ *  index ordered by column then TMS row. Data passed to 'fn' is only
+ *  valid during the call. Returns the number of tiles or -1 on error.
+ * --------------------------------------------------------------------------*/
+int mbtiles_scan( void *dbh, int z, int x0, int y0, int x1, int y1,
+		  void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  sqlite3_stmt *stmt;
+  char *data;
+  int rc, len, n = 0;
+
+  if ( !TILEVALID( z, x0, y0 ) || !TILEVALID( z, x1, y1 ) || (x0 > x1) || (y0 > y1) ) {
+    return 0;
+  }
+  if ( m->scanstmt == NULL ) {
+    char *query = "SELECT tile_column, tile_row, tile_data FROM tiles "
+      "WHERE zoom_level = ?1 AND tile_column BETWEEN ?2 AND ?3 AND tile_row BETWEEN ?4 AND ?5 "
+      "ORDER BY tile_column, tile_row";
+    rc = sqlite3_prepare_v2( m->db, query, strlen(query), &m->scanstmt, NULL);
+    if ( rc != SQLITE_OK ) {
+      fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(m->db));
+      return -1;
+    }
+  }
+
+  // rows are TMS rows, counted from the south
+  stmt = m->scanstmt;
+  sqlite3_reset( stmt );
+  sqlite3_bind_int( stmt, 1, z );
+  sqlite3_bind_int( stmt, 2, x0 );
+  sqlite3_bind_int( stmt, 3, x1 );
+  sqlite3_bind_int( stmt, 4, (1 << z) - 1 - y1 );
+  sqlite3_bind_int( stmt, 5, (1 << z) - 1 - y0 );
+  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
+    // blob must be fetched before its size
+    data = (char*) sqlite3_column_blob( stmt, 2 );
+    len = sqlite3_column_bytes( stmt, 2 );
+    fn( arg, z, sqlite3_column_int( stmt, 0 ),
+	(1 << z) - 1 - sqlite3_column_int( stmt, 1 ), data, len );
+    n++;
+  }
+  sqlite3_reset( stmt );
+
+  if ( rc != SQLITE_DONE ) {
+    fprintf(stderr, "Failed to scan tiles: %s\n", sqlite3_errmsg(m->db));
+    return -1;
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Calls 'fn' for each tile of the file with its coordinates and
+ *  data size. Returns the number of tiles or -1 on error.
+ * --------------------------------------------------------------------------*/
+int mbtiles_each( void *dbh, void (*fn)( void *arg, int z, int x, int y, int len ), void *arg )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  sqlite3_stmt *stmt;
+  char *query;
+  int rc, z, n = 0;
+
+  if ( m->normalized ) {
+    query = "SELECT map.zoom_level, map.tile_column, map.tile_row, length(images.tile_data) "
+      "FROM map JOIN images ON images.tile_id = map.tile_id";
+  }
+  else if ( m->table ) {
+    query = "SELECT zoom_level, tile_column, tile_row, length(tile_data) FROM tiles";
+  }
+  else {
+    fprintf( stderr, "Unknown mbtiles schema.\n" );
+    return -1;
+  }
+
+  rc = sqlite3_prepare_v2( m->db, query, strlen(query), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(m->db));
+    return -1;
+  }
+  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
+    z = sqlite3_column_int( stmt, 0 );
+    fn( arg, z, sqlite3_column_int( stmt, 1 ),
+	(1 << z) - 1 - sqlite3_column_int( stmt, 2 ),
+	sqlite3_column_int( stmt, 3 ));
+    n++;
+  }
+  sqlite3_finalize( stmt );
+  
+  if ( rc != SQLITE_DONE ) {
+    fprintf(stderr, "Failed to list tiles: %s\n", sqlite3_errmsg(m->db));
+    return -1;
+  }
+  return n;
+}
+
 /* --------------------------------------------------------------------------
  *  Utility
  * --------------------------------------------------------------------------*/
@@ -116,129 +616,376 @@ static char *skip( char* s)
 }
 
 /* --------------------------------------------------------------------------
- *  Generates 'tiles/tiles.json' from 'metadata' table of mbtiles
+ *  Creates a tiles.json object
  * --------------------------------------------------------------------------*/
-char *mbtiles_tiles_json( void *dbh, int *len )
+struct json_object *mbtiles_meta_new()
 {
-  static char *data = NULL;
-  static int  dlen = 0;
+  struct json_object *o = json_object_new_object();
+  json_object_object_add( o, "tilejson", json_object_new_string("2.0.0") );
+  return o;
+}
 
-  sqlite3 *db = sqlite3_db_handle( dbh );
-  sqlite3_stmt *stmt;
-  struct json_object *o, *a;
-  char *k, *v, *s, *format = NULL, url[64];
-  double d;
-  int i, rc;
+/* --------------------------------------------------------------------------
+ *  Parses 'n' numbers separated by commas, returns the number found
+ * --------------------------------------------------------------------------*/
+static int mbtiles_numbers( char *v, double *d, int n )
+{
+  char *s, *e;
+  int i;
 
-#define QUERY "SELECT * FROM metadata"
-  rc = sqlite3_prepare_v2( db, QUERY, strlen(QUERY), &stmt, NULL);
-  if ( rc != SQLITE_OK ) {
-    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
-    sqlite3_close(db);
-    return NULL;
+  for( s = v, i = 0; i < n; ++i ) {
+    s = skip(s);
+    d[i] = strtod( s, &e );
+    if ( e == s ) break;
+    s = e;
   }
-#undef QUERY
-    
-  o = json_object_new_object();
+  return i;
+}
 
-  json_object_object_add( o, "tilejson", json_object_new_string("2.0.0") );
-    
-  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
-    k = (char *) sqlite3_column_text( stmt, 0 );
-    v = (char *) sqlite3_column_text( stmt, 1 );
-
-    if ( !strcmp(k, "name") ) {
-      json_object_object_add( o, k, json_object_new_string(v));
-    }
-    if ( !strcmp(k, "attribution") ) {
-      json_object_object_add( o, k, json_object_new_string(v));
-    }
-    if ( !strcmp(k, "description") ) {
-      json_object_object_add( o, k, json_object_new_string(v));
-    }
-    if ( !strcmp(k, "version") ) {
-      json_object_object_add( o, k, json_object_new_string(v));
-    }
-    if ( !strcmp(k, "format") ) {
-      json_object_object_add( o, k, json_object_new_string(v));
-      if ( !strcmp(v, "jpg") ) format = "jpg";
-      if ( !strcmp(v, "png") ) format = "png";
-      if ( !strcmp(v, "pbf") ) format = "pbf";
-    }
-    if ( !strcmp(k, "minzoom") || !strcmp(k, "maxzoom") ) {
-      long d;
-      s = skip(v);
-      d = strtol( s, &s, 10 );
-      json_object_object_add( o, k, json_object_new_int(d));
-    }
-    if ( !strcmp(k, "bounds") ) {
-      struct json_object* a;
-      a = json_object_new_array();
-      for( s = v, i = 0; (*s != 0) && (i < 4); ++i ) {
-	s = skip(s);
-	d = strtod(s, &s);
-	json_object_array_add( a, json_object_new_double(d));
-      }
-      if ( i < 4 ) {
-	fprintf( stderr, "unable to parse map bounds.\n" );
-	exit(1);
-      }
-      json_object_object_add( o, k, a );
-    }
-    if ( !strcmp(k, "center") ) {
-      struct json_object* a;
-      a = json_object_new_array();
-      for( s = v, i = 0; (*s != 0) && (i < 3); ++i ) {
-	s = skip(s);
-	d = strtod(s, &s);
-	json_object_array_add( a, json_object_new_double(d));
-      }
-      if ( i < 3 ) {
-	fprintf( stderr, "unable to parse map bounds.\n" );
-	exit(1);
-      }
-      json_object_object_add( o, k, a );
+/* --------------------------------------------------------------------------
+ *  Replaces string property of metadata
+ * --------------------------------------------------------------------------*/
+static void mbtiles_meta_str( char **p, char *v )
+{
+  free( *p );
+  *p = strdup( v );
+  if ( *p == NULL ) {
+    fputs( "mbtiles: memory allocation error.\n", stderr );
+    exit(1);
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Sets the property of metadata matching 'metadata' entry k/v
+ *  Malformed values are reported and ignored.
+ * --------------------------------------------------------------------------*/
+void mbtiles_meta_set( mbtiles_meta_t *meta, char *k, char *v )
+{
+  if ( (k == NULL) || (v == NULL) ) {
+    return;
+  }
+  if ( !strcmp(k, "name") ) {
+    mbtiles_meta_str( &meta->name, v );
+  }
+  else if ( !strcmp(k, "attribution") ) {
+    mbtiles_meta_str( &meta->attribution, v );
+  }
+  else if ( !strcmp(k, "description") ) {
+    mbtiles_meta_str( &meta->description, v );
+  }
+  else if ( !strcmp(k, "version") ) {
+    mbtiles_meta_str( &meta->version, v );
+  }
+  else if ( !strcmp(k, "format") ) {
+    mbtiles_meta_str( &meta->format, v );
+  }
+  else if ( !strcmp(k, "minzoom") ) {
+    meta->minzoom = strtol( skip(v), NULL, 10 );
+  }
+  else if ( !strcmp(k, "maxzoom") ) {
+    meta->maxzoom = strtol( skip(v), NULL, 10 );
+  }
+  else if ( !strcmp(k, "bounds") ) {
+    meta->nbounds = mbtiles_numbers( v, meta->bounds, 4 );
+    if ( meta->nbounds < 4 ) {
+      fprintf( stderr, "unable to parse map bounds.\n" );
     }
-    if ( !strcmp(k, "json") ) {
-      enum json_tokener_error error;
-      struct json_object *so, *layers;
-      json_bool jb;
+  }
+  else if ( !strcmp(k, "center") ) {
+    meta->ncenter = mbtiles_numbers( v, meta->center, 3 );
+    if ( meta->ncenter < 3 ) {
+      fprintf( stderr, "unable to parse map center.\n" );
+    }
+  }
+  else if ( !strcmp(k, "json") ) {
+    enum json_tokener_error error;
+    struct json_object *so, *layers;
 	
-      so = json_tokener_parse_verbose( v, &error );
-      if ( error != json_tokener_success ) {
-	fprintf( stderr, "failed to parse metadata json field: %s\n",
-		 json_tokener_error_desc( error ));
-	exit(1);
-      }
+    so = json_tokener_parse_verbose( v, &error );
+    if ( error != json_tokener_success ) {
+      fprintf( stderr, "failed to parse metadata json field: %s\n",
+	       json_tokener_error_desc( error ));
+      return;
+    }
+    if ( json_object_object_get_ex( so, "vector_layers", &layers ) == TRUE ) {
+      json_object_put( meta->vector_layers );
+      meta->vector_layers = json_object_get( layers );
+    }
+    else {
+      fprintf( stderr, "Missing field 'vector_layers'.\n");
+    }
+    // the json field is only kept for its layers
+    json_object_put( so );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Resets metadata, releasing its properties
+ * --------------------------------------------------------------------------*/
+void mbtiles_meta_clear( mbtiles_meta_t *meta )
+{
+  free( meta->name );
+  free( meta->attribution );
+  free( meta->description );
+  free( meta->version );
+  free( meta->format );
+  json_object_put( meta->vector_layers );
+  memset( meta, 0, sizeof(mbtiles_meta_t));
+  meta->minzoom = meta->maxzoom = -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Creates the tiles.json object describing metadata
+ * --------------------------------------------------------------------------*/
+struct json_object *mbtiles_meta_object( mbtiles_meta_t *meta )
+{
+  struct json_object *o = mbtiles_meta_new(), *a;
+  int i;
+
+  if ( meta->name ) {
+    json_object_object_add( o, "name", json_object_new_string( meta->name ));
+  }
+  if ( meta->attribution ) {
+    json_object_object_add( o, "attribution", json_object_new_string( meta->attribution ));
+  }
+  if ( meta->description ) {
+    json_object_object_add( o, "description", json_object_new_string( meta->description ));
+  }
+  if ( meta->version ) {
+    json_object_object_add( o, "version", json_object_new_string( meta->version ));
+  }
+  if ( meta->format ) {
+    json_object_object_add( o, "format", json_object_new_string( meta->format ));
+  }
+  // rows are always served in XYZ order
+  json_object_object_add( o, "scheme", json_object_new_string( "xyz" ));
+  if ( meta->minzoom >= 0 ) {
+    json_object_object_add( o, "minzoom", json_object_new_int( meta->minzoom ));
+  }
+  if ( meta->maxzoom >= 0 ) {
+    json_object_object_add( o, "maxzoom", json_object_new_int( meta->maxzoom ));
+  }
+  if ( meta->nbounds == 4 ) {
+    a = json_object_new_array();
+    for( i = 0; i < 4; ++i ) {
+      json_object_array_add( a, json_object_new_double( meta->bounds[i] ));
+    }
+    json_object_object_add( o, "bounds", a );
+  }
+  if ( meta->ncenter == 3 ) {
+    a = json_object_new_array();
+    for( i = 0; i < 3; ++i ) {
+      json_object_array_add( a, json_object_new_double( meta->center[i] ));
+    }
+    json_object_object_add( o, "center", a );
+  }
+  if ( meta->vector_layers ) {
+    json_object_object_add( o, "vector_layers", json_object_get( meta->vector_layers ));
+  }
+  return o;
+}
 
-      jb = json_object_object_get_ex( so, "vector_layers", &layers );
-      if ( jb == TRUE ) {
-	json_object_object_add( o, "vector_layers", json_object_get(layers));
+/* --------------------------------------------------------------------------
+ *  Merges tiles.json object 'tj' of a source into tiles.json object 'o'
+ *  describing several sources. The first source merged gives format and
+ *  attribution, next ones extend bounds and zoom range and add their
+ *  vector layers when no layer with the same id exists.
+ * --------------------------------------------------------------------------*/
+void mbtiles_meta_merge( struct json_object *o, struct json_object *tj )
+{
+  static char *keys[] = { "format", "attribution", "description", "version",
+			  "bounds", "minzoom", "maxzoom" };
+  struct json_object *v, *w, *layers, *l, *id, *id2;
+  double a, b;
+  int i, j, k;
+
+  if ( json_object_object_get_ex( o, "vector_layers", &layers ) != TRUE ) {
+    for( i = 0; i < sizeof(keys)/sizeof(keys[0]); ++i ) {
+      if ( json_object_object_get_ex( tj, keys[i], &v ) == TRUE ) {
+	json_object_object_add( o, keys[i], json_object_get(v) );
       }
-      else {
-	fprintf( stderr, "Missing field 'vector_layers'.\n");
+    }
+    layers = json_object_new_array();
+    json_object_object_add( o, "vector_layers", layers );
+  }
+  else {
+    if ( (json_object_object_get_ex( o, "bounds", &v ) == TRUE) &&
+	 (json_object_object_get_ex( tj, "bounds", &w ) == TRUE) &&
+	 (json_object_array_length( v ) == 4) && (json_object_array_length( w ) == 4) ) {
+      // west, south are lowered, east, north are raised
+      for( i = 0; i < 4; ++i ) {
+	a = json_object_get_double( json_object_array_get_idx( v, i ));
+	b = json_object_get_double( json_object_array_get_idx( w, i ));
+	if ( (i < 2) ? (b < a) : (b > a) ) {
+	  json_object_array_put_idx( v, i, json_object_new_double( b ));
+	}
       }
+    }
+    if ( (json_object_object_get_ex( o, "minzoom", &v ) == TRUE) &&
+	 (json_object_object_get_ex( tj, "minzoom", &w ) == TRUE) &&
+	 (json_object_get_int( w ) < json_object_get_int( v )) ) {
+      json_object_object_add( o, "minzoom", json_object_get( w ));
+    }
+    if ( (json_object_object_get_ex( o, "maxzoom", &v ) == TRUE) &&
+	 (json_object_object_get_ex( tj, "maxzoom", &w ) == TRUE) &&
+	 (json_object_get_int( w ) > json_object_get_int( v )) ) {
+      json_object_object_add( o, "maxzoom", json_object_get( w ));
+    }
+  }
 
-      // free the subobject
-      json_object_put(so);
+  // union of vector layers
+  if ( json_object_object_get_ex( tj, "vector_layers", &v ) == TRUE ) {
+    for( i = 0; i < json_object_array_length( v ); ++i ) {
+      l = json_object_array_get_idx( v, i );
+      if ( json_object_object_get_ex( l, "id", &id ) != TRUE ) continue;
+      k = json_object_array_length( layers );
+      for( j = 0; j < k; ++j ) {
+	if ( (json_object_object_get_ex( json_object_array_get_idx( layers, j ), "id", &id2 ) == TRUE) &&
+	     !strcmp( json_object_get_string(id), json_object_get_string(id2) ) ) break;
+      }
+      if ( j == k ) {
+	json_object_array_add( layers, json_object_get(l) );
+      }
     }
   }
-    
-  sqlite3_reset( stmt );
-  sqlite3_finalize( stmt );
+}
 
-  // add the "tiles" property
+/* --------------------------------------------------------------------------
+ *  Sets the "tiles" property of tiles.json object. Tiles of named
+ *  sources are served below 'tiles/<name>/'.
+ * --------------------------------------------------------------------------*/
+static void mbtiles_meta_url( struct json_object *o, char *name )
+{
+  struct json_object *a, *f;
+  char *format = NULL, url[128];
+  
+  if ( json_object_object_get_ex( o, "format", &f ) == TRUE ) {
+    const char *v = json_object_get_string(f);
+    if ( !strcmp(v, "jpg") ) format = "jpg";
+    if ( !strcmp(v, "png") ) format = "png";
+    if ( !strcmp(v, "pbf") ) format = "pbf";
+    if ( !strcmp(v, "webp") ) format = "webp";
+  }
+  
+  // add the "tiles" property, replacing existing one
   // @todo : diff between raster and vectorial
   a = json_object_new_array();
-  sprintf( url, "http://127.0.0.1:%d/tiles/{z}/{x}/{y}.%s", g_port, format );
+  snprintf( url, sizeof(url), "http://127.0.0.1:%d/tiles/%s%s{z}/{x}/{y}.%s",
+	    g_port, name ? name : "", name ? "/" : "", format );
   json_object_array_add( a, json_object_new_string(url));
   json_object_object_add( o, "tiles", a );
-    
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds the "tiles" property to tiles.json object and returns its
+ *  string representation
+ * --------------------------------------------------------------------------*/
+char *mbtiles_meta_json( struct json_object *o, int *len )
+{
+  char *data;
+
+  mbtiles_meta_url( o, NULL );
   data = (char*) json_object_to_json_string_ext( o, JSON_C_TO_STRING_PRETTY );
-  dlen = strlen(data);
-  
   if ( len != NULL ) {
-    *len = dlen;
+    *len = strlen(data);
+  }
+  return data;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads 'metadata' table into typed metadata, remembering the state
+ *  of the file so that changes can be noticed
+ * --------------------------------------------------------------------------*/
+static void mbtiles_load_meta( mbtiles_t *m )
+{
+  sqlite3_stmt *stmt;
+  struct stat st;
+  int rc;
+
+  if ( stat( m->path, &st ) == 0 ) {
+    m->mtime = st.st_mtime;
+    m->size = st.st_size;
+  }
+  mbtiles_meta_clear( &m->meta );
+  free( m->tiles_json );
+  m->tiles_json = NULL;
+
+#define QUERY "SELECT name, value FROM metadata"
+  rc = sqlite3_prepare_v2( m->db, QUERY, strlen(QUERY), &stmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(m->db));
+    return;
+  }
+#undef QUERY
+  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
+    mbtiles_meta_set( &m->meta, (char *) sqlite3_column_text( stmt, 0 ),
+		      (char *) sqlite3_column_text( stmt, 1 ));
+  }
+  sqlite3_finalize( stmt );
+  logger( "metadata of '%s' loaded\n", m->path );
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns typed metadata of mbtiles
+ * --------------------------------------------------------------------------*/
+mbtiles_meta_t *mbtiles_meta( void *dbh )
+{
+  return &((mbtiles_t*) dbh)->meta;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' from metadata of mbtiles. It is made
+ *  once and made again when the file changes on disk.
+ * --------------------------------------------------------------------------*/
+char *mbtiles_tiles_json( void *dbh, int *len )
+{
+  mbtiles_t *m = (mbtiles_t*) dbh;
+  struct json_object *o;
+  struct stat st;
+
+  if ( (stat( m->path, &st ) == 0) && ((st.st_mtime != m->mtime) || (st.st_size != m->size)) ) {
+    mbtiles_load_meta( m );
+  }
+  if ( m->tiles_json == NULL ) {
+    o = mbtiles_meta_object( &m->meta );
+    m->tiles_json = strdup( mbtiles_meta_json( o, &m->tjlen ));
+    json_object_put( o );
+    if ( m->tiles_json == NULL ) {
+      fputs( "mbtiles: memory allocation error.\n", stderr );
+      exit(1);
+    }
+  }
+  if ( len != NULL ) {
+    *len = m->tjlen;
+  }
+  return m->tiles_json;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates tiles.json of a source served below 'tiles/<name>/'
+ *  Returned string is allocated and owned by the caller.
+ * --------------------------------------------------------------------------*/
+char *mbtiles_named_tiles_json( source_t *src, char *name, int *len )
+{
+  struct json_object *o;
+  enum json_tokener_error error;
+  char *data;
+
+  o = json_tokener_parse_verbose( source_tiles_json( src, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    fprintf( stderr, "failed to parse tiles.json: %s\n",
+	     json_tokener_error_desc( error ));
+    return NULL;
+  }
+  mbtiles_meta_url( o, name );
+  data = strdup( json_object_to_json_string_ext( o, JSON_C_TO_STRING_PRETTY ));
+  json_object_put( o );
+  if ( data == NULL ) {
+    fputs( "memory allocation error.\n", stderr );
+    exit(1);
+  }
+  if ( len != NULL ) {
+    *len = strlen(data);
   }
   return data;
 }
@@ -247,7 +994,7 @@ char *mbtiles_tiles_json( void *dbh, int *len )
 /* --------------------------------------------------------------------------
  *  Automatically generate style.json mbtiles files
  * --------------------------------------------------------------------------*/
-char *mbtiles_auto_raster_style_json( void *dbh, int *len )
+char *mbtiles_auto_raster_style_json( source_t *src, int *len )
 {
   int zero = 0;
   char *style = "styles/auto/raster/style.json";
@@ -266,7 +1013,7 @@ char *mbtiles_auto_raster_style_json( void *dbh, int *len )
 /* --------------------------------------------------------------------------
  *  Guess if it is an openmaptile file
  * --------------------------------------------------------------------------*/
-char *mbtiles_is_openmaptiles( void *dbh )
+char *mbtiles_is_openmaptiles( source_t *src )
 {
   //@todo: implement me !!
   return 0;
@@ -339,14 +1086,14 @@ struct json_object *mklayer( const char *src, char *type, char *rgb, int vis )
  *  Otherwise :
  *  For each layer
  * --------------------------------------------------------------------------*/
-char *mbtiles_auto_vectorial_style_json( void *dbh, int *len )
+char *mbtiles_auto_vectorial_style_json( source_t *source, int *len )
 {
   int zero = 0;
   char *data = NULL;
   
   // check if an openmaptiles style can be used
   // better that we can do here !
-  if (mbtiles_is_openmaptiles (dbh)) {
+  if (mbtiles_is_openmaptiles (source)) {
     char *style = "styles/openmaptiles/bright/style.json";
     
     data = arch_data( style, &zero );
@@ -366,7 +1113,7 @@ char *mbtiles_auto_vectorial_style_json( void *dbh, int *len )
     json_bool jb;
     int i, n;
 
-    tiles_str = mbtiles_tiles_json( dbh, NULL );
+    tiles_str = source_tiles_json( source, NULL );
 	
     tiles = json_tokener_parse_verbose( tiles_str, &error );
     if ( error != json_tokener_success ) {
@@ -443,51 +1190,136 @@ char *mbtiles_auto_vectorial_style_json( void *dbh, int *len )
   }
 }
 
+/* --------------------------------------------------------------------------
+ *  Automatic style generation for a single source
+ * --------------------------------------------------------------------------*/
+static char *mbtiles_auto_source_style_json( source_t *src, int *len )
+{
+  struct json_object *tiles, *f;
+  enum json_tokener_error error;
+  const char *v;
+  int raster = 0;
+
+  tiles = json_tokener_parse_verbose( source_tiles_json( src, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    fprintf( stderr, "failed to parse tiles.json: %s\n",
+	     json_tokener_error_desc( error ));
+    exit(1);
+  }
+  if ( json_object_object_get_ex( tiles, "format", &f ) == TRUE ) {
+    v = json_object_get_string(f);
+    if ( !strcmp(v, "jpg") ) raster = 1;
+    if ( !strcmp(v, "png") ) raster = 1;
+    if ( !strcmp(v, "webp") ) raster = 1;
+    if ( !strcmp(v, "pbf") ) raster = 0;
+  }
+  json_object_put(tiles);
+
+  if ( raster ) {
+    return mbtiles_auto_raster_style_json( src, len );
+  }
+  else {
+    fprintf(stderr, "Cannot automatically generate style for vector tiles.\n");
+    return mbtiles_auto_vectorial_style_json( src, len );
+  }
+}
+
 /* --------------------------------------------------------------------------
  *  Automatic style generation
  * --------------------------------------------------------------------------*/
-char *mbtiles_auto_style_json( void *dbh, int *len )
+char *mbtiles_auto_style_json( source_t *src, int *len )
 {
   static char *data = NULL;
   static int  dlen = 0;
 
   if ( data == NULL ) {
-    sqlite3 *db = sqlite3_db_handle( dbh );
-    sqlite3_stmt *stmt;
-    int rc, raster = 0;
-    char *k, *v;
+    data = mbtiles_auto_source_style_json( src, &dlen );
+  }
+  
+  if ( len != NULL ) {
+    *len = dlen;
+  }
+  return data;
+}
 
-#define QUERY "SELECT * FROM metadata"
-    rc = sqlite3_prepare_v2( db, QUERY, strlen(QUERY), &stmt, NULL);
-    if ( rc != SQLITE_OK ) {
-      fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
-      sqlite3_close(db);
-      return NULL;
-    }
-#undef QUERY
-    
-    while( (rc = sqlite3_step( stmt )) == SQLITE_ROW ) {
-      k = (char *) sqlite3_column_text( stmt, 0 );
-      v = (char *) sqlite3_column_text( stmt, 1 );
-
-      if ( !strcmp(k, "format") ) {
-	if ( !strcmp(v, "jpg") ) raster = 1;
-	if ( !strcmp(v, "png") ) raster = 1;
-	if ( !strcmp(v, "pbf") ) raster = 0;
-	break;
+/* --------------------------------------------------------------------------
+ *  Automatic style generation for several sources
+ *  The style of each source is generated then merged in a single style.
+ *  Sources and layers are prefixed with the source name and the sources
+ *  point to 'tiles/<name>/tiles.json'. Layers of the first source are
+ *  drawn first.
+ * --------------------------------------------------------------------------*/
+char *mbtiles_auto_multi_style_json( source_t **srcs, char **names, int n, int *len )
+{
+  static char *data = NULL;
+  static int  dlen = 0;
+
+  if ( data == NULL ) {
+    struct json_object *style, *sources, *layers, *o, *s, *a, *v;
+    enum json_tokener_error error;
+    char id[128], url[128];
+    int i, j;
+
+    style = json_object_new_object();
+    json_object_object_add( style, "version", json_object_new_int(8) );
+    json_object_object_add( style, "id",      json_object_new_string("mbtiles") );
+    json_object_object_add( style, "name",    json_object_new_string("mbtiles") );
+    json_object_object_add( style, "glyphs",  json_object_new_string("font/{fontstack}/{range}.pbf"));
+    sources = json_object_new_object();
+    json_object_object_add( style, "sources", sources );
+    layers = json_object_new_array();
+    json_object_object_add( style, "layers",  layers );
+
+    for( i = 0; i < n; ++i ) {
+      o = json_tokener_parse_verbose( mbtiles_auto_source_style_json( srcs[i], NULL ), &error );
+      if ( error != json_tokener_success ) {
+	fprintf( stderr, "failed to parse style of '%s': %s\n",
+		 names[i], json_tokener_error_desc( error ));
+	exit(1);
       }
-    }
 
-    sqlite3_reset( stmt );
-    sqlite3_finalize( stmt );
+      // rename sources
+      if ( json_object_object_get_ex( o, "sources", &s ) == TRUE ) {
+	struct json_object_iterator it = json_object_iter_begin( s );
+	struct json_object_iterator end = json_object_iter_end( s );
+	for( ; !json_object_iter_equal( &it, &end ); json_object_iter_next( &it ) ) {
+	  const char *key = json_object_iter_peek_name( &it );
+	  struct json_object *val = json_object_iter_peek_value( &it );
+	  snprintf( id, sizeof(id), "%s-%s", names[i], key );
+	  if ( json_object_object_get_ex( val, "url", &v ) == TRUE &&
+	       !strcmp( json_object_get_string(v), "tiles/tiles.json") ) {
+	    snprintf( url, sizeof(url), "tiles/%s/tiles.json", names[i] );
+	    json_object_object_add( val, "url", json_object_new_string(url) );
+	  }
+	  json_object_object_add( sources, id, json_object_get(val) );
+	}
+      }
 
-    if ( raster ) {
-      data = mbtiles_auto_raster_style_json( dbh, &dlen );
+      // rename layers and the source they refer to
+      if ( json_object_object_get_ex( o, "layers", &a ) == TRUE ) {
+	for( j = 0; j < json_object_array_length(a); ++j ) {
+	  struct json_object *l = json_object_array_get_idx( a, j );
+	  if ( json_object_object_get_ex( l, "id", &v ) == TRUE ) {
+	    snprintf( id, sizeof(id), "%s-%s", names[i], json_object_get_string(v) );
+	    json_object_object_add( l, "id", json_object_new_string(id) );
+	  }
+	  if ( json_object_object_get_ex( l, "source", &v ) == TRUE ) {
+	    snprintf( id, sizeof(id), "%s-%s", names[i], json_object_get_string(v) );
+	    json_object_object_add( l, "source", json_object_new_string(id) );
+	  }
+	  json_object_array_add( layers, json_object_get(l) );
+	}
+      }
+      json_object_put( o );
     }
-    else {
-      fprintf(stderr, "Cannot automatically generate style for vector tiles.\n");
-      data = mbtiles_auto_vectorial_style_json( dbh, &dlen);
+
+    data = strdup( json_object_to_json_string_ext( style, JSON_C_TO_STRING_PRETTY ));
+    json_object_put( style );
+    if ( data == NULL ) {
+      fputs( "memory allocation error.\n", stderr );
+      exit(1);
     }
+    dlen = strlen( data );
   }
   
   if ( len != NULL ) {
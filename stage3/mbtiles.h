@@ -0,0 +1,54 @@
+#ifndef __MBTILES_H__
+#define __MBTILES_H__
+
+#include <stdint.h>
+
+// packed tile id : 5 bits zoom, 29 bits column, 29 bits row
+#define TILEID(z,x,y) (((uint64_t)(z) << 58) | ((uint64_t)(x) << 29) | (uint64_t)(y))
+#define TILEZ(id) ((int) ((id) >> 58))
+#define TILEX(id) ((int) (((id) >> 29) & 0x1fffffff))
+#define TILEY(id) ((int) ((id) & 0x1fffffff))
+
+// tile exists in XYZ tiling, zoom levels fit in TILEID
+#define TILEVALID(z,x,y) (((z) >= 0) && ((z) <= 29) && ((x) >= 0) && ((y) >= 0) && \
+			  !((x) >> (z)) && !((y) >> (z)))
+
+struct json_object;
+
+// tileset metadata, zoom levels are -1 when not set
+typedef struct mbtiles_meta_s {
+  char *name, *attribution, *description, *version;
+  char *format;                     // "pbf", "jpg", "png", "webp"
+  int minzoom, maxzoom;
+  double bounds[4];                 // west, south, east, north
+  double center[3];                 // longitude, latitude, zoom
+  int nbounds, ncenter;             // number of values set
+  struct json_object *vector_layers;
+} mbtiles_meta_t;
+
+void *mbtiles_open( char *path );
+void  mbtiles_close( void *dbh );
+int   mbtiles_index( void *dbh );
+char *mbtiles_read( void *dbh, int z, int x, int y, int *len );
+int   mbtiles_tile_id( void *dbh, int z, int x, int y, uint64_t *id );
+char *mbtiles_read_id( void *dbh, uint64_t id, int *len );
+int   mbtiles_shared( void *dbh, uint64_t **ids );
+int   mbtiles_each( void *dbh, void (*fn)( void *arg, int z, int x, int y, int len ), void *arg );
+int   mbtiles_scan( void *dbh, int z, int x0, int y0, int x1, int y1,
+		    void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg );
+char *mbtiles_tiles_json( void *dbh, int *len );
+mbtiles_meta_t *mbtiles_meta( void *dbh );
+
+void  mbtiles_meta_set( mbtiles_meta_t *meta, char *k, char *v );
+void  mbtiles_meta_clear( mbtiles_meta_t *meta );
+struct json_object *mbtiles_meta_object( mbtiles_meta_t *meta );
+struct json_object *mbtiles_meta_new();
+void mbtiles_meta_merge( struct json_object *o, struct json_object *tj );
+char *mbtiles_meta_json( struct json_object *o, int *len );
+
+struct source_s;
+char *mbtiles_auto_style_json( struct source_s *src, int *len );
+char *mbtiles_auto_multi_style_json( struct source_s **srcs, char **names, int n, int *len );
+char *mbtiles_named_tiles_json( struct source_s *src, char *name, int *len );
+
+#endif
@@ -1,19 +1,46 @@
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <zlib.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 
+#include <json.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
 #include "http_parser.h"
 #include "archrt.h"
+#include "mbtiles.h"
+#include "source.h"
+#include "tilecache.h"
+#include "patch.h"
+#include "overzoom.h"
+#include "pyramid.h"
+#include "transcode.h"
+#include "raster.h"
+#include "prefetch.h"
+#include "pack.h"
+#include "extract.h"
+#include "layerfilter.h"
 
 typedef struct req_s req_t;
 struct req_s {
@@ -22,8 +49,12 @@ struct req_s {
   int   nhv;
   int   accept_deflate;
   char *body;
+  int   bodylen;        // -1 when body is too large
 };
 
+// size of connection read buffer
+#define RDBUF 4096
+
 typedef struct cnx_s cnx_t;
 struct cnx_s {
   int fd;
@@ -34,6 +65,9 @@ struct cnx_s {
   struct http_parser_url urlp;
   http_parser parser;
 
+  int busy;             // waiting for a transcoded tile
+  char rbuf[RDBUF];      // bytes read but not parsed while busy
+  int rlen;
 };
 
 // connection array
@@ -47,22 +81,101 @@ int serverfd = -1;
 
 #define BLKIO 4096
 
+// gzip magic number
+#define ISGZIP(d,l) (((l) >= 2) && ((unsigned char)(d)[0] == 0x1f) && ((unsigned char)(d)[1] == 0x8b))
+
+// tile cache size, shared by all maps
+#define TILECACHE_COUNT 4096
+#define TILECACHE_BYTES (64*1024*1024)
+
+// tiles.json answer
+typedef struct tjresp_s {
+  char *data;
+  int len;
+  char *zdata;          // deflate compressed data, NULL if not smaller
+  int zlen;
+  char etag[16];
+} tjresp_t;
+
+// tiles served by a map : zoom range, columns and rows covering bounds
+// at each zoom level
+typedef struct tilerange_s {
+  int minzoom, maxzoom;
+  int bounded;          // bounds are known
+  int x0[30], x1[30], y0[30], y1[30];
+} tilerange_t;
+
+// served tile sources
+#define MAXMAPS 16
+typedef struct map_s {
+  char *name;           // tiles are served below 'tiles/<name>/'
+  char *path;
+  char *patchdir;       // patches applied to source
+  source_t *src;        // tile source
+  source_t *patch;      // patched source, wrapped in 'src'
+  tilecache_t *cache;   // tile cache
+  tilecache_t *wcache;  // WebP transcoded tiles, same keys as 'cache'
+  tjresp_t tj[2];       // tiles.json for 'tiles/' and 'tiles/<name>/'
+  time_t mtime;         // source file state when tiles.json were made
+  off_t size;
+  tilerange_t range;    // tiles which can be requested
+  int lastz;            // zoom level of last tile request
+  int zoomin;           // last zoom change was a zoom in
+  int geojson;          // path is a GeoJSON file
+} map_t;
 
 int g_quiet = 1;
 int g_port = 9000;
-char *g_map, *g_style;
-
-void *g_sql;  // sqlite map database handle
-
-void *mbtiles_open( char *path );
-void  mbtiles_close( void *stmt );
-char *mbtiles_read( void *s, int x, int y, int z, int *len );
-char *mbtiles_tiles_json( void *dbh, int *len );
-char *mbtiles_auto_style_json( void *dbh, int *len );
+char *g_style;
+
+map_t g_maps[MAXMAPS];
+int g_nmaps = 0;
+int g_index = 0;
+int g_layerfilter = 0;
+int g_overzoom = 0;
+int g_pyramid = 0;
+char *g_webp = NULL;    // WebP disk cache directory
+int g_tfd = -1;         // readable when tiles are transcoded
+int g_prefetch = 0;     // max tiles prefetched per idle slice
+
+// connections waiting for a transcoded tile, at most one per connection
+typedef struct pending_s {
+  cnx_t *cnx;
+  map_t *map;
+  uint64_t key, hash;
+  char *data;           // source tile, sent when it is kept
+  int len;
+  char *mtype;
+  char etag[48];        // ETag header or empty string
+} pending_t;
+pending_t g_pending[MAXCNX];
+
+// rejected tile requests
+#define REJECT_SYNTAX 0       // malformed path or unknown format
+#define REJECT_RANGE  1       // coordinates beyond zoom level extent
+#define REJECT_ZOOM   2       // zoom level not served
+#define REJECT_BOUNDS 3       // tile outside of map bounds
+#define REJECT_MAX    4
+unsigned long g_rejected[REJECT_MAX];
+
+// tile batches : max tiles per batch, max request body size and
+// size of response chunks
+#define BATCH_MAXTILES 1024
+#define BATCH_MAXBODY (64*1024)
+#define BATCH_CHUNK (64*1024)
+
+// path below 'tiles/' or 'tiles/<name>/' of tile batches
+#define ISBATCH(k) (!strncmp( (k), "batch", 5 ) && (((k)[5] == 0) || ((k)[5] == '/')))
+
+// set by SIGHUP to rescan patches
+volatile sig_atomic_t g_rescan = 0;
 
 // forward
 int doclose( cnx_t *cnx );
+int doparse( cnx_t *cnx, char *buf, int nr );
 char *emalloc( size_t sz );
+char *req_header( req_t *req, char *name );
+void rescan();
 
 /* --------------------------------------------------------------------------
  *  Basic logger
@@ -165,6 +278,27 @@ int http_reply_error( cnx_t *cnx, enum http_status s )
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  Send HTTP 304 answer
+ * --------------------------------------------------------------------------*/
+int http_reply_not_modified( cnx_t *cnx, char *etag )
+{
+  int fd = cnx->fd;
+
+  send_response( fd, HTTP_STATUS_NOT_MODIFIED );
+  writeln( fd, "ETag: %s", etag );
+  if ( !http_should_keep_alive( &cnx->parser) ) {
+    writeln( fd, "Connection: Close");
+  }
+  writeln( fd, "");
+
+  if ( !http_should_keep_alive( &cnx->parser) ) {
+    doclose(cnx);
+  }
+
+  return 0;
+}
+
 /* --------------------------------------------------------------------------
  *  Reply with data
  * --------------------------------------------------------------------------*/
@@ -209,18 +343,245 @@ int http_reply_data( cnx_t *cnx, char *mtype, char *data, int len )
 }
 
 /* --------------------------------------------------------------------------
- *  Generates tiles/tiles.json
+ *  Reply with the content of file 'tfd', sent by the kernel without
+ *  copy. The file is closed.
  * --------------------------------------------------------------------------*/
-int http_reply_tiles_json( cnx_t *cnx, char *mtype )
+int http_reply_fd( cnx_t *cnx, char *mtype, int tfd, int len, int vary )
 {
-  static char *data = NULL;
-  static int len = 0;
+  int fd = cnx->fd;
+  unsigned char magic[2];
+  off_t off = 0;
+  ssize_t s;
 
-  // force to reply with uncompressed data
+  send_response( fd, HTTP_STATUS_OK );
+
+  writeln( fd, "Content-Type: %s", mtype);
+  writeln( fd, "Content-Length: %d", len );
+  if ( (pread( tfd, magic, 2, 0 ) == 2) && ISGZIP( magic, 2 ) ) {
+    writeln( fd, "Content-encoding: gzip" );
+  }
+  if ( vary ) {
+    writeln( fd, "Vary: Accept" );
+  }
+  if ( !http_should_keep_alive( &cnx->parser) ) {
+    writeln( fd, "Connection: Close");
+  }
+  writeln( fd, "" );
+
+  while( off < len ) {
+    s = sendfile( fd, tfd, &off, len - off );
+    if ( (s < 0) && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ) {
+      usleep(1);
+      continue;
+    }
+    if ( s <= 0 ) {
+      // reply can't be completed, neither the connection kept
+      fprintf( stderr, "sendfile: %s\n", s ? strerror(errno) : "tile file truncated" );
+      close( tfd );
+      doclose(cnx);
+      return 0;
+    }
+  }
+  close( tfd );
+
+  if ( !http_should_keep_alive( &cnx->parser) ) {
+    doclose(cnx);
+  }
+
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Sets tiles which can be requested from zoom range and bounds of
+ *  tiles.json of map source
+ * --------------------------------------------------------------------------*/
+void map_range( map_t *map )
+{
+  tilerange_t *r = &map->range;
+  struct json_object *tj, *v;
+  enum json_tokener_error error;
+  double b[4], lat, n;
+  int i, z;
+
+  r->minzoom = 0;
+  r->maxzoom = 29;
+  r->bounded = 0;
+  tj = json_tokener_parse_verbose( source_tiles_json( map->src, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    return;
+  }
+  if ( json_object_object_get_ex( tj, "minzoom", &v ) == TRUE ) {
+    r->minzoom = json_object_get_int( v );
+  }
+  if ( json_object_object_get_ex( tj, "maxzoom", &v ) == TRUE ) {
+    r->maxzoom = json_object_get_int( v );
+  }
+  if ( r->maxzoom > 29 ) r->maxzoom = 29;
+  if ( (json_object_object_get_ex( tj, "bounds", &v ) == TRUE) && (json_object_array_length( v ) == 4) ) {
+    for( i = 0; i < 4; ++i ) {
+      b[i] = json_object_get_double( json_object_array_get_idx( v, i ));
+    }
+    // bounds crossing the antimeridian are not handled
+    r->bounded = (b[0] < b[2]) && (b[1] < b[3]);
+  }
+  json_object_put( tj );
+  if ( !r->bounded ) {
+    return;
+  }
+
+  // web mercator tiles, rows are counted from the north
+  for( z = 0; z < 30; ++z ) {
+    n = (double) (1 << z);
+    r->x0[z] = (int) floor( (b[0] + 180.0) / 360.0 * n );
+    r->x1[z] = (int) floor( (b[2] + 180.0) / 360.0 * n );
+    lat = fmin( fmax( b[3], -85.0511 ), 85.0511 ) * M_PI / 180.0;
+    r->y0[z] = (int) floor( (1.0 - asinh( tan( lat )) / M_PI) / 2.0 * n );
+    lat = fmin( fmax( b[1], -85.0511 ), 85.0511 ) * M_PI / 180.0;
+    r->y1[z] = (int) floor( (1.0 - asinh( tan( lat )) / M_PI) / 2.0 * n );
+    if ( r->x0[z] < 0 ) r->x0[z] = 0;
+    if ( r->y0[z] < 0 ) r->y0[z] = 0;
+    if ( r->x1[z] >= n ) r->x1[z] = n - 1;
+    if ( r->y1[z] >= n ) r->y1[z] = n - 1;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Releases tiles.json answer
+ * --------------------------------------------------------------------------*/
+void tjresp_free( tjresp_t *r )
+{
+  free( r->data );
+  free( r->zdata );
+  memset( r, 0, sizeof(tjresp_t));
+}
+
+/* --------------------------------------------------------------------------
+ *  Makes tiles.json answer from 'data' which it takes ownership of.
+ *  ETag is the checksum of data, which is also compressed once.
+ * --------------------------------------------------------------------------*/
+void tjresp_make( tjresp_t *r, char *data, int len )
+{
+  uLongf zlen = compressBound( len );
+
+  r->data = data;
+  r->len = len;
+  snprintf( r->etag, sizeof(r->etag), "\"%08lx\"", crc32( 0, (Bytef*) data, len ));
+  r->zdata = emalloc( zlen );
+  if ( (compress2( (Bytef*) r->zdata, &zlen, (Bytef*) data, len, Z_BEST_COMPRESSION ) != Z_OK) ||
+       (zlen >= len) ) {
+    free( r->zdata );
+    r->zdata = NULL;
+    zlen = 0;
+  }
+  r->zlen = zlen;
+}
+
+/* --------------------------------------------------------------------------
+ *  Serves tiles/tiles.json or tiles/<name>/tiles.json
+ *  Answers are made once and made again when the source file changes.
+ * --------------------------------------------------------------------------*/
+int http_reply_tiles_json( cnx_t *cnx, char *mtype, map_t *map, int named )
+{
+  tjresp_t *r = map->tj + named;
+  struct stat st;
+  char *data = NULL, *inm, etaghdr[32];
+  int len = 0;
+
+  if ( (stat( map->path, &st ) == 0) && ((st.st_mtime != map->mtime) || (st.st_size != map->size)) ) {
+    map->mtime = st.st_mtime;
+    map->size = st.st_size;
+    tjresp_free( map->tj );
+    tjresp_free( map->tj + 1 );
+    map_range( map );
+  }
+
+  if ( r->data == NULL ) {
+    if ( named ) {
+      data = mbtiles_named_tiles_json( map->src, map->name, &len );
+    }
+    else if ( (data = source_tiles_json( map->src, &len )) != NULL ) {
+      data = strdup( data );
+    }
+    if ( data == NULL ) {
+      return http_reply_error( cnx, HTTP_STATUS_INTERNAL_SERVER_ERROR );
+    }
+    tjresp_make( r, data, len );
+  }
+
+  inm = req_header( &cnx->req, "if-none-match" );
+  if ( inm && strstr( inm, r->etag ) ) {
+    return http_reply_not_modified( cnx, r->etag );
+  }
+  snprintf( etaghdr, sizeof(etaghdr), "ETag: %s", r->etag );
+
+  if ( cnx->req.accept_deflate && r->zdata ) {
+    return http_reply_data_ex( cnx, mtype, r->zdata, r->zlen, etaghdr, "Vary: Accept-Encoding", NULL );
+  }
   cnx->req.accept_deflate = 0;
-  data = mbtiles_tiles_json( g_sql, &len );
-  
-  return http_reply_data( cnx, mtype, data, len);
+  return http_reply_data_ex( cnx, mtype, r->data, r->len, etaghdr, "Vary: Accept-Encoding", NULL );
+}
+
+/* --------------------------------------------------------------------------
+ *  Automatic style of served maps
+ * --------------------------------------------------------------------------*/
+char *auto_style_json( int *len )
+{
+  source_t *srcs[MAXMAPS];
+  char *names[MAXMAPS];
+  int i;
+
+  if ( g_nmaps == 1 ) {
+    return mbtiles_auto_style_json( g_maps[0].src, len );
+  }
+  for( i = 0; i < g_nmaps; ++i ) {
+    srcs[i] = g_maps[i].src;
+    names[i] = g_maps[i].name;
+  }
+  return mbtiles_auto_multi_style_json( srcs, names, g_nmaps, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Parses the served style to find the layers it draws, NULL if it
+ *  can't be read
+ * --------------------------------------------------------------------------*/
+struct json_object *style_object()
+{
+  struct json_object *style, *tj, *v;
+  enum json_tokener_error error;
+  char path[64], *data;
+  const char *format;
+  int m, ok, zero = 0;
+
+  if ( !strcmp( g_style, "@auto" ) ) {
+    // automatic style gives up on vector maps without layers, let it
+    // do so when the page asks for it
+    for( m = 0; m < g_nmaps; ++m ) {
+      tj = json_tokener_parse_verbose( source_tiles_json( g_maps[m].src, NULL ), &error );
+      if ( error != json_tokener_success ) {
+	return NULL;
+      }
+      format = (json_object_object_get_ex( tj, "format", &v ) == TRUE) ? json_object_get_string( v ) : "";
+      ok = !strcmp( format, "jpg" ) || !strcmp( format, "png" ) || !strcmp( format, "webp" ) ||
+	((json_object_object_get_ex( tj, "vector_layers", &v ) == TRUE) && (json_object_array_length( v ) > 0));
+      json_object_put( tj );
+      if ( !ok ) {
+	return NULL;
+      }
+    }
+    data = auto_style_json( NULL );
+  }
+  else if ( g_style[0] == '@' ) {
+    snprintf( path, sizeof(path), "styles/openmaptiles/%s/style.json", g_style + 1 );
+    data = arch_data( path, &zero );
+  }
+  else {
+    return json_object_from_file( g_style );
+  }
+  if ( data == NULL ) {
+    return NULL;
+  }
+  style = json_tokener_parse_verbose( data, &error );
+  return (error == json_tokener_success) ? style : NULL;
 }
 
 /* --------------------------------------------------------------------------
@@ -257,7 +618,7 @@ int http_reply_style( cnx_t *cnx, char *mtype )
       else if ( !strcmp( g_style + 1, "auto" )) {
 	// force to reply with uncompressed data
 	deflate = 0;
-	data = mbtiles_auto_style_json( g_sql, &len );
+	data = auto_style_json( &len );
       }
       else {
 	fprintf( stderr, "Unknown predefined style '%s'.\n", g_style );
@@ -281,7 +642,7 @@ int http_reply_style( cnx_t *cnx, char *mtype )
 
       if ( len > 0 ) {
 	int n, t = 0;
-	p = (char*) emalloc(len);
+	p = (char*) emalloc(len + 1);
 	while( t < len ) {
 	  n = fread( p + t, 1, (len-t > BLKIO) ? BLKIO : len - t, fin);
 	  if ( n == -1 ) {
@@ -290,6 +651,7 @@ int http_reply_style( cnx_t *cnx, char *mtype )
 	  }
 	  t += n;
 	}
+	p[len] = 0;
 	data = emalloc(len + 4);
 	sprintf( data, p, g_port );
 	len = strlen(data);
@@ -306,94 +668,854 @@ int http_reply_style( cnx_t *cnx, char *mtype )
     }
   }
 
-  cnx->req.accept_deflate = deflate;
-  http_reply_data( cnx, mtype, data, len );
+  cnx->req.accept_deflate = deflate;
+  http_reply_data( cnx, mtype, data, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Serves stats.json, counters of rejected tile requests, of prefetch,
+ *  of layer filtering and of raster tiles transcoding
+ * --------------------------------------------------------------------------*/
+int http_reply_stats( cnx_t *cnx, char *mtype )
+{
+  transcode_stats_t *st;
+  prefetch_stats_t *pf;
+  layerfilter_stats_t *lf;
+  char buf[2048];
+  int len;
+
+  cnx->req.accept_deflate = 0;
+  len = snprintf( buf, sizeof(buf),
+		  "{\n"
+		  "  \"tiles\":{\n"
+		  "    \"rejected\":{ \"syntax\":%lu, \"range\":%lu, \"zoom\":%lu, \"bounds\":%lu }\n"
+		  "  },\n",
+		  g_rejected[REJECT_SYNTAX], g_rejected[REJECT_RANGE],
+		  g_rejected[REJECT_ZOOM], g_rejected[REJECT_BOUNDS] );
+  if ( g_prefetch == 0 ) {
+    len += snprintf( buf + len, sizeof(buf) - len, "  \"prefetch\":{ \"enabled\":false },\n" );
+  }
+  else {
+    pf = prefetch_stats();
+    len += snprintf( buf + len, sizeof(buf) - len,
+		     "  \"prefetch\":{\n"
+		     "    \"enabled\":true,\n"
+		     "    \"queued\":%lu,\n"
+		     "    \"dropped\":%lu,\n"
+		     "    \"cancelled\":%lu,\n"
+		     "    \"loaded\":%lu,\n"
+		     "    \"hits\":%lu,\n"
+		     "    \"hit_rate\":%.3f,\n"
+		     "    \"budget\":%d,\n"
+		     "    \"max_budget\":%d\n"
+		     "  },\n",
+		     pf->queued, pf->dropped, pf->cancelled, pf->loaded, pf->hits,
+		     pf->loaded ? (double) pf->hits / pf->loaded : 0.0,
+		     pf->budget, pf->maxbudget );
+  }
+  if ( g_layerfilter == 0 ) {
+    len += snprintf( buf + len, sizeof(buf) - len, "  \"layerfilter\":{ \"enabled\":false },\n" );
+  }
+  else {
+    lf = layerfilter_stats();
+    len += snprintf( buf + len, sizeof(buf) - len,
+		     "  \"layerfilter\":{\n"
+		     "    \"enabled\":true,\n"
+		     "    \"tiles\":%lu,\n"
+		     "    \"filtered\":%lu,\n"
+		     "    \"layers_dropped\":%lu,\n"
+		     "    \"bytes_in\":%llu,\n"
+		     "    \"bytes_out\":%llu,\n"
+		     "    \"ratio\":%.3f\n"
+		     "  },\n",
+		     lf->tiles, lf->filtered, lf->layers, lf->inbytes, lf->outbytes,
+		     lf->inbytes ? (double) lf->outbytes / lf->inbytes : 0.0 );
+  }
+  if ( g_webp == NULL ) {
+    len += snprintf( buf + len, sizeof(buf) - len, "  \"webp\":{ \"enabled\":false }\n}\n" );
+    return http_reply_data( cnx, mtype, buf, len );
+  }
+
+  st = transcode_stats();
+  len += snprintf( buf + len, sizeof(buf) - len,
+		   "  \"webp\":{\n"
+		   "    \"enabled\":true,\n"
+		   "    \"transcoded\":%lu,\n"
+		   "    \"kept\":%lu,\n"
+		   "    \"queued\":%d,\n"
+		   "    \"queue_full\":%lu,\n"
+		   "    \"memory_hits\":%lu,\n"
+		   "    \"disk_hits\":%lu,\n"
+		   "    \"bytes_in\":%llu,\n"
+		   "    \"bytes_out\":%llu,\n"
+		   "    \"ratio\":%.3f,\n"
+		   "    \"transcode_ms_avg\":%.2f,\n"
+		   "    \"transcode_ms_max\":%.2f\n"
+		   "  }\n"
+		   "}\n",
+		   st->transcoded, st->kept, st->queued, st->fallbacks, st->memhits, st->diskhits,
+		   st->inbytes, st->outbytes, st->inbytes ? (double) st->outbytes / st->inbytes : 0.0,
+		   (st->transcoded + st->kept) ? st->totalms / (st->transcoded + st->kept) : 0.0,
+		   st->maxms );
+  return http_reply_data( cnx, mtype, buf, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Encode a complete keep-alive HTTP answer for tile data
+ *  Used for tiles shared by many coordinates which are served
+ *  with a single write.
+ * --------------------------------------------------------------------------*/
+char *http_encode_tile( char *mtype, char *data, int len, char *etag, int gzip, int vary, int *rlen )
+{
+  char hdr[512], *resp;
+  int n;
+
+  n = snprintf( hdr, sizeof(hdr),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %d\r\n"
+		"ETag: %s\r\n"
+		"%s%s"
+		"\r\n",
+		HTTP_STATUS_OK, http_status_str(HTTP_STATUS_OK),
+		mtype, len, etag, gzip ? "Content-encoding: gzip\r\n" : "",
+		vary ? "Vary: Accept\r\n" : "" );
+  resp = emalloc( n + len );
+  memcpy( resp, hdr, n );
+  memcpy( resp + n, data, len );
+  *rlen = n + len;
+  return resp;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reply with a raster tile transcoded to WebP or kept as is
+ * --------------------------------------------------------------------------*/
+int http_reply_transcoded( cnx_t *cnx, char *mtype, char *etaghdr, char *data, int len, int webp )
+{
+  return http_reply_data_ex( cnx, webp ? "image/webp" : mtype, data, len,
+			     etaghdr ? etaghdr : "Vary: Accept", etaghdr ? "Vary: Accept" : NULL, NULL );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reply with a raster tile to a client accepting WebP
+ *  The WebP tile is taken from disk cache, otherwise transcoding is
+ *  queued and the reply is sent once it is done.
+ * --------------------------------------------------------------------------*/
+int http_reply_webp( cnx_t *cnx, map_t *map, char *mtype, uint64_t key, char *etaghdr, char *data, int len )
+{
+  pending_t *p = NULL;
+  uint64_t hash;
+  char *out;
+  int olen, i, rc;
+
+  if ( transcode_lookup( data, len, &hash, &out, &olen ) ) {
+    tilecache_put( map->wcache, key, out ? out : "", olen, 0 );
+    rc = http_reply_transcoded( cnx, mtype, etaghdr, out ? out : data, out ? olen : len, out != NULL );
+    free( out );
+    return rc;
+  }
+  if ( transcode_submit( hash, data, len ) < 0 ) {
+    // no ETag as the tile will be sent transcoded later
+    logger( "transcode queue full\n" );
+    return http_reply_transcoded( cnx, mtype, NULL, data, len, 0 );
+  }
+
+  for( i = 0; (i < MAXCNX) && (p == NULL); ++i ) {
+    if ( g_pending[i].cnx == NULL ) {
+      p = g_pending + i;
+    }
+  }
+  if ( p == NULL ) {
+    return http_reply_transcoded( cnx, mtype, NULL, data, len, 0 );
+  }
+  p->cnx = cnx;
+  p->map = map;
+  p->key = key;
+  p->hash = hash;
+  p->data = emalloc( len );
+  memcpy( p->data, data, len );
+  p->len = len;
+  p->mtype = mtype;
+  snprintf( p->etag, sizeof(p->etag), "%s", etaghdr ? etaghdr : "" );
+  // connection is not read until reply is sent
+  cnx->busy = 1;
+  logger( "tile queued for transcoding\n" );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Sends transcoded tiles to waiting connections
+ *  Requests read after the deferred one are parsed once it is sent.
+ * --------------------------------------------------------------------------*/
+void dotranscoded()
+{
+  char buf[RDBUF];
+  pending_t *p;
+  cnx_t *cnx;
+  uint64_t hash;
+  char *out;
+  int olen, i, n;
+
+  while( transcode_done( &hash, &out, &olen ) ) {
+    for( i = 0; i < MAXCNX; ++i ) {
+      p = g_pending + i;
+      if ( (p->cnx == NULL) || (p->hash != hash) ) {
+	continue;
+      }
+      tilecache_put( p->map->wcache, p->key, out ? out : "", olen, 0 );
+      p->cnx->busy = 0;
+      logger( "tile transcoded, %d bytes\n", out ? olen : p->len );
+      http_reply_transcoded( p->cnx, p->mtype, p->etag[0] ? p->etag : NULL,
+			     out ? out : p->data, out ? olen : p->len, out != NULL );
+      free( p->data );
+      p->data = NULL;
+      cnx = p->cnx;
+      p->cnx = NULL;
+      http_parser_pause( &cnx->parser, 0 );
+      n = cnx->rlen;
+      cnx->rlen = 0;
+      memcpy( buf, cnx->rbuf, n );
+      doparse( cnx, buf, n );
+    }
+    free( out );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Reply with a tile
+ *  Tiles are cached by tile id so that a single cached copy serves
+ *  all the coordinates sharing the same image in normalized mbtiles.
+ *  Tile data is sent with gzip encoding when it is gzip compressed.
+ *  Raster tiles are sent as WebP to clients accepting it when
+ *  transcoding is enabled. Tiles stored in files of their own are
+ *  sent from the file when not cached.
+ * --------------------------------------------------------------------------*/
+int http_reply_tile( cnx_t *cnx, map_t *map, char *mtype, int x, int y, int z )
+{
+  char *data = NULL, *inm, *accept, etag[32], etaghdr[48];
+  char *h[3] = { NULL, NULL, NULL };
+  tcentry_t *e;
+  uint64_t id, key;
+  int len = 0, rc, gzip, nh = 0, raster, webp;
+
+  logger("http_reply_tile: %s %d/%d/%d (%s)\n", map->name, z, x, y, mtype);
+
+  cnx->req.accept_deflate = 0;  // data is identity or gzip but not deflate
+
+  // answer depends on Accept header when raster tiles are transcoded
+  raster = g_webp && (!strcmp( mtype, "image/jpeg" ) || !strcmp( mtype, "image/png" ));
+  accept = req_header( &cnx->req, "accept" );
+  webp = raster && accept && strstr( accept, "image/webp" );
+
+  rc = source_tile_id( map->src, z, x, y, &id );
+  if ( rc == 0 ) {
+    return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
+  }
+
+  if ( rc > 0 ) {
+    key = id;
+    snprintf( etag, sizeof(etag), webp ? "\"%" PRIx64 "-w\"" : "\"%" PRIx64 "\"", id );
+    inm = req_header( &cnx->req, "if-none-match" );
+    if ( inm && strstr( inm, etag ) ) {
+      return http_reply_not_modified( cnx, etag );
+    }
+    snprintf( etaghdr, sizeof(etaghdr), "ETag: %s", etag );
+    h[nh++] = etaghdr;
+  }
+  else {
+    // tiles can't be identified, cache them by coordinates
+    key = TILEID( z, x, y );
+  }
+
+  if ( webp ) {
+    e = tilecache_get( map->wcache, key );
+    if ( e ) {
+      transcode_stats()->memhits++;
+      if ( e->len > 0 ) {
+	return http_reply_transcoded( cnx, mtype, h[0], e->data, e->len, 1 );
+      }
+      // source tile is kept as is
+      webp = 0;
+    }
+  }
+
+  e = tilecache_get( map->cache, key );
+  if ( (e == NULL) && (rc < 0) && !webp ) {
+    int tfd;
+    switch( source_tile_fd( map->src, z, x, y, &tfd, &len ) ) {
+    case 0:
+      return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
+    case 1:
+      return http_reply_fd( cnx, mtype, tfd, len, raster );
+    }
+  }
+  if ( e == NULL ) {
+    if ( rc > 0 ) {
+      data = source_read_id( map->src, id, &len );
+    }
+    else {
+      data = source_read( map->src, z, x, y, &len );
+    }
+    if ( data == NULL ) {
+      return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
+    }
+    e = tilecache_put( map->cache, key, data, len, 0 );
+  }
+  else {
+    logger("tile %d/%d/%d found in cache\n", z, x, y);
+    if ( e->flags & TC_PREFETCHED ) {
+      e->flags &= ~TC_PREFETCHED;
+      prefetch_hit();
+    }
+  }
+  
+  gzip = ISGZIP( e ? e->data : data, e ? e->len : len );
+  
+  if ( e ) {
+    // shared tiles are answered with a pre-encoded response
+    if ( (rc > 0) && (e->flags & TC_PINNED) && !webp && http_should_keep_alive( &cnx->parser) ) {
+      if ( (e->resp == NULL) || strcmp( e->mtype, mtype ) ) {
+	int rlen;
+	char *resp = http_encode_tile( mtype, e->data, e->len, etag, gzip, raster, &rlen );
+	tilecache_set_resp( map->cache, e, mtype, resp, rlen );
+      }
+      logger("ANS %d %s (shared)\n", HTTP_STATUS_OK, http_status_str(HTTP_STATUS_OK));
+      safewrite( cnx->fd, e->resp, e->rlen );
+      return 0;
+    }
+    data = e->data;
+    len = e->len;
+  }
+
+  if ( webp && (raster_type( data, len ) != RASTER_UNKNOWN) ) {
+    return http_reply_webp( cnx, map, mtype, key, h[0], data, len );
+  }
+  if ( gzip ) {
+    h[nh++] = "Content-encoding: gzip";
+  }
+  if ( raster ) {
+    h[nh++] = "Vary: Accept";
+  }
+  return http_reply_data_ex( cnx, mtype, data, len, h[0], h[1], h[2], NULL );
+}
+
+/* --------------------------------------------------------------------------
+ *  Compute mimetype from length
+ * --------------------------------------------------------------------------*/
+char* http_mimetype( char *k, int len )
+{
+  static struct {
+    char *ext;
+    char *mtype;
+  } tab[] =
+      {
+       { ".pbf",  "application/x-protobuf" },
+       { ".json", "application/json" },
+       { ".js",   "application/javascript" },
+       { ".html", "text/html" },
+       { ".css",  "text/css" },
+       { ".png",  "image/png" },
+       { ".jpg",  "image/jpeg" },
+       { ".jpeg",  "image/jpeg" },
+       { ".webp",  "image/webp" }
+      };
+  int i, elen;
+  for( i = 0; i < sizeof(tab)/sizeof(tab[0]); ++i ) {
+    elen = strlen(tab[i].ext);
+    if ( !strncmp(k + (len-elen), tab[i].ext, elen) ) {
+      return tab[i].mtype;
+    }
+  }
+  return "text/plain";
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns numeric value of an hexadecimal digit
+ * --------------------------------------------------------------------------*/
+int alphaval( char c )
+{
+  if ( c >= '0' && c <= '9' ) return c - '0';
+  c = toupper(c);
+  if ( c >= 'A' && c <= 'F' ) return c + 10 - 'A';
+  return 0;
+}  
+
+/* --------------------------------------------------------------------------
+ *  Remove percent encoding sequences inplace
+ * --------------------------------------------------------------------------*/
+char *http_rm_percent( char *path, int len )
+{
+  char *s, *d;
+  for( s = d = path; len-- && *s; ++s, ++d ) {
+    if ( *s != '%' ) {
+      *d = *s;
+    }
+    else {
+      if (isalnum(s[1]) && isalnum(s[2])) {
+	*d = (alphaval(s[1]) << 4) | alphaval(s[2]);
+	s += 2;
+      }
+      else {
+	*d = '%';
+      }
+    }
+  }
+  *d = 0;
+  return path;
+}
+
+/* --------------------------------------------------------------------------
+ *  Find map by name, 'name' ends with a '/'
+ * --------------------------------------------------------------------------*/
+map_t *http_find_map( char *name )
+{
+  int i, l;
+  for( i = 0; i < g_nmaps; ++i ) {
+    l = strlen( g_maps[i].name );
+    if ( !strncmp( name, g_maps[i].name, l ) && (name[l] == '/') ) {
+      return g_maps + i;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Answers a rejected tile request : 404 for impossible tiles and 204
+ *  for tiles outside of the map. Answers are encoded once.
+ * --------------------------------------------------------------------------*/
+int http_reply_rejected( cnx_t *cnx, int reason )
+{
+  static char *names[REJECT_MAX] = { "syntax", "range", "zoom", "bounds" };
+  static char resp[2][2][128];
+  static int rlen[2][2];
+  int empty = (reason == REJECT_ZOOM) || (reason == REJECT_BOUNDS);
+  int close = !http_should_keep_alive( &cnx->parser );
+  enum http_status s = empty ? HTTP_STATUS_NO_CONTENT : HTTP_STATUS_NOT_FOUND;
+
+  g_rejected[reason]++;
+  if ( rlen[empty][close] == 0 ) {
+    // no body allowed with 204
+    rlen[empty][close] = snprintf( resp[empty][close], sizeof(resp[0][0]),
+				   "HTTP/1.1 %d %s\r\n"
+				   "Server: archrt (linux)\r\n"
+				   "%s%s"
+				   "\r\n",
+				   s, http_status_str(s),
+				   empty ? "" : "Content-Length: 0\r\n",
+				   close ? "Connection: Close\r\n" : "" );
+  }
+  logger("ANS %d %s (%s)\n", s, http_status_str(s), names[reason]);
+  safewrite( cnx->fd, resp[empty][close], rlen[empty][close] );
+  if ( close ) {
+    doclose( cnx );
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Parses 'z/x/y.ext' into v[0..2], numbers are made of digits only and
+ *  saturate at 2^30. Returns the extension or NULL if malformed.
+ * --------------------------------------------------------------------------*/
+char *http_parse_tile( char *k, int *v )
+{
+  long n;
+  int i;
+
+  for( i = 0; i < 3; ++i ) {
+    if ( !isdigit( *k ) ) {
+      return NULL;
+    }
+    for( n = 0; isdigit( *k ); ++k ) {
+      n = 10 * n + (*k - '0');
+      if ( n > (1L << 30) ) n = 1L << 30;
+    }
+    v[i] = (int) n;
+    if ( *k++ != ((i < 2) ? '/' : '.') ) {
+      return NULL;
+    }
+  }
+  return k;
+}
+
+/* --------------------------------------------------------------------------
+ *  Tile batch being answered
+ * --------------------------------------------------------------------------*/
+typedef struct batch_s {
+  cnx_t *cnx;
+  int chunked;          // chunked transfer encoding
+  uint64_t *ids;        // requested tiles, sorted
+  char *sent;           // tiles already sent
+  int n;
+  char *buf;            // records not sent yet
+  int len;
+} batch_t;
+
+/* --------------------------------------------------------------------------
+ *  Sends buffered records as a chunk
+ * --------------------------------------------------------------------------*/
+void batch_flush( batch_t *b )
+{
+  char hdr[16];
+
+  if ( b->len == 0 ) {
+    return;
+  }
+  if ( b->chunked ) {
+    safewrite( b->cnx->fd, hdr, snprintf( hdr, sizeof(hdr), "%x\r\n", b->len ));
+  }
+  safewrite( b->cnx->fd, b->buf, b->len );
+  if ( b->chunked ) {
+    safewrite( b->cnx->fd, "\r\n", 2 );
+  }
+  b->len = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a tile record : zoom (1 byte), column, row and data length
+ *  (4 bytes each, little endian) followed by tile data. Missing tiles
+ *  have no data.
+ * --------------------------------------------------------------------------*/
+void batch_record( batch_t *b, int z, int x, int y, char *data, int len )
+{
+  unsigned char hdr[13];
+  char size[16];
+  int i;
+
+  hdr[0] = z;
+  for( i = 0; i < 4; ++i ) {
+    hdr[1+i] = x >> (8*i);
+    hdr[5+i] = y >> (8*i);
+    hdr[9+i] = len >> (8*i);
+  }
+  if ( b->len + sizeof(hdr) + len > BATCH_CHUNK ) {
+    batch_flush( b );
+  }
+  if ( sizeof(hdr) + len > BATCH_CHUNK ) {
+    // large tiles are sent in their own chunk
+    if ( b->chunked ) {
+      safewrite( b->cnx->fd, size, snprintf( size, sizeof(size), "%x\r\n", (int) sizeof(hdr) + len ));
+    }
+    safewrite( b->cnx->fd, (char*) hdr, sizeof(hdr) );
+    safewrite( b->cnx->fd, data, len );
+    if ( b->chunked ) {
+      safewrite( b->cnx->fd, "\r\n", 2 );
+    }
+    return;
+  }
+  memcpy( b->buf + b->len, hdr, sizeof(hdr) );
+  if ( len > 0 ) {
+    memcpy( b->buf + b->len + sizeof(hdr), data, len );
+  }
+  b->len += sizeof(hdr) + len;
+}
+
+/* --------------------------------------------------------------------------
+ *  Compares tile ids for sorting
+ * --------------------------------------------------------------------------*/
+int batch_cmp( const void *a, const void *b )
+{
+  uint64_t u = *(const uint64_t*) a, v = *(const uint64_t*) b;
+  return (u < v) ? -1 : (u > v);
+}
+
+/* --------------------------------------------------------------------------
+ *  Range scan callback, records requested tiles
+ * --------------------------------------------------------------------------*/
+void batch_tile( void *arg, int z, int x, int y, char *data, int len )
+{
+  batch_t *b = (batch_t*) arg;
+  uint64_t id = TILEID( z, x, y ), *e;
+
+  e = (uint64_t*) bsearch( &id, b->ids, b->n, sizeof(uint64_t), batch_cmp );
+  if ( e && !b->sent[e - b->ids] ) {
+    b->sent[e - b->ids] = 1;
+    batch_record( b, z, x, y, data, len );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Parses a number made of digits, saturating at 2^30
+ * --------------------------------------------------------------------------*/
+char *batch_number( char *k, int *v )
+{
+  long n;
+
+  if ( !isdigit( *k ) ) {
+    return NULL;
+  }
+  for( n = 0; isdigit( *k ); ++k ) {
+    n = 10 * n + (*k - '0');
+    if ( n > (1L << 30) ) n = 1L << 30;
+  }
+  *v = (int) n;
+  return k;
+}
+
+/* --------------------------------------------------------------------------
+ *  Parses 'z/x/y' or 'z/x0-x1/y0-y1' into v[0..4] (zoom, columns and
+ *  rows). Returns the end of the entry or NULL if malformed.
+ * --------------------------------------------------------------------------*/
+char *batch_parse( char *k, int *v )
+{
+  int i;
+
+  k = batch_number( k, v );
+  for( i = 0; k && (i < 2); ++i ) {
+    if ( *k++ != '/' ) {
+      return NULL;
+    }
+    k = batch_number( k, v + 1 + 2*i );
+    if ( k == NULL ) {
+      return NULL;
+    }
+    v[2+2*i] = v[1+2*i];
+    if ( *k == '-' ) {
+      k = batch_number( k + 1, v + 2 + 2*i );
+    }
+  }
+  return k;
+}
+
+/* --------------------------------------------------------------------------
+ *  Replies to a tile batch : 'spec' holds entries 'z/x/y' or
+ *  'z/x0-x1/y0-y1' separated by blanks or commas. Tiles are streamed
+ *  as records in chunks, in zoom, column and row order, followed by
+ *  empty records for missing tiles. Tiles of a zoom level are read
+ *  with a single range scan of their bounding box when the source
+ *  supports it, unless the box is mostly made of tiles which weren't
+ *  requested.
+ * --------------------------------------------------------------------------*/
+int http_reply_batch( cnx_t *cnx, map_t *map, char *spec )
+{
+  tilerange_t *r = &map->range;
+  batch_t b;
+  int v[5], i, j, k, x, y, z, x0, y0, x1, y1, close;
+  long area;
+
+  if ( cnx->req.bodylen < 0 ) {
+    return http_reply_error( cnx, HTTP_STATUS_PAYLOAD_TOO_LARGE );
+  }
+  if ( spec == NULL ) {
+    return http_reply_error( cnx, HTTP_STATUS_BAD_REQUEST );
+  }
+
+  memset( &b, 0, sizeof(b));
+  b.ids = (uint64_t*) emalloc( BATCH_MAXTILES * sizeof(uint64_t));
+  while( *spec ) {
+    if ( isspace( *spec ) || (*spec == ',') ) {
+      spec++;
+      continue;
+    }
+    spec = batch_parse( spec, v );
+    if ( (spec == NULL) || (*spec && !isspace( *spec ) && (*spec != ',')) ||
+	 !TILEVALID( v[0], v[1], v[3] ) || !TILEVALID( v[0], v[2], v[4] ) ||
+	 (v[1] > v[2]) || (v[3] > v[4]) ) {
+      free( b.ids );
+      return http_reply_error( cnx, HTTP_STATUS_BAD_REQUEST );
+    }
+    area = (long) (v[2] - v[1] + 1) * (v[4] - v[3] + 1);
+    if ( b.n + area > BATCH_MAXTILES ) {
+      free( b.ids );
+      return http_reply_error( cnx, HTTP_STATUS_PAYLOAD_TOO_LARGE );
+    }
+    for( x = v[1]; x <= v[2]; ++x ) {
+      for( y = v[3]; y <= v[4]; ++y ) {
+	b.ids[b.n++] = TILEID( v[0], x, y );
+      }
+    }
+  }
+  if ( b.n == 0 ) {
+    free( b.ids );
+    return http_reply_error( cnx, HTTP_STATUS_BAD_REQUEST );
+  }
+  qsort( b.ids, b.n, sizeof(uint64_t), batch_cmp );
+  for( i = j = 1; i < b.n; ++i ) {
+    if ( b.ids[i] != b.ids[j-1] ) {
+      b.ids[j++] = b.ids[i];
+    }
+  }
+  b.n = j;
+  b.sent = (char*) emalloc( b.n );
+  memset( b.sent, 0, b.n );
+  b.buf = emalloc( BATCH_CHUNK );
+  b.cnx = cnx;
+
+  // chunks need HTTP/1.1, the connection is closed otherwise
+  b.chunked = (cnx->parser.http_major > 1) || (cnx->parser.http_minor > 0);
+  close = !b.chunked || !http_should_keep_alive( &cnx->parser );
+  send_response( cnx->fd, HTTP_STATUS_OK );
+  writeln( cnx->fd, "Content-Type: application/octet-stream" );
+  if ( b.chunked ) {
+    writeln( cnx->fd, "Transfer-Encoding: chunked" );
+  }
+  if ( close ) {
+    writeln( cnx->fd, "Connection: Close" );
+  }
+  writeln( cnx->fd, "" );
+
+  for( i = 0; i < b.n; i = j ) {
+    z = TILEZ( b.ids[i] );
+    x0 = y0 = 1 << 29;
+    x1 = y1 = -1;
+    for( j = i; (j < b.n) && (TILEZ( b.ids[j] ) == z); ++j ) {
+      x = TILEX( b.ids[j] );
+      y = TILEY( b.ids[j] );
+      if ( x < x0 ) x0 = x;
+      if ( x > x1 ) x1 = x;
+      if ( y < y0 ) y0 = y;
+      if ( y > y1 ) y1 = y;
+    }
+    // tiles outside of the map are not read
+    if ( (z < r->minzoom) || (z > r->maxzoom) ) {
+      continue;
+    }
+    if ( r->bounded ) {
+      if ( x0 < r->x0[z] ) x0 = r->x0[z];
+      if ( x1 > r->x1[z] ) x1 = r->x1[z];
+      if ( y0 < r->y0[z] ) y0 = r->y0[z];
+      if ( y1 > r->y1[z] ) y1 = r->y1[z];
+      if ( (x0 > x1) || (y0 > y1) ) {
+	continue;
+      }
+    }
+    area = (long) (x1 - x0 + 1) * (y1 - y0 + 1);
+    if ( map->src->ops->scan && (area <= 4L * (j - i)) ) {
+      source_scan( map->src, z, x0, y0, x1, y1, batch_tile, &b );
+    }
+    else {
+      // sparse tiles or sources without range scan are read one by one
+      for( k = i; k < j; ++k ) {
+	x = TILEX( b.ids[k] );
+	y = TILEY( b.ids[k] );
+	if ( (x >= x0) && (x <= x1) && (y >= y0) && (y <= y1) ) {
+	  source_scan( map->src, z, x, y, x, y, batch_tile, &b );
+	}
+      }
+    }
+  }
+  for( i = 0; i < b.n; ++i ) {
+    if ( !b.sent[i] ) {
+      batch_record( &b, TILEZ( b.ids[i] ), TILEX( b.ids[i] ), TILEY( b.ids[i] ), NULL, 0 );
+    }
+  }
+  batch_flush( &b );
+  if ( b.chunked ) {
+    safewrite( cnx->fd, "0\r\n\r\n", 5 );
+  }
+  logger("batch: %d tiles\n", b.n);
+
+  free( b.buf );
+  free( b.sent );
+  free( b.ids );
+  if ( close ) {
+    doclose( cnx );
+  }
+  return 0;
 }
 
 /* --------------------------------------------------------------------------
- *  Reply with a tile
+ *  Queues for prefetch the tiles around tile z/x/y : its 8 neighbours
+ *  and, when the last zoom change was a zoom in, its 4 children. Tiles
+ *  queued last are loaded first, so the most likely ones are queued last.
  * --------------------------------------------------------------------------*/
-int http_reply_tile( cnx_t *cnx, char *mtype, int x, int y, int z, int gzip)
+void map_prefetch( map_t *map, int z, int x, int y )
 {
-  char *data = NULL;
-  int len = 0;
-
-  logger("http_reply_tile: %d/%d/%d (%s%s)\n", z, x, y, mtype, gzip ? " compressed" : "");
-
-  cnx->req.accept_deflate = 0;  // data is identity or gzip but not deflate
-  data = mbtiles_read( g_sql, z, x, y, &len );
-  if ( data ) {
-    return http_reply_data_ex( cnx, mtype, data, len,
-			       gzip ? "Content-encoding: gzip" : NULL,
-			       NULL );
+  // diagonal neighbours first, then side ones
+  static int dx[8] = { -1, 1, -1, 1, 0, 0, -1, 1 };
+  static int dy[8] = { -1, -1, 1, 1, -1, 1, 0, 0 };
+  tilerange_t *r = &map->range;
+  int i, n, tx, ty;
+
+  if ( z != map->lastz ) {
+    map->zoomin = z > map->lastz;
+    map->lastz = z;
   }
-  else {
-    return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
+
+  // columns wrap around the antimeridian, rows don't
+  n = 1 << z;
+  for( i = 0; i < 8; ++i ) {
+    tx = (x + dx[i] + n) % n;
+    ty = y + dy[i];
+    if ( (ty < 0) || (ty >= n) ) continue;
+    if ( r->bounded && ((tx < r->x0[z]) || (tx > r->x1[z]) || (ty < r->y0[z]) || (ty > r->y1[z])) ) continue;
+    prefetch_push( map, z, tx, ty );
   }
-}
 
-/* --------------------------------------------------------------------------
- *  Compute mimetype from length
- * --------------------------------------------------------------------------*/
-char* http_mimetype( char *k, int len )
-{
-  static struct {
-    char *ext;
-    char *mtype;
-  } tab[] =
-      {
-       { ".pbf",  "application/x-protobuf" },
-       { ".json", "application/json" },
-       { ".js",   "application/javascript" },
-       { ".html", "text/html" },
-       { ".css",  "text/css" },
-       { ".png",  "image/png" },
-       { ".jpg",  "image/jpeg" },
-       { ".jpeg",  "image/jpeg" }
-      };
-  int i, elen;
-  for( i = 0; i < sizeof(tab)/sizeof(tab[0]); ++i ) {
-    elen = strlen(tab[i].ext);
-    if ( !strncmp(k + (len-elen), tab[i].ext, elen) ) {
-      return tab[i].mtype;
+  if ( map->zoomin && (z < r->maxzoom) ) {
+    ++z;
+    for( i = 0; i < 4; ++i ) {
+      tx = 2 * x + (i & 1);
+      ty = 2 * y + (i >> 1);
+      if ( r->bounded && ((tx < r->x0[z]) || (tx > r->x1[z]) || (ty < r->y0[z]) || (ty > r->y1[z])) ) continue;
+      prefetch_push( map, z, tx, ty );
     }
   }
-  return "text/plain";
 }
 
 /* --------------------------------------------------------------------------
- *  Returns numeric value of an hexadecimal digit
+ *  Reply to tile related requests
+ *  'k' is the path following 'tiles/', tiles of first map are also
+ *  available without map name.
  * --------------------------------------------------------------------------*/
-int alphaval( char c )
+int http_reply_tiles( cnx_t *cnx, char *k )
 {
-  if ( c >= '0' && c <= '9' ) return c - '0';
-  c = toupper(c);
-  if ( c >= 'A' && c <= 'F' ) return c + 10 - 'A';
-  return 0;
-}  
+  map_t *map = g_maps;
+  tilerange_t *r;
+  char *ext, *mtype = NULL;
+  int v[3], x, y, z, named = 0;
+
+  if ( !isdigit(k[0]) && strcmp( k, "tiles.json") && !ISBATCH(k) ) {
+    map = http_find_map( k );
+    if ( map == NULL ) {
+      return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
+    }
+    k += strlen( map->name ) + 1;
+    named = 1;
+  }
 
-/* --------------------------------------------------------------------------
- *  Remove percent encoding sequences inplace
- * --------------------------------------------------------------------------*/
-char *http_rm_percent( char *path, int len )
-{
-  char *s, *d;
-  for( s = d = path; len-- && *s; ++s, ++d ) {
-    if ( *s != '%' ) {
-      *d = *s;
+  // tile batches are given in path or posted
+  if ( ISBATCH(k) ) {
+    return http_reply_batch( cnx, map, k[5] ? k + 6 : cnx->req.body );
+  }
+  if ( cnx->parser.method != HTTP_GET ) {
+    return http_reply_error( cnx, HTTP_STATUS_BAD_REQUEST );
+  }
+  
+  if ( isdigit(k[0]) ) {
+    // requests are checked before any I/O
+    ext = http_parse_tile( k, v );
+    if ( ext ) {
+      if ( !strcmp( ext, "pbf") ) mtype = "application/x-protobuf";
+      else if ( !strcmp( ext, "jpg") ) mtype = "image/jpeg";
+      else if ( !strcmp( ext, "png") ) mtype = "image/png";
+      else if ( !strcmp( ext, "webp") ) mtype = "image/webp";
     }
-    else {
-      if (isalnum(s[1]) && isalnum(s[2])) {
-	*d = (alphaval(s[1]) << 4) | alphaval(s[2]);
-	s += 2;
-      }
-      else {
-	*d = '%';
-      }
+    if ( mtype == NULL ) {
+      return http_reply_rejected( cnx, REJECT_SYNTAX );
+    }
+    z = v[0];
+    x = v[1];
+    y = v[2];
+    if ( !TILEVALID( z, x, y ) ) {
+      return http_reply_rejected( cnx, REJECT_RANGE );
+    }
+    r = &map->range;
+    if ( (z < r->minzoom) || (z > r->maxzoom) ) {
+      return http_reply_rejected( cnx, REJECT_ZOOM );
     }
+    if ( r->bounded && ((x < r->x0[z]) || (x > r->x1[z]) || (y < r->y0[z]) || (y > r->y1[z])) ) {
+      return http_reply_rejected( cnx, REJECT_BOUNDS );
+    }
+    if ( g_prefetch ) {
+      map_prefetch( map, z, x, y );
+    }
+    return http_reply_tile( cnx, map, mtype, x, y, z );
   }
-  *d = 0;
-  return path;
+  else if ( !strcmp( k, "tiles.json") ) {
+    return http_reply_tiles_json( cnx, "application/json", map, named );
+  }
+  
+  return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
 }
 
 /* --------------------------------------------------------------------------
@@ -402,7 +1524,7 @@ char *http_rm_percent( char *path, int len )
 int http_reply( cnx_t *cnx )
 {
   char *data = NULL, *mtype, *k;
-  int n = 0, l, x, y, z;
+  int l;
   
   if ( cnx->urlp.field_set & (1 << UF_QUERY) ) {
     return http_reply_error( cnx, HTTP_STATUS_BAD_REQUEST );
@@ -414,6 +1536,7 @@ int http_reply( cnx_t *cnx )
   switch( cnx->parser.method ) {
     
   case HTTP_GET:
+  case HTTP_POST:
     k = cnx->req.url + cnx->urlp.field_data[UF_PATH].off + 1;
     l = cnx->urlp.field_data[UF_PATH].len - 1;
     if ( l == 0 ) {
@@ -429,33 +1552,11 @@ int http_reply( cnx_t *cnx )
     // special case for "/tiles/*" URL which are served
     // using mbtiles file content
     if ( !strncmp( k, "tiles/", 6) ) {
-      if ( isdigit(k[6]) ) {
-	n = sscanf( k, "tiles/%d/%d/%d.", &z, &x, &y );
-	if ( n == 3 ) {
-	  l = strlen(k) - 4;
-	  if ( !strcmp( k+l, ".pbf") ) {
-	    return http_reply_tile( cnx, "application/x-protobuf", x, y, z, 1);	    
-	  }
-	  else if ( !strcmp( k+l, ".jpg") ) {
-	    return http_reply_tile( cnx, "image/jpeg", x, y, z, 0);
-	  }
-	  else if ( !strcmp( k+l, ".png") ) {
-	    return http_reply_tile( cnx, "image/png", x, y, z, 0);
-	  }
-	  // reached for usupported format
-	}
-	
-	return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
-      }
-      else {
-	if ( !strcmp( k, "tiles/tiles.json") ) {
-	  mtype = http_mimetype(k,l);
-	  return http_reply_tiles_json( cnx, mtype );
-	}
-	else {
-	  return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
-	}
-      }
+      return http_reply_tiles( cnx, k + 6 );
+    }
+    else if ( cnx->parser.method == HTTP_POST ) {
+      // only tile batches are posted
+      return http_reply_error( cnx, HTTP_STATUS_BAD_REQUEST );
     }
     else {
       // get data maybe compressed if gzip encoding is supported
@@ -470,6 +1571,9 @@ int http_reply( cnx_t *cnx )
     else if ( !strcmp( k, "style.json") ) {
       return http_reply_style( cnx, "application/json" );
     }
+    else if ( !strcmp( k, "stats.json") ) {
+      return http_reply_stats( cnx, "application/json" );
+    }
     else {
       return http_reply_error( cnx, HTTP_STATUS_NOT_FOUND );
     }
@@ -527,6 +1631,7 @@ void req_clean( req_t *req )
   req->url = NULL;
   free( req->body );
   req->body = NULL;
+  req->bodylen = 0;
   for( i = 0; i < req->nhv; i++ ) {
     free( req->hv[i] );
     req->hv[i] = NULL;
@@ -546,6 +1651,21 @@ int message_begin_cb( http_parser *p )
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  Retrieve request header value, 'name' is case insensitive
+ *  Returns NULL if header not present
+ * --------------------------------------------------------------------------*/
+char *req_header( req_t *req, char *name )
+{
+  int i;
+  for (i = 0; i + 1 < req->nhv; i+=2) {
+    if ( !strcasecmp(req->hv[i], name) ) {
+      return req->hv[i+1];
+    }
+  }
+  return NULL;
+}
+
 /* --------------------------------------------------------------------------
  *  Called when HTTP headers parsing is completed
  * --------------------------------------------------------------------------*/
@@ -619,6 +1739,11 @@ int message_complete_cb( http_parser *p)
   
   req_clean( req );
 
+  // pipelined requests are parsed once the deferred reply is sent
+  if ( cnx->busy ) {
+    http_parser_pause( p, 1 );
+  }
+
   logger("-------------------------------------\n");
   
   return 0;
@@ -643,6 +1768,31 @@ int url_cb( http_parser *p, const char *at, size_t length)
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  Called when a chunk of request body is parsed, bodies larger than
+ *  BATCH_MAXBODY are dropped
+ * --------------------------------------------------------------------------*/
+int body_cb( http_parser *p, const char *at, size_t length)
+{
+  cnx_t *cnx = (cnx_t*) p->data;
+  req_t *req = &cnx->req;
+
+  if ( req->bodylen < 0 ) {
+    return 0;
+  }
+  if ( req->bodylen + length > BATCH_MAXBODY ) {
+    free( req->body );
+    req->body = NULL;
+    req->bodylen = -1;
+    return 0;
+  }
+  req->body = erealloc( req->body, req->bodylen + length + 1 );
+  memcpy( req->body + req->bodylen, at, length );
+  req->bodylen += length;
+  req->body[req->bodylen] = 0;
+  return 0;
+}
+
 /* --------------------------------------------------------------------------
  *  Called when a header field name is parsed
  * --------------------------------------------------------------------------*/
@@ -779,6 +1929,7 @@ int doaccept( int fd )
   cnx->settings.on_message_begin = message_begin_cb;
   cnx->settings.on_headers_complete = headers_complete_cb;;
   cnx->settings.on_message_complete = message_complete_cb;
+  cnx->settings.on_body = body_cb;
 
   http_parser_init( &cnx->parser, HTTP_REQUEST);
   cnx->parser.data = cnx;
@@ -800,30 +1951,51 @@ int doclose( cnx_t *cnx )
   }
 }
 
+/* --------------------------------------------------------------------------
+ *  Parses incoming HTTP requests
+ *  Parsing stops when the reply to a request is deferred, bytes left
+ *  are kept in the connection until the reply is sent.
+ * --------------------------------------------------------------------------*/
+int doparse( cnx_t *cnx, char *buf, int nr )
+{
+  int tp, np;
+
+  for( tp = 0; tp < nr; tp += np ) {
+    np = http_parser_execute(&cnx->parser, &cnx->settings, buf + tp, nr - tp);
+    if ( HTTP_PARSER_ERRNO( &cnx->parser ) == HPE_PAUSED ) {
+      cnx->rlen = nr - tp - np;
+      memcpy( cnx->rbuf, buf + tp + np, cnx->rlen );
+      return 0;
+    }
+    if ( HTTP_PARSER_ERRNO( &cnx->parser ) ) {
+      fprintf( stderr, "HTTP error %s : %s\n",
+	       http_errno_name( HTTP_PARSER_ERRNO( &cnx->parser )),
+	       http_errno_description( HTTP_PARSER_ERRNO( &cnx->parser )));
+      doclose(cnx);
+      return -1;
+    }
+    if ( cnx->parser.upgrade ) {
+      fprintf( stderr, "HTTP connexion upgrade not supported.\n" );
+      doclose(cnx);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 /* --------------------------------------------------------------------------
  *  Reads input and parses incoming HTTP requests
+ *  Reading stops when a reply is deferred.
  * --------------------------------------------------------------------------*/
 int doinput( cnx_t *cnx )
 {
-  char buf[4096];
-  int nr, tp, np, nt = 0;
+  char buf[RDBUF];
+  int nr, nt = 0;
   
-  while( (nr = read( cnx->fd, buf, sizeof(buf))) > 0 ) {
+  while( !cnx->busy && (nr = read( cnx->fd, buf, sizeof(buf))) > 0 ) {
     nt += nr;
-    for( tp = 0; tp < nr; tp += np ) {
-      np = http_parser_execute(&cnx->parser, &cnx->settings, buf + tp, nr - tp);
-      if ( HTTP_PARSER_ERRNO( &cnx->parser ) ) {
-	fprintf( stderr, "HTTP error %s : %s\n",
-		 http_errno_name( HTTP_PARSER_ERRNO( &cnx->parser )),
-		 http_errno_description( HTTP_PARSER_ERRNO( &cnx->parser )));
-	doclose(cnx);
-	return -1;
-      }
-      if ( cnx->parser.upgrade ) {
-	fprintf( stderr, "HTTP connexion upgrade not supported.\n" );
-	doclose(cnx);
-	return -1;
-      }
+    if ( doparse( cnx, buf, nr ) < 0 ) {
+      return -1;
     }
   }
   if ( nt == 0 ) {
@@ -834,22 +2006,79 @@ int doinput( cnx_t *cnx )
   return nt;
 }
 
+/* --------------------------------------------------------------------------
+ *  Loads queued tiles in the tile cache, called when the server is idle.
+ *  Stops after the current budget of tiles or PREFETCH_SLICE ms.
+ * --------------------------------------------------------------------------*/
+void doprefetch()
+{
+  struct timespec t0, t;
+  map_t *map;
+  void *p;
+  uint64_t id, key;
+  char *data;
+  int n, rc, len, x, y, z;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  n = prefetch_stats()->budget;
+  while( (n > 0) && prefetch_pop( &p, &z, &x, &y ) ) {
+    map = (map_t*) p;
+    rc = source_tile_id( map->src, z, x, y, &id );
+    if ( rc == 0 ) {
+      continue;
+    }
+    key = (rc > 0) ? id : TILEID( z, x, y );
+    if ( tilecache_get( map->cache, key ) ) {
+      continue;
+    }
+    data = (rc > 0) ? source_read_id( map->src, id, &len ) : source_read( map->src, z, x, y, &len );
+    if ( data == NULL ) {
+      continue;
+    }
+    if ( tilecache_put( map->cache, key, data, len, TC_PREFETCHED ) ) {
+      logger("prefetch: %s %d/%d/%d\n", map->name, z, x, y);
+      prefetch_loaded();
+    }
+    --n;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    if ( (t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000 >= PREFETCH_SLICE ) {
+      break;
+    }
+  }
+}
+
 /* --------------------------------------------------------------------------
  *  IO loop based on select
+ *  When tiles are queued for prefetch, select doesn't wait and queued
+ *  tiles are loaded if nothing is ready. They are cancelled when
+ *  requests keep coming without idle time or transcoded tiles are
+ *  awaited.
  * --------------------------------------------------------------------------*/
 int selectloop()
 {
+  struct timeval tv = { 0, 0 };
   fd_set rdset;
-  int i, r, m;
+  int i, r, m, busy = 0, idle;
   
   while(1) {
+    if ( g_rescan ) {
+      g_rescan = 0;
+      rescan();
+    }
+
     FD_ZERO( &rdset );
     
     FD_SET( serverfd, &rdset );
 
     m = serverfd;
+    if ( g_tfd >= 0 ) {
+      FD_SET( g_tfd, &rdset );
+      if ( g_tfd > m ) {
+	m = g_tfd;
+      }
+    }
     for( i = 0; i < MAXCNX; ++i ) {
-      if ( cnxtab[i] ) {
+      if ( cnxtab[i] && !cnxtab[i]->busy ) {
 	FD_SET( cnxtab[i]->fd, &rdset );
 	if ( cnxtab[i]->fd > m ) {
 	  m = cnxtab[i]->fd;
@@ -857,17 +2086,38 @@ int selectloop()
       }
     }
 
-    r = select( m+1, &rdset, NULL, NULL, NULL );
+    idle = g_prefetch && prefetch_pending();
+    r = select( m+1, &rdset, NULL, NULL, idle ? &tv : NULL );
+    if ( (r == -1) && (errno == EINTR) ) {
+      continue;
+    }
     if ( r == -1 ) {
       perror("select");
       return -1;
     }
+    if ( idle ) {
+      if ( r == 0 ) {
+	busy = 0;
+	doprefetch();
+	continue;
+      }
+      for( i = 0; (i < MAXCNX) && !(cnxtab[i] && cnxtab[i]->busy); ++i );
+      busy += r;
+      if ( (busy >= PREFETCH_BUSY) || (i < MAXCNX) ) {
+	logger("prefetch cancelled\n");
+	prefetch_cancel();
+	busy = 0;
+      }
+    }
 
     if ( FD_ISSET( serverfd, &rdset ) ) {
       doaccept( serverfd );
     }
+    if ( (g_tfd >= 0) && FD_ISSET( g_tfd, &rdset ) ) {
+      dotranscoded();
+    }
     for( i = 0; i < MAXCNX; ++i ) {
-      if ( cnxtab[i] && FD_ISSET( cnxtab[i]->fd, &rdset ) ) {
+      if ( cnxtab[i] && !cnxtab[i]->busy && FD_ISSET( cnxtab[i]->fd, &rdset ) ) {
 	doinput( cnxtab[i] );
       }
     }
@@ -876,6 +2126,51 @@ int selectloop()
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  Loads in cache the tiles shared by many coordinates
+ * --------------------------------------------------------------------------*/
+void pin( map_t *map )
+{
+  uint64_t *ids;
+  char *data;
+  int i, n, len;
+    
+  n = source_shared( map->src, &ids );
+  for( i = 0; i < n; ++i ) {
+    data = source_read_id( map->src, ids[i], &len );
+    if ( data ) {
+      tilecache_put( map->cache, ids[i], data, len, TC_PINNED );
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Rescan patch directories, cache of patched maps is emptied
+ * --------------------------------------------------------------------------*/
+void rescan()
+{
+  int i;
+  for( i = 0; i < g_nmaps; ++i ) {
+    if ( g_maps[i].patch && (patch_rescan( g_maps[i].patch ) > 0) ) {
+      tilecache_clear( g_maps[i].cache );
+      if ( g_maps[i].wcache ) {
+	tilecache_clear( g_maps[i].wcache );
+      }
+      if ( g_index ) {
+	pin( g_maps + i );
+      }
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  SIGHUP handler
+ * --------------------------------------------------------------------------*/
+void onhup( int sig )
+{
+  g_rescan = 1;
+}
+
 /* --------------------------------------------------------------------------
  *  Close connections
  * --------------------------------------------------------------------------*/
@@ -888,7 +2183,15 @@ void byebye()
       close( cnxtab[i]->fd );
     }
   }
-  mbtiles_close( g_sql );
+  for( i = 0; i < g_nmaps; ++i ) {
+    source_close( g_maps[i].src );
+    tilecache_free( g_maps[i].cache );
+    if ( g_maps[i].wcache ) {
+      tilecache_free( g_maps[i].wcache );
+    }
+    tjresp_free( g_maps[i].tj );
+    tjresp_free( g_maps[i].tj + 1 );
+  }
 }
 
 /* --------------------------------------------------------------------------
@@ -907,13 +2210,99 @@ void usage( char *fmt, ... )
   fprintf( fout, "\t -h            Prints this help message.\n");
   fprintf( fout, "\t -x            Open web browser.\n");
   fprintf( fout, "\t -v            Be verbose.\n");
+  fprintf( fout, "\t -i            Index tiles in memory at startup.\n");
   fprintf( fout, "\t -p port       Sets port number to listen on.\n");
-  fprintf( fout, "\t -m mbtiles    Sets mbtile file to display.\n");
+  fprintf( fout, "\t -m map        Adds mbtiles, PMTiles, GeoPackage or tile pack file\n");
+  fprintf( fout, "\t               to display, or a directory of z/x/y tile files or of\n");
+  fprintf( fout, "\t               map files. Vector maps joined with '+' ('a+b')\n");
+  fprintf( fout, "\t               are served as one map holding all their layers.\n");
+  fprintf( fout, "\t               Can be repeated, 'name=file' serves tiles below\n");
+  fprintf( fout, "\t               /tiles/<name>/ (default name is file name).\n");
+  fprintf( fout, "\t -g map        Adds GeoJSON file to display as vector tiles made\n");
+  fprintf( fout, "\t               on demand, same naming as '-m'.\n");
+  fprintf( fout, "\t -u dir        Applies patch mbtiles of 'dir' to previous map,\n");
+  fprintf( fout, "\t               directory is scanned again on SIGHUP.\n");
+  fprintf( fout, "\t -o levels     Upscales raster tiles up to 'levels' zoom levels\n");
+  fprintf( fout, "\t               beyond max zoom.\n");
+  fprintf( fout, "\t -d levels     Builds raster tiles up to 'levels' zoom levels\n");
+  fprintf( fout, "\t               below min zoom from their children.\n");
+  fprintf( fout, "\t -w dir        Sends raster tiles as WebP to clients accepting it,\n");
+  fprintf( fout, "\t               transcoded tiles are stored in 'dir'.\n");
+  fprintf( fout, "\t -f tiles      Prefetches neighbours and children of requested\n");
+  fprintf( fout, "\t               tiles while idle, at most 'tiles' at a time.\n");
   fprintf( fout, "\t -s style      Sets style.json file to use for rendering.\n");
+  fprintf( fout, "\t -a            Serves vector tiles with all their layers, including\n");
+  fprintf( fout, "\t               the ones the style doesn't draw.\n");
+  fprintf( fout, "\t --extract w,s,e,n,z0-z1\n");
+  fprintf( fout, "\t               Extracts tiles of map given by '-m' inside bounding box\n");
+  fprintf( fout, "\t               and zoom levels to mbtiles file given by '--output'\n");
+  fprintf( fout, "\t               instead of serving it.\n");
+  fprintf( fout, "\t --output file Sets mbtiles file made by '--extract'.\n");
 
   exit( fmt ? 1 : 0 );
 }
 
+/* --------------------------------------------------------------------------
+ *  Adds a map given as 'name=path' or 'path' to the list of served maps
+ * --------------------------------------------------------------------------*/
+void addmap( char *arg )
+{
+  char *name, *path, *p;
+  int i;
+
+  if ( g_nmaps == MAXMAPS ) {
+    usage( "too many maps, at most %d can be served.\n", MAXMAPS );
+  }
+  
+  p = strchr( arg, '=' );
+  if ( p && (memchr( arg, '/', p - arg ) == NULL) ) {
+    name = strndup( arg, p - arg );
+    path = p + 1;
+  }
+  else {
+    // default name is file name without extension, the first
+    // one for composites
+    path = arg;
+    name = strndup( arg, strcspn( arg, "+" ));
+    if ( name == NULL ) {
+      fputs( "memory allocation error.\n", stderr );
+      exit(1);
+    }
+    for( i = strlen(name); (i > 1) && (name[i-1] == '/'); --i ) {
+      name[i-1] = 0;
+    }
+    p = strrchr( name, '/' );
+    if ( p ) {
+      memmove( name, p + 1, strlen(p) );
+    }
+    p = strrchr( name, '.' );
+    if ( p && (p != name) ) *p = 0;
+  }
+  if ( name == NULL ) {
+    fputs( "memory allocation error.\n", stderr );
+    exit(1);
+  }
+
+  // name is used in URL and must not look like a zoom level
+  if ( !*name || isdigit(*name) || !strcmp( name, "tiles.json") || !strcmp( name, "batch") ) {
+    usage( "invalid map name '%s'.\n", name );
+  }
+  for( p = name; *p; ++p ) {
+    if ( !isalnum(*p) && (*p != '-') && (*p != '_') && (*p != '.') ) {
+      usage( "invalid map name '%s'.\n", name );
+    }
+  }
+  for( i = 0; i < g_nmaps; ++i ) {
+    if ( !strcmp( g_maps[i].name, name ) ) {
+      usage( "map name '%s' used twice.\n", name );
+    }
+  }
+  
+  g_maps[g_nmaps].name = name;
+  g_maps[g_nmaps].path = path;
+  g_nmaps++;
+}
+
 /* --------------------------------------------------------------------------
  *  Main program
  * --------------------------------------------------------------------------*/
@@ -924,12 +2313,27 @@ int main( int argc, char **argv )
 #define F_STYLE 0x04
 #define F_EXEC  0x08
 #define F_VERB  0x10
-  int opt, flags = 0;
+#define F_INDEX 0x20
+#define F_OVER  0x40
+#define F_PYR   0x80
+#define F_WEBP  0x100
+#define F_PREF  0x200
+#define F_EXTR  0x400
+#define F_OUT   0x800
+#define F_ALL   0x1000
+  static struct option longopts[] = {
+    { "extract", required_argument, NULL, 'E' },
+    { "output", required_argument, NULL, 'O' },
+    { NULL, 0, NULL, 0 }
+  };
+  char *extract = NULL, *output = NULL;
+  int opt, m, flags = 0;
   
   signal( SIGPIPE, SIG_IGN );
+  signal( SIGHUP, onhup );
   atexit( byebye );
   
-  while ((opt = getopt(argc, argv, "hxvp:m:s:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "hxviap:m:g:u:o:d:w:f:s:", longopts, NULL)) != -1) {
     switch (opt) {
     case 'h':
       usage( NULL );
@@ -946,6 +2350,19 @@ int main( int argc, char **argv )
       }
       flags |= F_VERB;
       break;
+    case 'i':
+      if ( flags & F_INDEX ) {
+	usage( "option '-%c' can be specified only once.\n", opt);
+      }
+      flags |= F_INDEX;
+      g_index = 1;
+      break;
+    case 'a':
+      if ( flags & F_ALL ) {
+	usage( "option '-%c' can be specified only once.\n", opt);
+      }
+      flags |= F_ALL;
+      break;
     case 'p':
       if ( flags & F_PORT ) {
 	usage( "option '-%c' can be specified only once.\n", opt);
@@ -954,11 +2371,56 @@ int main( int argc, char **argv )
       flags |= F_PORT;
       break;
     case 'm':
-      if ( flags & F_MAP ) {
+      addmap( optarg );
+      flags |= F_MAP;
+      break;
+    case 'g':
+      addmap( optarg );
+      g_maps[g_nmaps-1].geojson = 1;
+      flags |= F_MAP;
+      break;
+    case 'o':
+      if ( flags & F_OVER ) {
 	usage( "option '-%c' can be specified only once.\n", opt);
       }
-      g_map = optarg;
-      flags |= F_MAP;
+      g_overzoom = atoi(optarg);
+      if ( (g_overzoom <= 0) || (g_overzoom > OVERZOOM_MAXLEVELS) ) {
+	usage( "option '-%c' expects a number of levels from 1 to %d.\n", opt, OVERZOOM_MAXLEVELS);
+      }
+      flags |= F_OVER;
+      break;
+    case 'd':
+      if ( flags & F_PYR ) {
+	usage( "option '-%c' can be specified only once.\n", opt);
+      }
+      g_pyramid = atoi(optarg);
+      if ( (g_pyramid <= 0) || (g_pyramid > PYRAMID_MAXLEVELS) ) {
+	usage( "option '-%c' expects a number of levels from 1 to %d.\n", opt, PYRAMID_MAXLEVELS);
+      }
+      flags |= F_PYR;
+      break;
+    case 'w':
+      if ( flags & F_WEBP ) {
+	usage( "option '-%c' can be specified only once.\n", opt);
+      }
+      g_webp = optarg;
+      flags |= F_WEBP;
+      break;
+    case 'f':
+      if ( flags & F_PREF ) {
+	usage( "option '-%c' can be specified only once.\n", opt);
+      }
+      g_prefetch = atoi(optarg);
+      if ( (g_prefetch <= 0) || (g_prefetch > PREFETCH_QUEUE) ) {
+	usage( "option '-%c' expects a number of tiles from 1 to %d.\n", opt, PREFETCH_QUEUE);
+      }
+      flags |= F_PREF;
+      break;
+    case 'u':
+      if ( (g_nmaps == 0) || g_maps[g_nmaps-1].patchdir ) {
+	usage( "option '-%c' must follow option '-m' or '-g' and be given once per map.\n", opt);
+      }
+      g_maps[g_nmaps-1].patchdir = optarg;
       break;
     case 's':
       if ( flags & F_STYLE ) {
@@ -967,13 +2429,41 @@ int main( int argc, char **argv )
       g_style = optarg;
       flags |= F_STYLE;
       break;
+    case 'E':
+      if ( flags & F_EXTR ) {
+	usage( "option '%s' can be specified only once.\n", "--extract");
+      }
+      extract = optarg;
+      flags |= F_EXTR;
+      break;
+    case 'O':
+      if ( flags & F_OUT ) {
+	usage( "option '%s' can be specified only once.\n", "--output");
+      }
+      output = optarg;
+      flags |= F_OUT;
+      break;
     default:
       usage("unrecognized option.\n");
     }
   }
 
+  if ( flags & (F_EXTR|F_OUT) ) {
+    if ( !(flags & F_EXTR) || !(flags & F_OUT) ) {
+      usage( "options '%s' and '%s' go together.\n", "--extract", "--output" );
+    }
+    if ( (g_nmaps != 1) || g_maps[0].geojson || g_maps[0].patchdir ) {
+      usage( "option '%s' expects a single map given by '%s'.\n", "--extract", "-m" );
+    }
+    exit( extract_mbtiles( g_maps[0].path, extract, output ) < 0 ? 1 : 0 );
+  }
+
   if ( !(flags & F_MAP) ) {
-    usage( "option '%s' is mandatory.\n", "-m" );
+    // executables made by 'make mbv-bundle' serve their tile pack
+    if ( !pack_bundled() ) {
+      usage( "option '%s' or '%s' is mandatory.\n", "-m", "-g" );
+    }
+    addmap( "bundle=" PACK_BUNDLE );
   }
   if ( !(flags & F_STYLE) ) {
     g_style = "@auto";
@@ -984,8 +2474,64 @@ int main( int argc, char **argv )
   
   serverfd = server(g_port);
 
-  g_sql = mbtiles_open( g_map ); 
-  mbtiles_tiles_json( g_sql, NULL );
+  for( m = 0; m < g_nmaps; ++m ) {
+    map_t *map = g_maps + m;
+    
+    map->src = map->geojson ? source_open_geojson( map->path ) : source_open( map->path );
+    if ( map->src == NULL ) {
+      exit(1);
+    }
+    if ( map->patchdir ) {
+      map->src = map->patch = patch_source( map->src, map->patchdir );
+      if ( map->src == NULL ) {
+	exit(1);
+      }
+    }
+    if ( g_pyramid ) {
+      map->src = pyramid_source( map->src, g_pyramid );
+    }
+    if ( g_overzoom ) {
+      map->src = overzoom_source( map->src, g_overzoom );
+    }
+  }
+
+  // vector tiles only keep the layers drawn by the style
+  if ( !(flags & F_ALL) ) {
+    struct json_object *style = style_object();
+    for( m = 0; m < g_nmaps; ++m ) {
+      source_t *src = g_maps[m].src;
+      g_maps[m].src = layerfilter_source( src, style, g_maps[m].name, m == 0 );
+      g_layerfilter |= (g_maps[m].src != src);
+    }
+    json_object_put( style );
+  }
+
+  for( m = 0; m < g_nmaps; ++m ) {
+    map_t *map = g_maps + m;
+
+    // cache is split evenly between maps
+    map->cache = tilecache_new( TILECACHE_COUNT / g_nmaps, TILECACHE_BYTES / g_nmaps );
+    if ( g_webp ) {
+      // WebP tiles are smaller than source ones
+      map->wcache = tilecache_new( TILECACHE_COUNT / g_nmaps, TILECACHE_BYTES / 4 / g_nmaps );
+    }
+    if ( flags & F_INDEX ) {
+      source_index( map->src );
+      // keep tiles shared by many coordinates in cache
+      pin( map );
+    }
+    source_tiles_json( map->src, NULL );
+    map_range( map );
+  }
+  if ( g_prefetch ) {
+    prefetch_init( g_prefetch );
+  }
+  if ( g_webp ) {
+    g_tfd = transcode_init( g_webp, sysconf( _SC_NPROCESSORS_ONLN ));
+    if ( g_tfd < 0 ) {
+      exit(1);
+    }
+  }
 
   if ( flags & F_EXEC ) {
     char cmd[64];
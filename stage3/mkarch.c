@@ -387,7 +387,8 @@ int dofilehex( FILE *fin, FILE *fout, char *varname )
   if ( d - bufo ) {
     safewrite( fout, bufo, d - bufo );
   }
-  fprintf( fout, "};\n" );
+  // null character ending text members, not counted in size
+  fprintf( fout, "\n0x00};\n" );
   //fprintf( fout, "#include <stdio.h>\n" );
   //fprintf( fout, "int main() { return puts(%s); }\n", varname );
   fflush( fout );
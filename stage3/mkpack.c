@@ -0,0 +1,399 @@
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <math.h>
+
+#include "pack.h"
+#include "sqlut.h"
+
+typedef struct tile_s {
+  uint64_t key;                   // directory key
+  sqlite3_int64 rowid;            // row holding tile data
+} tile_t;
+
+// tiles kept : zoom levels and, when 'bounded', tiles covering bounds
+typedef struct region_s {
+  int minzoom, maxzoom;
+  int bounded;
+  double bounds[4];               // west, south, east, north
+  int x0[30], x1[30], y0[30], y1[30];
+} region_t;
+
+typedef struct blob_s {
+  uint64_t h;                     // content hash, 0 if slot is free
+  uint64_t off;                   // offset in data section
+  uint32_t len;
+} blob_t;
+
+FILE* dofopen (char *name, char *mode)
+{
+  FILE *f;
+  f = fopen( name, mode );
+  if ( !f ) {
+    perror( name );
+    exit(1);
+  }
+  return f;
+}
+
+/* --------------------------------------------------------------------------
+ *  Parses option '-b west,south,east,north'
+ * --------------------------------------------------------------------------*/
+int parse_bounds( char *arg, region_t *r )
+{
+  double *b = r->bounds, lat, n;
+  int z;
+  
+  if ( (sscanf( arg, "%lf,%lf,%lf,%lf", b, b + 1, b + 2, b + 3 ) != 4) ||
+       (b[0] >= b[2]) || (b[1] >= b[3]) || (b[0] < -180) || (b[2] > 180) ||
+       (b[1] < -90) || (b[3] > 90) ) {
+    return 0;
+  }
+  
+  // web mercator tiles, rows are counted from the north
+  for( z = 0; z < 30; ++z ) {
+    n = (double) (1 << z);
+    r->x0[z] = (int) floor( (b[0] + 180.0) / 360.0 * n );
+    r->x1[z] = (int) floor( (b[2] + 180.0) / 360.0 * n );
+    lat = fmin( fmax( b[3], -85.0511 ), 85.0511 ) * M_PI / 180.0;
+    r->y0[z] = (int) floor( (1.0 - asinh( tan( lat )) / M_PI) / 2.0 * n );
+    lat = fmin( fmax( b[1], -85.0511 ), 85.0511 ) * M_PI / 180.0;
+    r->y1[z] = (int) floor( (1.0 - asinh( tan( lat )) / M_PI) / 2.0 * n );
+    if ( r->x0[z] < 0 ) r->x0[z] = 0;
+    if ( r->y0[z] < 0 ) r->y0[z] = 0;
+    if ( r->x1[z] >= n ) r->x1[z] = n - 1;
+    if ( r->y1[z] >= n ) r->y1[z] = n - 1;
+  }
+  r->bounded = 1;
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Tells if XYZ tile is kept
+ * --------------------------------------------------------------------------*/
+int in_region( region_t *r, int z, int x, int y )
+{
+  if ( (z < r->minzoom) || (z > r->maxzoom) ) {
+    return 0;
+  }
+  return !r->bounded || ((x >= r->x0[z]) && (x <= r->x1[z]) && (y >= r->y0[z]) && (y <= r->y1[z]));
+}
+
+int tile_cmp( const void *a, const void *b )
+{
+  uint64_t ka = ((tile_t*) a)->key;
+  uint64_t kb = ((tile_t*) b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+/* --------------------------------------------------------------------------
+ *  Lists tiles of the mbtiles database kept in region, sorted by
+ *  directory key
+ * --------------------------------------------------------------------------*/
+tile_t *list_tiles( sqlite3 *db, char *query, region_t *r, int *ntiles )
+{
+  sqlite3_stmt *stmt;
+  tile_t *tab = NULL;
+  int n = 0, sz = 0, z, x, y;
+  
+  if ( sqlite3_prepare_v2( db, query, -1, &stmt, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    z = sqlite3_column_int( stmt, 0 );
+    x = sqlite3_column_int( stmt, 1 );
+    y = sqlite3_column_int( stmt, 2 );
+    if ( (z < 0) || (z > 29) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+      fprintf( stderr, "Skipping invalid tile %d/%d/%d\n", z, x, y );
+      continue;
+    }
+    y = (1 << z) - 1 - y;  // TMS -> XYZ
+    if ( !in_region( r, z, x, y ) ) {
+      continue;
+    }
+    if ( n == sz ) {
+      sz = sz ? 2*sz : 4096;
+      tab = (tile_t*) realloc( tab, sz * sizeof(tile_t));
+      if ( !tab ) {
+	fputs( "memory allocation error.\n", stderr );
+	exit(1);
+      }
+    }
+    tab[n].key = PACKKEY( z, hilbert( z, x, y ));
+    tab[n].rowid = sqlite3_column_int64( stmt, 3 );
+    n++;
+  }
+  sqlite3_finalize( stmt );
+
+  qsort( tab, n, sizeof(tile_t), tile_cmp );
+  *ntiles = n;
+  return tab;
+}
+
+/* --------------------------------------------------------------------------
+ *  Writes a "key\0value\0" pair, returns its size
+ * --------------------------------------------------------------------------*/
+uint32_t write_pair( FILE *fout, const char *k, const char *v )
+{
+  fwrite( k, 1, strlen(k) + 1, fout );
+  fwrite( v, 1, strlen(v) + 1, fout );
+  return strlen(k) + strlen(v) + 2;
+}
+
+/* --------------------------------------------------------------------------
+ *  Writes metadata table as "key\0value\0" pairs. Zoom levels, bounds
+ *  and center are those of the region when it is restricted.
+ * --------------------------------------------------------------------------*/
+uint32_t write_meta( sqlite3 *db, region_t *r, FILE *fout )
+{
+  sqlite3_stmt *stmt;
+  uint32_t n = 0;
+  const char *k, *v;
+  char buf[128];
+  
+  if ( sqlite3_prepare_v2( db, "SELECT name, value FROM metadata", -1, &stmt, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    k = (const char*) sqlite3_column_text( stmt, 0 );
+    v = (const char*) sqlite3_column_text( stmt, 1 );
+    if ( !k || !v ) continue;
+    if ( (r->minzoom > 0) && !strcmp( k, "minzoom" ) ) continue;
+    if ( (r->maxzoom < 29) && !strcmp( k, "maxzoom" ) ) continue;
+    if ( r->bounded && (!strcmp( k, "bounds" ) || !strcmp( k, "center" )) ) continue;
+    n += write_pair( fout, k, v );
+  }
+  sqlite3_finalize( stmt );
+
+  if ( r->minzoom > 0 ) {
+    snprintf( buf, sizeof(buf), "%d", r->minzoom );
+    n += write_pair( fout, "minzoom", buf );
+  }
+  if ( r->maxzoom < 29 ) {
+    snprintf( buf, sizeof(buf), "%d", r->maxzoom );
+    n += write_pair( fout, "maxzoom", buf );
+  }
+  if ( r->bounded ) {
+    snprintf( buf, sizeof(buf), "%.6f,%.6f,%.6f,%.6f",
+	      r->bounds[0], r->bounds[1], r->bounds[2], r->bounds[3] );
+    n += write_pair( fout, "bounds", buf );
+    snprintf( buf, sizeof(buf), "%.6f,%.6f,%d", (r->bounds[0] + r->bounds[2]) / 2,
+	      (r->bounds[1] + r->bounds[3]) / 2, r->minzoom );
+    n += write_pair( fout, "center", buf );
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Tells if data 'b' of size 'len' is already written at offset 'off'
+ * --------------------------------------------------------------------------*/
+int same_data( FILE *fout, uint64_t off, char *b, uint32_t len )
+{
+  static char *tmp = NULL;
+  static uint32_t tmpsz = 0;
+  
+  if ( len > tmpsz ) {
+    free( tmp );
+    tmpsz = len;
+    tmp = emalloc( tmpsz );
+  }
+  fflush( fout );
+  if ( pread( fileno(fout), tmp, len, off ) != len ) {
+    perror( "pread" );
+    exit(1);
+  }
+  return !memcmp( tmp, b, len );
+}
+
+int usage( char *fmt, ... )
+{
+  FILE *fout = fmt ? stderr : stdout;
+  fprintf( fout, "usage: ");
+  if ( fmt ) {
+    va_list va;
+    va_start(va, fmt );
+    vfprintf( fout, fmt, va ); 
+    va_end(va);
+  }
+  else {
+    fputs( "mkpack -i input.mbtiles -o output.pack [-b west,south,east,north] [-z min-max]\n", fout );
+  }
+
+  fputs( "\t -h                  Prints this help message\n", fout );
+  fputs( "\t -i /path/to/input   input mbtiles file\n", fout );
+  fputs( "\t -o /path/to/output  output tile pack file\n", fout );
+  fputs( "\t -b w,s,e,n          keeps tiles covering these bounds only\n", fout );
+  fputs( "\t -z min-max          keeps these zoom levels only\n", fout );
+
+  exit( fmt ? 1 : 0 );
+}
+
+int main( int argc, char **argv )
+{
+  char *ipath = NULL, *opath = NULL, *table, *query, *buf = NULL;
+  sqlite3 *db;
+  sqlite3_blob *blob = NULL;
+  packhdr_t hdr;
+  packdir_t *dir;
+  blob_t *htab;
+  tile_t *tiles;
+  region_t region = { .minzoom = 0, .maxzoom = 29 };
+  FILE *fout;
+  uint64_t off = 0, h;
+  uint32_t hmask, len, bufsz = 0;
+  int opt, i, n, nblobs = 0;
+  
+  while ((opt = getopt(argc, argv, "hi:o:b:z:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(NULL);
+      break;
+    case 'i':
+      if ( ipath  ) usage( "option '-%c' found more than once.\n", opt );
+      ipath = optarg;
+      break;
+    case 'o':
+      if ( opath ) usage( "option '-%c' found more than once.\n", opt );
+      opath = optarg;
+      break;
+    case 'b':
+      if ( region.bounded ) usage( "option '-%c' found more than once.\n", opt );
+      if ( !parse_bounds( optarg, &region ) ) {
+	usage( "option '-%c' expects west,south,east,north in degrees.\n", opt );
+      }
+      break;
+    case 'z':
+      if ( (sscanf( optarg, "%d-%d", &region.minzoom, &region.maxzoom ) != 2) ||
+	   (region.minzoom < 0) || (region.maxzoom > 29) || (region.minzoom > region.maxzoom) ) {
+	usage( "option '-%c' expects zoom levels as min-max from 0 to 29.\n", opt );
+      }
+      break;
+    default: /* '?' */
+      usage( "unexpected value on command line '%s'.\n", optarg );
+    }
+  }
+  if ( !ipath || !opath ) {
+    usage( "options '-i' and '-o' are mandatory.\n" );
+  }
+
+  if ( sqlite3_open_v2( ipath, &db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  
+  if ( has_table( db, "map" ) && has_table( db, "images" ) ) {
+    table = "images";
+    query = "SELECT map.zoom_level, map.tile_column, map.tile_row, images.rowid "
+      "FROM map JOIN images ON images.tile_id = map.tile_id";
+  }
+  else if ( has_table( db, "tiles" ) ) {
+    table = "tiles";
+    query = "SELECT zoom_level, tile_column, tile_row, rowid FROM tiles";
+  }
+  else {
+    fprintf( stderr, "'%s' : unknown mbtiles schema.\n", ipath );
+    exit(1);
+  }
+  
+  tiles = list_tiles( db, query, &region, &n );
+  printf( "%d tiles found in '%s'\n", n, ipath );
+
+  fout = dofopen( opath, "w+" );
+
+  // metadata follows header
+  memset( &hdr, 0, sizeof(hdr));
+  memcpy( hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+  hdr.ntiles = n;
+  hdr.metaoff = sizeof(hdr);
+  fseek( fout, hdr.metaoff, SEEK_SET );
+  hdr.nmeta = write_meta( db, &region, fout );
+
+  // directory is aligned on 8 bytes, data follows
+  hdr.diroff = (hdr.metaoff + hdr.nmeta + 7) & ~7ULL;
+  hdr.dataoff = hdr.diroff + (uint64_t) n * sizeof(packdir_t);
+  fseek( fout, hdr.dataoff, SEEK_SET );
+  
+  dir = (packdir_t*) emalloc( (n + 1) * sizeof(packdir_t));
+  for( hmask = 1; hmask < 2*n; hmask <<= 1 );
+  htab = (blob_t*) emalloc( hmask * sizeof(blob_t));
+  hmask--;
+
+  // write tile data in directory order, storing duplicates once
+  for( i = 0; i < n; ++i ) {
+    int rc;
+    uint32_t j;
+    
+    if ( blob ) {
+      rc = sqlite3_blob_reopen( blob, tiles[i].rowid );
+    }
+    else {
+      rc = sqlite3_blob_open( db, "main", table, "tile_data", tiles[i].rowid, 0, &blob );
+    }
+    if ( rc != SQLITE_OK ) {
+      fprintf( stderr, "Cannot read tile data : %s\n", sqlite3_errmsg(db));
+      exit(1);
+    }
+    len = sqlite3_blob_bytes( blob );
+    if ( len > bufsz ) {
+      free( buf );
+      bufsz = len;
+      buf = emalloc( bufsz );
+    }
+    if ( sqlite3_blob_read( blob, buf, len, 0 ) != SQLITE_OK ) {
+      fprintf( stderr, "Cannot read tile data : %s\n", sqlite3_errmsg(db));
+      exit(1);
+    }
+
+    h = ((uint64_t) crc32( 0, (Bytef*) buf, len ) << 32) | adler32( 1, (Bytef*) buf, len );
+    if ( h == 0 ) h = 1;
+    for( j = (uint32_t) (h ^ (h >> 29)) & hmask; htab[j].h; j = (j + 1) & hmask ) {
+      if ( (htab[j].h == h) && (htab[j].len == len) &&
+	   same_data( fout, hdr.dataoff + htab[j].off, buf, len ) ) {
+	break;
+      }
+    }
+    if ( htab[j].h == 0 ) {
+      if ( fwrite( buf, 1, len, fout ) != len ) {
+	perror( opath );
+	exit(1);
+      }
+      htab[j].h = h;
+      htab[j].off = off;
+      htab[j].len = len;
+      off += len;
+      nblobs++;
+    }
+    dir[i].key = tiles[i].key;
+    dir[i].off = htab[j].off;
+    dir[i].len = len;
+  }
+  hdr.datalen = off;
+
+  fseek( fout, hdr.diroff, SEEK_SET );
+  fwrite( dir, sizeof(packdir_t), n, fout );
+  fseek( fout, 0, SEEK_SET );
+  fwrite( &hdr, sizeof(hdr), 1, fout );
+  if ( fclose( fout ) ) {
+    perror( opath );
+    exit(1);
+  }
+  
+  printf( "%d tiles, %d distinct blobs, %llu bytes of tile data written to '%s'\n",
+	  n, nblobs, (unsigned long long) off, opath );
+
+  if ( blob ) sqlite3_blob_close( blob );
+  sqlite3_close( db );
+  free( tiles );
+  free( dir );
+  free( htab );
+  free( buf );
+  return 0;
+}
@@ -0,0 +1,397 @@
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "raster.h"
+#include "sqlut.h"
+
+// parent tiles made between two writes, per thread
+#define CHUNK 256
+
+typedef struct job_s {
+  int x, y;                       // parent tile, TMS row
+  char *data;                     // encoded parent, NULL if no child
+  int len;
+} job_t;
+
+typedef struct worker_s {
+  pthread_t th;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;             // reads a child tile
+  int z;                          // zoom level of parents
+  int nchild;
+} worker_t;
+
+// jobs of current chunk, shared by workers
+static job_t *g_jobs;
+static int g_njobs, g_next;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* --------------------------------------------------------------------------
+ *  Opens database 'path', the tileset being completed is attached as
+ *  'src' when tiles are written to a separate file. Both are then
+ *  seen through the 'pyr' temporary view.
+ * --------------------------------------------------------------------------*/
+sqlite3 *dbopen( char *path, int flags, char *ipath )
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+
+  if ( sqlite3_open_v2( path, &db, flags, NULL ) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  sqlite3_busy_timeout( db, 10000 );
+  if ( ipath ) {
+    stmt = prepare( db, "ATTACH DATABASE ?1 AS src" );
+    sqlite3_bind_text( stmt, 1, ipath, -1, SQLITE_STATIC );
+    if ( sqlite3_step( stmt ) != SQLITE_DONE ) {
+      fprintf(stderr, "Cannot attach database: %s\n", sqlite3_errmsg(db));
+      exit(1);
+    }
+    sqlite3_finalize( stmt );
+    exec( db, "CREATE TEMP VIEW pyr AS "
+	  "SELECT zoom_level, tile_column, tile_row, tile_data FROM main.tiles UNION ALL "
+	  "SELECT zoom_level, tile_column, tile_row, tile_data FROM src.tiles" );
+  }
+  else {
+    exec( db, "CREATE TEMP VIEW pyr AS "
+	  "SELECT zoom_level, tile_column, tile_row, tile_data FROM main.tiles" );
+  }
+  return db;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads and decodes child tile z/x/y (TMS row), returns NULL if missing
+ * --------------------------------------------------------------------------*/
+image_t *read_child( worker_t *w, int z, int x, int y, image_t *img, int *type )
+{
+  const void *data;
+  int len;
+  image_t *res = NULL;
+
+  sqlite3_bind_int( w->stmt, 1, z );
+  sqlite3_bind_int( w->stmt, 2, x );
+  sqlite3_bind_int( w->stmt, 3, y );
+  if ( sqlite3_step( w->stmt ) == SQLITE_ROW ) {
+    data = sqlite3_column_blob( w->stmt, 0 );
+    len = sqlite3_column_bytes( w->stmt, 0 );
+    if ( data && len ) {
+      if ( *type == RASTER_UNKNOWN ) {
+	*type = raster_type( (char*) data, len );
+      }
+      if ( raster_decode( (char*) data, len, img ) == 0 ) {
+	res = img;
+	w->nchild++;
+      }
+      else {
+	fprintf( stderr, "Cannot decode tile %d/%d/%d\n", z, x, y );
+      }
+    }
+  }
+  sqlite3_reset( w->stmt );
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  Worker thread : makes parents of current chunk until none is left
+ * --------------------------------------------------------------------------*/
+void *work( void *arg )
+{
+  worker_t *w = (worker_t*) arg;
+  image_t child[4], *pc[4], img;
+  job_t *j;
+  int i, type;
+
+  for( ;; ) {
+    pthread_mutex_lock( &g_lock );
+    j = (g_next < g_njobs) ? g_jobs + g_next++ : NULL;
+    pthread_mutex_unlock( &g_lock );
+    if ( j == NULL ) {
+      break;
+    }
+
+    // top left child is on the north side, TMS rows grow to the north
+    type = RASTER_UNKNOWN;
+    memset( child, 0, sizeof(child));
+    for( i = 0; i < 4; ++i ) {
+      pc[i] = read_child( w, w->z + 1, 2*j->x + (i & 1), 2*j->y + 1 - (i >> 1), child + i, &type );
+    }
+    memset( &img, 0, sizeof(img));
+    if ( raster_reduce( pc, &img ) == 0 ) {
+      j->data = raster_encode( &img, type, &j->len );
+    }
+    else if ( pc[0] || pc[1] || pc[2] || pc[3] ) {
+      fprintf( stderr, "Children of tile %d/%d/%d differ in size\n", w->z, j->x, j->y );
+    }
+    raster_free( &img );
+    for( i = 0; i < 4; ++i ) {
+      raster_free( child + i );
+    }
+  }
+  return NULL;
+}
+
+int usage( char *fmt, ... )
+{
+  FILE *fout = fmt ? stderr : stdout;
+  fprintf( fout, "usage: ");
+  if ( fmt ) {
+    va_list va;
+    va_start(va, fmt );
+    vfprintf( fout, fmt, va );
+    va_end(va);
+  }
+  else {
+    fputs( "mkpyramid -i input.mbtiles [-o output.mbtiles] [-z zoom] [-j threads]\n", fout );
+  }
+
+  fputs( "\t -h                  Prints this help message\n", fout );
+  fputs( "\t -i /path/to/input   raster mbtiles file to complete\n", fout );
+  fputs( "\t -o /path/to/output  writes made tiles to this mbtiles file\n", fout );
+  fputs( "\t                     instead of input file\n", fout );
+  fputs( "\t -z zoom             lowest zoom level to make (default 0)\n", fout );
+  fputs( "\t -j threads          number of threads (default number of cpus)\n", fout );
+
+  exit( fmt ? 1 : 0 );
+}
+
+int main( int argc, char **argv )
+{
+  char *ipath = NULL, *opath = NULL, *wpath, *attach, buf[32];
+  sqlite3 *db;
+  sqlite3_stmt *list, *ins, *del, *img = NULL, *meta;
+  worker_t *workers;
+  struct timespec t0, t1;
+  int opt, i, k, n, sz, z, minz, lowz = 0, nth = 0, normalized = 0, total = 0;
+  int *parents;
+
+  while ((opt = getopt(argc, argv, "hi:o:z:j:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(NULL);
+      break;
+    case 'i':
+      if ( ipath  ) usage( "option '-%c' found more than once.\n", opt );
+      ipath = optarg;
+      break;
+    case 'o':
+      if ( opath ) usage( "option '-%c' found more than once.\n", opt );
+      opath = optarg;
+      break;
+    case 'z':
+      lowz = atoi( optarg );
+      if ( (lowz < 0) || (lowz > 28) ) usage( "option '-%c' expects a zoom level.\n", opt );
+      break;
+    case 'j':
+      nth = atoi( optarg );
+      if ( nth <= 0 ) usage( "option '-%c' expects a number of threads.\n", opt );
+      break;
+    default: /* '?' */
+      usage( "unexpected value on command line '%s'.\n", optarg );
+    }
+  }
+  if ( !ipath ) {
+    usage( "option '-i' is mandatory.\n" );
+  }
+  if ( nth == 0 ) {
+    nth = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( nth <= 0 ) nth = 1;
+  }
+
+  // made tiles are written to input file or to a separate flat mbtiles
+  if ( opath ) {
+    if ( sqlite3_open_v2( opath, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL ) != SQLITE_OK ) {
+      fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+      exit(1);
+    }
+    exec( db, "CREATE TABLE IF NOT EXISTS metadata (name text, value text);"
+	  "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, "
+	  "tile_row integer, tile_data blob);"
+	  "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);" );
+    sqlite3_close( db );
+    wpath = opath;
+    attach = ipath;
+  }
+  else {
+    wpath = ipath;
+    attach = NULL;
+  }
+  db = dbopen( wpath, SQLITE_OPEN_READWRITE, attach );
+
+  if ( opath ) {
+    exec( db, "DELETE FROM metadata;"
+	  "INSERT INTO metadata (name, value) SELECT name, value FROM src.metadata" );
+    del = prepare( db, "DELETE FROM tiles WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3" );
+    ins = prepare( db, "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) "
+		   "VALUES (?1, ?2, ?3, ?4)" );
+  }
+  else if ( has_table( db, "map" ) && has_table( db, "images" ) ) {
+    normalized = 1;
+    del = prepare( db, "DELETE FROM map WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3" );
+    img = prepare( db, "INSERT OR REPLACE INTO images (tile_data, tile_id) VALUES (?4, ?5)" );
+    ins = prepare( db, "INSERT INTO map (zoom_level, tile_column, tile_row, tile_id) "
+		   "VALUES (?1, ?2, ?3, ?5)" );
+  }
+  else if ( has_table( db, "tiles" ) ) {
+    del = prepare( db, "DELETE FROM tiles WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3" );
+    ins = prepare( db, "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) "
+		   "VALUES (?1, ?2, ?3, ?4)" );
+  }
+  else {
+    fprintf( stderr, "'%s' : unknown mbtiles schema.\n", ipath );
+    exit(1);
+  }
+
+  list = prepare( db, "SELECT MIN(zoom_level) FROM pyr" );
+  if ( (sqlite3_step( list ) != SQLITE_ROW) || (sqlite3_column_type( list, 0 ) == SQLITE_NULL) ) {
+    fprintf( stderr, "'%s' : no tiles found.\n", ipath );
+    exit(1);
+  }
+  minz = sqlite3_column_int( list, 0 );
+  sqlite3_finalize( list );
+  if ( minz <= lowz ) {
+    printf( "'%s' already has tiles at zoom level %d\n", ipath, minz );
+    return 0;
+  }
+
+  // each worker has its own read only connection
+  workers = (worker_t*) emalloc( nth * sizeof(worker_t));
+  for( i = 0; i < nth; ++i ) {
+    workers[i].db = dbopen( wpath, SQLITE_OPEN_READONLY, attach );
+    workers[i].stmt = prepare( workers[i].db, "SELECT tile_data FROM pyr "
+			       "WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3 LIMIT 1" );
+  }
+  g_jobs = (job_t*) emalloc( CHUNK * nth * sizeof(job_t));
+  list = prepare( db, "SELECT DISTINCT tile_column / 2, tile_row / 2 FROM pyr WHERE zoom_level = ?1" );
+
+  for( z = minz - 1; z >= lowz; --z ) {
+    int nlevel = 0, nchild = 0;
+    double dt;
+
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+
+    // parents of level z+1 tiles
+    parents = NULL;
+    n = sz = 0;
+    sqlite3_bind_int( list, 1, z + 1 );
+    while( sqlite3_step( list ) == SQLITE_ROW ) {
+      if ( n == sz ) {
+	sz = sz ? 2*sz : 4096;
+	parents = (int*) realloc( parents, 2 * sz * sizeof(int));
+	if ( !parents ) {
+	  fputs( "memory allocation error.\n", stderr );
+	  exit(1);
+	}
+      }
+      parents[2*n] = sqlite3_column_int( list, 0 );
+      parents[2*n+1] = sqlite3_column_int( list, 1 );
+      n++;
+    }
+    sqlite3_reset( list );
+
+    for( k = 0; k < n; k += CHUNK * nth ) {
+      g_njobs = (n - k < CHUNK * nth) ? n - k : CHUNK * nth;
+      g_next = 0;
+      for( i = 0; i < g_njobs; ++i ) {
+	g_jobs[i].x = parents[2*(k+i)];
+	g_jobs[i].y = parents[2*(k+i)+1];
+	g_jobs[i].data = NULL;
+      }
+      for( i = 0; i < nth; ++i ) {
+	workers[i].z = z;
+	workers[i].nchild = 0;
+	if ( pthread_create( &workers[i].th, NULL, work, workers + i ) ) {
+	  perror( "pthread_create" );
+	  exit(1);
+	}
+      }
+      for( i = 0; i < nth; ++i ) {
+	pthread_join( workers[i].th, NULL );
+	nchild += workers[i].nchild;
+      }
+
+      // workers are idle, write made tiles in a single transaction
+      exec( db, "BEGIN" );
+      for( i = 0; i < g_njobs; ++i ) {
+	job_t *j = g_jobs + i;
+	if ( j->data == NULL ) continue;
+
+	sqlite3_bind_int( del, 1, z );
+	sqlite3_bind_int( del, 2, j->x );
+	sqlite3_bind_int( del, 3, j->y );
+	sqlite3_step( del );
+	sqlite3_reset( del );
+
+	snprintf( buf, sizeof(buf), "pyramid-%d-%d-%d", z, j->x, j->y );
+	if ( normalized ) {
+	  sqlite3_bind_blob( img, 4, j->data, j->len, SQLITE_STATIC );
+	  sqlite3_bind_text( img, 5, buf, -1, SQLITE_STATIC );
+	  if ( sqlite3_step( img ) != SQLITE_DONE ) {
+	    fprintf(stderr, "Cannot write tile: %s\n", sqlite3_errmsg(db));
+	    exit(1);
+	  }
+	  sqlite3_reset( img );
+	}
+	else {
+	  sqlite3_bind_blob( ins, 4, j->data, j->len, SQLITE_STATIC );
+	}
+	sqlite3_bind_int( ins, 1, z );
+	sqlite3_bind_int( ins, 2, j->x );
+	sqlite3_bind_int( ins, 3, j->y );
+	if ( normalized ) {
+	  sqlite3_bind_text( ins, 5, buf, -1, SQLITE_STATIC );
+	}
+	if ( sqlite3_step( ins ) != SQLITE_DONE ) {
+	  fprintf(stderr, "Cannot write tile: %s\n", sqlite3_errmsg(db));
+	  exit(1);
+	}
+	sqlite3_reset( ins );
+	free( j->data );
+	nlevel++;
+      }
+      exec( db, "COMMIT" );
+    }
+    free( parents );
+
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    printf( "zoom %2d : %d tiles made from %d tiles in %.2f s (%.0f tiles/s)\n",
+	    z, nlevel, nchild, dt, (dt > 0) ? nlevel / dt : 0.0 );
+    total += nlevel;
+  }
+
+  // new min zoom level
+  snprintf( buf, sizeof(buf), "%d", lowz );
+  meta = prepare( db, "UPDATE metadata SET value = ?1 WHERE name = 'minzoom'" );
+  sqlite3_bind_text( meta, 1, buf, -1, SQLITE_STATIC );
+  sqlite3_step( meta );
+  sqlite3_finalize( meta );
+  if ( sqlite3_changes( db ) == 0 ) {
+    meta = prepare( db, "INSERT INTO metadata (name, value) VALUES ('minzoom', ?1)" );
+    sqlite3_bind_text( meta, 1, buf, -1, SQLITE_STATIC );
+    sqlite3_step( meta );
+    sqlite3_finalize( meta );
+  }
+
+  printf( "%d tiles written to '%s' using %d threads\n", total, wpath, nth );
+
+  for( i = 0; i < nth; ++i ) {
+    sqlite3_finalize( workers[i].stmt );
+    sqlite3_close( workers[i].db );
+  }
+  sqlite3_finalize( list );
+  sqlite3_finalize( ins );
+  sqlite3_finalize( del );
+  if ( img ) sqlite3_finalize( img );
+  sqlite3_close( db );
+  free( workers );
+  free( g_jobs );
+  return 0;
+}
@@ -0,0 +1,477 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+
+#include <json.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#include "mosaic.h"
+#include "source.h"
+#include "mbtiles.h"
+
+extern void logger(const char *fmt, ...);
+
+// R-tree node fanout
+#define FANOUT 8
+
+// web mercator latitude limit
+#define MAXLAT 85.0511287798
+
+/* --------------------------------------------------------------------------
+ *  File of the mosaic
+ *  Bounds are stored in web mercator coordinates scaled to [0,1], with
+ *  y growing southward like tile rows, so that a tile x/y at zoom z
+ *  covers [x/2^z, (x+1)/2^z] x [y/2^z, (y+1)/2^z].
+ * --------------------------------------------------------------------------*/
+typedef struct mfile_s {
+  char *path;
+  double box[4];              // minx, miny, maxx, maxy
+  int minzoom, maxzoom;
+  int bad;                    // failed to open
+  source_t *src;              // NULL when closed
+  struct mfile_s *prev, *next;  // open files, most recently used first
+} mfile_t;
+
+/* --------------------------------------------------------------------------
+ *  R-tree node, packed with the sort-tile-recursive algorithm
+ *  Children are child[first] to child[first+count-1], they are file
+ *  indexes for leaves and node indexes otherwise.
+ * --------------------------------------------------------------------------*/
+typedef struct mnode_s {
+  double box[4];
+  int minzoom, maxzoom;
+  int leaf;
+  int first, count;
+} mnode_t;
+
+// item being packed in the R-tree
+typedef struct ritem_s {
+  double box[4];
+  int minzoom, maxzoom;
+  int id;
+} ritem_t;
+
+typedef struct mosaic_s {
+  mfile_t *files;
+  int nfiles;
+  mnode_t *nodes;
+  int nnodes, root;
+  int *child;
+  int nchild;
+  int *stack, *hits;          // R-tree query work arrays
+  mfile_t *mru, *lru;         // open files
+  int nopen;
+  struct json_object *tiles;  // tiles.json object
+  char *tiles_json;
+  int tjlen;
+} mosaic_t;
+
+/* --------------------------------------------------------------------------
+ *  Web mercator coordinates in [0,1] of longitude / latitude
+ * --------------------------------------------------------------------------*/
+static double lon2x( double lon )
+{
+  return (lon + 180.0) / 360.0;
+}
+
+static double lat2y( double lat )
+{
+  if ( lat > MAXLAT ) lat = MAXLAT;
+  if ( lat < -MAXLAT ) lat = -MAXLAT;
+  lat *= M_PI / 180.0;
+  return (1.0 - log( tan(lat) + 1.0 / cos(lat) ) / M_PI) / 2.0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Comparison of R-tree items along x and y
+ * --------------------------------------------------------------------------*/
+static int ritem_cmpx( const void *a, const void *b )
+{
+  const ritem_t *ra = (const ritem_t*) a, *rb = (const ritem_t*) b;
+  double ca = ra->box[0] + ra->box[2], cb = rb->box[0] + rb->box[2];
+  return (ca > cb) - (ca < cb);
+}
+
+static int ritem_cmpy( const void *a, const void *b )
+{
+  const ritem_t *ra = (const ritem_t*) a, *rb = (const ritem_t*) b;
+  double ca = ra->box[1] + ra->box[3], cb = rb->box[1] + rb->box[3];
+  return (ca > cb) - (ca < cb);
+}
+
+/* --------------------------------------------------------------------------
+ *  Packs 'n' items in nodes of one R-tree level
+ *  Items are sorted in vertical slices, then by y within each slice and
+ *  grouped by FANOUT. Items are replaced by the created nodes, whose
+ *  number is returned.
+ * --------------------------------------------------------------------------*/
+static int mosaic_pack( mosaic_t *m, ritem_t *it, int n, int leaf )
+{
+  int p = (n + FANOUT - 1) / FANOUT;
+  int s = (int) ceil( sqrt( (double) p ));
+  int i, j, k, slice = s * FANOUT, nn = 0;
+
+  qsort( it, n, sizeof(ritem_t), ritem_cmpx );
+  for( i = 0; i < n; i += slice ) {
+    qsort( it + i, (n - i < slice) ? n - i : slice, sizeof(ritem_t), ritem_cmpy );
+  }
+
+  for( i = 0; i < n; i += FANOUT ) {
+    mnode_t *nd = m->nodes + m->nnodes;
+
+    nd->leaf = leaf;
+    nd->first = m->nchild;
+    nd->count = (n - i < FANOUT) ? n - i : FANOUT;
+    memcpy( nd->box, it[i].box, sizeof(nd->box) );
+    nd->minzoom = it[i].minzoom;
+    nd->maxzoom = it[i].maxzoom;
+    for( j = i; j < i + nd->count; ++j ) {
+      for( k = 0; k < 2; ++k ) {
+	if ( it[j].box[k] < nd->box[k] ) nd->box[k] = it[j].box[k];
+	if ( it[j].box[k+2] > nd->box[k+2] ) nd->box[k+2] = it[j].box[k+2];
+      }
+      if ( it[j].minzoom < nd->minzoom ) nd->minzoom = it[j].minzoom;
+      if ( it[j].maxzoom > nd->maxzoom ) nd->maxzoom = it[j].maxzoom;
+      m->child[m->nchild++] = it[j].id;
+    }
+
+    // node becomes an item of next level, 'nn <= i' so it is safe
+    memcpy( it[nn].box, nd->box, sizeof(nd->box) );
+    it[nn].minzoom = nd->minzoom;
+    it[nn].maxzoom = nd->maxzoom;
+    it[nn].id = m->nnodes++;
+    nn++;
+  }
+  return nn;
+}
+
+/* --------------------------------------------------------------------------
+ *  Builds the R-tree over the files of the mosaic
+ * --------------------------------------------------------------------------*/
+static void mosaic_rtree( mosaic_t *m )
+{
+  ritem_t *it;
+  int i, n = m->nfiles, leaf = 1;
+
+  // a tree with fanout >= 2 has less nodes than leaves
+  m->nodes = (mnode_t*) calloc( 2 * n + 1, sizeof(mnode_t));
+  m->child = (int*) calloc( 3 * n + 1, sizeof(int));
+  m->stack = (int*) calloc( 2 * n + 1, sizeof(int));
+  m->hits = (int*) calloc( n, sizeof(int));
+  it = (ritem_t*) calloc( n, sizeof(ritem_t));
+  if ( !m->nodes || !m->child || !m->stack || !m->hits || !it ) {
+    fputs( "mosaic: memory allocation error.\n", stderr );
+    exit(1);
+  }
+
+  for( i = 0; i < n; ++i ) {
+    memcpy( it[i].box, m->files[i].box, sizeof(it[i].box) );
+    it[i].minzoom = m->files[i].minzoom;
+    it[i].maxzoom = m->files[i].maxzoom;
+    it[i].id = i;
+  }
+  do {
+    n = mosaic_pack( m, it, n, leaf );
+    leaf = 0;
+  } while( n > 1 );
+  m->root = m->nnodes - 1;
+
+  free( it );
+}
+
+/* --------------------------------------------------------------------------
+ *  Compare file indexes
+ * --------------------------------------------------------------------------*/
+static int int_cmp( const void *a, const void *b )
+{
+  return *(const int*) a - *(const int*) b;
+}
+
+/* --------------------------------------------------------------------------
+ *  Finds files covering 'box' at zoom level z, they are returned
+ *  in name order in m->hits
+ * --------------------------------------------------------------------------*/
+static int mosaic_query( mosaic_t *m, int z, double *box )
+{
+  int sp = 0, nh = 0, i, id;
+  mnode_t *nd;
+
+  m->stack[sp++] = m->root;
+  while( sp > 0 ) {
+    nd = m->nodes + m->stack[--sp];
+    if ( (z < nd->minzoom) || (z > nd->maxzoom) ||
+	 (box[0] >= nd->box[2]) || (box[2] <= nd->box[0]) ||
+	 (box[1] >= nd->box[3]) || (box[3] <= nd->box[1]) ) {
+      continue;
+    }
+    for( i = 0; i < nd->count; ++i ) {
+      id = m->child[nd->first + i];
+      if ( nd->leaf ) {
+	mfile_t *f = m->files + id;
+	if ( (z >= f->minzoom) && (z <= f->maxzoom) &&
+	     (box[0] < f->box[2]) && (box[2] > f->box[0]) &&
+	     (box[1] < f->box[3]) && (box[3] > f->box[1]) ) {
+	  m->hits[nh++] = id;
+	}
+      }
+      else {
+	m->stack[sp++] = id;
+      }
+    }
+  }
+  if ( nh > 1 ) {
+    qsort( m->hits, nh, sizeof(int), int_cmp );
+  }
+  return nh;
+}
+
+/* --------------------------------------------------------------------------
+ *  Open files list management
+ * --------------------------------------------------------------------------*/
+static void mosaic_unlink( mosaic_t *m, mfile_t *f )
+{
+  if ( f->prev ) f->prev->next = f->next; else m->mru = f->next;
+  if ( f->next ) f->next->prev = f->prev; else m->lru = f->prev;
+  f->prev = f->next = NULL;
+}
+
+static void mosaic_link( mosaic_t *m, mfile_t *f )
+{
+  f->prev = NULL;
+  f->next = m->mru;
+  if ( m->mru ) m->mru->prev = f; else m->lru = f;
+  m->mru = f;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns source of file, opening it if needed. When too many files
+ *  are open, the least recently used one is closed.
+ * --------------------------------------------------------------------------*/
+static source_t *mosaic_source( mosaic_t *m, mfile_t *f )
+{
+  if ( f->src ) {
+    if ( m->mru != f ) {
+      mosaic_unlink( m, f );
+      mosaic_link( m, f );
+    }
+    return f->src;
+  }
+  if ( f->bad ) {
+    return NULL;
+  }
+
+  if ( m->nopen >= MOSAIC_MAXOPEN ) {
+    mfile_t *l = m->lru;
+    logger( "mosaic: closing '%s'\n", l->path );
+    mosaic_unlink( m, l );
+    source_close( l->src );
+    l->src = NULL;
+    m->nopen--;
+  }
+
+  logger( "mosaic: opening '%s'\n", f->path );
+  f->src = source_open( f->path );
+  if ( f->src == NULL ) {
+    f->bad = 1;
+    return NULL;
+  }
+  mosaic_link( m, f );
+  m->nopen++;
+  return f->src;
+}
+
+/* --------------------------------------------------------------------------
+ *  Selects tile files when scanning directory
+ * --------------------------------------------------------------------------*/
+static int mosaic_filter( const struct dirent *d )
+{
+  char *ext = strrchr( d->d_name, '.' );
+  if ( (ext == NULL) || (d->d_name[0] == '.') ) return 0;
+  return !strcmp( ext, ".mbtiles" ) || !strcmp( ext, ".pmtiles" ) || !strcmp( ext, ".pack" );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads bounds and zoom range of a file from its tiles.json and merges
+ *  it into the tiles.json of the mosaic
+ * --------------------------------------------------------------------------*/
+static int mosaic_add( mosaic_t *m, mfile_t *f )
+{
+  struct json_object *tj, *v;
+  enum json_tokener_error error;
+  double b[4] = { -180.0, -MAXLAT, 180.0, MAXLAT };
+  source_t *src;
+  int i;
+
+  src = source_open( f->path );
+  if ( src == NULL ) {
+    return -1;
+  }
+  tj = json_tokener_parse_verbose( source_tiles_json( src, NULL ), &error );
+  source_close( src );
+  if ( error != json_tokener_success ) {
+    fprintf( stderr, "%s: failed to parse tiles.json: %s\n",
+	     f->path, json_tokener_error_desc( error ));
+    return -1;
+  }
+
+  if ( (json_object_object_get_ex( tj, "bounds", &v ) == TRUE) &&
+       (json_object_array_length( v ) == 4) ) {
+    for( i = 0; i < 4; ++i ) {
+      b[i] = json_object_get_double( json_object_array_get_idx( v, i ));
+    }
+  }
+  f->box[0] = lon2x( b[0] );
+  f->box[1] = lat2y( b[3] );
+  f->box[2] = lon2x( b[2] );
+  f->box[3] = lat2y( b[1] );
+  f->minzoom = 0;
+  f->maxzoom = 30;
+  if ( json_object_object_get_ex( tj, "minzoom", &v ) == TRUE ) {
+    f->minzoom = json_object_get_int( v );
+  }
+  if ( json_object_object_get_ex( tj, "maxzoom", &v ) == TRUE ) {
+    f->maxzoom = json_object_get_int( v );
+  }
+  logger( "mosaic: '%s' zoom %d-%d bounds %g,%g,%g,%g\n",
+	  f->path, f->minzoom, f->maxzoom, b[0], b[1], b[2], b[3] );
+
+  mbtiles_meta_merge( m->tiles, tj );
+
+  json_object_put( tj );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Open the mosaic of tile files of directory 'path'
+ * --------------------------------------------------------------------------*/
+void *mosaic_open( char *path )
+{
+  struct dirent **ents;
+  mosaic_t *m;
+  char *name;
+  int i, n;
+
+  n = scandir( path, &ents, mosaic_filter, alphasort );
+  if ( n < 0 ) {
+    perror( path );
+    return NULL;
+  }
+
+  m = (mosaic_t*) calloc( 1, sizeof(mosaic_t));
+  if ( m ) m->files = (mfile_t*) calloc( n + 1, sizeof(mfile_t));
+  if ( (m == NULL) || (m->files == NULL) ) {
+    fputs( "mosaic: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  m->tiles = mbtiles_meta_new();
+  name = strrchr( path, '/' );
+  json_object_object_add( m->tiles, "name", json_object_new_string( name && name[1] ? name + 1 : path ));
+
+  for( i = 0; i < n; ++i ) {
+    mfile_t *f = m->files + m->nfiles;
+    f->path = (char*) malloc( strlen(path) + strlen(ents[i]->d_name) + 2 );
+    if ( f->path == NULL ) {
+      fputs( "mosaic: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    sprintf( f->path, "%s/%s", path, ents[i]->d_name );
+    free( ents[i] );
+    if ( mosaic_add( m, f ) < 0 ) {
+      fprintf( stderr, "mosaic: skipping '%s'\n", f->path );
+      free( f->path );
+      continue;
+    }
+    m->nfiles++;
+  }
+  free( ents );
+
+  if ( m->nfiles == 0 ) {
+    fprintf( stderr, "No tile file found in '%s'.\n", path );
+    json_object_put( m->tiles );
+    free( m->files );
+    free( m );
+    return NULL;
+  }
+
+  mosaic_rtree( m );
+  logger( "mosaic '%s' : %d files, %d R-tree nodes\n", path, m->nfiles, m->nnodes );
+  return (void*) m;
+}
+
+/* --------------------------------------------------------------------------
+ *  Close mosaic and its open files
+ * --------------------------------------------------------------------------*/
+void mosaic_close( void *h )
+{
+  mosaic_t *m = (mosaic_t*) h;
+  int i;
+
+  if ( m == NULL ) return;
+  for( i = 0; i < m->nfiles; ++i ) {
+    source_close( m->files[i].src );
+    free( m->files[i].path );
+  }
+  json_object_put( m->tiles );
+  free( m->files );
+  free( m->nodes );
+  free( m->child );
+  free( m->stack );
+  free( m->hits );
+  free( m );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile from the first file covering it which holds the tile
+ * --------------------------------------------------------------------------*/
+char *mosaic_read( void *h, int z, int x, int y, int *len )
+{
+  mosaic_t *m = (mosaic_t*) h;
+  source_t *src;
+  char *data;
+  double box[4], n;
+  int i, k;
+
+  if ( (z < 0) || (z > 29) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+    return NULL;
+  }
+  n = (double) (1 << z);
+  box[0] = x / n;
+  box[1] = y / n;
+  box[2] = (x + 1) / n;
+  box[3] = (y + 1) / n;
+
+  k = mosaic_query( m, z, box );
+  for( i = 0; i < k; ++i ) {
+    src = mosaic_source( m, m->files + m->hits[i] );
+    if ( src == NULL ) {
+      continue;
+    }
+    data = source_read_quiet( src, z, x, y, len );
+    if ( data && (*len > 0) ) {
+      return data;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' merging files properties
+ * --------------------------------------------------------------------------*/
+char *mosaic_tiles_json( void *h, int *len )
+{
+  mosaic_t *m = (mosaic_t*) h;
+  if ( m->tiles_json == NULL ) {
+    m->tiles_json = mbtiles_meta_json( m->tiles, &m->tjlen );
+  }
+  if ( len != NULL ) {
+    *len = m->tjlen;
+  }
+  return m->tiles_json;
+}
@@ -0,0 +1,20 @@
+#ifndef __MOSAIC_H__
+#define __MOSAIC_H__
+
+#include <stdint.h>
+
+/* --------------------------------------------------------------------------
+ *  Mosaic of tile files stored in a directory. Each tile request is
+ *  routed to the files whose bounds and zoom range cover the tile, the
+ *  first file (in name order) holding the tile wins.
+ * --------------------------------------------------------------------------*/
+
+// max number of files kept open at the same time
+#define MOSAIC_MAXOPEN 32
+
+void *mosaic_open( char *path );
+void  mosaic_close( void *h );
+char *mosaic_read( void *h, int z, int x, int y, int *len );
+char *mosaic_tiles_json( void *h, int *len );
+
+#endif
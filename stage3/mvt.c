@@ -0,0 +1,897 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+
+#include "mvt.h"
+
+/* --------------------------------------------------------------------------
+ *  Makes room for 'len' more bytes in buffer
+ * --------------------------------------------------------------------------*/
+void mvt_reserve( mvtbuf_t *b, int len )
+{
+  if ( b->len + len > b->size ) {
+    int sz = b->size ? b->size : 4096;
+    while( sz < b->len + len ) sz *= 2;
+    b->data = (char*) realloc( b->data, sz );
+    if ( b->data == NULL ) {
+      fputs( "mvt: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    b->size = sz;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Release buffer memory
+ * --------------------------------------------------------------------------*/
+void mvt_free( mvtbuf_t *b )
+{
+  free( b->data );
+  b->data = NULL;
+  b->len = b->size = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Appends tile data to buffer, gzip compressed data is inflated.
+ *  Concatenated gzip members are all inflated.
+ *  Returns 0 on success, -1 on error.
+ * --------------------------------------------------------------------------*/
+int mvt_append( mvtbuf_t *b, char *data, int len )
+{
+  z_stream zs;
+  int rc;
+
+  if ( !MVT_ISGZIP( data, len ) ) {
+    mvt_reserve( b, len );
+    memcpy( b->data + b->len, data, len );
+    b->len += len;
+    return 0;
+  }
+
+  memset( &zs, 0, sizeof(zs));
+  if ( inflateInit2( &zs, 16 + MAX_WBITS ) != Z_OK ) {
+    fprintf( stderr, "mvt: inflateInit2() failed.\n" );
+    return -1;
+  }
+  zs.next_in = (Bytef*) data;
+  zs.avail_in = len;
+  do {
+    mvt_reserve( b, 4 * len + 256 );
+    zs.next_out = (Bytef*) b->data + b->len;
+    zs.avail_out = b->size - b->len;
+    rc = inflate( &zs, Z_NO_FLUSH );
+    b->len = b->size - zs.avail_out;
+    if ( (rc == Z_STREAM_END) && (zs.avail_in > 0) ) {
+      // next gzip member
+      rc = inflateReset( &zs );
+    }
+  } while( rc == Z_OK );
+  inflateEnd( &zs );
+  
+  if ( rc != Z_STREAM_END ) {
+    fprintf( stderr, "mvt: failed to inflate tile (%d).\n", rc );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Compress data into 'dst' as a single gzip member
+ *  Returns 0 on success, -1 on error.
+ * --------------------------------------------------------------------------*/
+int mvt_gzip( mvtbuf_t *dst, char *data, int len, int level )
+{
+  z_stream zs;
+  int rc;
+
+  memset( &zs, 0, sizeof(zs));
+  if ( deflateInit2( &zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+    fprintf( stderr, "mvt: deflateInit2() failed.\n" );
+    return -1;
+  }
+  dst->len = 0;
+  mvt_reserve( dst, deflateBound( &zs, len ));
+  zs.next_in = (Bytef*) data;
+  zs.avail_in = len;
+  zs.next_out = (Bytef*) dst->data;
+  zs.avail_out = dst->size;
+  rc = deflate( &zs, Z_FINISH );
+  dst->len = zs.total_out;
+  deflateEnd( &zs );
+
+  if ( rc != Z_STREAM_END ) {
+    fprintf( stderr, "mvt: failed to compress tile (%d).\n", rc );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Grows array 'p' of '*sz' elements of 'esz' bytes to hold 'n' elements
+ * --------------------------------------------------------------------------*/
+static void *mvt_grow( void *p, int *sz, int n, int esz )
+{
+  if ( n > *sz ) {
+    int s = *sz ? *sz : 64;
+    while( s < n ) s *= 2;
+    p = realloc( p, (size_t) s * esz );
+    if ( p == NULL ) {
+      fputs( "mvt: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    *sz = s;
+  }
+  return p;
+}
+
+// protobuf field key
+#define PB_KEY(f,w) (((f) << 3) | (w))
+
+/* --------------------------------------------------------------------------
+ *  Appends a protobuf varint
+ * --------------------------------------------------------------------------*/
+static void pb_varint( mvtbuf_t *b, uint64_t v )
+{
+  mvt_reserve( b, 10 );
+  while( v >= 0x80 ) {
+    b->data[b->len++] = (char) ((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  b->data[b->len++] = (char) v;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the size of a protobuf varint
+ * --------------------------------------------------------------------------*/
+static int pb_varint_size( uint64_t v )
+{
+  int n = 1;
+  while( v >= 0x80 ) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Appends a length delimited protobuf field
+ * --------------------------------------------------------------------------*/
+static void pb_bytes( mvtbuf_t *b, int field, char *data, int len )
+{
+  pb_varint( b, PB_KEY( field, 2 ));
+  pb_varint( b, len );
+  mvt_reserve( b, len );
+  memcpy( b->data + b->len, data, len );
+  b->len += len;
+}
+
+/* --------------------------------------------------------------------------
+ *  Zigzag encoding of signed integers
+ * --------------------------------------------------------------------------*/
+static uint32_t pb_zigzag( int v )
+{
+  return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+/* --------------------------------------------------------------------------
+ *  Empties geometry and sets its type
+ * --------------------------------------------------------------------------*/
+void mvt_geom_reset( mvtgeom_t *g, int type )
+{
+  g->type = type;
+  g->npts = g->nparts = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Release geometry memory
+ * --------------------------------------------------------------------------*/
+void mvt_geom_free( mvtgeom_t *g )
+{
+  free( g->xy );
+  free( g->part );
+  free( g->outer );
+  free( g->work );
+  memset( g, 0, sizeof(mvtgeom_t));
+}
+
+/* --------------------------------------------------------------------------
+ *  Starts a new part, 'outer' tells exterior rings of polygons
+ * --------------------------------------------------------------------------*/
+void mvt_geom_part( mvtgeom_t *g, int outer )
+{
+  int sz = g->partsize;
+
+  g->part = (int*) mvt_grow( g->part, &g->partsize, g->nparts + 2, sizeof(int));
+  g->outer = (char*) mvt_grow( g->outer, &sz, g->nparts + 2, 1 );
+  g->part[g->nparts] = g->npts;
+  g->outer[g->nparts] = outer;
+  g->nparts++;
+  g->part[g->nparts] = g->npts;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a point to the current part
+ * --------------------------------------------------------------------------*/
+void mvt_geom_point( mvtgeom_t *g, double x, double y )
+{
+  g->xy = (double*) mvt_grow( g->xy, &g->ptsize, 2 * g->npts + 2, sizeof(double));
+  g->xy[2 * g->npts] = x;
+  g->xy[2 * g->npts + 1] = y;
+  g->npts++;
+  g->part[g->nparts] = g->npts;
+}
+
+/* --------------------------------------------------------------------------
+ *  Drops the current part when it has less than 'min' points
+ * --------------------------------------------------------------------------*/
+static void mvt_geom_endpart( mvtgeom_t *g, int min )
+{
+  if ( (g->nparts > 0) && (g->npts - g->part[g->nparts - 1] < min) ) {
+    g->nparts--;
+    g->npts = g->part[g->nparts];
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Clips segment a-b to the box lo..hi (Liang-Barsky), clipped segment
+ *  is stored in 'out'. Returns -1 if the segment is outside the box,
+ *  otherwise bit 0 is set when the start is moved, bit 1 when the end
+ *  is moved.
+ * --------------------------------------------------------------------------*/
+static int mvt_clip_segment( double *a, double *b, double lo, double hi, double *out )
+{
+  double t0 = 0, t1 = 1, r, dx = b[0] - a[0], dy = b[1] - a[1];
+  double p[4], q[4];
+  int i;
+
+  p[0] = -dx; q[0] = a[0] - lo;
+  p[1] = dx;  q[1] = hi - a[0];
+  p[2] = -dy; q[2] = a[1] - lo;
+  p[3] = dy;  q[3] = hi - a[1];
+  for( i = 0; i < 4; ++i ) {
+    if ( p[i] == 0 ) {
+      if ( q[i] < 0 ) return -1;
+      continue;
+    }
+    r = q[i] / p[i];
+    if ( p[i] < 0 ) {
+      if ( r > t1 ) return -1;
+      if ( r > t0 ) t0 = r;
+    }
+    else {
+      if ( r < t0 ) return -1;
+      if ( r < t1 ) t1 = r;
+    }
+  }
+  out[0] = a[0] + t0 * dx;
+  out[1] = a[1] + t0 * dy;
+  out[2] = a[0] + t1 * dx;
+  out[3] = a[1] + t1 * dy;
+  return (t0 > 0) | ((t1 < 1) << 1);
+}
+
+/* --------------------------------------------------------------------------
+ *  Clips the 'n' ring points starting at point 's' of 't' against one
+ *  side of the box (Sutherland-Hodgman) : coordinate 'axis' must be
+ *  above 'v', or below when 'below' is set. Returns the number of
+ *  points left, stored at the same place.
+ * --------------------------------------------------------------------------*/
+static int mvt_clip_ring( mvtgeom_t *t, int s, int n, int axis, double v, int below )
+{
+  double *in, *out, *a, *b, r;
+  int i, m = 0, ina, inb;
+
+  t->xy = (double*) mvt_grow( t->xy, &t->ptsize, 2 * (s + 3 * n), sizeof(double));
+  in = t->xy + 2 * s;
+  out = in + 2 * n;
+  for( i = 0; i < n; ++i ) {
+    a = in + 2 * ((i + n - 1) % n);
+    b = in + 2 * i;
+    ina = below ? (a[axis] <= v) : (a[axis] >= v);
+    inb = below ? (b[axis] <= v) : (b[axis] >= v);
+    if ( ina != inb ) {
+      r = (v - a[axis]) / (b[axis] - a[axis]);
+      out[2 * m + axis] = v;
+      out[2 * m + 1 - axis] = a[1 - axis] + r * (b[1 - axis] - a[1 - axis]);
+      m++;
+    }
+    if ( inb ) {
+      out[2 * m] = b[0];
+      out[2 * m + 1] = b[1];
+      m++;
+    }
+  }
+  memmove( in, out, 2 * m * sizeof(double));
+  return m;
+}
+
+/* --------------------------------------------------------------------------
+ *  Clips geometry to the box lo..hi on both axes, 'tmp' is a work
+ *  geometry whose content is lost. Lines leaving the box are split in
+ *  several parts, rings are closed along the box sides.
+ * --------------------------------------------------------------------------*/
+void mvt_geom_clip( mvtgeom_t *g, mvtgeom_t *tmp, double lo, double hi )
+{
+  double *a, seg[4];
+  mvtgeom_t swap;
+  int i, p, s, e, n, rc, open;
+
+  for( i = 0; i < 2 * g->npts; ++i ) {
+    if ( (g->xy[i] < lo) || (g->xy[i] > hi) ) break;
+  }
+  if ( i == 2 * g->npts ) {
+    return;
+  }
+
+  mvt_geom_reset( tmp, g->type );
+  for( p = 0; p < g->nparts; ++p ) {
+    s = g->part[p];
+    e = g->part[p + 1];
+    switch( g->type ) {
+    case MVT_POINT:
+      mvt_geom_part( tmp, 0 );
+      for( i = s; i < e; ++i ) {
+	a = g->xy + 2 * i;
+	if ( (a[0] >= lo) && (a[0] <= hi) && (a[1] >= lo) && (a[1] <= hi) ) {
+	  mvt_geom_point( tmp, a[0], a[1] );
+	}
+      }
+      mvt_geom_endpart( tmp, 1 );
+      break;
+    case MVT_LINESTRING:
+      open = 0;
+      for( i = s; i + 1 < e; ++i ) {
+	rc = mvt_clip_segment( g->xy + 2 * i, g->xy + 2 * i + 2, lo, hi, seg );
+	if ( rc < 0 ) {
+	  open = 0;
+	  continue;
+	}
+	if ( !open || (rc & 1) ) {
+	  mvt_geom_endpart( tmp, 2 );
+	  mvt_geom_part( tmp, 0 );
+	  mvt_geom_point( tmp, seg[0], seg[1] );
+	}
+	mvt_geom_point( tmp, seg[2], seg[3] );
+	open = !(rc & 2);
+      }
+      mvt_geom_endpart( tmp, 2 );
+      break;
+    case MVT_POLYGON:
+      mvt_geom_part( tmp, g->outer[p] );
+      for( i = s; i < e; ++i ) {
+	mvt_geom_point( tmp, g->xy[2 * i], g->xy[2 * i + 1] );
+      }
+      s = tmp->part[tmp->nparts - 1];
+      n = e - g->part[p];
+      n = mvt_clip_ring( tmp, s, n, 0, lo, 0 );
+      n = mvt_clip_ring( tmp, s, n, 0, hi, 1 );
+      n = mvt_clip_ring( tmp, s, n, 1, lo, 0 );
+      n = mvt_clip_ring( tmp, s, n, 1, hi, 1 );
+      tmp->npts = s + n;
+      tmp->part[tmp->nparts] = tmp->npts;
+      mvt_geom_endpart( tmp, 3 );
+      break;
+    }
+  }
+
+  swap = *g;
+  *g = *tmp;
+  *tmp = swap;
+}
+
+/* --------------------------------------------------------------------------
+ *  Squared distance of point p to segment a-b
+ * --------------------------------------------------------------------------*/
+static double mvt_segdist2( double *p, double *a, double *b )
+{
+  double dx = b[0] - a[0], dy = b[1] - a[1], t, x, y;
+
+  t = dx * dx + dy * dy;
+  if ( t > 0 ) {
+    t = ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / t;
+    if ( t < 0 ) t = 0;
+    if ( t > 1 ) t = 1;
+  }
+  x = a[0] + t * dx - p[0];
+  y = a[1] + t * dy - p[1];
+  return x * x + y * y;
+}
+
+/* --------------------------------------------------------------------------
+ *  Simplifies lines and rings (Douglas-Peucker) : points closer than
+ *  'tol' to the simplified line are dropped. Tolerance is given in tile
+ *  units, so lower zoom levels are simplified more.
+ * --------------------------------------------------------------------------*/
+void mvt_geom_simplify( mvtgeom_t *g, double tol )
+{
+  double *xy = g->xy, d, dmax, tol2 = tol * tol;
+  int p, s, e, i, a, b, imax, n, w = 0, sp;
+
+  if ( (g->type == MVT_POINT) || (tol <= 0) ) {
+    return;
+  }
+
+  for( p = 0; p < g->nparts; ++p ) {
+    s = g->part[p];
+    e = g->part[p + 1];
+    n = e - s;
+    g->part[p] = w;
+    if ( n <= 2 ) {
+      memmove( xy + 2 * w, xy + 2 * s, 2 * n * sizeof(double));
+      w += n;
+      continue;
+    }
+
+    // dropped points are marked with a NAN x
+    g->work = (int*) mvt_grow( g->work, &g->worksize, 2 * n, sizeof(int));
+    sp = 0;
+    g->work[sp++] = s;
+    g->work[sp++] = e - 1;
+    while( sp > 0 ) {
+      b = g->work[--sp];
+      a = g->work[--sp];
+      dmax = 0;
+      imax = -1;
+      for( i = a + 1; i < b; ++i ) {
+	d = mvt_segdist2( xy + 2 * i, xy + 2 * a, xy + 2 * b );
+	if ( d > dmax ) {
+	  dmax = d;
+	  imax = i;
+	}
+      }
+      if ( dmax > tol2 ) {
+	g->work[sp++] = a;
+	g->work[sp++] = imax;
+	g->work[sp++] = imax;
+	g->work[sp++] = b;
+      }
+      else {
+	for( i = a + 1; i < b; ++i ) {
+	  xy[2 * i] = NAN;
+	}
+      }
+    }
+    for( i = s; i < e; ++i ) {
+      if ( !isnan( xy[2 * i] )) {
+	xy[2 * w] = xy[2 * i];
+	xy[2 * w + 1] = xy[2 * i + 1];
+	w++;
+      }
+    }
+  }
+  g->part[g->nparts] = g->npts = w;
+}
+
+/* --------------------------------------------------------------------------
+ *  Prepares layer 'name' for encoding, the name is not copied
+ * --------------------------------------------------------------------------*/
+void mvt_layer_init( mvtlayer_t *l, char *name )
+{
+  memset( l, 0, sizeof(mvtlayer_t));
+  l->name = name;
+}
+
+/* --------------------------------------------------------------------------
+ *  Release layer memory
+ * --------------------------------------------------------------------------*/
+void mvt_layer_free( mvtlayer_t *l )
+{
+  int i;
+
+  for( i = 0; i < l->nkeys; ++i ) {
+    free( l->keys[i] );
+  }
+  free( l->keys );
+  free( l->voff );
+  free( l->vhash );
+  free( l->tags );
+  free( l->q );
+  mvt_free( &l->features );
+  mvt_free( &l->values );
+  mvt_free( &l->geom );
+  mvt_free( &l->feat );
+  memset( l, 0, sizeof(mvtlayer_t));
+}
+
+/* --------------------------------------------------------------------------
+ *  FNV-1a hash of encoded value
+ * --------------------------------------------------------------------------*/
+static uint32_t mvt_hash( char *data, int len )
+{
+  uint32_t h = 2166136261u;
+  int i;
+
+  for( i = 0; i < len; ++i ) {
+    h = (h ^ (unsigned char) data[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the index of the value encoded at offset 'start' of the
+ *  values buffer, the encoding is dropped when the value is known
+ * --------------------------------------------------------------------------*/
+static uint32_t mvt_layer_value( mvtlayer_t *l, int start )
+{
+  int i, k, mask, len = l->values.len - start;
+
+  if ( 2 * (l->nvalues + 1) > l->vhsize ) {
+    free( l->vhash );
+    l->vhsize = l->vhsize ? 2 * l->vhsize : 256;
+    l->vhash = (int*) calloc( l->vhsize, sizeof(int));
+    if ( l->vhash == NULL ) {
+      fputs( "mvt: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    mask = l->vhsize - 1;
+    for( k = 0; k < l->nvalues; ++k ) {
+      i = mvt_hash( l->values.data + l->voff[k], l->voff[k + 1] - l->voff[k] ) & mask;
+      while( l->vhash[i] ) i = (i + 1) & mask;
+      l->vhash[i] = k + 1;
+    }
+  }
+
+  mask = l->vhsize - 1;
+  i = mvt_hash( l->values.data + start, len ) & mask;
+  while( (k = l->vhash[i]) ) {
+    k--;
+    if ( (l->voff[k + 1] - l->voff[k] == len) &&
+	 !memcmp( l->values.data + l->voff[k], l->values.data + start, len ) ) {
+      l->values.len = start;
+      return k;
+    }
+    i = (i + 1) & mask;
+  }
+  l->voff = (int*) mvt_grow( l->voff, &l->vsize, l->nvalues + 2, sizeof(int));
+  l->voff[l->nvalues] = start;
+  l->voff[l->nvalues + 1] = l->values.len;
+  l->vhash[i] = l->nvalues + 1;
+  return l->nvalues++;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a tag to the current feature, its value is encoded at offset
+ *  'start' of the values buffer
+ * --------------------------------------------------------------------------*/
+static void mvt_layer_tag( mvtlayer_t *l, char *key, int start )
+{
+  int k;
+
+  for( k = 0; k < l->nkeys; ++k ) {
+    if ( !strcmp( l->keys[k], key )) break;
+  }
+  if ( k == l->nkeys ) {
+    int sz = l->keysize;
+    l->keys = (char**) mvt_grow( l->keys, &sz, k + 1, sizeof(char*));
+    l->keysize = sz;
+    l->keys[k] = strdup( key );
+    if ( l->keys[k] == NULL ) {
+      fputs( "mvt: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    l->nkeys++;
+  }
+  l->tags = (uint32_t*) mvt_grow( l->tags, &l->tagsize, l->ntags + 2, sizeof(uint32_t));
+  l->tags[l->ntags++] = k;
+  l->tags[l->ntags++] = mvt_layer_value( l, start );
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a string attribute to the current feature
+ * --------------------------------------------------------------------------*/
+void mvt_layer_string( mvtlayer_t *l, char *key, char *v, int len )
+{
+  int start = l->values.len;
+  pb_bytes( &l->values, 1, v, len );
+  mvt_layer_tag( l, key, start );
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds an integer attribute to the current feature
+ * --------------------------------------------------------------------------*/
+void mvt_layer_int( mvtlayer_t *l, char *key, int64_t v )
+{
+  int start = l->values.len;
+
+  if ( v < 0 ) {
+    pb_varint( &l->values, PB_KEY( 6, 0 ));
+    pb_varint( &l->values, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+  }
+  else {
+    pb_varint( &l->values, PB_KEY( 5, 0 ));
+    pb_varint( &l->values, (uint64_t) v );
+  }
+  mvt_layer_tag( l, key, start );
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a boolean attribute to the current feature
+ * --------------------------------------------------------------------------*/
+void mvt_layer_bool( mvtlayer_t *l, char *key, int v )
+{
+  int start = l->values.len;
+
+  pb_varint( &l->values, PB_KEY( 7, 0 ));
+  pb_varint( &l->values, v != 0 );
+  mvt_layer_tag( l, key, start );
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a floating point attribute to the current feature
+ * --------------------------------------------------------------------------*/
+void mvt_layer_double( mvtlayer_t *l, char *key, double v )
+{
+  int i, start = l->values.len;
+  uint64_t u;
+
+  memcpy( &u, &v, sizeof(u));
+  pb_varint( &l->values, PB_KEY( 3, 1 ));
+  mvt_reserve( &l->values, 8 );
+  for( i = 0; i < 8; ++i ) {
+    l->values.data[l->values.len++] = (char) (u >> (8 * i));
+  }
+  mvt_layer_tag( l, key, start );
+}
+
+/* --------------------------------------------------------------------------
+ *  Appends the points of part 'p' to the current feature geometry,
+ *  quantized to tile units. Repeated points are dropped, as is the
+ *  closing point of rings. Rings are oriented as MVT expects : exterior
+ *  rings have a positive area in tile coordinates (y pointing down).
+ *  Returns 0 when the part is degenerate and skipped.
+ * --------------------------------------------------------------------------*/
+static int mvt_layer_part( mvtlayer_t *l, mvtgeom_t *g, int p, int *cx, int *cy )
+{
+  int i, j, m = 0, x, y, t, s = g->part[p], e = g->part[p + 1], *q;
+  int64_t area = 0;
+
+  l->q = (int*) mvt_grow( l->q, &l->qsize, 2 * (e - s), sizeof(int));
+  q = l->q;
+  for( i = s; i < e; ++i ) {
+    x = (int) lround( g->xy[2 * i] );
+    y = (int) lround( g->xy[2 * i + 1] );
+    if ( (g->type != MVT_POINT) && (m > 0) && (x == q[2 * m - 2]) && (y == q[2 * m - 1]) ) {
+      continue;
+    }
+    q[2 * m] = x;
+    q[2 * m + 1] = y;
+    m++;
+  }
+
+  if ( g->type == MVT_LINESTRING ) {
+    if ( m < 2 ) return 0;
+  }
+  else if ( g->type == MVT_POLYGON ) {
+    if ( (m > 1) && (q[0] == q[2 * m - 2]) && (q[1] == q[2 * m - 1]) ) {
+      m--;
+    }
+    if ( m < 3 ) return 0;
+    for( i = 0; i < m; ++i ) {
+      j = (i + 1) % m;
+      area += (int64_t) q[2 * i] * q[2 * j + 1] - (int64_t) q[2 * j] * q[2 * i + 1];
+    }
+    if ( area == 0 ) return 0;
+    if ( (area > 0) != (g->outer[p] != 0) ) {
+      for( i = 0, j = m - 1; i < j; ++i, --j ) {
+	t = q[2 * i]; q[2 * i] = q[2 * j]; q[2 * j] = t;
+	t = q[2 * i + 1]; q[2 * i + 1] = q[2 * j + 1]; q[2 * j + 1] = t;
+      }
+    }
+  }
+
+  // MoveTo first point, LineTo next ones, then ClosePath for rings
+  for( i = 0; i < m; ++i ) {
+    if ( (i == 0) && (g->type != MVT_POINT) ) {
+      pb_varint( &l->geom, 1 | (1 << 3));
+    }
+    else if ( (i == 1) && (g->type != MVT_POINT) ) {
+      pb_varint( &l->geom, 2 | ((m - 1) << 3));
+    }
+    pb_varint( &l->geom, pb_zigzag( q[2 * i] - *cx ));
+    pb_varint( &l->geom, pb_zigzag( q[2 * i + 1] - *cy ));
+    *cx = q[2 * i];
+    *cy = q[2 * i + 1];
+  }
+  if ( g->type == MVT_POLYGON ) {
+    pb_varint( &l->geom, 7 | (1 << 3));
+  }
+  return m;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds a feature with the tags added since the last feature, an 'id'
+ *  of 0 is not encoded. Returns 0 when the geometry is empty once
+ *  quantized and the feature skipped.
+ * --------------------------------------------------------------------------*/
+int mvt_layer_feature( mvtlayer_t *l, uint64_t id, mvtgeom_t *g )
+{
+  int p, i, n, cx = 0, cy = 0, npts = 0, keep = 1;
+  mvtbuf_t *f = &l->feat;
+
+  l->geom.len = 0;
+  if ( g->type == MVT_POINT ) {
+    // all points follow a single MoveTo
+    for( p = 0; p < g->nparts; ++p ) {
+      npts += g->part[p + 1] - g->part[p];
+    }
+    if ( npts > 0 ) {
+      pb_varint( &l->geom, 1 | (npts << 3));
+      for( p = 0; p < g->nparts; ++p ) {
+	mvt_layer_part( l, g, p, &cx, &cy );
+      }
+    }
+  }
+  else {
+    for( p = 0; p < g->nparts; ++p ) {
+      // holes of a dropped exterior ring are dropped too
+      if ( (g->type == MVT_POLYGON) && g->outer[p] ) {
+	keep = 1;
+      }
+      if ( keep && !mvt_layer_part( l, g, p, &cx, &cy ) && (g->type == MVT_POLYGON) && g->outer[p] ) {
+	keep = 0;
+      }
+    }
+  }
+  if ( l->geom.len == 0 ) {
+    l->ntags = 0;
+    return 0;
+  }
+
+  f->len = 0;
+  if ( id ) {
+    pb_varint( f, PB_KEY( 1, 0 ));
+    pb_varint( f, id );
+  }
+  if ( l->ntags > 0 ) {
+    for( i = n = 0; i < l->ntags; ++i ) {
+      n += pb_varint_size( l->tags[i] );
+    }
+    pb_varint( f, PB_KEY( 2, 2 ));
+    pb_varint( f, n );
+    for( i = 0; i < l->ntags; ++i ) {
+      pb_varint( f, l->tags[i] );
+    }
+  }
+  pb_varint( f, PB_KEY( 3, 0 ));
+  pb_varint( f, g->type );
+  pb_bytes( f, 4, l->geom.data, l->geom.len );
+  pb_bytes( &l->features, 2, f->data, f->len );
+
+  l->ntags = 0;
+  l->nfeatures++;
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Appends the layer to 'tile' when it has features, the layer is
+ *  emptied and ready for the next tile
+ * --------------------------------------------------------------------------*/
+void mvt_layer_end( mvtlayer_t *l, mvtbuf_t *tile )
+{
+  mvtbuf_t *b = &l->feat;
+  int i;
+
+  if ( l->nfeatures > 0 ) {
+    b->len = 0;
+    pb_varint( b, PB_KEY( 15, 0 ));
+    pb_varint( b, 2 );
+    pb_bytes( b, 1, l->name, strlen( l->name ));
+    mvt_reserve( b, l->features.len );
+    memcpy( b->data + b->len, l->features.data, l->features.len );
+    b->len += l->features.len;
+    for( i = 0; i < l->nkeys; ++i ) {
+      pb_bytes( b, 3, l->keys[i], strlen( l->keys[i] ));
+    }
+    for( i = 0; i < l->nvalues; ++i ) {
+      pb_bytes( b, 4, l->values.data + l->voff[i], l->voff[i + 1] - l->voff[i] );
+    }
+    pb_varint( b, PB_KEY( 5, 0 ));
+    pb_varint( b, MVT_EXTENT );
+    pb_bytes( tile, 3, b->data, b->len );
+  }
+
+  for( i = 0; i < l->nkeys; ++i ) {
+    free( l->keys[i] );
+  }
+  if ( l->vhash ) {
+    memset( l->vhash, 0, l->vhsize * sizeof(int));
+  }
+  l->nkeys = l->nvalues = l->ntags = l->nfeatures = 0;
+  l->features.len = l->values.len = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a protobuf varint at '*p', returns -1 if it goes past 'end'
+ * --------------------------------------------------------------------------*/
+static int pb_read( char **p, char *end, uint64_t *v )
+{
+  int shift = 0;
+
+  *v = 0;
+  while( (*p < end) && (shift < 64) ) {
+    unsigned char c = (unsigned char) *(*p)++;
+    *v |= (uint64_t) (c & 0x7f) << shift;
+    if ( !(c & 0x80) ) {
+      return 0;
+    }
+    shift += 7;
+  }
+  return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Skips the value of a field of wire type 'w' at '*p', setting 'val'
+ *  and 'vlen' to the bytes of length delimited values. Returns -1 if
+ *  the value goes past 'end' or has an unknown wire type.
+ * --------------------------------------------------------------------------*/
+static int pb_skip( char **p, char *end, int w, char **val, uint64_t *vlen )
+{
+  uint64_t v;
+
+  switch( w ) {
+  case 0:
+    return pb_read( p, end, &v );
+  case 1:
+  case 5:
+    v = (w == 1) ? 8 : 4;
+    break;
+  case 2:
+    if ( pb_read( p, end, &v ) ) return -1;
+    *val = *p;
+    *vlen = v;
+    break;
+  default:
+    return -1;
+  }
+  if ( v > (uint64_t) (end - *p) ) {
+    return -1;
+  }
+  *p += v;
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Walks the layers of uncompressed tile 'data' without decoding their
+ *  features, 'fn' is called for each layer. Returns the number of
+ *  layers or -1 if the tile is malformed.
+ * --------------------------------------------------------------------------*/
+int mvt_walk( char *data, int len, void (*fn)( void *arg, mvtinfo_t *l ), void *arg )
+{
+  char *p = data, *end = data + len, *start, *lp, *lend, *val = NULL;
+  uint64_t key, k, vlen = 0;
+  mvtinfo_t l;
+  int n = 0;
+
+  while( p < end ) {
+    start = p;
+    if ( pb_read( &p, end, &key ) || pb_skip( &p, end, key & 7, &val, &vlen ) ) {
+      return -1;
+    }
+    if ( key != PB_KEY( 3, 2 ) ) {
+      continue;
+    }
+
+    memset( &l, 0, sizeof(l));
+    l.data = start;
+    l.len = p - start;
+    for( lp = val, lend = val + vlen; lp < lend; ) {
+      if ( pb_read( &lp, lend, &k ) || pb_skip( &lp, lend, k & 7, &val, &vlen ) ) {
+	return -1;
+      }
+      if ( k == PB_KEY( 1, 2 ) ) {
+	l.name = val;
+	l.namelen = (int) vlen;
+      }
+      else if ( k == PB_KEY( 2, 2 ) ) {
+	l.nfeatures++;
+      }
+    }
+    if ( fn ) {
+      fn( arg, &l );
+    }
+    n++;
+  }
+  return n;
+}
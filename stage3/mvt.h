@@ -0,0 +1,105 @@
+#ifndef __MVT_H__
+#define __MVT_H__
+
+#include <stdint.h>
+
+/* --------------------------------------------------------------------------
+ *  Mapbox vector tile helpers
+ *  A vector tile is a protobuf message made of repeated 'layers'
+ *  fields, so the concatenation of two tiles is a valid tile holding
+ *  the layers of both.
+ * --------------------------------------------------------------------------*/
+
+// growable byte buffer
+typedef struct mvtbuf_s {
+  char *data;
+  int len;
+  int size;
+} mvtbuf_t;
+
+// gzip magic number
+#define MVT_ISGZIP(d,l) (((l) >= 2) && ((unsigned char)(d)[0] == 0x1f) && ((unsigned char)(d)[1] == 0x8b))
+
+/* --------------------------------------------------------------------------
+ *  Vector tile encoding : geometries are given in tile units, clipped,
+ *  simplified, then quantized when features are added to a layer.
+ * --------------------------------------------------------------------------*/
+
+// tile extent and clipping buffer, in tile units
+#define MVT_EXTENT 4096
+#define MVT_BUFFER 64
+
+// max distance of points dropped by simplification, in tile units
+#define MVT_SIMPLIFY 2.0
+
+// geometry types
+#define MVT_POINT      1
+#define MVT_LINESTRING 2
+#define MVT_POLYGON    3
+
+// geometry made of parts (points, lines or rings of polygons),
+// part i holds points part[i] to part[i+1]-1, rings are not closed
+typedef struct mvtgeom_s {
+  int type;
+  double *xy;                 // x, y pairs
+  int npts, ptsize;
+  int *part;                  // first point of parts, nparts+1 entries
+  char *outer;                // 1 for exterior rings of polygons
+  int nparts, partsize;
+  int *work, worksize;        // simplification stack
+} mvtgeom_t;
+
+// layer being encoded
+typedef struct mvtlayer_s {
+  char *name;
+  mvtbuf_t features;          // encoded 'features' fields
+  mvtbuf_t values;            // encoded values, unique
+  mvtbuf_t geom, feat;        // current feature
+  char **keys;
+  int nkeys, keysize;
+  int *voff;                  // offsets of values, nvalues+1 entries
+  int nvalues, vsize;
+  int *vhash, vhsize;         // value indexes + 1 by hash
+  uint32_t *tags;             // key and value indexes of current feature
+  int ntags, tagsize;
+  int *q, qsize;              // quantized points of current part
+  int nfeatures;
+} mvtlayer_t;
+
+void mvt_reserve( mvtbuf_t *b, int len );
+void mvt_free( mvtbuf_t *b );
+int  mvt_append( mvtbuf_t *b, char *data, int len );
+int  mvt_gzip( mvtbuf_t *dst, char *data, int len, int level );
+
+void mvt_geom_reset( mvtgeom_t *g, int type );
+void mvt_geom_free( mvtgeom_t *g );
+void mvt_geom_part( mvtgeom_t *g, int outer );
+void mvt_geom_point( mvtgeom_t *g, double x, double y );
+void mvt_geom_clip( mvtgeom_t *g, mvtgeom_t *tmp, double lo, double hi );
+void mvt_geom_simplify( mvtgeom_t *g, double tol );
+
+void mvt_layer_init( mvtlayer_t *l, char *name );
+void mvt_layer_free( mvtlayer_t *l );
+void mvt_layer_string( mvtlayer_t *l, char *key, char *v, int len );
+void mvt_layer_int( mvtlayer_t *l, char *key, int64_t v );
+void mvt_layer_double( mvtlayer_t *l, char *key, double v );
+void mvt_layer_bool( mvtlayer_t *l, char *key, int v );
+int  mvt_layer_feature( mvtlayer_t *l, uint64_t id, mvtgeom_t *g );
+void mvt_layer_end( mvtlayer_t *l, mvtbuf_t *tile );
+
+/* --------------------------------------------------------------------------
+ *  Vector tile decoding : layers are walked without decoding features
+ * --------------------------------------------------------------------------*/
+
+// layer of a walked tile, pointers are inside tile data
+typedef struct mvtinfo_s {
+  char *name;                 // not nul terminated
+  int namelen;
+  char *data;                 // whole 'layers' field of the tile
+  int len;
+  int nfeatures;
+} mvtinfo_t;
+
+int  mvt_walk( char *data, int len, void (*fn)( void *arg, mvtinfo_t *l ), void *arg );
+
+#endif
@@ -0,0 +1,451 @@
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "hilbert.h"
+#include "mvt.h"
+#include "sqlut.h"
+
+/* --------------------------------------------------------------------------
+ *  mbtiles optimizer
+ *  Tiles are read in Hilbert order of each zoom level and recompressed
+ *  by worker threads, then written to a new normalized mbtiles file
+ *  where equal tiles are stored once. Tile data is written in the order
+ *  tiles are first used, so neighbour tiles are close in the file.
+ * --------------------------------------------------------------------------*/
+
+// tiles recompressed between two writes, per thread
+#define CHUNK 1024
+
+// sort key of tiles : zoom level then position along the Hilbert curve
+#define SORTKEY(z,d) (((uint64_t)(z) << 58) | (uint64_t)(d))
+
+typedef struct tile_s {
+  uint64_t key;
+  int z, x, y;                    // TMS row
+  sqlite3_int64 rowid;            // row holding tile data in input
+} tile_t;
+
+typedef struct job_s {
+  tile_t *t;
+  char *data;                     // recompressed data, NULL if unreadable
+  int len, inlen;
+} job_t;
+
+typedef struct worker_s {
+  pthread_t th;
+  sqlite3 *db;
+  sqlite3_blob *blob;
+  mvtbuf_t in, raw, out;
+} worker_t;
+
+typedef struct image_s {
+  uint64_t h;                     // content hash, 0 if slot is free
+  uint32_t len;
+  sqlite3_int64 rowid;            // row of 'images' in output
+} image_t;
+
+// jobs of current chunk, shared by workers
+static job_t *g_jobs;
+static int g_njobs, g_next;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *g_table;             // input table holding tile data
+static int g_vector = 0;          // tiles are gzip compressed vector tiles
+static int g_level = Z_BEST_COMPRESSION;
+
+int tile_cmp( const void *a, const void *b )
+{
+  uint64_t ka = ((tile_t*) a)->key;
+  uint64_t kb = ((tile_t*) b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+/* --------------------------------------------------------------------------
+ *  Lists tiles of the input file, sorted by zoom level and Hilbert curve
+ * --------------------------------------------------------------------------*/
+tile_t *list_tiles( sqlite3 *db, char *query, int *ntiles )
+{
+  sqlite3_stmt *stmt;
+  tile_t *tab = NULL;
+  int n = 0, sz = 0, z, x, y;
+
+  stmt = prepare( db, query );
+  while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+    z = sqlite3_column_int( stmt, 0 );
+    x = sqlite3_column_int( stmt, 1 );
+    y = sqlite3_column_int( stmt, 2 );
+    if ( (z < 0) || (z > 29) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+      fprintf( stderr, "Skipping invalid tile %d/%d/%d\n", z, x, y );
+      continue;
+    }
+    if ( n == sz ) {
+      sz = sz ? 2*sz : 4096;
+      tab = (tile_t*) realloc( tab, sz * sizeof(tile_t));
+      if ( !tab ) {
+	fputs( "memory allocation error.\n", stderr );
+	exit(1);
+      }
+    }
+    tab[n].key = SORTKEY( z, hilbert( z, x, (1 << z) - 1 - y ));
+    tab[n].z = z;
+    tab[n].x = x;
+    tab[n].y = y;
+    tab[n].rowid = sqlite3_column_int64( stmt, 3 );
+    n++;
+  }
+  sqlite3_finalize( stmt );
+
+  qsort( tab, n, sizeof(tile_t), tile_cmp );
+  *ntiles = n;
+  return tab;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads and recompresses the tile of job 'j'. Vector tiles are gzip
+ *  compressed again at the best level, the original data is kept when
+ *  it is smaller. Raster tiles are kept as is.
+ * --------------------------------------------------------------------------*/
+void recompress( worker_t *w, job_t *j )
+{
+  int rc, len;
+
+  if ( w->blob ) {
+    rc = sqlite3_blob_reopen( w->blob, j->t->rowid );
+  }
+  else {
+    rc = sqlite3_blob_open( w->db, "main", g_table, "tile_data", j->t->rowid, 0, &w->blob );
+  }
+  if ( rc != SQLITE_OK ) {
+    // a failed handle can't be reopened
+    fprintf( stderr, "Cannot read tile data : %s\n", sqlite3_errmsg(w->db));
+    sqlite3_blob_close( w->blob );
+    w->blob = NULL;
+    return;
+  }
+  len = sqlite3_blob_bytes( w->blob );
+  w->in.len = 0;
+  mvt_reserve( &w->in, len );
+  if ( sqlite3_blob_read( w->blob, w->in.data, len, 0 ) != SQLITE_OK ) {
+    fprintf( stderr, "Cannot read tile data : %s\n", sqlite3_errmsg(w->db));
+    sqlite3_blob_close( w->blob );
+    w->blob = NULL;
+    return;
+  }
+  w->in.len = len;
+  j->inlen = len;
+
+  if ( g_vector && (len > 0) ) {
+    w->raw.len = 0;
+    if ( (mvt_append( &w->raw, w->in.data, len ) == 0) &&
+	 (mvt_gzip( &w->out, w->raw.data, w->raw.len, g_level ) == 0) &&
+	 (!MVT_ISGZIP( w->in.data, len ) || (w->out.len < len)) ) {
+      j->data = emalloc( w->out.len );
+      memcpy( j->data, w->out.data, w->out.len );
+      j->len = w->out.len;
+      return;
+    }
+  }
+  j->data = emalloc( len ? len : 1 );
+  memcpy( j->data, w->in.data, len );
+  j->len = len;
+}
+
+/* --------------------------------------------------------------------------
+ *  Worker thread : recompresses tiles of current chunk until none is left
+ * --------------------------------------------------------------------------*/
+void *work( void *arg )
+{
+  worker_t *w = (worker_t*) arg;
+  job_t *j;
+
+  for( ;; ) {
+    pthread_mutex_lock( &g_lock );
+    j = (g_next < g_njobs) ? g_jobs + g_next++ : NULL;
+    pthread_mutex_unlock( &g_lock );
+    if ( j == NULL ) {
+      break;
+    }
+    recompress( w, j );
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Tells if data 'b' of size 'len' is stored in row 'rowid' of images
+ * --------------------------------------------------------------------------*/
+int same_data( sqlite3 *db, sqlite3_int64 rowid, char *b, uint32_t len )
+{
+  static mvtbuf_t tmp;
+  sqlite3_blob *blob;
+  int res;
+
+  // blob handle isn't kept, it would block the next writes
+  if ( sqlite3_blob_open( db, "main", "images", "tile_data", rowid, 0, &blob ) != SQLITE_OK ) {
+    fprintf( stderr, "Cannot read tile data : %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  res = (sqlite3_blob_bytes( blob ) == len);
+  if ( res ) {
+    tmp.len = 0;
+    mvt_reserve( &tmp, len );
+    if ( sqlite3_blob_read( blob, tmp.data, len, 0 ) != SQLITE_OK ) {
+      fprintf( stderr, "Cannot read tile data : %s\n", sqlite3_errmsg(db));
+      exit(1);
+    }
+    res = !memcmp( tmp.data, b, len );
+  }
+  sqlite3_blob_close( blob );
+  return res;
+}
+
+int usage( char *fmt, ... )
+{
+  FILE *fout = fmt ? stderr : stdout;
+  fprintf( fout, "usage: ");
+  if ( fmt ) {
+    va_list va;
+    va_start(va, fmt );
+    vfprintf( fout, fmt, va );
+    va_end(va);
+  }
+  else {
+    fputs( "mbtiles-optimize -i input.mbtiles -o output.mbtiles [-l level] [-j threads]\n", fout );
+  }
+
+  fputs( "\t -h                  Prints this help message\n", fout );
+  fputs( "\t -i /path/to/input   input mbtiles file\n", fout );
+  fputs( "\t -o /path/to/output  output mbtiles file, which must not exist\n", fout );
+  fputs( "\t -l level            compression level of vector tiles (default 9)\n", fout );
+  fputs( "\t -j threads          number of threads (default number of cpus)\n", fout );
+
+  exit( fmt ? 1 : 0 );
+}
+
+int main( int argc, char **argv )
+{
+  char *ipath = NULL, *opath = NULL, *query, format[16] = "", id[32];
+  sqlite3 *db, *out;
+  sqlite3_stmt *stmt, *img, *map;
+  worker_t *workers;
+  tile_t *tiles;
+  image_t *htab;
+  struct timespec t0, t1;
+  struct stat ist, ost;
+  uint64_t h, inbytes = 0, outbytes = 0;
+  uint32_t hmask, k;
+  double dt;
+  int opt, i, n, c, nth = 0, nimages = 0;
+
+  while ((opt = getopt(argc, argv, "hi:o:l:j:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(NULL);
+      break;
+    case 'i':
+      if ( ipath  ) usage( "option '-%c' found more than once.\n", opt );
+      ipath = optarg;
+      break;
+    case 'o':
+      if ( opath ) usage( "option '-%c' found more than once.\n", opt );
+      opath = optarg;
+      break;
+    case 'l':
+      g_level = atoi( optarg );
+      if ( (g_level < 1) || (g_level > 9) ) usage( "option '-%c' expects a level from 1 to 9.\n", opt );
+      break;
+    case 'j':
+      nth = atoi( optarg );
+      if ( nth <= 0 ) usage( "option '-%c' expects a number of threads.\n", opt );
+      break;
+    default: /* '?' */
+      usage( "unexpected value on command line '%s'.\n", optarg );
+    }
+  }
+  if ( !ipath || !opath ) {
+    usage( "options '-i' and '-o' are mandatory.\n" );
+  }
+  if ( access( opath, F_OK ) == 0 ) {
+    fprintf( stderr, "'%s' already exists.\n", opath );
+    exit(1);
+  }
+  if ( nth == 0 ) {
+    nth = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( nth <= 0 ) nth = 1;
+  }
+
+  if ( sqlite3_open_v2( ipath, &db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  if ( has_table( db, "map" ) && has_table( db, "images" ) ) {
+    g_table = "images";
+    query = "SELECT map.zoom_level, map.tile_column, map.tile_row, images.rowid "
+      "FROM map JOIN images ON images.tile_id = map.tile_id";
+  }
+  else if ( has_table( db, "tiles" ) ) {
+    g_table = "tiles";
+    query = "SELECT zoom_level, tile_column, tile_row, rowid FROM tiles";
+  }
+  else {
+    fprintf( stderr, "'%s' : unknown mbtiles schema.\n", ipath );
+    exit(1);
+  }
+  if ( has_table( db, "metadata" ) ) {
+    stmt = prepare( db, "SELECT value FROM metadata WHERE name = 'format'" );
+    if ( (sqlite3_step( stmt ) == SQLITE_ROW) && sqlite3_column_text( stmt, 0 ) ) {
+      snprintf( format, sizeof(format), "%s", sqlite3_column_text( stmt, 0 ));
+    }
+    sqlite3_finalize( stmt );
+  }
+  g_vector = !strcmp( format, "pbf" ) || !strcmp( format, "mvt" );
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  tiles = list_tiles( db, query, &n );
+  printf( "%d tiles found in '%s'\n", n, ipath );
+
+  // output is made from scratch, no journal needed
+  if ( sqlite3_open_v2( opath, &out, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL ) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(out));
+    exit(1);
+  }
+  exec( out, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;"
+	"CREATE TABLE metadata (name text, value text);"
+	"CREATE TABLE images (tile_data blob, tile_id text);"
+	"CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);"
+	"CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, "
+	"map.tile_row AS tile_row, images.tile_data AS tile_data "
+	"FROM map JOIN images ON images.tile_id = map.tile_id;" );
+  sqlite3_close( db );
+  stmt = prepare( out, "ATTACH DATABASE ?1 AS src" );
+  sqlite3_bind_text( stmt, 1, ipath, -1, SQLITE_STATIC );
+  if ( sqlite3_step( stmt ) != SQLITE_DONE ) {
+    fprintf(stderr, "Cannot attach database: %s\n", sqlite3_errmsg(out));
+    exit(1);
+  }
+  sqlite3_finalize( stmt );
+  exec( out, "INSERT INTO metadata (name, value) SELECT name, value FROM src.metadata;"
+	"DETACH DATABASE src" );
+  img = prepare( out, "INSERT INTO images (tile_data, tile_id) VALUES (?1, ?2)" );
+  map = prepare( out, "INSERT INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?1, ?2, ?3, ?4)" );
+
+  // each worker has its own read only connection
+  workers = (worker_t*) emalloc( nth * sizeof(worker_t));
+  for( i = 0; i < nth; ++i ) {
+    if ( sqlite3_open_v2( ipath, &workers[i].db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK ) {
+      fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(workers[i].db));
+      exit(1);
+    }
+  }
+  g_jobs = (job_t*) emalloc( CHUNK * nth * sizeof(job_t));
+  for( hmask = 1; hmask < 2*n; hmask <<= 1 );
+  htab = (image_t*) emalloc( hmask * sizeof(image_t));
+  hmask--;
+
+  for( c = 0; c < n; c += CHUNK * nth ) {
+    g_njobs = (n - c < CHUNK * nth) ? n - c : CHUNK * nth;
+    g_next = 0;
+    for( i = 0; i < g_njobs; ++i ) {
+      g_jobs[i].t = tiles + c + i;
+      g_jobs[i].data = NULL;
+    }
+    for( i = 0; i < nth; ++i ) {
+      if ( pthread_create( &workers[i].th, NULL, work, workers + i ) ) {
+	perror( "pthread_create" );
+	exit(1);
+      }
+    }
+    for( i = 0; i < nth; ++i ) {
+      pthread_join( workers[i].th, NULL );
+    }
+
+    // workers are idle, write tiles in Hilbert order in a single transaction
+    exec( out, "BEGIN" );
+    for( i = 0; i < g_njobs; ++i ) {
+      job_t *j = g_jobs + i;
+      if ( j->data == NULL ) {
+	fprintf( stderr, "Skipping unreadable tile %d/%d/%d\n", j->t->z, j->t->x, j->t->y );
+	continue;
+      }
+      inbytes += j->inlen;
+
+      h = ((uint64_t) crc32( 0, (Bytef*) j->data, j->len ) << 32) | adler32( 1, (Bytef*) j->data, j->len );
+      if ( h == 0 ) h = 1;
+      for( k = (uint32_t) (h ^ (h >> 29)) & hmask; htab[k].h; k = (k + 1) & hmask ) {
+	if ( (htab[k].h == h) && (htab[k].len == j->len) &&
+	     same_data( out, htab[k].rowid, j->data, j->len ) ) {
+	  break;
+	}
+      }
+      // tile id is the slot, unique even when hashes collide
+      snprintf( id, sizeof(id), "%x", k );
+      if ( htab[k].h == 0 ) {
+	sqlite3_bind_blob( img, 1, j->data, j->len, SQLITE_STATIC );
+	sqlite3_bind_text( img, 2, id, -1, SQLITE_STATIC );
+	if ( sqlite3_step( img ) != SQLITE_DONE ) {
+	  fprintf(stderr, "Cannot write tile: %s\n", sqlite3_errmsg(out));
+	  exit(1);
+	}
+	sqlite3_reset( img );
+	htab[k].h = h;
+	htab[k].len = j->len;
+	htab[k].rowid = sqlite3_last_insert_rowid( out );
+	outbytes += j->len;
+	nimages++;
+      }
+      sqlite3_bind_int( map, 1, j->t->z );
+      sqlite3_bind_int( map, 2, j->t->x );
+      sqlite3_bind_int( map, 3, j->t->y );
+      sqlite3_bind_text( map, 4, id, -1, SQLITE_STATIC );
+      if ( sqlite3_step( map ) != SQLITE_DONE ) {
+	fprintf(stderr, "Cannot write tile: %s\n", sqlite3_errmsg(out));
+	exit(1);
+      }
+      sqlite3_reset( map );
+      free( j->data );
+    }
+    exec( out, "COMMIT" );
+  }
+  sqlite3_finalize( img );
+  sqlite3_finalize( map );
+
+  // map index covers tile lookups, images are found by their id
+  printf( "building indexes\n" );
+  exec( out, "CREATE UNIQUE INDEX map_index ON map (zoom_level, tile_column, tile_row, tile_id);"
+	"CREATE UNIQUE INDEX images_id ON images (tile_id);"
+	"ANALYZE" );
+  printf( "compacting '%s'\n", opath );
+  exec( out, "VACUUM" );
+  sqlite3_close( out );
+
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+  stat( ipath, &ist );
+  stat( opath, &ost );
+  printf( "%d tiles, %d distinct, tile data %llu -> %llu bytes, file %llu -> %llu bytes (%.1f%%) "
+	  "in %.2f s using %d threads\n", n, nimages,
+	  (unsigned long long) inbytes, (unsigned long long) outbytes,
+	  (unsigned long long) ist.st_size, (unsigned long long) ost.st_size,
+	  ist.st_size ? 100.0 * ost.st_size / ist.st_size : 0.0, dt, nth );
+
+  for( i = 0; i < nth; ++i ) {
+    if ( workers[i].blob ) sqlite3_blob_close( workers[i].blob );
+    sqlite3_close( workers[i].db );
+    mvt_free( &workers[i].in );
+    mvt_free( &workers[i].raw );
+    mvt_free( &workers[i].out );
+  }
+  free( workers );
+  free( g_jobs );
+  free( htab );
+  free( tiles );
+  return 0;
+}
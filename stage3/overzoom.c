@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#include "overzoom.h"
+#include "mbtiles.h"
+#include "raster.h"
+
+extern void logger(const char *fmt, ...);
+
+// decoded ancestor tile
+typedef struct ancestor_s {
+  uint64_t key;
+  image_t img;
+  int type;
+  unsigned stamp;
+} ancestor_t;
+
+typedef struct overzoom_s {
+  source_t *base;
+  int maxzoom, levels;
+  ancestor_t anc[OVERZOOM_CACHE];
+  unsigned stamp;
+  char *out;                  // last tile made
+  struct json_object *tiles;  // tiles.json object
+  char *tiles_json;
+  int tjlen;
+} overzoom_t;
+
+static source_ops_t overzoom_ops;
+
+/* --------------------------------------------------------------------------
+ *  Wraps raster source 'base' so that tiles up to 'levels' zoom levels
+ *  beyond its max zoom are available. Sources which are not raster are
+ *  returned unchanged.
+ * --------------------------------------------------------------------------*/
+source_t *overzoom_source( source_t *base, int levels )
+{
+  struct json_object *tj, *v;
+  enum json_tokener_error error;
+  overzoom_t *oz;
+  source_t *src;
+  const char *format = "";
+  int maxzoom;
+
+  tj = json_tokener_parse_verbose( source_tiles_json( base, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    fprintf( stderr, "failed to parse tiles.json: %s\n", json_tokener_error_desc( error ));
+    return base;
+  }
+  if ( json_object_object_get_ex( tj, "format", &v ) == TRUE ) {
+    format = json_object_get_string( v );
+  }
+  if ( strcmp( format, "jpg" ) && strcmp( format, "png" ) ) {
+    json_object_put( tj );
+    return base;
+  }
+  if ( json_object_object_get_ex( tj, "maxzoom", &v ) != TRUE ) {
+    fprintf( stderr, "'%s' has no max zoom level, overzoom disabled.\n", base->path );
+    json_object_put( tj );
+    return base;
+  }
+  maxzoom = json_object_get_int( v );
+  if ( levels > OVERZOOM_MAXLEVELS ) levels = OVERZOOM_MAXLEVELS;
+  if ( maxzoom + levels > 29 ) levels = 29 - maxzoom;
+
+  oz = (overzoom_t*) calloc( 1, sizeof(overzoom_t));
+  src = (source_t*) calloc( 1, sizeof(source_t));
+  if ( (oz == NULL) || (src == NULL) ) {
+    fputs( "overzoom: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  oz->base = base;
+  oz->maxzoom = maxzoom;
+  oz->levels = levels;
+  oz->tiles = tj;
+  // clients must request tiles beyond the max zoom of the source
+  json_object_object_add( tj, "maxzoom", json_object_new_int( maxzoom + levels ));
+
+  src->path = base->path;
+  src->ops = &overzoom_ops;
+  src->h = oz;
+  logger( "overzoom '%s' : zoom levels %d to %d\n", base->path, maxzoom + 1, maxzoom + levels );
+  return src;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns decoded ancestor tile z/x/y, NULL if it doesn't exist
+ * --------------------------------------------------------------------------*/
+static ancestor_t *overzoom_ancestor( overzoom_t *oz, int z, int x, int y )
+{
+  uint64_t key = TILEID( z, x, y );
+  ancestor_t *a = oz->anc;
+  char *data;
+  int i, len;
+
+  for( i = 0; i < OVERZOOM_CACHE; ++i ) {
+    if ( oz->anc[i].img.pix && (oz->anc[i].key == key) ) {
+      oz->anc[i].stamp = ++oz->stamp;
+      return oz->anc + i;
+    }
+    if ( oz->anc[i].stamp < a->stamp ) {
+      a = oz->anc + i;
+    }
+  }
+
+  data = source_read_quiet( oz->base, z, x, y, &len );
+  if ( (data == NULL) || (len == 0) ) {
+    return NULL;
+  }
+
+  // replace least recently used entry
+  raster_free( &a->img );
+  a->type = raster_type( data, len );
+  if ( raster_decode( data, len, &a->img ) < 0 ) {
+    return NULL;
+  }
+  a->key = key;
+  a->stamp = ++oz->stamp;
+  return a;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile, tiles beyond max zoom are made from their deepest
+ *  existing ancestor. Returned data is valid until next call.
+ * --------------------------------------------------------------------------*/
+static char *overzoom_read( void *h, int z, int x, int y, int *len )
+{
+  overzoom_t *oz = (overzoom_t*) h;
+  ancestor_t *a = NULL;
+  image_t img;
+  double s;
+  int dz;
+
+  if ( z <= oz->maxzoom ) {
+    return source_read( oz->base, z, x, y, len );
+  }
+  if ( (z > oz->maxzoom + oz->levels) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+    return NULL;
+  }
+
+  for( dz = z - oz->maxzoom; (dz <= z) && (a == NULL); ++dz ) {
+    a = overzoom_ancestor( oz, z - dz, x >> dz, y >> dz );
+  }
+  if ( a == NULL ) {
+    return NULL;
+  }
+  dz--;
+
+  // tile covers a 1/2^dz part of ancestor, made at ancestor size
+  s = 1.0 / (1 << dz);
+  img.w = a->img.w;
+  img.h = a->img.h;
+  raster_scale( &a->img, (x & ((1 << dz) - 1)) * s * a->img.w, (y & ((1 << dz) - 1)) * s * a->img.h,
+		s * a->img.w, s * a->img.h, &img );
+  free( oz->out );
+  oz->out = raster_encode( &img, a->type, len );
+  raster_free( &img );
+
+  logger( "overzoom: %d/%d/%d made from %d/%d/%d\n", z, x, y, z - dz, x >> dz, y >> dz );
+  return oz->out;
+}
+
+/* --------------------------------------------------------------------------
+ *  Other source operations
+ * --------------------------------------------------------------------------*/
+static void overzoom_close( void *h )
+{
+  overzoom_t *oz = (overzoom_t*) h;
+  int i;
+
+  for( i = 0; i < OVERZOOM_CACHE; ++i ) {
+    raster_free( &oz->anc[i].img );
+  }
+  free( oz->out );
+  json_object_put( oz->tiles );
+  source_close( oz->base );
+  free( oz );
+}
+
+static char *overzoom_tiles_json( void *h, int *len )
+{
+  overzoom_t *oz = (overzoom_t*) h;
+  if ( oz->tiles_json == NULL ) {
+    oz->tiles_json = (char*) json_object_to_json_string_ext( oz->tiles, JSON_C_TO_STRING_PRETTY );
+    oz->tjlen = strlen( oz->tiles_json );
+  }
+  if ( len != NULL ) {
+    *len = oz->tjlen;
+  }
+  return oz->tiles_json;
+}
+
+static int overzoom_tile_id( void *h, int z, int x, int y, uint64_t *id )
+{
+  overzoom_t *oz = (overzoom_t*) h;
+  // made tiles have no id and are cached by coordinates
+  if ( z > oz->maxzoom ) {
+    return -1;
+  }
+  return source_tile_id( oz->base, z, x, y, id );
+}
+
+static char *overzoom_read_id( void *h, uint64_t id, int *len )
+{
+  return source_read_id( ((overzoom_t*) h)->base, id, len );
+}
+
+static int overzoom_index( void *h )
+{
+  return source_index( ((overzoom_t*) h)->base );
+}
+
+static int overzoom_shared( void *h, uint64_t **ids )
+{
+  return source_shared( ((overzoom_t*) h)->base, ids );
+}
+
+static source_ops_t overzoom_ops = {
+  "overzoom",
+  NULL,
+  overzoom_close,
+  overzoom_read,
+  overzoom_tiles_json,
+  overzoom_tile_id,
+  overzoom_read_id,
+  overzoom_index,
+  overzoom_shared,
+  NULL
+};
@@ -0,0 +1,20 @@
+#ifndef __OVERZOOM_H__
+#define __OVERZOOM_H__
+
+#include "source.h"
+
+/* --------------------------------------------------------------------------
+ *  Raster overzoom : tiles beyond the max zoom level of a raster source
+ *  are made by upscaling the matching part of their deepest ancestor.
+ * --------------------------------------------------------------------------*/
+
+// max number of levels beyond max zoom, a 256 pixels tile is then
+// made from a single ancestor pixel
+#define OVERZOOM_MAXLEVELS 8
+
+// decoded ancestors kept in memory
+#define OVERZOOM_CACHE 4
+
+source_t *overzoom_source( source_t *base, int levels );
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <json.h>
+
+#include "pack.h"
+#include "mbtiles.h"
+
+extern void logger(const char *fmt, ...);
+
+// tile pack linked in the executable by bundle.S, undefined otherwise
+extern const char pack_bundle[] __attribute__((weak));
+extern const char pack_bundle_end[] __attribute__((weak));
+
+/* --------------------------------------------------------------------------
+ *  Tile pack handle : the whole file is mapped in memory
+ * --------------------------------------------------------------------------*/
+typedef struct pack_s {
+  char *map;                  // mapped file or bundled pack
+  size_t size;
+  int mapped;
+  packhdr_t *hdr;
+  packdir_t *dir;             // directory
+  char *data;                 // tile data
+  char *tiles_json;           // generated tiles.json
+  int tjlen;
+} pack_t;
+
+// tile id : data size in upper bits, data offset in the 40 lower bits
+#define PACKID(len,off) (((uint64_t)(len) << 40) | (uint64_t)(off))
+
+/* --------------------------------------------------------------------------
+ *  Tells if a tile pack is linked in the executable
+ * --------------------------------------------------------------------------*/
+int pack_bundled( void )
+{
+  return (pack_bundle != NULL) && (pack_bundle_end != NULL) &&
+    (pack_bundle_end - pack_bundle >= sizeof(packhdr_t));
+}
+
+/* --------------------------------------------------------------------------
+ *  Open tile pack file and returns a handle to it, PACK_BUNDLE opens
+ *  the tile pack linked in the executable
+ * --------------------------------------------------------------------------*/
+void *pack_open( char *path )
+{
+  struct stat stb;
+  packhdr_t *hdr;
+  pack_t *p;
+  char *map;
+  int fd, mapped = 1;
+
+  if ( !strcmp( path, PACK_BUNDLE ) ) {
+    if ( !pack_bundled() ) {
+      fprintf( stderr, "No tile pack linked in this executable.\n" );
+      return NULL;
+    }
+    map = (char*) pack_bundle;
+    stb.st_size = pack_bundle_end - pack_bundle;
+    mapped = 0;
+    goto check;
+  }
+
+  fd = open( path, O_RDONLY );
+  if ( fd == -1 ) {
+    perror( path );
+    return NULL;
+  }
+  if ( fstat( fd, &stb ) == -1 ) {
+    perror( path );
+    close( fd );
+    return NULL;
+  }
+  if ( stb.st_size < sizeof(packhdr_t) ) {
+    fprintf( stderr, "File '%s' is not a tile pack.\n", path );
+    close( fd );
+    return NULL;
+  }
+  
+  map = (char*) mmap( NULL, stb.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    perror( "pack_open: mmap()" );
+    return NULL;
+  }
+
+ check:
+  hdr = (packhdr_t*) map;
+  if ( memcmp( hdr->magic, PACK_MAGIC, sizeof(hdr->magic) ) ||
+       (hdr->metaoff + hdr->nmeta > stb.st_size) ||
+       (hdr->diroff + (uint64_t) hdr->ntiles * sizeof(packdir_t) > stb.st_size) ||
+       (hdr->dataoff + hdr->datalen > stb.st_size) ) {
+    fprintf( stderr, "File '%s' is not a valid tile pack.\n", path );
+    if ( mapped ) munmap( map, stb.st_size );
+    return NULL;
+  }
+
+  p = (pack_t*) calloc( 1, sizeof(pack_t));
+  if ( p == NULL ) {
+    fputs( "pack_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  p->map = map;
+  p->size = stb.st_size;
+  p->mapped = mapped;
+  p->hdr = hdr;
+  p->dir = (packdir_t*) (map + hdr->diroff);
+  p->data = map + hdr->dataoff;
+
+  logger( "pack '%s' : %u tiles, %llu bytes of tile data\n",
+	  path, hdr->ntiles, (unsigned long long) hdr->datalen );
+  return (void*) p;
+}
+
+/* --------------------------------------------------------------------------
+ *  Close tile pack
+ * --------------------------------------------------------------------------*/
+void pack_close( void *h )
+{
+  pack_t *p = (pack_t*) h;
+  if ( p == NULL ) return;
+  if ( p->mapped ) munmap( p->map, p->size );
+  free( p->tiles_json );
+  free( p );
+}
+
+/* --------------------------------------------------------------------------
+ *  Search directory entry of a tile
+ * --------------------------------------------------------------------------*/
+static packdir_t *pack_search( pack_t *p, int z, int x, int y )
+{
+  uint64_t key;
+  int lo = 0, hi = (int) p->hdr->ntiles - 1, mid;
+
+  if ( (z < 0) || (z > 29) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+    return NULL;
+  }
+  
+  key = PACKKEY( z, hilbert( z, x, y ));
+  while( lo <= hi ) {
+    mid = (lo + hi) / 2;
+    if ( p->dir[mid].key < key ) {
+      lo = mid + 1;
+    }
+    else if ( p->dir[mid].key > key ) {
+      hi = mid - 1;
+    }
+    else {
+      return p->dir + mid;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile, returns a pointer in mapped file
+ * --------------------------------------------------------------------------*/
+char *pack_read( void *h, int z, int x, int y, int *len )
+{
+  pack_t *p = (pack_t*) h;
+  packdir_t *e = pack_search( p, z, x, y );
+  if ( e == NULL ) {
+    logger( "No tile %d/%d/%d\n", z, x, y );
+    *len = 0;
+    return NULL;
+  }
+  *len = e->len;
+  return p->data + e->off;
+}
+
+/* --------------------------------------------------------------------------
+ *  Retrieve tile id : duplicate tiles share the same data and id
+ * --------------------------------------------------------------------------*/
+int pack_tile_id( void *h, int z, int x, int y, uint64_t *id )
+{
+  pack_t *p = (pack_t*) h;
+  packdir_t *e = pack_search( p, z, x, y );
+  if ( e == NULL ) return 0;
+  *id = PACKID( e->len, e->off );
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile given its id
+ * --------------------------------------------------------------------------*/
+char *pack_read_id( void *h, uint64_t id, int *len )
+{
+  pack_t *p = (pack_t*) h;
+  *len = (int) (id >> 40);
+  return p->data + (id & ((1ULL << 40) - 1));
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' from metadata stored in pack
+ * --------------------------------------------------------------------------*/
+char *pack_tiles_json( void *h, int *len )
+{
+  pack_t *p = (pack_t*) h;
+
+  if ( p->tiles_json == NULL ) {
+    mbtiles_meta_t meta = { .minzoom = -1, .maxzoom = -1 };
+    struct json_object *o;
+    char *k = p->map + p->hdr->metaoff;
+    char *end = k + p->hdr->nmeta;
+    char *v;
+    
+    while( k < end ) {
+      v = k + strnlen( k, end - k ) + 1;
+      if ( v >= end ) break;
+      mbtiles_meta_set( &meta, k, v );
+      k = v + strnlen( v, end - v ) + 1;
+    }
+    o = mbtiles_meta_object( &meta );
+    p->tiles_json = strdup( mbtiles_meta_json( o, &p->tjlen ));
+    json_object_put( o );
+    mbtiles_meta_clear( &meta );
+  }
+
+  if ( len != NULL ) {
+    *len = p->tjlen;
+  }
+  return p->tiles_json;
+}
@@ -0,0 +1,57 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <stdint.h>
+
+#include "hilbert.h"
+
+/* --------------------------------------------------------------------------
+ *  Tile pack file format, written by 'mkpack' and served by mbv.
+ *  All integers are stored in host byte order.
+ *
+ *    header      packhdr_t
+ *    metadata    'nmeta' bytes : "key\0value\0" pairs of mbtiles metadata
+ *    directory   'ntiles' packdir_t sorted by key
+ *    data        tile blobs, stored once, in directory order
+ *
+ *  Directory key is zoom level in the 6 upper bits and position of the
+ *  tile along the Hilbert curve of its zoom level in the lower bits :
+ *  tiles close on the map are close in the directory and in the data.
+ * --------------------------------------------------------------------------*/
+#define PACK_MAGIC "MBVPACK1"
+
+typedef struct packhdr_s {
+  char     magic[8];
+  uint32_t ntiles;            // directory entries
+  uint32_t nmeta;             // metadata size
+  uint64_t metaoff;           // metadata offset
+  uint64_t diroff;            // directory offset
+  uint64_t dataoff;           // data offset
+  uint64_t datalen;           // data size
+  char     pad[16];
+} packhdr_t;
+
+typedef struct packdir_s {
+  uint64_t key;               // PACKKEY(z, hilbert(z,x,y))
+  uint64_t off;               // data offset, relative to 'dataoff'
+  uint32_t len;               // data size
+  uint32_t pad;
+} packdir_t;
+
+#define PACKKEY(z,d) (((uint64_t)(z) << 58) | (uint64_t)(d))
+
+/* --------------------------------------------------------------------------
+ *  A tile pack can be linked in the executable ('make mbv-bundle'), it
+ *  is opened with this path in place of a file name.
+ * --------------------------------------------------------------------------*/
+#define PACK_BUNDLE "@bundle"
+
+int   pack_bundled( void );
+void *pack_open( char *path );
+void  pack_close( void *h );
+char *pack_read( void *h, int z, int x, int y, int *len );
+int   pack_tile_id( void *h, int z, int x, int y, uint64_t *id );
+char *pack_read_id( void *h, uint64_t id, int *len );
+char *pack_tiles_json( void *h, int *len );
+
+#endif
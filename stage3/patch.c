@@ -0,0 +1,404 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "patch.h"
+#include "mbtiles.h"
+
+extern void logger(const char *fmt, ...);
+
+// tile id of patched tiles : top bit set, patch serial and tile id in patch
+#define PATCHID(s,id) ((1ULL << 63) | ((uint64_t)(s) << 40) | (uint64_t)(id))
+#define PATCHID_SERIAL(id) ((unsigned) (((id) >> 40) & 0x7fffff))
+#define PATCHID_ID(id) ((id) & ((1ULL << 40) - 1))
+
+typedef struct patch_s {
+  char *path;
+  time_t mtime;
+  off_t size;
+  unsigned serial;            // unique among loaded patches
+  void *h;                    // mbtiles handle
+  uint64_t *bloom;            // Bloom filter of tiles and tombstones
+  uint32_t bmask;             // number of bits - 1
+  uint64_t *dead;             // sorted tombstones
+  int ndead, szdead;
+  int ntiles;
+} patch_t;
+
+typedef struct patchset_s {
+  source_t *base;
+  char *dir;
+  patch_t *patches;           // in name order, last one wins
+  int npatches;
+  unsigned serial;
+  int indexed;
+} patchset_t;
+
+static source_ops_t patch_ops;
+
+/* --------------------------------------------------------------------------
+ *  Bloom filter hashing, bits are derived from a 64 bits hash with
+ *  double hashing
+ * --------------------------------------------------------------------------*/
+static uint64_t patch_hash( uint64_t key )
+{
+  key += 0x9e3779b97f4a7c15ULL;
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+static void bloom_add( patch_t *p, uint64_t key )
+{
+  uint64_t h = patch_hash( key );
+  uint32_t h1 = (uint32_t) h, h2 = (uint32_t) (h >> 32) | 1, b;
+  int i;
+  for( i = 0; i < PATCH_BLOOM_HASH; ++i ) {
+    b = (h1 + i * h2) & p->bmask;
+    p->bloom[b >> 6] |= 1ULL << (b & 63);
+  }
+}
+
+static int bloom_test( patch_t *p, uint64_t key )
+{
+  uint64_t h = patch_hash( key );
+  uint32_t h1 = (uint32_t) h, h2 = (uint32_t) (h >> 32) | 1, b;
+  int i;
+  for( i = 0; i < PATCH_BLOOM_HASH; ++i ) {
+    b = (h1 + i * h2) & p->bmask;
+    if ( !(p->bloom[b >> 6] & (1ULL << (b & 63))) ) return 0;
+  }
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Tombstones are kept sorted to be searched
+ * --------------------------------------------------------------------------*/
+static int u64_cmp( const void *a, const void *b )
+{
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+static int patch_dead( patch_t *p, uint64_t key )
+{
+  return p->ndead && bsearch( &key, p->dead, p->ndead, sizeof(uint64_t), u64_cmp );
+}
+
+/* --------------------------------------------------------------------------
+ *  mbtiles_each() callbacks : counts tiles then fills Bloom filter
+ * --------------------------------------------------------------------------*/
+static void patch_count( void *arg, int z, int x, int y, int len )
+{
+  ((patch_t*) arg)->ntiles++;
+}
+
+static void patch_fill( void *arg, int z, int x, int y, int len )
+{
+  patch_t *p = (patch_t*) arg;
+  uint64_t key = TILEID( z, x, y );
+
+  bloom_add( p, key );
+  if ( len == 0 ) {
+    if ( p->ndead == p->szdead ) {
+      p->szdead = p->szdead ? 2 * p->szdead : 64;
+      p->dead = (uint64_t*) realloc( p->dead, p->szdead * sizeof(uint64_t));
+      if ( p->dead == NULL ) {
+	fputs( "patch: memory allocation error.\n", stderr );
+	exit(1);
+      }
+    }
+    p->dead[p->ndead++] = key;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Release patch
+ * --------------------------------------------------------------------------*/
+static void patch_free( patch_t *p )
+{
+  mbtiles_close( p->h );
+  free( p->bloom );
+  free( p->dead );
+  free( p->path );
+}
+
+/* --------------------------------------------------------------------------
+ *  Open patch file and build its Bloom filter
+ * --------------------------------------------------------------------------*/
+static int patch_load( patchset_t *ps, patch_t *p )
+{
+  uint32_t nbits = 64;
+
+  p->h = mbtiles_open( p->path );
+  if ( p->h == NULL ) {
+    return -1;
+  }
+  if ( mbtiles_each( p->h, patch_count, p ) < 0 ) {
+    mbtiles_close( p->h );
+    return -1;
+  }
+  while( nbits < (uint64_t) p->ntiles * PATCH_BLOOM_BITS ) nbits *= 2;
+  p->bmask = nbits - 1;
+  p->bloom = (uint64_t*) calloc( nbits / 64, sizeof(uint64_t));
+  if ( p->bloom == NULL ) {
+    fputs( "patch: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  mbtiles_each( p->h, patch_fill, p );
+  if ( p->ndead > 1 ) {
+    qsort( p->dead, p->ndead, sizeof(uint64_t), u64_cmp );
+  }
+  if ( ps->indexed ) {
+    mbtiles_index( p->h );
+  }
+  p->serial = ++ps->serial;
+  logger( "patch '%s' : %d tiles, %d tombstones\n", p->path, p->ntiles, p->ndead );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Selects patch files when scanning directory
+ * --------------------------------------------------------------------------*/
+static int patch_filter( const struct dirent *d )
+{
+  char *ext = strrchr( d->d_name, '.' );
+  return (d->d_name[0] != '.') && ext && !strcmp( ext, ".mbtiles" );
+}
+
+/* --------------------------------------------------------------------------
+ *  Scans patch directory : new and modified files are loaded, removed
+ *  ones are closed. Returns the number of changes, -1 on error.
+ * --------------------------------------------------------------------------*/
+int patch_rescan( source_t *src )
+{
+  patchset_t *ps = (patchset_t*) src->h;
+  struct dirent **ents;
+  struct stat st;
+  patch_t *tab;
+  int i, j, n, k = 0, changes = 0;
+
+  if ( src->ops != &patch_ops ) {
+    return 0;
+  }
+  
+  n = scandir( ps->dir, &ents, patch_filter, alphasort );
+  if ( n < 0 ) {
+    perror( ps->dir );
+    return -1;
+  }
+  tab = (patch_t*) calloc( n + 1, sizeof(patch_t));
+  if ( tab == NULL ) {
+    fputs( "patch: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  
+  for( i = 0; i < n; ++i ) {
+    patch_t *p = tab + k;
+    p->path = (char*) malloc( strlen(ps->dir) + strlen(ents[i]->d_name) + 2 );
+    if ( p->path == NULL ) {
+      fputs( "patch: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    sprintf( p->path, "%s/%s", ps->dir, ents[i]->d_name );
+    free( ents[i] );
+    if ( stat( p->path, &st ) != 0 ) {
+      perror( p->path );
+      free( p->path );
+      continue;
+    }
+    
+    // keep unchanged patches
+    for( j = 0; j < ps->npatches; ++j ) {
+      patch_t *o = ps->patches + j;
+      if ( o->h && !strcmp( o->path, p->path ) &&
+	   (o->mtime == st.st_mtime) && (o->size == st.st_size) ) {
+	free( p->path );
+	*p = *o;
+	o->h = NULL;
+	break;
+      }
+    }
+    if ( j == ps->npatches ) {
+      p->mtime = st.st_mtime;
+      p->size = st.st_size;
+      if ( patch_load( ps, p ) < 0 ) {
+	fprintf( stderr, "patch: skipping '%s'\n", p->path );
+	free( p->path );
+	memset( p, 0, sizeof(patch_t));
+	continue;
+      }
+      changes++;
+    }
+    k++;
+  }
+  free( ents );
+
+  // close removed or modified patches
+  for( j = 0; j < ps->npatches; ++j ) {
+    if ( ps->patches[j].h ) {
+      logger( "patch '%s' removed\n", ps->patches[j].path );
+      patch_free( ps->patches + j );
+      changes++;
+    }
+  }
+  free( ps->patches );
+  ps->patches = tab;
+  ps->npatches = k;
+  
+  logger( "patch directory '%s' : %d patches, %d changes\n", ps->dir, k, changes );
+  return changes;
+}
+
+/* --------------------------------------------------------------------------
+ *  Wraps base source so that patches of directory 'dir' are applied
+ *  to it. The base source is closed with the returned source.
+ * --------------------------------------------------------------------------*/
+source_t *patch_source( source_t *base, char *dir )
+{
+  patchset_t *ps;
+  source_t *src;
+
+  ps = (patchset_t*) calloc( 1, sizeof(patchset_t));
+  src = (source_t*) calloc( 1, sizeof(source_t));
+  if ( (ps == NULL) || (src == NULL) ) {
+    fputs( "patch: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  ps->base = base;
+  ps->dir = dir;
+  src->path = base->path;
+  src->ops = &patch_ops;
+  src->h = ps;
+  
+  if ( patch_rescan( src ) < 0 ) {
+    free( ps );
+    free( src );
+    return NULL;
+  }
+  return src;
+}
+
+/* --------------------------------------------------------------------------
+ *  Finds the patch holding a tile. Returns 1 and sets 'id' when found,
+ *  0 for tombstones, -1 when no patch holds the tile.
+ * --------------------------------------------------------------------------*/
+static int patch_find( patchset_t *ps, int z, int x, int y, uint64_t *id )
+{
+  uint64_t key = TILEID( z, x, y ), pid;
+  int i;
+
+  for( i = ps->npatches - 1; i >= 0; --i ) {
+    patch_t *p = ps->patches + i;
+    if ( !bloom_test( p, key ) ) {
+      continue;
+    }
+    if ( patch_dead( p, key ) ) {
+      return 0;
+    }
+    // false positives of Bloom filter go on to next patch
+    if ( mbtiles_tile_id( p->h, z, x, y, &pid ) > 0 ) {
+      *id = PATCHID( p->serial, pid );
+      return 1;
+    }
+  }
+  return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Source operations
+ * --------------------------------------------------------------------------*/
+static void patch_close( void *h )
+{
+  patchset_t *ps = (patchset_t*) h;
+  int i;
+
+  for( i = 0; i < ps->npatches; ++i ) {
+    patch_free( ps->patches + i );
+  }
+  free( ps->patches );
+  source_close( ps->base );
+  free( ps );
+}
+
+static char *patch_read_id( void *h, uint64_t id, int *len )
+{
+  patchset_t *ps = (patchset_t*) h;
+  unsigned serial;
+  int i;
+  
+  if ( !(id >> 63) ) {
+    return source_read_id( ps->base, id, len );
+  }
+  serial = PATCHID_SERIAL( id );
+  for( i = 0; i < ps->npatches; ++i ) {
+    if ( ps->patches[i].serial == serial ) {
+      return mbtiles_read_id( ps->patches[i].h, PATCHID_ID( id ), len );
+    }
+  }
+  return NULL;
+}
+
+static int patch_tile_id( void *h, int z, int x, int y, uint64_t *id )
+{
+  patchset_t *ps = (patchset_t*) h;
+  int rc = patch_find( ps, z, x, y, id );
+  
+  if ( rc >= 0 ) {
+    return rc;
+  }
+  return source_tile_id( ps->base, z, x, y, id );
+}
+
+static char *patch_read( void *h, int z, int x, int y, int *len )
+{
+  patchset_t *ps = (patchset_t*) h;
+  uint64_t id;
+  int rc = patch_find( ps, z, x, y, &id );
+  
+  if ( rc > 0 ) {
+    return patch_read_id( h, id, len );
+  }
+  if ( rc == 0 ) {
+    return NULL;
+  }
+  return source_read( ps->base, z, x, y, len );
+}
+
+static char *patch_tiles_json( void *h, int *len )
+{
+  return source_tiles_json( ((patchset_t*) h)->base, len );
+}
+
+static int patch_index( void *h )
+{
+  patchset_t *ps = (patchset_t*) h;
+  int i;
+
+  ps->indexed = 1;
+  for( i = 0; i < ps->npatches; ++i ) {
+    mbtiles_index( ps->patches[i].h );
+  }
+  return source_index( ps->base );
+}
+
+static int patch_shared( void *h, uint64_t **ids )
+{
+  return source_shared( ((patchset_t*) h)->base, ids );
+}
+
+static source_ops_t patch_ops = {
+  "patch",
+  NULL,
+  patch_close,
+  patch_read,
+  patch_tiles_json,
+  patch_tile_id,
+  patch_read_id,
+  patch_index,
+  patch_shared,
+  NULL
+};
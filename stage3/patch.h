@@ -0,0 +1,21 @@
+#ifndef __PATCH_H__
+#define __PATCH_H__
+
+#include "source.h"
+
+/* --------------------------------------------------------------------------
+ *  Patch mbtiles applied over a base tile source
+ *  Patches are the '.mbtiles' files of a directory, applied in file name
+ *  order : a tile is looked up in the last patch first, then in previous
+ *  ones and finally in the base source. A tile stored with empty data
+ *  is a tombstone hiding the tile of previous patches and base.
+ * --------------------------------------------------------------------------*/
+
+// Bloom filter size and hash count : ~1% false positives
+#define PATCH_BLOOM_BITS 10
+#define PATCH_BLOOM_HASH 7
+
+source_t *patch_source( source_t *base, char *dir );
+int patch_rescan( source_t *src );
+
+#endif
@@ -0,0 +1,569 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <json.h>
+
+#include "pmtiles.h"
+#include "hilbert.h"
+#include "mbtiles.h"
+
+extern void logger(const char *fmt, ...);
+
+/* --------------------------------------------------------------------------
+ *  PMTiles version 3 reader
+ *  https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md
+ * --------------------------------------------------------------------------*/
+#define PM_HDRSZ 127
+
+// compression
+#define PM_COMP_UNKNOWN 0
+#define PM_COMP_NONE    1
+#define PM_COMP_GZIP    2
+
+// tile types
+#define PM_TYPE_MVT     1
+#define PM_TYPE_PNG     2
+#define PM_TYPE_JPEG    3
+#define PM_TYPE_WEBP    4
+
+// max depth of leaf directories
+#define PM_MAXDEPTH 4
+
+// number of cached leaf directories
+#define PM_LEAFCACHE 64
+
+typedef struct pmentry_s {
+  uint64_t tile_id;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t run_length;        // 0 for leaf directory entries
+} pmentry_t;
+
+typedef struct pmdir_s {
+  pmentry_t *e;
+  int n;
+} pmdir_t;
+
+typedef struct pmleaf_s {
+  uint64_t offset;            // leaf offset, key of the cache entry
+  pmdir_t dir;
+  unsigned int stamp;         // last use
+} pmleaf_t;
+
+typedef struct pmtiles_s {
+  int fd;
+  char *map;                  // mapped file or NULL if pread is used
+  size_t size;
+  char *buf;                  // buffer for pread
+  size_t bufsz;
+  
+  uint64_t root_off, root_len;
+  uint64_t meta_off, meta_len;
+  uint64_t leaf_off, leaf_len;
+  uint64_t data_off, data_len;
+  int internal_comp;
+  int tile_comp;
+  int tile_type;
+  int minzoom, maxzoom;
+  double bounds[4];
+  int center_zoom;
+  double center[2];
+  
+  pmdir_t root;
+  pmleaf_t leaves[PM_LEAFCACHE];
+  unsigned int stamp;
+
+  char *tiles_json;
+  int tjlen;
+} pmtiles_t;
+
+/* --------------------------------------------------------------------------
+ *  Little endian integer readers
+ * --------------------------------------------------------------------------*/
+static uint64_t rd64( unsigned char *p )
+{
+  uint64_t v = 0;
+  int i;
+  for( i = 7; i >= 0; --i ) v = (v << 8) | p[i];
+  return v;
+}
+
+static int32_t rd32( unsigned char *p )
+{
+  return (int32_t) ((uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+		    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24));
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a varint, returns 0 if buffer is exhausted
+ * --------------------------------------------------------------------------*/
+static int rdvarint( unsigned char **p, unsigned char *end, uint64_t *v )
+{
+  int shift = 0;
+  *v = 0;
+  while ( *p < end && shift < 64 ) {
+    unsigned char b = *(*p)++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if ( !(b & 0x80) ) return 1;
+    shift += 7;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns pointer on 'len' bytes of file at offset 'off'
+ *  Data is read in handle buffer when file isn't mapped in memory
+ *  and is valid until next call.
+ * --------------------------------------------------------------------------*/
+static char *pm_get( pmtiles_t *p, uint64_t off, uint64_t len )
+{
+  ssize_t n;
+  
+  if ( off + len > p->size ) {
+    fprintf( stderr, "pmtiles: read beyond end of file.\n" );
+    return NULL;
+  }
+  if ( p->map ) {
+    return p->map + off;
+  }
+  if ( len > p->bufsz ) {
+    free( p->buf );
+    p->bufsz = len;
+    p->buf = (char*) malloc( len ? len : 1 );
+    if ( p->buf == NULL ) {
+      fputs( "pmtiles: memory allocation error.\n", stderr );
+      exit(1);
+    }
+  }
+  n = pread( p->fd, p->buf, len, off );
+  if ( n != (ssize_t) len ) {
+    perror( "pmtiles: pread()" );
+    return NULL;
+  }
+  return p->buf;
+}
+
+/* --------------------------------------------------------------------------
+ *  Decompress internal data (directories, metadata)
+ *  Returns a malloc'ed buffer, NULL on error.
+ * --------------------------------------------------------------------------*/
+static char *pm_decompress( pmtiles_t *p, char *data, uint64_t len, uint64_t *ulen )
+{
+  char *out;
+  
+  if ( p->internal_comp == PM_COMP_NONE ) {
+    out = (char*) malloc( len + 1 );
+    if ( out == NULL ) {
+      fputs( "pmtiles: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    memcpy( out, data, len );
+    out[len] = 0;
+    *ulen = len;
+    return out;
+  }
+  else if ( p->internal_comp == PM_COMP_GZIP ) {
+    z_stream zs;
+    size_t sz = 4*len + 64;
+    int rc;
+
+    memset( &zs, 0, sizeof(zs));
+    if ( inflateInit2( &zs, 16 + MAX_WBITS ) != Z_OK ) {
+      fprintf( stderr, "pmtiles: inflateInit2() failed.\n" );
+      return NULL;
+    }
+    out = (char*) malloc( sz + 1 );
+    if ( out == NULL ) {
+      fputs( "pmtiles: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    zs.next_in = (Bytef*) data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*) out;
+    zs.avail_out = sz;
+    while( (rc = inflate( &zs, Z_NO_FLUSH )) == Z_OK ) {
+      if ( zs.avail_out == 0 ) {
+	out = (char*) realloc( out, 2*sz + 1 );
+	if ( out == NULL ) {
+	  fputs( "pmtiles: memory allocation error.\n", stderr );
+	  exit(1);
+	}
+	zs.next_out = (Bytef*) out + sz;
+	zs.avail_out = sz;
+	sz *= 2;
+      }
+    }
+    *ulen = zs.total_out;
+    inflateEnd( &zs );
+    if ( rc != Z_STREAM_END ) {
+      fprintf( stderr, "pmtiles: failed to decompress data.\n" );
+      free( out );
+      return NULL;
+    }
+    out[*ulen] = 0;
+    return out;
+  }
+  fprintf( stderr, "pmtiles: unsupported internal compression %d.\n", p->internal_comp );
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Decode a directory stored at offset 'off'
+ *  Entries are run-length and delta encoded in columns.
+ * --------------------------------------------------------------------------*/
+static int pm_read_dir( pmtiles_t *p, uint64_t off, uint64_t len, pmdir_t *dir )
+{
+  unsigned char *u, *s, *end;
+  uint64_t ulen, n, v, last = 0;
+  char *data;
+  int i;
+
+  dir->e = NULL;
+  dir->n = 0;
+  
+  data = pm_get( p, off, len );
+  if ( data == NULL ) return -1;
+  u = (unsigned char*) pm_decompress( p, data, len, &ulen );
+  if ( u == NULL ) return -1;
+  s = u;
+  end = u + ulen;
+
+  if ( !rdvarint( &s, end, &n ) || (n > ulen) ) goto bad;
+  dir->e = (pmentry_t*) calloc( n ? n : 1, sizeof(pmentry_t));
+  if ( dir->e == NULL ) {
+    fputs( "pmtiles: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  dir->n = (int) n;
+  
+  for( i = 0; i < n; ++i ) {
+    if ( !rdvarint( &s, end, &v ) ) goto bad;
+    last += v;
+    dir->e[i].tile_id = last;
+  }
+  for( i = 0; i < n; ++i ) {
+    if ( !rdvarint( &s, end, &v ) ) goto bad;
+    dir->e[i].run_length = (uint32_t) v;
+  }
+  for( i = 0; i < n; ++i ) {
+    if ( !rdvarint( &s, end, &v ) ) goto bad;
+    dir->e[i].length = (uint32_t) v;
+  }
+  for( i = 0; i < n; ++i ) {
+    if ( !rdvarint( &s, end, &v ) ) goto bad;
+    if ( (v == 0) && (i > 0) ) {
+      dir->e[i].offset = dir->e[i-1].offset + dir->e[i-1].length;
+    }
+    else {
+      dir->e[i].offset = v - 1;
+    }
+  }
+  free( u );
+  return 0;
+
+ bad:
+  fprintf( stderr, "pmtiles: corrupted directory at offset %llu.\n", (unsigned long long) off );
+  free( u );
+  free( dir->e );
+  dir->e = NULL;
+  dir->n = 0;
+  return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Retrieve leaf directory from cache, reading it if needed
+ * --------------------------------------------------------------------------*/
+static pmdir_t *pm_leaf( pmtiles_t *p, uint64_t off, uint64_t len )
+{
+  pmleaf_t *l, *lru = p->leaves;
+  int i;
+
+  p->stamp++;
+  for( i = 0; i < PM_LEAFCACHE; ++i ) {
+    l = p->leaves + i;
+    if ( l->dir.e && (l->offset == off) ) {
+      l->stamp = p->stamp;
+      return &l->dir;
+    }
+    if ( l->stamp < lru->stamp ) lru = l;
+  }
+
+  logger( "pmtiles: reading leaf directory at %llu\n", (unsigned long long) off );
+  free( lru->dir.e );
+  lru->dir.e = NULL;
+  lru->offset = off;
+  lru->stamp = p->stamp;
+  if ( pm_read_dir( p, p->leaf_off + off, len, &lru->dir ) ) {
+    return NULL;
+  }
+  return &lru->dir;
+}
+
+/* --------------------------------------------------------------------------
+ *  Search the entry of 'tile_id', going down in leaf directories
+ * --------------------------------------------------------------------------*/
+static pmentry_t *pm_search( pmtiles_t *p, uint64_t tile_id )
+{
+  pmdir_t *dir = &p->root;
+  pmentry_t *e;
+  int depth, lo, hi, mid;
+
+  for( depth = 0; dir && depth < PM_MAXDEPTH; ++depth ) {
+    // find last entry with entry tile id <= tile_id
+    lo = 0;
+    hi = dir->n - 1;
+    while( lo <= hi ) {
+      mid = (lo + hi) / 2;
+      if ( dir->e[mid].tile_id <= tile_id ) {
+	lo = mid + 1;
+      }
+      else {
+	hi = mid - 1;
+      }
+    }
+    if ( hi < 0 ) return NULL;
+    e = dir->e + hi;
+    if ( e->run_length == 0 ) {
+      dir = pm_leaf( p, e->offset, e->length );
+    }
+    else if ( tile_id - e->tile_id < e->run_length ) {
+      return e;
+    }
+    else {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Compute PMTiles tile id : number of tiles of lower zoom levels plus
+ *  position along the Hilbert curve
+ * --------------------------------------------------------------------------*/
+static uint64_t pm_tile_id( int z, int x, int y )
+{
+  uint64_t acc = (((uint64_t) 1 << (2*z)) - 1) / 3;
+  return acc + hilbert( z, x, y );
+}
+
+/* --------------------------------------------------------------------------
+ *  Open PMTiles file and returns a handle to it
+ * --------------------------------------------------------------------------*/
+void *pmtiles_open( char *path )
+{
+  unsigned char *h;
+  struct stat stb;
+  pmtiles_t *p;
+
+  p = (pmtiles_t*) calloc( 1, sizeof(pmtiles_t));
+  if ( p == NULL ) {
+    fputs( "pmtiles_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  
+  p->fd = open( path, O_RDONLY );
+  if ( p->fd == -1 ) {
+    perror( path );
+    free( p );
+    return NULL;
+  }
+  if ( fstat( p->fd, &stb ) == -1 ) {
+    perror( path );
+    goto err;
+  }
+  p->size = stb.st_size;
+
+  // map file in memory, fall back to pread if not possible
+  p->map = (char*) mmap( NULL, p->size, PROT_READ, MAP_SHARED, p->fd, 0 );
+  if ( p->map == MAP_FAILED ) {
+    logger( "pmtiles: mmap() failed, using pread()\n" );
+    p->map = NULL;
+  }
+
+  h = (unsigned char*) pm_get( p, 0, PM_HDRSZ );
+  if ( (h == NULL) || memcmp( h, PMTILES_MAGIC, 7 ) || (h[7] != 3) ) {
+    fprintf( stderr, "File '%s' is not a PMTiles version 3 file.\n", path );
+    goto err;
+  }
+  
+  p->root_off = rd64( h + 8 );
+  p->root_len = rd64( h + 16 );
+  p->meta_off = rd64( h + 24 );
+  p->meta_len = rd64( h + 32 );
+  p->leaf_off = rd64( h + 40 );
+  p->leaf_len = rd64( h + 48 );
+  p->data_off = rd64( h + 56 );
+  p->data_len = rd64( h + 64 );
+  p->internal_comp = h[97];
+  p->tile_comp = h[98];
+  p->tile_type = h[99];
+  p->minzoom = h[100];
+  p->maxzoom = h[101];
+  p->bounds[0] = rd32( h + 102 ) / 1e7;
+  p->bounds[1] = rd32( h + 106 ) / 1e7;
+  p->bounds[2] = rd32( h + 110 ) / 1e7;
+  p->bounds[3] = rd32( h + 114 ) / 1e7;
+  p->center_zoom = h[118];
+  p->center[0] = rd32( h + 119 ) / 1e7;
+  p->center[1] = rd32( h + 123 ) / 1e7;
+
+  if ( (p->tile_comp != PM_COMP_NONE) && (p->tile_comp != PM_COMP_GZIP) ) {
+    fprintf( stderr, "File '%s' : unsupported tile compression %d.\n", path, p->tile_comp );
+    goto err;
+  }
+  
+  if ( pm_read_dir( p, p->root_off, p->root_len, &p->root ) ) {
+    goto err;
+  }
+  
+  logger( "pmtiles '%s' : zoom %d-%d, %d root entries\n",
+	  path, p->minzoom, p->maxzoom, p->root.n );
+  return (void*) p;
+
+ err:
+  pmtiles_close( p );
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Close PMTiles file
+ * --------------------------------------------------------------------------*/
+void pmtiles_close( void *h )
+{
+  pmtiles_t *p = (pmtiles_t*) h;
+  int i;
+  
+  if ( p == NULL ) return;
+  if ( p->map ) munmap( p->map, p->size );
+  close( p->fd );
+  for( i = 0; i < PM_LEAFCACHE; ++i ) {
+    free( p->leaves[i].dir.e );
+  }
+  free( p->root.e );
+  free( p->buf );
+  free( p->tiles_json );
+  free( p );
+}
+
+/* --------------------------------------------------------------------------
+ *  Retrieve tile id : offset and length of data in the tile data
+ *  section, so tiles sharing the same data share the same id.
+ * --------------------------------------------------------------------------*/
+int pmtiles_tile_id( void *h, int z, int x, int y, uint64_t *id )
+{
+  pmtiles_t *p = (pmtiles_t*) h;
+  pmentry_t *e;
+
+  if ( (z < 0) || (z > 26) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+    return 0;
+  }
+  e = pm_search( p, pm_tile_id( z, x, y ));
+  if ( e == NULL ) return 0;
+  *id = ((uint64_t) e->length << 40) | e->offset;
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile given its id
+ * --------------------------------------------------------------------------*/
+char *pmtiles_read_id( void *h, uint64_t id, int *len )
+{
+  pmtiles_t *p = (pmtiles_t*) h;
+  uint64_t off = id & ((1ULL << 40) - 1);
+  char *data;
+
+  *len = (int) (id >> 40);
+  data = pm_get( p, p->data_off + off, *len );
+  if ( data == NULL ) {
+    *len = 0;
+  }
+  return data;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile
+ * --------------------------------------------------------------------------*/
+char *pmtiles_read( void *h, int z, int x, int y, int *len )
+{
+  uint64_t id;
+  if ( !pmtiles_tile_id( h, z, x, y, &id ) ) {
+    logger( "No tile %d/%d/%d\n", z, x, y );
+    *len = 0;
+    return NULL;
+  }
+  return pmtiles_read_id( h, id, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' from PMTiles header and metadata
+ * --------------------------------------------------------------------------*/
+char *pmtiles_tiles_json( void *h, int *len )
+{
+  pmtiles_t *p = (pmtiles_t*) h;
+
+  if ( p->tiles_json == NULL ) {
+    mbtiles_meta_t meta = { .minzoom = -1, .maxzoom = -1 };
+    struct json_object *o, *m, *v;
+    char *format = NULL, *data;
+    static char *keys[] = { "name", "attribution", "description", "version" };
+    uint64_t ulen;
+    int i;
+
+    switch( p->tile_type ) {
+    case PM_TYPE_MVT:  format = "pbf"; break;
+    case PM_TYPE_PNG:  format = "png"; break;
+    case PM_TYPE_JPEG: format = "jpg"; break;
+    case PM_TYPE_WEBP: format = "webp"; break;
+    }
+    if ( format ) {
+      mbtiles_meta_set( &meta, "format", format );
+    }
+    meta.minzoom = p->minzoom;
+    meta.maxzoom = p->maxzoom;
+    for( i = 0; i < 4; ++i ) {
+      meta.bounds[i] = p->bounds[i];
+    }
+    meta.nbounds = 4;
+    meta.center[0] = p->center[0];
+    meta.center[1] = p->center[1];
+    meta.center[2] = p->center_zoom;
+    meta.ncenter = 3;
+
+    // metadata is a JSON object holding 'vector_layers' like the
+    // 'json' field of mbtiles metadata
+    data = pm_get( p, p->meta_off, p->meta_len );
+    data = data ? pm_decompress( p, data, p->meta_len, &ulen ) : NULL;
+    if ( data ) {
+      m = json_tokener_parse( data );
+      if ( m ) {
+	for( i = 0; i < sizeof(keys)/sizeof(keys[0]); ++i ) {
+	  if ( json_object_object_get_ex( m, keys[i], &v ) ) {
+	    mbtiles_meta_set( &meta, keys[i], (char*) json_object_get_string(v) );
+	  }
+	}
+	if ( json_object_object_get_ex( m, "vector_layers", &v ) ) {
+	  meta.vector_layers = json_object_get( v );
+	}
+	json_object_put( m );
+      }
+      free( data );
+    }
+
+    o = mbtiles_meta_object( &meta );
+    p->tiles_json = strdup( mbtiles_meta_json( o, &p->tjlen ));
+    json_object_put( o );
+    mbtiles_meta_clear( &meta );
+  }
+
+  if ( len != NULL ) {
+    *len = p->tjlen;
+  }
+  return p->tiles_json;
+}
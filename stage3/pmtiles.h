@@ -0,0 +1,15 @@
+#ifndef __PMTILES_H__
+#define __PMTILES_H__
+
+#include <stdint.h>
+
+#define PMTILES_MAGIC "PMTiles"
+
+void *pmtiles_open( char *path );
+void  pmtiles_close( void *h );
+char *pmtiles_read( void *h, int z, int x, int y, int *len );
+int   pmtiles_tile_id( void *h, int z, int x, int y, uint64_t *id );
+char *pmtiles_read_id( void *h, uint64_t id, int *len );
+char *pmtiles_tiles_json( void *h, int *len );
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefetch.h"
+
+extern void logger(const char *fmt, ...);
+
+typedef struct pfentry_s {
+  void *map;                  // NULL for entries queued again later
+  int z, x, y;
+} pfentry_t;
+
+static struct {
+  pfentry_t tab[PREFETCH_QUEUE];
+  int head, count;            // ring of queued tiles, newest at head+count-1
+  int wloaded, whits;         // current budget window
+  prefetch_stats_t stats;
+} g_pf;
+
+/* --------------------------------------------------------------------------
+ *  Sets the max number of tiles loaded per idle slice, the budget starts
+ *  at its lowest value.
+ * --------------------------------------------------------------------------*/
+void prefetch_init( int maxbudget )
+{
+  memset( &g_pf, 0, sizeof(g_pf));
+  if ( maxbudget < 1 ) maxbudget = 1;
+  g_pf.stats.maxbudget = maxbudget;
+  g_pf.stats.budget = (maxbudget < PREFETCH_MINBUDGET) ? maxbudget : PREFETCH_MINBUDGET;
+  logger( "prefetch : at most %d tiles per idle slice\n", maxbudget );
+}
+
+/* --------------------------------------------------------------------------
+ *  Queues a tile, a tile already queued is moved to the top of the queue
+ * --------------------------------------------------------------------------*/
+void prefetch_push( void *map, int z, int x, int y )
+{
+  pfentry_t *e;
+  int i;
+
+  for( i = 0; i < g_pf.count; ++i ) {
+    e = g_pf.tab + (g_pf.head + i) % PREFETCH_QUEUE;
+    if ( (e->map == map) && (e->z == z) && (e->x == x) && (e->y == y) ) {
+      e->map = NULL;
+      break;
+    }
+  }
+  if ( i == g_pf.count ) {
+    g_pf.stats.queued++;
+  }
+  if ( g_pf.count == PREFETCH_QUEUE ) {
+    if ( g_pf.tab[g_pf.head].map ) {
+      g_pf.stats.dropped++;
+    }
+    g_pf.head = (g_pf.head + 1) % PREFETCH_QUEUE;
+    g_pf.count--;
+  }
+  e = g_pf.tab + (g_pf.head + g_pf.count) % PREFETCH_QUEUE;
+  e->map = map;
+  e->z = z;
+  e->x = x;
+  e->y = y;
+  g_pf.count++;
+}
+
+/* --------------------------------------------------------------------------
+ *  Gets the most recently queued tile, returns 0 if the queue is empty
+ * --------------------------------------------------------------------------*/
+int prefetch_pop( void **map, int *z, int *x, int *y )
+{
+  pfentry_t *e;
+
+  while( g_pf.count > 0 ) {
+    g_pf.count--;
+    e = g_pf.tab + (g_pf.head + g_pf.count) % PREFETCH_QUEUE;
+    if ( e->map ) {
+      *map = e->map;
+      *z = e->z;
+      *x = e->x;
+      *y = e->y;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns non zero when tiles are queued
+ * --------------------------------------------------------------------------*/
+int prefetch_pending()
+{
+  return g_pf.count;
+}
+
+/* --------------------------------------------------------------------------
+ *  Empties the queue, called when the server is under load
+ * --------------------------------------------------------------------------*/
+void prefetch_cancel()
+{
+  int i;
+
+  for( i = 0; i < g_pf.count; ++i ) {
+    if ( g_pf.tab[(g_pf.head + i) % PREFETCH_QUEUE].map ) {
+      g_pf.stats.cancelled++;
+    }
+  }
+  g_pf.head = g_pf.count = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Counts a tile loaded in cache. Every PREFETCH_WINDOW tiles the budget
+ *  is doubled when half of the loaded tiles were requested and halved
+ *  when less than a quarter were.
+ * --------------------------------------------------------------------------*/
+void prefetch_loaded()
+{
+  prefetch_stats_t *st = &g_pf.stats;
+  int b = st->budget;
+
+  st->loaded++;
+  if ( ++g_pf.wloaded < PREFETCH_WINDOW ) {
+    return;
+  }
+  if ( 2 * g_pf.whits >= PREFETCH_WINDOW ) {
+    b = (2 * b > st->maxbudget) ? st->maxbudget : 2 * b;
+  }
+  else if ( 4 * g_pf.whits < PREFETCH_WINDOW ) {
+    b = (b / 2 < PREFETCH_MINBUDGET) ? PREFETCH_MINBUDGET : b / 2;
+    if ( b > st->maxbudget ) b = st->maxbudget;
+  }
+  if ( b != st->budget ) {
+    logger( "prefetch : %d/%d tiles requested, budget %d -> %d\n",
+	    g_pf.whits, g_pf.wloaded, st->budget, b );
+    st->budget = b;
+  }
+  g_pf.wloaded = g_pf.whits = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Counts a request served by a prefetched tile
+ * --------------------------------------------------------------------------*/
+void prefetch_hit()
+{
+  g_pf.stats.hits++;
+  g_pf.whits++;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns counters
+ * --------------------------------------------------------------------------*/
+prefetch_stats_t *prefetch_stats()
+{
+  return &g_pf.stats;
+}
@@ -0,0 +1,45 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+/* --------------------------------------------------------------------------
+ *  Prefetch queue : tiles likely to be requested next (neighbours and
+ *  children of requested tiles) are queued and loaded in the tile cache
+ *  while the server is idle. The most recently queued tiles are loaded
+ *  first, the oldest ones are dropped when the queue is full.
+ * --------------------------------------------------------------------------*/
+
+// queued tiles
+#define PREFETCH_QUEUE 256
+
+// tiles loaded per idle slice adapt between these bounds
+#define PREFETCH_MINBUDGET 2
+
+// time allowed to an idle slice in milliseconds
+#define PREFETCH_SLICE 10
+
+// loaded tiles between budget updates
+#define PREFETCH_WINDOW 32
+
+// ready descriptors between idle polls cancelling queued tiles
+#define PREFETCH_BUSY 16
+
+typedef struct prefetch_stats_s {
+  unsigned long queued;       // tiles queued
+  unsigned long dropped;      // queued tiles dropped when the queue is full
+  unsigned long cancelled;    // queued tiles cancelled under load
+  unsigned long loaded;       // tiles loaded in cache
+  unsigned long hits;         // loaded tiles requested afterwards
+  int budget;                 // current tiles per idle slice
+  int maxbudget;
+} prefetch_stats_t;
+
+void prefetch_init( int maxbudget );
+void prefetch_push( void *map, int z, int x, int y );
+int  prefetch_pop( void **map, int *z, int *x, int *y );
+int  prefetch_pending();
+void prefetch_cancel();
+void prefetch_loaded();
+void prefetch_hit();
+prefetch_stats_t *prefetch_stats();
+
+#endif
@@ -0,0 +1,274 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#include "pyramid.h"
+#include "mbtiles.h"
+#include "raster.h"
+
+extern void logger(const char *fmt, ...);
+
+// decoded tile, either read from source or made
+typedef struct decoded_s {
+  uint64_t key;
+  image_t img;
+  int type;
+  unsigned stamp;
+} decoded_t;
+
+typedef struct pyramid_s {
+  source_t *base;
+  int minzoom, levels;
+  decoded_t dec[PYRAMID_CACHE];
+  unsigned stamp;
+  int nread;                  // source tiles read for last tile made
+  char *out;                  // last tile made
+  struct json_object *tiles;  // tiles.json object
+  char *tiles_json;
+  int tjlen;
+} pyramid_t;
+
+static source_ops_t pyramid_ops;
+
+/* --------------------------------------------------------------------------
+ *  Wraps raster source 'base' so that tiles up to 'levels' zoom levels
+ *  below its min zoom are available. Sources which are not raster are
+ *  returned unchanged.
+ * --------------------------------------------------------------------------*/
+source_t *pyramid_source( source_t *base, int levels )
+{
+  struct json_object *tj, *v;
+  enum json_tokener_error error;
+  pyramid_t *py;
+  source_t *src;
+  const char *format = "";
+  int minzoom = 0;
+
+  tj = json_tokener_parse_verbose( source_tiles_json( base, NULL ), &error );
+  if ( error != json_tokener_success ) {
+    fprintf( stderr, "failed to parse tiles.json: %s\n", json_tokener_error_desc( error ));
+    return base;
+  }
+  if ( json_object_object_get_ex( tj, "format", &v ) == TRUE ) {
+    format = json_object_get_string( v );
+  }
+  if ( json_object_object_get_ex( tj, "minzoom", &v ) == TRUE ) {
+    minzoom = json_object_get_int( v );
+  }
+  if ( (strcmp( format, "jpg" ) && strcmp( format, "png" )) || (minzoom <= 0) ) {
+    json_object_put( tj );
+    return base;
+  }
+  if ( levels > PYRAMID_MAXLEVELS ) levels = PYRAMID_MAXLEVELS;
+  if ( levels > minzoom ) levels = minzoom;
+
+  py = (pyramid_t*) calloc( 1, sizeof(pyramid_t));
+  src = (source_t*) calloc( 1, sizeof(source_t));
+  if ( (py == NULL) || (src == NULL) ) {
+    fputs( "pyramid: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  py->base = base;
+  py->minzoom = minzoom;
+  py->levels = levels;
+  py->tiles = tj;
+  json_object_object_add( tj, "minzoom", json_object_new_int( minzoom - levels ));
+
+  src->path = base->path;
+  src->ops = &pyramid_ops;
+  src->h = py;
+  logger( "pyramid '%s' : zoom levels %d to %d\n", base->path, minzoom - levels, minzoom - 1 );
+  return src;
+}
+
+/* --------------------------------------------------------------------------
+ *  Decodes tile z/x/y into 'img' which is owned by caller. Tiles below
+ *  min zoom are made from their children. Returns image type or -1 if
+ *  the tile doesn't exist.
+ * --------------------------------------------------------------------------*/
+static int pyramid_decode( pyramid_t *py, int z, int x, int y, image_t *img )
+{
+  uint64_t key = TILEID( z, x, y );
+  decoded_t *d = py->dec;
+  image_t child[4], *pc[4];
+  size_t sz;
+  char *data;
+  int i, len, rc, type = -1;
+
+  for( i = 0; i < PYRAMID_CACHE; ++i ) {
+    if ( py->dec[i].img.pix && (py->dec[i].key == key) ) {
+      d = py->dec + i;
+      d->stamp = ++py->stamp;
+      sz = (size_t) 4 * d->img.w * d->img.h;
+      *img = d->img;
+      img->pix = (unsigned char*) malloc( sz );
+      if ( img->pix == NULL ) {
+	fputs( "pyramid: memory allocation error.\n", stderr );
+	exit(1);
+      }
+      memcpy( img->pix, d->img.pix, sz );
+      return d->type;
+    }
+  }
+
+  if ( z >= py->minzoom ) {
+    data = source_read_quiet( py->base, z, x, y, &len );
+    if ( (data == NULL) || (len == 0) ) {
+      return -1;
+    }
+    py->nread++;
+    type = raster_type( data, len );
+    if ( raster_decode( data, len, img ) < 0 ) {
+      return -1;
+    }
+  }
+  else {
+    // children in order top left, top right, bottom left, bottom right
+    for( i = 0; i < 4; ++i ) {
+      memset( child + i, 0, sizeof(image_t));
+      rc = pyramid_decode( py, z + 1, 2*x + (i & 1), 2*y + (i >> 1), child + i );
+      pc[i] = (rc < 0) ? NULL : child + i;
+      if ( (rc >= 0) && (type < 0) ) {
+	type = rc;
+      }
+    }
+    if ( (type >= 0) && (raster_reduce( pc, img ) < 0) ) {
+      fprintf( stderr, "pyramid: children of %d/%d/%d differ in size.\n", z, x, y );
+      type = -1;
+    }
+    for( i = 0; i < 4; ++i ) {
+      raster_free( child + i );
+    }
+    if ( type < 0 ) {
+      return -1;
+    }
+  }
+
+  // keep a copy in least recently used entry, children made above
+  // have changed entries usage
+  for( d = py->dec, i = 1; i < PYRAMID_CACHE; ++i ) {
+    if ( py->dec[i].stamp < d->stamp ) {
+      d = py->dec + i;
+    }
+  }
+  raster_free( &d->img );
+  sz = (size_t) 4 * img->w * img->h;
+  d->img = *img;
+  d->img.pix = (unsigned char*) malloc( sz );
+  if ( d->img.pix == NULL ) {
+    fputs( "pyramid: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  memcpy( d->img.pix, img->pix, sz );
+  d->key = key;
+  d->type = type;
+  d->stamp = ++py->stamp;
+  return type;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile, tiles below min zoom are made from their children.
+ *  Returned data is valid until next call.
+ * --------------------------------------------------------------------------*/
+static char *pyramid_read( void *h, int z, int x, int y, int *len )
+{
+  pyramid_t *py = (pyramid_t*) h;
+  image_t img;
+  int type;
+
+  if ( z >= py->minzoom ) {
+    return source_read( py->base, z, x, y, len );
+  }
+  if ( (z < py->minzoom - py->levels) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+    return NULL;
+  }
+
+  memset( &img, 0, sizeof(img));
+  py->nread = 0;
+  type = pyramid_decode( py, z, x, y, &img );
+  if ( type < 0 ) {
+    return NULL;
+  }
+  free( py->out );
+  py->out = raster_encode( &img, type, len );
+  raster_free( &img );
+
+  logger( "pyramid: %d/%d/%d made, %d source tiles read\n", z, x, y, py->nread );
+  return py->out;
+}
+
+/* --------------------------------------------------------------------------
+ *  Other source operations
+ * --------------------------------------------------------------------------*/
+static void pyramid_close( void *h )
+{
+  pyramid_t *py = (pyramid_t*) h;
+  int i;
+
+  for( i = 0; i < PYRAMID_CACHE; ++i ) {
+    raster_free( &py->dec[i].img );
+  }
+  free( py->out );
+  json_object_put( py->tiles );
+  source_close( py->base );
+  free( py );
+}
+
+static char *pyramid_tiles_json( void *h, int *len )
+{
+  pyramid_t *py = (pyramid_t*) h;
+  if ( py->tiles_json == NULL ) {
+    py->tiles_json = (char*) json_object_to_json_string_ext( py->tiles, JSON_C_TO_STRING_PRETTY );
+    py->tjlen = strlen( py->tiles_json );
+  }
+  if ( len != NULL ) {
+    *len = py->tjlen;
+  }
+  return py->tiles_json;
+}
+
+static int pyramid_tile_id( void *h, int z, int x, int y, uint64_t *id )
+{
+  pyramid_t *py = (pyramid_t*) h;
+  // made tiles have no id and are cached by coordinates
+  if ( z < py->minzoom ) {
+    return -1;
+  }
+  return source_tile_id( py->base, z, x, y, id );
+}
+
+static char *pyramid_read_id( void *h, uint64_t id, int *len )
+{
+  return source_read_id( ((pyramid_t*) h)->base, id, len );
+}
+
+static int pyramid_index( void *h )
+{
+  return source_index( ((pyramid_t*) h)->base );
+}
+
+static int pyramid_shared( void *h, uint64_t **ids )
+{
+  return source_shared( ((pyramid_t*) h)->base, ids );
+}
+
+static source_ops_t pyramid_ops = {
+  "pyramid",
+  NULL,
+  pyramid_close,
+  pyramid_read,
+  pyramid_tiles_json,
+  pyramid_tile_id,
+  pyramid_read_id,
+  pyramid_index,
+  pyramid_shared,
+  NULL
+};
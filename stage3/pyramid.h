@@ -0,0 +1,20 @@
+#ifndef __PYRAMID_H__
+#define __PYRAMID_H__
+
+#include "source.h"
+
+/* --------------------------------------------------------------------------
+ *  Raster pyramid : tiles below the min zoom level of a raster source
+ *  are made on demand by reducing their 4 children.
+ * --------------------------------------------------------------------------*/
+
+// max number of levels below min zoom, a tile is then made from
+// 4^levels source tiles
+#define PYRAMID_MAXLEVELS 4
+
+// decoded tiles kept in memory
+#define PYRAMID_CACHE 16
+
+source_t *pyramid_source( source_t *base, int levels );
+
+#endif
@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <math.h>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "raster.h"
+
+/* --------------------------------------------------------------------------
+ *  Guess image type from magic number
+ * --------------------------------------------------------------------------*/
+int raster_type( char *data, int len )
+{
+  unsigned char *d = (unsigned char*) data;
+  if ( (len >= 3) && (d[0] == 0xff) && (d[1] == 0xd8) && (d[2] == 0xff) ) {
+    return RASTER_JPEG;
+  }
+  if ( (len >= 8) && !memcmp( d, "\x89PNG\r\n\x1a\n", 8 ) ) {
+    return RASTER_PNG;
+  }
+  return RASTER_UNKNOWN;
+}
+
+/* --------------------------------------------------------------------------
+ *  Allocates pixels of image
+ * --------------------------------------------------------------------------*/
+static void raster_alloc( image_t *img, int w, int h )
+{
+  img->w = w;
+  img->h = h;
+  img->pix = (unsigned char*) malloc( (size_t) 4 * w * h );
+  if ( img->pix == NULL ) {
+    fputs( "raster: memory allocation error.\n", stderr );
+    exit(1);
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Release image pixels
+ * --------------------------------------------------------------------------*/
+void raster_free( image_t *img )
+{
+  free( img->pix );
+  img->pix = NULL;
+  img->w = img->h = 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  libjpeg error handler : jumps back instead of exiting
+ * --------------------------------------------------------------------------*/
+typedef struct jerr_s {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jb;
+} jerr_t;
+
+static void raster_jpeg_error( j_common_ptr cinfo )
+{
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)( cinfo, msg );
+  fprintf( stderr, "raster: %s\n", msg );
+  longjmp( ((jerr_t*) cinfo->err)->jb, 1 );
+}
+
+/* --------------------------------------------------------------------------
+ *  Decode JPEG image
+ * --------------------------------------------------------------------------*/
+static int raster_decode_jpeg( char *data, int len, image_t *img )
+{
+  struct jpeg_decompress_struct cinfo;
+  jerr_t jerr;
+  JSAMPROW row;
+
+  img->pix = NULL;
+  cinfo.err = jpeg_std_error( &jerr.mgr );
+  jerr.mgr.error_exit = raster_jpeg_error;
+  if ( setjmp( jerr.jb ) ) {
+    jpeg_destroy_decompress( &cinfo );
+    raster_free( img );
+    return -1;
+  }
+
+  jpeg_create_decompress( &cinfo );
+  jpeg_mem_src( &cinfo, (unsigned char*) data, len );
+  jpeg_read_header( &cinfo, TRUE );
+#ifdef JCS_EXTENSIONS
+  cinfo.out_color_space = JCS_EXT_RGBA;
+#else
+  cinfo.out_color_space = JCS_RGB;
+#endif
+  jpeg_start_decompress( &cinfo );
+  raster_alloc( img, cinfo.output_width, cinfo.output_height );
+  img->alpha = 0;
+
+  while( cinfo.output_scanline < cinfo.output_height ) {
+    row = img->pix + (size_t) 4 * img->w * cinfo.output_scanline;
+    jpeg_read_scanlines( &cinfo, &row, 1 );
+#ifndef JCS_EXTENSIONS
+    {
+      // expand RGB to RGBA in place, from the end of row
+      int i;
+      for( i = img->w - 1; i >= 0; --i ) {
+	row[4*i+3] = 255;
+	row[4*i+2] = row[3*i+2];
+	row[4*i+1] = row[3*i+1];
+	row[4*i+0] = row[3*i+0];
+      }
+    }
+#endif
+  }
+  jpeg_finish_decompress( &cinfo );
+  jpeg_destroy_decompress( &cinfo );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Decode PNG image
+ * --------------------------------------------------------------------------*/
+static int raster_decode_png( char *data, int len, image_t *img )
+{
+  png_image pi;
+
+  memset( &pi, 0, sizeof(pi));
+  pi.version = PNG_IMAGE_VERSION;
+  if ( !png_image_begin_read_from_memory( &pi, data, len ) ) {
+    fprintf( stderr, "raster: %s\n", pi.message );
+    return -1;
+  }
+  img->alpha = (pi.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+  pi.format = PNG_FORMAT_RGBA;
+  raster_alloc( img, pi.width, pi.height );
+  if ( !png_image_finish_read( &pi, NULL, img->pix, 0, NULL ) ) {
+    fprintf( stderr, "raster: %s\n", pi.message );
+    png_image_free( &pi );
+    raster_free( img );
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Decode JPEG or PNG image, returns 0 on success, -1 on error
+ * --------------------------------------------------------------------------*/
+int raster_decode( char *data, int len, image_t *img )
+{
+  switch( raster_type( data, len )) {
+  case RASTER_JPEG:
+    return raster_decode_jpeg( data, len, img );
+  case RASTER_PNG:
+    return raster_decode_png( data, len, img );
+  }
+  fputs( "raster: unsupported image format.\n", stderr );
+  return -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Encode JPEG image, alpha channel is dropped
+ * --------------------------------------------------------------------------*/
+static char *raster_encode_jpeg( image_t *img, int *len )
+{
+  struct jpeg_compress_struct cinfo;
+  unsigned char *out = NULL;
+  unsigned long sz = 0;
+  jerr_t jerr;
+  JSAMPROW row;
+#ifndef JCS_EXTENSIONS
+  unsigned char *rgb = (unsigned char*) malloc( 3 * img->w );
+  int i;
+  if ( rgb == NULL ) {
+    fputs( "raster: memory allocation error.\n", stderr );
+    exit(1);
+  }
+#endif
+
+  cinfo.err = jpeg_std_error( &jerr.mgr );
+  jerr.mgr.error_exit = raster_jpeg_error;
+  if ( setjmp( jerr.jb ) ) {
+    jpeg_destroy_compress( &cinfo );
+    free( out );
+#ifndef JCS_EXTENSIONS
+    free( rgb );
+#endif
+    return NULL;
+  }
+
+  jpeg_create_compress( &cinfo );
+  jpeg_mem_dest( &cinfo, &out, &sz );
+  cinfo.image_width = img->w;
+  cinfo.image_height = img->h;
+#ifdef JCS_EXTENSIONS
+  cinfo.input_components = 4;
+  cinfo.in_color_space = JCS_EXT_RGBA;
+#else
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+#endif
+  jpeg_set_defaults( &cinfo );
+  jpeg_set_quality( &cinfo, RASTER_JPEG_QUALITY, TRUE );
+  jpeg_start_compress( &cinfo, TRUE );
+  while( cinfo.next_scanline < cinfo.image_height ) {
+    row = img->pix + (size_t) 4 * img->w * cinfo.next_scanline;
+#ifndef JCS_EXTENSIONS
+    for( i = 0; i < img->w; ++i ) {
+      memcpy( rgb + 3*i, row + 4*i, 3 );
+    }
+    row = rgb;
+#endif
+    jpeg_write_scanlines( &cinfo, &row, 1 );
+  }
+  jpeg_finish_compress( &cinfo );
+  jpeg_destroy_compress( &cinfo );
+#ifndef JCS_EXTENSIONS
+  free( rgb );
+#endif
+
+  *len = (int) sz;
+  return (char*) out;
+}
+
+/* --------------------------------------------------------------------------
+ *  Encode PNG image, with alpha channel if source image had one
+ * --------------------------------------------------------------------------*/
+static char *raster_encode_png( image_t *img, int *len )
+{
+  png_alloc_size_t sz = 0;
+  unsigned char *pix = img->pix;
+  png_image pi;
+  char *out;
+  int i;
+
+  memset( &pi, 0, sizeof(pi));
+  pi.version = PNG_IMAGE_VERSION;
+  pi.width = img->w;
+  pi.height = img->h;
+  pi.format = PNG_FORMAT_RGBA;
+
+  if ( !img->alpha ) {
+    // drop alpha channel, pixels are compacted in place
+    for( i = 0; i < img->w * img->h; ++i ) {
+      memmove( pix + 3*i, pix + 4*i, 3 );
+    }
+    pi.format = PNG_FORMAT_RGB;
+  }
+
+  if ( !png_image_write_to_memory( &pi, NULL, &sz, 0, pix, 0, NULL ) ) {
+    fprintf( stderr, "raster: %s\n", pi.message );
+    return NULL;
+  }
+  out = (char*) malloc( sz );
+  if ( out == NULL ) {
+    fputs( "raster: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  if ( !png_image_write_to_memory( &pi, out, &sz, 0, pix, 0, NULL ) ) {
+    fprintf( stderr, "raster: %s\n", pi.message );
+    free( out );
+    return NULL;
+  }
+  *len = (int) sz;
+  return out;
+}
+
+/* --------------------------------------------------------------------------
+ *  Encode image, returns malloc'ed data or NULL on error.
+ *  Image pixels may be modified when encoding.
+ * --------------------------------------------------------------------------*/
+char *raster_encode( image_t *img, int type, int *len )
+{
+  switch( type ) {
+  case RASTER_JPEG:
+    return raster_encode_jpeg( img, len );
+  case RASTER_PNG:
+    return raster_encode_png( img, len );
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Blends rows a and b of n bytes with weight w/256 of b
+ * --------------------------------------------------------------------------*/
+static void blend_rows( unsigned char *d, unsigned char *a, unsigned char *b, int n, int w )
+{
+  int i = 0;
+#ifdef __SSE2__
+  __m128i z = _mm_setzero_si128();
+  __m128i wa = _mm_set1_epi16( 256 - w ), wb = _mm_set1_epi16( w );
+  for( ; i + 16 <= n; i += 16 ) {
+    __m128i va = _mm_loadu_si128( (__m128i*) (a + i) );
+    __m128i vb = _mm_loadu_si128( (__m128i*) (b + i) );
+    __m128i lo = _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( va, z ), wa ),
+				_mm_mullo_epi16( _mm_unpacklo_epi8( vb, z ), wb ));
+    __m128i hi = _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( va, z ), wa ),
+				_mm_mullo_epi16( _mm_unpackhi_epi8( vb, z ), wb ));
+    _mm_storeu_si128( (__m128i*) (d + i),
+		      _mm_packus_epi16( _mm_srli_epi16( lo, 8 ), _mm_srli_epi16( hi, 8 )));
+  }
+#endif
+  for( ; i < n; ++i ) {
+    d[i] = (a[i] * (256 - w) + b[i] * w) >> 8;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Blends RGBA pixels p[0] and p[1] with weight w/256 of p[1]
+ * --------------------------------------------------------------------------*/
+static inline void blend_pixel( unsigned char *d, unsigned char *p, int w )
+{
+#ifdef __SSE2__
+  __m128i z = _mm_setzero_si128();
+  __m128i v = _mm_unpacklo_epi8( _mm_loadl_epi64( (__m128i*) p ), z );
+  v = _mm_mullo_epi16( v, _mm_set_epi16( w, w, w, w, 256 - w, 256 - w, 256 - w, 256 - w ));
+  v = _mm_srli_epi16( _mm_add_epi16( v, _mm_srli_si128( v, 8 )), 8 );
+  *(int*) d = _mm_cvtsi128_si32( _mm_packus_epi16( v, z ));
+#else
+  int i;
+  for( i = 0; i < 4; ++i ) {
+    d[i] = (p[i] * (256 - w) + p[i+4] * w) >> 8;
+  }
+#endif
+}
+
+/* --------------------------------------------------------------------------
+ *  Bilinear scaling of area sx,sy,sw,sh of image 'src' to image 'dst'
+ *  whose size is set by caller. Area is given in source pixels and may
+ *  be less than a pixel wide.
+ * --------------------------------------------------------------------------*/
+void raster_scale( image_t *src, double sx, double sy, double sw, double sh, image_t *dst )
+{
+  unsigned char *tmp;
+  int *xs, *xw;
+  double f;
+  int ox, oy, x0, y0, y1, w, xmin, xmax;
+
+  raster_alloc( dst, dst->w, dst->h );
+  dst->alpha = src->alpha;
+
+  // source column and weight of each destination column
+  xs = (int*) malloc( 2 * dst->w * sizeof(int));
+  // blended row, one more pixel so that pixel x0+1 always exists
+  tmp = (unsigned char*) malloc( 4 * (src->w + 1) + 16 );
+  if ( (xs == NULL) || (tmp == NULL) ) {
+    fputs( "raster: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  xw = xs + dst->w;
+  for( ox = 0; ox < dst->w; ++ox ) {
+    f = sx + (ox + 0.5) * sw / dst->w - 0.5;
+    if ( f < 0 ) f = 0;
+    if ( f > src->w - 1 ) f = src->w - 1;
+    xs[ox] = (int) f;
+    xw[ox] = (int) ((f - xs[ox]) * 256);
+  }
+  // only columns used are blended
+  xmin = xs[0];
+  xmax = (xs[dst->w - 1] + 1 < src->w) ? xs[dst->w - 1] + 1 : src->w - 1;
+
+  for( oy = 0; oy < dst->h; ++oy ) {
+    f = sy + (oy + 0.5) * sh / dst->h - 0.5;
+    if ( f < 0 ) f = 0;
+    if ( f > src->h - 1 ) f = src->h - 1;
+    y0 = (int) f;
+    y1 = (y0 + 1 < src->h) ? y0 + 1 : y0;
+    w = (int) ((f - y0) * 256);
+    blend_rows( tmp + 4 * xmin,
+		src->pix + (size_t) 4 * (src->w * y0 + xmin),
+		src->pix + (size_t) 4 * (src->w * y1 + xmin),
+		4 * (xmax - xmin + 1), w );
+    memcpy( tmp + 4 * (xmax + 1), tmp + 4 * xmax, 4 );
+
+    for( ox = 0; ox < dst->w; ++ox ) {
+      x0 = xs[ox];
+      blend_pixel( dst->pix + (size_t) 4 * (dst->w * oy + ox), tmp + 4 * x0, xw[ox] );
+    }
+  }
+  free( tmp );
+  free( xs );
+}
+
+/* --------------------------------------------------------------------------
+ *  Averages each 2x2 block of rows a and b of 2*n RGBA pixels into n
+ *  pixels of row d
+ * --------------------------------------------------------------------------*/
+static void reduce_rows( unsigned char *d, unsigned char *a, unsigned char *b, int n )
+{
+  int i = 0, k;
+#ifdef __SSE2__
+  for( ; i + 4 <= n; i += 4 ) {
+    // vertical average of 8 pixels, then average of even and odd pixels
+    __m128i v0 = _mm_avg_epu8( _mm_loadu_si128( (__m128i*) (a + 8*i) ),
+			       _mm_loadu_si128( (__m128i*) (b + 8*i) ));
+    __m128i v1 = _mm_avg_epu8( _mm_loadu_si128( (__m128i*) (a + 8*i + 16) ),
+			       _mm_loadu_si128( (__m128i*) (b + 8*i + 16) ));
+    __m128 f0 = _mm_castsi128_ps( v0 ), f1 = _mm_castsi128_ps( v1 );
+    __m128i even = _mm_castps_si128( _mm_shuffle_ps( f0, f1, _MM_SHUFFLE( 2, 0, 2, 0 )));
+    __m128i odd  = _mm_castps_si128( _mm_shuffle_ps( f0, f1, _MM_SHUFFLE( 3, 1, 3, 1 )));
+    _mm_storeu_si128( (__m128i*) (d + 4*i), _mm_avg_epu8( even, odd ));
+  }
+#endif
+  // same rounding as SSE2 version
+  for( ; i < n; ++i ) {
+    for( k = 0; k < 4; ++k ) {
+      d[4*i+k] = ( ((a[8*i+k] + b[8*i+k] + 1) >> 1) +
+		   ((a[8*i+k+4] + b[8*i+k+4] + 1) >> 1) + 1 ) >> 1;
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Makes parent tile 'dst' from its 4 children given in order top left,
+ *  top right, bottom left, bottom right, with a 2x2 box filter. Missing
+ *  children (NULL) leave a transparent area. Returns -1 if there is no
+ *  child or if children sizes differ.
+ * --------------------------------------------------------------------------*/
+int raster_reduce( image_t *child[4], image_t *dst )
+{
+  image_t *c;
+  int i, y, w = 0, h = 0;
+
+  for( i = 0; i < 4; ++i ) {
+    if ( child[i] == NULL ) continue;
+    if ( w == 0 ) {
+      w = child[i]->w;
+      h = child[i]->h;
+    }
+    else if ( (child[i]->w != w) || (child[i]->h != h) ) {
+      return -1;
+    }
+  }
+  if ( (w < 2) || (h < 2) ) {
+    return -1;
+  }
+
+  raster_alloc( dst, w, h );
+  memset( dst->pix, 0, (size_t) 4 * w * h );
+  dst->alpha = 0;
+  for( i = 0; i < 4; ++i ) {
+    c = child[i];
+    if ( c == NULL ) {
+      dst->alpha = 1;
+      continue;
+    }
+    dst->alpha |= c->alpha;
+    for( y = 0; y < h / 2; ++y ) {
+      reduce_rows( dst->pix + (size_t) 4 * (w * ((i >> 1) * (h / 2) + y) + (i & 1) * (w / 2)),
+		   c->pix + (size_t) 8 * w * y, c->pix + (size_t) 4 * w * (2*y + 1), w / 2 );
+    }
+  }
+  return 0;
+}
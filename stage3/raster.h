@@ -0,0 +1,29 @@
+#ifndef __RASTER_H__
+#define __RASTER_H__
+
+/* --------------------------------------------------------------------------
+ *  Raster tiles decoding, scaling, reduction and encoding
+ *  Images are decoded to 8 bits RGBA pixels.
+ * --------------------------------------------------------------------------*/
+
+#define RASTER_UNKNOWN 0
+#define RASTER_JPEG    1
+#define RASTER_PNG     2
+
+// JPEG encoding quality
+#define RASTER_JPEG_QUALITY 85
+
+typedef struct image_s {
+  unsigned char *pix;         // RGBA pixels, rows of 4*w bytes
+  int w, h;
+  int alpha;                  // source image had an alpha channel
+} image_t;
+
+int   raster_type( char *data, int len );
+int   raster_decode( char *data, int len, image_t *img );
+char *raster_encode( image_t *img, int type, int *len );
+void  raster_scale( image_t *src, double sx, double sy, double sw, double sh, image_t *dst );
+int   raster_reduce( image_t *child[4], image_t *dst );
+void  raster_free( image_t *img );
+
+#endif
@@ -0,0 +1,162 @@
+// --------------------------------------------------------------------------
+//   Tiles loaded in batches : tile requests made by the map within a few
+//   milliseconds are gathered and posted to 'tiles/batch' (or to
+//   'tiles/<name>/batch'), which streams back records made of zoom
+//   (1 byte), column, row and data length (4 bytes each, little endian)
+//   followed by tile data. Missing tiles have no data.
+//   Batched tiles don't go through the tile cache, ETags, prefetching
+//   or WebP transcoding of the server so batches are only used when
+//   the page is opened with '#batch', for slow links.
+// --------------------------------------------------------------------------
+
+// time during which tile requests are gathered, in milliseconds
+const BATCH_DELAY = 5;
+
+// max tiles per batch, see BATCH_MAXTILES in mbv.c
+const BATCH_MAXTILES = 1024;
+
+// pending requests by batch URL
+var batch_queues = {};
+
+// --------------------------------------------------------------------------
+//   Returns true if batches are asked for and the browser can unpack
+//   gzip compressed tiles
+// --------------------------------------------------------------------------
+function batch_supported()
+{
+    return (window.location.hash === "#batch") &&
+	(typeof DecompressionStream !== "undefined") &&
+	(typeof ReadableStream !== "undefined");
+}
+
+// --------------------------------------------------------------------------
+//   Map transformRequest hook : tile URLs of this server are changed
+//   to 'batch://' URLs handled by batch_load
+// --------------------------------------------------------------------------
+function batch_transform( url, restype )
+{
+    if ( (restype === "Tile") && batch_supported() &&
+	 /^https?:\/\/[^\/]+\/tiles\/([^\/]+\/)?\d+\/\d+\/\d+\.\w+$/.test( url ) ) {
+	return { url: url.replace( /^https?:/, "batch:" ) };
+    }
+}
+
+// --------------------------------------------------------------------------
+//   Hands tile data to the map, gzip compressed tiles are unpacked
+// --------------------------------------------------------------------------
+function batch_deliver( req, data )
+{
+    if ( req.cancelled ) {
+	return;
+    }
+    if ( (data.length >= 2) && (data[0] === 0x1f) && (data[1] === 0x8b) ) {
+	const stream = new Blob( [data] ).stream().pipeThrough( new DecompressionStream("gzip") );
+	new Response( stream ).arrayBuffer().then( (buf) => {
+	    if ( !req.cancelled ) req.callback( null, buf );
+	}).catch( (err) => {
+	    if ( !req.cancelled ) req.callback( err );
+	});
+    }
+    else {
+	req.callback( null, data.slice().buffer );
+    }
+}
+
+// --------------------------------------------------------------------------
+//   Posts the pending requests of 'base' URL and dispatches the records
+//   as they are received
+// --------------------------------------------------------------------------
+function batch_send( base )
+{
+    var waiting = {}, keys;
+
+    for ( const req of batch_queues[base] ) {
+	if ( !req.cancelled ) {
+	    (waiting[req.key] = waiting[req.key] || []).push( req );
+	}
+    }
+    delete batch_queues[base];
+    keys = Object.keys( waiting );
+    if ( keys.length === 0 ) {
+	return;
+    }
+
+    fetch( base + "batch", { method: "POST", body: keys.join(" ") } ).then( (resp) => {
+	if ( !resp.ok ) {
+	    throw new Error( "tile batch failed : " + resp.status );
+	}
+	const reader = resp.body.getReader();
+	var buf = new Uint8Array(0);
+
+	function pump() {
+	    return reader.read().then( ({ done, value }) => {
+		var off = 0;
+		if ( done ) {
+		    return;
+		}
+		if ( buf.length > 0 ) {
+		    const b = new Uint8Array( buf.length + value.length );
+		    b.set( buf );
+		    b.set( value, buf.length );
+		    value = b;
+		}
+		const dv = new DataView( value.buffer, value.byteOffset, value.byteLength );
+		while ( off + 13 <= value.length ) {
+		    const len = dv.getUint32( off + 9, true );
+		    if ( off + 13 + len > value.length ) {
+			break;
+		    }
+		    const key = value[off] + "/" + dv.getUint32( off + 1, true ) + "/" + dv.getUint32( off + 5, true );
+		    const data = value.subarray( off + 13, off + 13 + len );
+		    for ( const req of waiting[key] || [] ) {
+			batch_deliver( req, data );
+		    }
+		    delete waiting[key];
+		    off += 13 + len;
+		}
+		buf = value.slice( off );
+		return pump();
+	    });
+	}
+	return pump();
+    }).catch( (err) => {
+	console.log( err );
+    }).finally( () => {
+	// requests left without answer fail
+	for ( const key in waiting ) {
+	    for ( const req of waiting[key] ) {
+		if ( !req.cancelled ) req.callback( new Error( "tile " + key + " not in batch" ) );
+	    }
+	}
+    });
+}
+
+// --------------------------------------------------------------------------
+//   Protocol handler of 'batch://' URLs, queues the request until the
+//   batch is sent
+// --------------------------------------------------------------------------
+function batch_load( params, callback )
+{
+    const m = params.url.match( /^batch:\/\/([^\/]+\/tiles\/(?:[^\/]+\/)?)(\d+)\/(\d+)\/(\d+)\.\w+$/ );
+    const req = { callback: callback, cancelled: false };
+    var base;
+
+    if ( m === null ) {
+	callback( new Error( "bad tile URL " + params.url ) );
+	return { cancel: () => {} };
+    }
+    base = window.location.protocol + "//" + m[1];
+    req.key = m[2] + "/" + m[3] + "/" + m[4];
+
+    if ( !batch_queues[base] ) {
+	batch_queues[base] = [];
+	setTimeout( () => { if ( batch_queues[base] ) batch_send( base ); }, BATCH_DELAY );
+    }
+    batch_queues[base].push( req );
+    if ( batch_queues[base].length >= BATCH_MAXTILES ) {
+	batch_send( base );
+    }
+    return { cancel: () => { req.cancelled = true; } };
+}
+
+maplibregl.addProtocol( "batch", batch_load );
@@ -0,0 +1,336 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "source.h"
+#include "mbtiles.h"
+#include "pack.h"
+#include "pmtiles.h"
+#include "mosaic.h"
+#include "composite.h"
+#include "geopackage.h"
+#include "geojson.h"
+#include "tiledir.h"
+
+static source_ops_t mbtiles_ops = {
+  "mbtiles",
+  mbtiles_open,
+  mbtiles_close,
+  mbtiles_read,
+  mbtiles_tiles_json,
+  mbtiles_tile_id,
+  mbtiles_read_id,
+  mbtiles_index,
+  mbtiles_shared,
+  mbtiles_scan
+};
+
+static source_ops_t pack_ops = {
+  "pack",
+  pack_open,
+  pack_close,
+  pack_read,
+  pack_tiles_json,
+  pack_tile_id,
+  pack_read_id,
+  NULL,
+  NULL,
+  NULL
+};
+
+static source_ops_t pmtiles_ops = {
+  "pmtiles",
+  pmtiles_open,
+  pmtiles_close,
+  pmtiles_read,
+  pmtiles_tiles_json,
+  pmtiles_tile_id,
+  pmtiles_read_id,
+  NULL,
+  NULL,
+  NULL
+};
+
+static source_ops_t gpkg_ops = {
+  "gpkg",
+  gpkg_open,
+  gpkg_close,
+  gpkg_read,
+  gpkg_tiles_json,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  gpkg_scan
+};
+
+static source_ops_t geojson_ops = {
+  "geojson",
+  geojson_open,
+  geojson_close,
+  geojson_read,
+  geojson_tiles_json,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+static source_ops_t mosaic_ops = {
+  "mosaic",
+  mosaic_open,
+  mosaic_close,
+  mosaic_read,
+  mosaic_tiles_json,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+static source_ops_t tiledir_ops = {
+  "tiledir",
+  tiledir_open,
+  tiledir_close,
+  tiledir_read,
+  tiledir_tiles_json,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  tiledir_tile_fd
+};
+
+static source_ops_t composite_ops = {
+  "composite",
+  composite_open,
+  composite_close,
+  composite_read,
+  composite_tiles_json,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+/* --------------------------------------------------------------------------
+ *  Guess backend from file content, directories holding zoom level
+ *  directories are tile trees, other directories are mosaics and
+ *  'a+b' paths naming no file are composites. GeoPackages are told
+ *  from mbtiles by the application id of the sqlite header.
+ *  PACK_BUNDLE names the tile pack linked in the executable.
+ * --------------------------------------------------------------------------*/
+static source_ops_t *source_probe( char *path )
+{
+  struct stat st;
+  char magic[GPKG_APPID_OFFSET + 4];
+  int fd, n;
+
+  if ( !strcmp( path, PACK_BUNDLE ) ) {
+    return &pack_ops;
+  }
+  if ( strchr( path, '+' ) && (stat( path, &st ) != 0) ) {
+    return &composite_ops;
+  }
+  
+  fd = open( path, O_RDONLY );
+  if ( fd == -1 ) {
+    perror( path );
+    return NULL;
+  }
+  if ( (fstat( fd, &st ) == 0) && S_ISDIR( st.st_mode ) ) {
+    close( fd );
+    return tiledir_probe( path ) ? &tiledir_ops : &mosaic_ops;
+  }
+  n = read( fd, magic, sizeof(magic) );
+  close( fd );
+
+  if ( (n >= 16) && !memcmp( magic, "SQLite format 3", 16 ) ) {
+    if ( (n == sizeof(magic)) && (!memcmp( magic + GPKG_APPID_OFFSET, "GPKG", 4 ) ||
+				  !memcmp( magic + GPKG_APPID_OFFSET, "GP1", 3 )) ) {
+      return &gpkg_ops;
+    }
+    return &mbtiles_ops;
+  }
+  if ( (n >= 8) && !memcmp( magic, PACK_MAGIC, 8 ) ) {
+    return &pack_ops;
+  }
+  if ( (n >= 7) && !memcmp( magic, PMTILES_MAGIC, 7 ) ) {
+    return &pmtiles_ops;
+  }
+  fprintf( stderr, "Unknown tile source format '%s'.\n", path );
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Opens 'path' with backend 'ops'
+ * --------------------------------------------------------------------------*/
+static source_t *source_new( char *path, source_ops_t *ops )
+{
+  source_t *src;
+  void *h;
+
+  h = ops->open( path );
+  if ( h == NULL ) {
+    return NULL;
+  }
+  
+  src = (source_t*) calloc( 1, sizeof(source_t));
+  if ( src == NULL ) {
+    fputs( "source_open: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  src->path = path;
+  src->ops = ops;
+  src->h = h;
+  return src;
+}
+
+/* --------------------------------------------------------------------------
+ *  Open tile source
+ * --------------------------------------------------------------------------*/
+source_t *source_open( char *path )
+{
+  source_ops_t *ops;
+
+  ops = source_probe( path );
+  if ( ops == NULL ) {
+    return NULL;
+  }
+  return source_new( path, ops );
+}
+
+/* --------------------------------------------------------------------------
+ *  Open GeoJSON file, which isn't told from other files by its content
+ * --------------------------------------------------------------------------*/
+source_t *source_open_geojson( char *path )
+{
+  return source_new( path, &geojson_ops );
+}
+
+/* --------------------------------------------------------------------------
+ *  Close tile source
+ * --------------------------------------------------------------------------*/
+void source_close( source_t *src )
+{
+  if ( src == NULL ) return;
+  src->ops->close( src->h );
+  free( src );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile
+ * --------------------------------------------------------------------------*/
+char *source_read( source_t *src, int z, int x, int y, int *len )
+{
+  return src->ops->read( src->h, z, x, y, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates tiles.json
+ * --------------------------------------------------------------------------*/
+char *source_tiles_json( source_t *src, int *len )
+{
+  return src->ops->tiles_json( src->h, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Retrieve tile id, returns -1 if not supported by backend
+ * --------------------------------------------------------------------------*/
+int source_tile_id( source_t *src, int z, int x, int y, uint64_t *id )
+{
+  if ( src->ops->tile_id == NULL ) return -1;
+  return src->ops->tile_id( src->h, z, x, y, id );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile given its id
+ * --------------------------------------------------------------------------*/
+char *source_read_id( source_t *src, uint64_t id, int *len )
+{
+  if ( src->ops->read_id == NULL ) {
+    *len = 0;
+    return NULL;
+  }
+  return src->ops->read_id( src->h, id, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile, checking first for its presence when the backend can
+ *  do it quietly. Returns NULL if the tile is missing.
+ * --------------------------------------------------------------------------*/
+char *source_read_quiet( source_t *src, int z, int x, int y, int *len )
+{
+  uint64_t id;
+  int rc;
+
+  rc = source_tile_id( src, z, x, y, &id );
+  if ( rc == 0 ) {
+    *len = 0;
+    return NULL;
+  }
+  return (rc > 0) ? source_read_id( src, id, len ) : source_read( src, z, x, y, len );
+}
+
+/* --------------------------------------------------------------------------
+ *  Build in memory index, returns -1 if not supported by backend
+ * --------------------------------------------------------------------------*/
+int source_index( source_t *src )
+{
+  if ( src->ops->index == NULL ) return -1;
+  return src->ops->index( src->h );
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns ids of tiles shared by many coordinates
+ * --------------------------------------------------------------------------*/
+int source_shared( source_t *src, uint64_t **ids )
+{
+  if ( src->ops->shared == NULL ) return 0;
+  return src->ops->shared( src->h, ids );
+}
+
+/* --------------------------------------------------------------------------
+ *  Calls 'fn' for each tile of zoom level 'z' in columns x0..x1 and
+ *  rows y0..y1. Backends without range scan are read tile by tile,
+ *  column by column. Returns the number of tiles or -1 on error.
+ * --------------------------------------------------------------------------*/
+int source_scan( source_t *src, int z, int x0, int y0, int x1, int y1,
+		 void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg )
+{
+  char *data;
+  int x, y, len, n = 0;
+
+  if ( src->ops->scan ) {
+    return src->ops->scan( src->h, z, x0, y0, x1, y1, fn, arg );
+  }
+  for( x = x0; x <= x1; ++x ) {
+    for( y = y0; y <= y1; ++y ) {
+      data = src->ops->read( src->h, z, x, y, &len );
+      if ( data ) {
+	fn( arg, z, x, y, data, len );
+	n++;
+      }
+    }
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Opens the file of a tile to send it as is, returns 1 and sets the
+ *  descriptor and size of the tile, 0 if the tile is missing and -1 if
+ *  not supported by backend
+ * --------------------------------------------------------------------------*/
+int source_tile_fd( source_t *src, int z, int x, int y, int *fd, int *len )
+{
+  if ( src->ops->tile_fd == NULL ) return -1;
+  return src->ops->tile_fd( src->h, z, x, y, fd, len );
+}
@@ -0,0 +1,46 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include <stdint.h>
+
+/* --------------------------------------------------------------------------
+ *  Tile source backend. Optional operations are NULL when the
+ *  backend doesn't support them.
+ * --------------------------------------------------------------------------*/
+typedef struct source_ops_s {
+  char *name;
+  void *(*open)( char *path );
+  void  (*close)( void *h );
+  char *(*read)( void *h, int z, int x, int y, int *len );
+  char *(*tiles_json)( void *h, int *len );
+  // optional
+  int   (*tile_id)( void *h, int z, int x, int y, uint64_t *id );
+  char *(*read_id)( void *h, uint64_t id, int *len );
+  int   (*index)( void *h );
+  int   (*shared)( void *h, uint64_t **ids );
+  int   (*scan)( void *h, int z, int x0, int y0, int x1, int y1,
+		 void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg );
+  int   (*tile_fd)( void *h, int z, int x, int y, int *fd, int *len );
+} source_ops_t;
+
+typedef struct source_s {
+  char *path;
+  source_ops_t *ops;
+  void *h;                    // backend handle
+} source_t;
+
+source_t *source_open( char *path );
+source_t *source_open_geojson( char *path );
+void  source_close( source_t *src );
+char *source_read( source_t *src, int z, int x, int y, int *len );
+char *source_tiles_json( source_t *src, int *len );
+int   source_tile_id( source_t *src, int z, int x, int y, uint64_t *id );
+char *source_read_id( source_t *src, uint64_t id, int *len );
+char *source_read_quiet( source_t *src, int z, int x, int y, int *len );
+int   source_index( source_t *src );
+int   source_shared( source_t *src, uint64_t **ids );
+int   source_scan( source_t *src, int z, int x0, int y0, int x1, int y1,
+		   void (*fn)( void *arg, int z, int x, int y, char *data, int len ), void *arg );
+int   source_tile_fd( source_t *src, int z, int x, int y, int *fd, int *len );
+
+#endif
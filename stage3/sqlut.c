@@ -0,0 +1,64 @@
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlut.h"
+
+/* --------------------------------------------------------------------------
+ *  Allocates zeroed memory
+ * --------------------------------------------------------------------------*/
+char *emalloc( size_t sz )
+{
+  char *res = malloc(sz);
+  if ( !res ) {
+    fputs( "memory allocation error.\n", stderr );
+    exit(1);
+  }
+  memset( res, 0, sz );
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns 1 if database has table 'name'
+ * --------------------------------------------------------------------------*/
+int has_table( sqlite3 *db, char *name )
+{
+  sqlite3_stmt *stmt;
+  int res;
+
+  if ( sqlite3_prepare_v2( db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?1",
+			   -1, &stmt, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  sqlite3_bind_text( stmt, 1, name, -1, SQLITE_STATIC );
+  res = (sqlite3_step( stmt ) == SQLITE_ROW);
+  sqlite3_finalize( stmt );
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  Prepares statement 'query'
+ * --------------------------------------------------------------------------*/
+sqlite3_stmt *prepare( sqlite3 *db, char *query )
+{
+  sqlite3_stmt *stmt;
+  if ( sqlite3_prepare_v2( db, query, -1, &stmt, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  return stmt;
+}
+
+/* --------------------------------------------------------------------------
+ *  Runs statements of 'query' which return no row
+ * --------------------------------------------------------------------------*/
+void exec( sqlite3 *db, char *query )
+{
+  char *err = NULL;
+  if ( sqlite3_exec( db, query, NULL, NULL, &err ) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot run query: %s\n", err);
+    exit(1);
+  }
+}
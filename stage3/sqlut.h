@@ -0,0 +1,17 @@
+#ifndef __SQLUT_H__
+#define __SQLUT_H__
+
+#include <stddef.h>
+#include <sqlite3.h>
+
+/* --------------------------------------------------------------------------
+ *  Helpers shared by the standalone mbtiles tools. Errors are fatal :
+ *  a message is printed and the program exits.
+ * --------------------------------------------------------------------------*/
+
+char *emalloc( size_t sz );
+int has_table( sqlite3 *db, char *name );
+sqlite3_stmt *prepare( sqlite3 *db, char *query );
+void exec( sqlite3 *db, char *query );
+
+#endif
@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "source.h"
+
+/* --------------------------------------------------------------------------
+ *  Tile source benchmark
+ *  Reads the same random sample of tiles from each source given on the
+ *  command line and reports read throughput.
+ * --------------------------------------------------------------------------*/
+
+int g_port = 9000;
+int g_quiet = 1;
+
+typedef struct coord_s {
+  int z, x, y;
+} coord_t;
+
+/* --------------------------------------------------------------------------
+ *  Basic logger
+ * --------------------------------------------------------------------------*/
+void logger(const char *fmt, ...)
+{
+  if (!g_quiet) {
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Current time in seconds
+ * --------------------------------------------------------------------------*/
+static double now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* --------------------------------------------------------------------------
+ *  xorshift random generator, gives the same sample on each run
+ * --------------------------------------------------------------------------*/
+static uint32_t rnd( uint32_t *s )
+{
+  uint32_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *s = x;
+}
+
+/* --------------------------------------------------------------------------
+ *  Lists existing tiles of source up to zoom level 'maxzoom'
+ * --------------------------------------------------------------------------*/
+static coord_t *list_tiles( source_t *src, int maxzoom, int *n )
+{
+  coord_t *tab = NULL;
+  uint64_t id;
+  int z, x, y, len, rc, sz = 0;
+
+  *n = 0;
+  for( z = 0; z <= maxzoom; ++z ) {
+    for( x = 0; x < (1 << z); ++x ) {
+      for( y = 0; y < (1 << z); ++y ) {
+	// tile ids avoid reading data and logging missing tiles
+	rc = source_tile_id( src, z, x, y, &id );
+	if ( rc == 0 ) continue;
+	if ( (rc < 0) && (source_read( src, z, x, y, &len ) == NULL) ) continue;
+	if ( *n == sz ) {
+	  sz = sz ? 2*sz : 1024;
+	  tab = (coord_t*) realloc( tab, sz * sizeof(coord_t));
+	  if ( tab == NULL ) {
+	    fputs( "memory allocation error.\n", stderr );
+	    exit(1);
+	  }
+	}
+	tab[*n].z = z;
+	tab[*n].x = x;
+	tab[*n].y = y;
+	(*n)++;
+      }
+    }
+  }
+  return tab;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads 'count' tiles of sample from source
+ * --------------------------------------------------------------------------*/
+static void bench( source_t *src, coord_t *tab, int n, int count, char *label )
+{
+  double t0, t1, bytes = 0;
+  uint32_t seed = 0x12345678, sum = 0;
+  char *data;
+  int i, len, miss = 0, empty = 0;
+
+  t0 = now();
+  for( i = 0; i < count; ++i ) {
+    coord_t *c = tab + (rnd( &seed ) % n);
+    data = source_read( src, c->z, c->x, c->y, &len );
+    if ( data == NULL ) {
+      miss++;
+      continue;
+    }
+    if ( len == 0 ) {
+      empty++;
+      continue;
+    }
+    // touch data so it is really read
+    sum += (unsigned char) data[0] + (unsigned char) data[len-1];
+    bytes += len;
+  }
+  t1 = now();
+
+  printf( "%-8s %-5s %10.0f tiles/s %8.1f MB/s %6.2f us/tile (%d missing, %d empty, %08x)\n",
+	  src->ops->name, label, count / (t1 - t0), bytes / (t1 - t0) / 1e6,
+	  (t1 - t0) * 1e6 / count, miss, empty, sum );
+}
+
+/* --------------------------------------------------------------------------
+ *  Prints program usage and exits
+ * --------------------------------------------------------------------------*/
+void usage( char *fmt, ... )
+{
+  FILE *fout = fmt ? stderr : stdout;
+  va_list va;
+  if ( !fmt ) fmt = "tilebench [-n count] [-z maxzoom] source...";
+  fprintf( fout, "usage: ");
+  va_start( va, fmt );
+  vfprintf( fout, fmt, va );
+  va_end( va );
+  fprintf( fout, "\n" );
+
+  fprintf( fout, "\t -h            Prints this help message.\n");
+  fprintf( fout, "\t -v            Be verbose.\n");
+  fprintf( fout, "\t -n count      Number of tiles read from each source.\n");
+  fprintf( fout, "\t -z maxzoom    Max zoom level of sampled tiles.\n");
+
+  exit( fmt ? 1 : 0 );
+}
+
+/* --------------------------------------------------------------------------
+ *  Main program
+ * --------------------------------------------------------------------------*/
+int main( int argc, char **argv )
+{
+  source_t *src;
+  coord_t *tab;
+  int opt, i, n, count = 100000, maxzoom = 8;
+
+  while ((opt = getopt(argc, argv, "hvn:z:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage( NULL );
+      break;
+    case 'v':
+      g_quiet = 0;
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'z':
+      maxzoom = atoi(optarg);
+      break;
+    default:
+      usage("unrecognized option.\n");
+    }
+  }
+  if ( optind >= argc ) {
+    usage( "no tile source given.\n" );
+  }
+  if ( (count <= 0) || (maxzoom < 0) || (maxzoom > 12) ) {
+    usage( "invalid tile count or zoom level.\n" );
+  }
+
+  // sample is taken from first source
+  src = source_open( argv[optind] );
+  if ( src == NULL ) {
+    exit(1);
+  }
+  tab = list_tiles( src, maxzoom, &n );
+  source_close( src );
+  if ( n == 0 ) {
+    fprintf( stderr, "No tile found in '%s' up to zoom level %d.\n", argv[optind], maxzoom );
+    exit(1);
+  }
+  printf( "%d tiles sampled from '%s', reading %d tiles from each source\n",
+	  n, argv[optind], count );
+  
+  for( i = optind; i < argc; ++i ) {
+    src = source_open( argv[i] );
+    if ( src == NULL ) {
+      continue;
+    }
+    printf( "%s\n", argv[i] );
+    bench( src, tab, n, count, "cold" );
+    bench( src, tab, n, count, "warm" );
+    if ( source_index( src ) >= 0 ) {
+      bench( src, tab, n, count, "index" );
+    }
+    source_close( src );
+  }
+
+  free( tab );
+  return 0;
+}
@@ -0,0 +1,240 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tilecache.h"
+
+extern void logger(const char *fmt, ...);
+
+/* --------------------------------------------------------------------------
+ *  A LRU cache of tiles keyed by a 64 bits tile identifier.
+ *  Entries are stored in an array and linked in a doubly linked list
+ *  (most recently used first) and in hash chains. Pinned entries are
+ *  kept out of the LRU list and are never evicted.
+ * --------------------------------------------------------------------------*/
+struct tilecache_s {
+  tcentry_t *tab;             // entries
+  int  count;                 // number of entries
+  int *htab;                  // hash table, heads of hash chains
+  int  hmask;
+  int  head, last;            // LRU list
+  int  free;                  // list of free entries linked by 'next'
+  size_t bytes;               // bytes used by cached data
+  size_t maxbytes;            // max bytes used by cached data
+};
+
+#define HASH(tc,k) ((int)(((k) * 0x9E3779B97F4A7C15ULL) >> 32) & (tc)->hmask)
+
+/* --------------------------------------------------------------------------
+ *  Allocates a cache of 'count' entries using at most 'maxbytes' of data
+ * --------------------------------------------------------------------------*/
+tilecache_t *tilecache_new( int count, size_t maxbytes )
+{
+  tilecache_t *tc;
+  int i, hsz = 16;
+
+  while ( hsz < 2*count ) hsz <<= 1;
+  
+  tc = (tilecache_t*) calloc( 1, sizeof(tilecache_t));
+  if ( tc ) {
+    tc->tab = (tcentry_t*) calloc( count, sizeof(tcentry_t));
+    tc->htab = (int*) malloc( hsz * sizeof(int));
+  }
+  if ( !tc || !tc->tab || !tc->htab ) {
+    fputs( "tilecache_new: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  tc->count = count;
+  tc->hmask = hsz - 1;
+  tc->maxbytes = maxbytes;
+  tc->head = tc->last = -1;
+  for( i = 0; i < hsz; ++i ) {
+    tc->htab[i] = -1;
+  }
+  for( i = 0; i < count; ++i ) {
+    tc->tab[i].next = (i+1 < count) ? i+1 : -1;
+    tc->tab[i].prev = tc->tab[i].hnext = -1;
+  }
+  tc->free = 0;
+  return tc;
+}
+
+/* --------------------------------------------------------------------------
+ *  Remove entry from LRU list
+ * --------------------------------------------------------------------------*/
+static void tc_unlink( tilecache_t *tc, int i )
+{
+  tcentry_t *e = tc->tab + i;
+  if ( e->prev >= 0 ) tc->tab[e->prev].next = e->next; else tc->head = e->next;
+  if ( e->next >= 0 ) tc->tab[e->next].prev = e->prev; else tc->last = e->prev;
+  e->next = e->prev = -1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Insert entry at head of LRU list
+ * --------------------------------------------------------------------------*/
+static void tc_insert_at_head( tilecache_t *tc, int i )
+{
+  tcentry_t *e = tc->tab + i;
+  e->prev = -1;
+  e->next = tc->head;
+  if ( tc->head >= 0 ) tc->tab[tc->head].prev = i; else tc->last = i;
+  tc->head = i;
+}
+
+/* --------------------------------------------------------------------------
+ *  Release entry : remove it from hash chain, free its data
+ *  and put it in free list. Entry must not be in LRU list.
+ * --------------------------------------------------------------------------*/
+static void tc_release( tilecache_t *tc, int i )
+{
+  tcentry_t *e = tc->tab + i;
+  int *p = tc->htab + HASH(tc, e->key);
+
+  while( *p != i ) {
+    assert( *p >= 0 );
+    p = &tc->tab[*p].hnext;
+  }
+  *p = e->hnext;
+
+  tc->bytes -= e->len + e->rlen;
+  free( e->data );
+  free( e->resp );
+  memset( e, 0, sizeof(tcentry_t));
+  e->prev = e->hnext = -1;
+  e->next = tc->free;
+  tc->free = i;
+}
+
+/* --------------------------------------------------------------------------
+ *  Evict least recently used entry
+ *  Returns 0 if there is nothing left to evict
+ * --------------------------------------------------------------------------*/
+static int tc_evict( tilecache_t *tc )
+{
+  int i = tc->last;
+  if ( i < 0 ) return 0;
+  tc_unlink( tc, i );
+  tc_release( tc, i );
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Free cache
+ * --------------------------------------------------------------------------*/
+void tilecache_free( tilecache_t *tc )
+{
+  int i;
+  if ( tc == NULL ) return;
+  for( i = 0; i < tc->count; ++i ) {
+    free( tc->tab[i].data );
+    free( tc->tab[i].resp );
+  }
+  free( tc->tab );
+  free( tc->htab );
+  free( tc );
+}
+
+/* --------------------------------------------------------------------------
+ *  Remove all entries, pinned ones included
+ * --------------------------------------------------------------------------*/
+void tilecache_clear( tilecache_t *tc )
+{
+  int i;
+  for( i = 0; i <= tc->hmask; ++i ) {
+    while( tc->htab[i] >= 0 ) {
+      int j = tc->htab[i];
+      if ( !(tc->tab[j].flags & TC_PINNED) ) {
+	tc_unlink( tc, j );
+      }
+      tc_release( tc, j );
+    }
+  }
+  assert( tc->head == -1 );
+  assert( tc->bytes == 0 );
+}
+
+/* --------------------------------------------------------------------------
+ *  Search cache for tile 'key', returns NULL if not found
+ *  The entry found becomes the most recently used one.
+ * --------------------------------------------------------------------------*/
+tcentry_t *tilecache_get( tilecache_t *tc, uint64_t key )
+{
+  int i;
+  for( i = tc->htab[HASH(tc, key)]; i >= 0; i = tc->tab[i].hnext ) {
+    tcentry_t *e = tc->tab + i;
+    if ( e->key == key ) {
+      if ( !(e->flags & TC_PINNED) && (tc->head != i) ) {
+	tc_unlink( tc, i );
+	tc_insert_at_head( tc, i );
+      }
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Add a copy of tile data to cache
+ *  Returns the entry or NULL if the tile can't be cached.
+ * --------------------------------------------------------------------------*/
+tcentry_t *tilecache_put( tilecache_t *tc, uint64_t key, char *data, int len, int flags )
+{
+  tcentry_t *e;
+  int i, h;
+
+  if ( (size_t) len > tc->maxbytes / 4 ) {
+    return NULL;
+  }
+  
+  e = tilecache_get( tc, key );
+  if ( e ) {
+    return e;
+  }
+
+  while ( (tc->free < 0) || (tc->bytes + len > tc->maxbytes) ) {
+    if ( !tc_evict( tc ) ) {
+      return NULL;
+    }
+  }
+
+  i = tc->free;
+  e = tc->tab + i;
+  tc->free = e->next;
+  
+  e->data = (char*) malloc( len ? len : 1 );
+  if ( e->data == NULL ) {
+    fputs( "tilecache_put: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  memcpy( e->data, data, len );
+  e->len = len;
+  e->key = key;
+  e->flags = flags;
+  tc->bytes += len;
+
+  h = HASH(tc, key);
+  e->hnext = tc->htab[h];
+  tc->htab[h] = i;
+
+  e->next = e->prev = -1;
+  if ( !(flags & TC_PINNED) ) {
+    tc_insert_at_head( tc, i );
+  }
+  return e;
+}
+
+/* --------------------------------------------------------------------------
+ *  Attach a pre-encoded HTTP response to a cache entry
+ *  Takes ownership of 'resp'.
+ * --------------------------------------------------------------------------*/
+void tilecache_set_resp( tilecache_t *tc, tcentry_t *e, char *mtype, char *resp, int rlen )
+{
+  tc->bytes += rlen - e->rlen;
+  free( e->resp );
+  e->resp = resp;
+  e->rlen = rlen;
+  e->mtype = mtype;
+}
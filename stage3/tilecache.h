@@ -0,0 +1,32 @@
+#ifndef __TILECACHE_H__
+#define __TILECACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// cache entry flags
+#define TC_PINNED     0x01    // never evicted
+#define TC_PREFETCHED 0x02    // loaded ahead of request, not requested yet
+
+typedef struct tcentry_s {
+  uint64_t key;
+  char *data;                 // tile data
+  int   len;
+  char *resp;                 // pre-encoded HTTP response or NULL
+  int   rlen;
+  char *mtype;                // mime type used to encode 'resp'
+  int   flags;
+  int   next, prev;           // LRU list
+  int   hnext;                // hash chain
+} tcentry_t;
+
+typedef struct tilecache_s tilecache_t;
+
+tilecache_t *tilecache_new( int count, size_t maxbytes );
+void tilecache_free( tilecache_t *tc );
+void tilecache_clear( tilecache_t *tc );
+tcentry_t *tilecache_get( tilecache_t *tc, uint64_t key );
+tcentry_t *tilecache_put( tilecache_t *tc, uint64_t key, char *data, int len, int flags );
+void tilecache_set_resp( tilecache_t *tc, tcentry_t *e, char *mtype, char *resp, int rlen );
+
+#endif
@@ -0,0 +1,474 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <json.h>
+
+#include "tiledir.h"
+#include "mbtiles.h"
+
+extern void logger(const char *fmt, ...);
+
+// number of buckets of the open columns hash table
+#define NBUCKETS (2 * TILEDIR_MAXDIRS)
+
+/* --------------------------------------------------------------------------
+ *  Column directory 'z/x' of the tree, open or found missing
+ * --------------------------------------------------------------------------*/
+typedef struct tdcol_s {
+  uint64_t id;                  // TILEID(z,x,0)
+  int fd;                       // -1 when the directory is missing
+  time_t stamp;                 // time it was found missing
+  struct tdcol_s *prev, *next;  // most recently used first
+  struct tdcol_s *hnext;        // hash bucket chain
+} tdcol_t;
+
+// tile found missing
+typedef struct tdmiss_s {
+  uint64_t id;
+  time_t stamp;
+} tdmiss_t;
+
+typedef struct tiledir_s {
+  char *path;
+  int fd;                       // root directory
+  int zfd[30];                  // zoom level directories, -1 when not open
+  char ext[16];                 // extension of tile files, with its dot
+  int tms;                      // rows are numbered from the south
+  int minzoom, maxzoom;         // zoom directories found
+  tdcol_t cols[TILEDIR_MAXDIRS];
+  tdcol_t *buckets[NBUCKETS];
+  tdcol_t *mru, *lru;
+  int ncols;
+  tdmiss_t miss[TILEDIR_MISSES];
+  char *buf;                    // tile data returned by tiledir_read
+  int bufsz;
+  char *tiles_json;
+  int tjlen;
+} tiledir_t;
+
+/* --------------------------------------------------------------------------
+ *  Returns true if 'name' is a number, as names of zoom level and
+ *  column directories are
+ * --------------------------------------------------------------------------*/
+static int td_number( const char *name )
+{
+  if ( *name == '\0' ) return 0;
+  while( isdigit( (unsigned char) *name )) ++name;
+  return *name == '\0';
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns true if directory 'path' holds zoom level directories
+ * --------------------------------------------------------------------------*/
+int tiledir_probe( char *path )
+{
+  struct dirent *ent;
+  struct stat st;
+  DIR *dirp;
+  int found = 0, fd;
+
+  dirp = opendir( path );
+  if ( dirp == NULL ) {
+    return 0;
+  }
+  fd = dirfd( dirp );
+  while( !found && (ent = readdir( dirp )) ) {
+    found = td_number( ent->d_name ) &&
+      (fstatat( fd, ent->d_name, &st, 0 ) == 0) && S_ISDIR( st.st_mode );
+  }
+  closedir( dirp );
+  return found;
+}
+
+/* --------------------------------------------------------------------------
+ *  Finds the first entry of directory 'fd' subdir 'name' which is a
+ *  number (directories) or a number followed by an extension (tile
+ *  files). The entry name is copied to 'out'.
+ * --------------------------------------------------------------------------*/
+static int td_first( int fd, char *name, int file, char *out, int sz )
+{
+  struct dirent *ent;
+  DIR *dirp;
+  char *dot;
+  int sfd, found = 0;
+
+  sfd = openat( fd, name, O_RDONLY | O_DIRECTORY );
+  if ( (sfd == -1) || ((dirp = fdopendir( sfd )) == NULL) ) {
+    if ( sfd != -1 ) close( sfd );
+    return 0;
+  }
+  while( !found && (ent = readdir( dirp )) ) {
+    dot = strchr( ent->d_name, '.' );
+    if ( file ) {
+      if ( (dot == NULL) || (dot == ent->d_name) ) continue;
+      *dot = '\0';
+      found = td_number( ent->d_name );
+      *dot = '.';
+    }
+    else {
+      found = td_number( ent->d_name );
+    }
+    if ( found ) {
+      snprintf( out, sz, "%s", ent->d_name );
+    }
+  }
+  closedir( dirp );
+  return found;
+}
+
+/* --------------------------------------------------------------------------
+ *  Finds zoom range of the tree and extension of tile files, taken
+ *  from the first tile of the lowest zoom level
+ * --------------------------------------------------------------------------*/
+static void td_scan( tiledir_t *t )
+{
+  char zname[16], xname[300], yname[320];
+  struct dirent *ent;
+  DIR *dirp;
+  int fd, z;
+
+  t->minzoom = t->maxzoom = -1;
+  fd = dup( t->fd );
+  if ( (fd == -1) || ((dirp = fdopendir( fd )) == NULL) ) {
+    if ( fd != -1 ) close( fd );
+    return;
+  }
+  while( (ent = readdir( dirp )) ) {
+    if ( !td_number( ent->d_name ) || (strlen( ent->d_name ) > 2) ) continue;
+    z = atoi( ent->d_name );
+    if ( z > 29 ) continue;
+    if ( (t->minzoom < 0) || (z < t->minzoom) ) t->minzoom = z;
+    if ( z > t->maxzoom ) t->maxzoom = z;
+  }
+  closedir( dirp );
+
+  for( z = t->minzoom; (z >= 0) && (z <= t->maxzoom); ++z ) {
+    snprintf( zname, sizeof(zname), "%d", z );
+    if ( td_first( t->fd, zname, 0, xname, sizeof(xname) )) {
+      snprintf( yname, sizeof(yname), "%s/%s", zname, xname );
+      if ( td_first( t->fd, yname, 1, xname, sizeof(xname) )) {
+	snprintf( t->ext, sizeof(t->ext), "%s", strchr( xname, '.' ));
+	return;
+      }
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Loads metadata of the tree from JSON file 'name', either TileJSON or
+ *  the 'metadata' table of a mbtiles saved as a JSON object. Returns
+ *  -1 if the file doesn't exist.
+ *  Only TileJSON tells the row scheme of the tree, the one of a saved
+ *  metadata table is the one of the mbtiles.
+ * --------------------------------------------------------------------------*/
+static int td_meta( tiledir_t *t, mbtiles_meta_t *meta, char *name, int tilejson )
+{
+  struct json_object_iterator it, end;
+  struct json_object *o, *v;
+  char path[4096], buf[128];
+  const char *k;
+  int i, n;
+
+  snprintf( path, sizeof(path), "%s/%s", t->path, name );
+  if ( access( path, R_OK ) != 0 ) {
+    return -1;
+  }
+  o = json_object_from_file( path );
+  if ( (o == NULL) || !json_object_is_type( o, json_type_object )) {
+    fprintf( stderr, "%s: failed to parse JSON.\n", path );
+    json_object_put( o );
+    return 0;
+  }
+
+  it = json_object_iter_begin( o );
+  end = json_object_iter_end( o );
+  for( ; !json_object_iter_equal( &it, &end ); json_object_iter_next( &it ) ) {
+    k = json_object_iter_peek_name( &it );
+    v = json_object_iter_peek_value( &it );
+    if ( !strcmp( k, "vector_layers" ) ) {
+      json_object_put( meta->vector_layers );
+      meta->vector_layers = json_object_get( v );
+    }
+    else if ( !strcmp( k, "scheme" ) ) {
+      t->tms = tilejson && !strcmp( json_object_get_string( v ), "tms" );
+    }
+    else if ( json_object_is_type( v, json_type_array ) ) {
+      // bounds and center are arrays in TileJSON
+      buf[0] = '\0';
+      for( i = n = 0; i < json_object_array_length( v ) && (n < sizeof(buf)); ++i ) {
+	n += snprintf( buf + n, sizeof(buf) - n, i ? ",%s" : "%s",
+		       json_object_get_string( json_object_array_get_idx( v, i )));
+      }
+      mbtiles_meta_set( meta, (char*) k, buf );
+    }
+    else if ( !json_object_is_type( v, json_type_null ) ) {
+      mbtiles_meta_set( meta, (char*) k, (char*) json_object_get_string( v ));
+    }
+  }
+  json_object_put( o );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Open tile tree 'path'
+ * --------------------------------------------------------------------------*/
+void *tiledir_open( char *path )
+{
+  tiledir_t *t;
+  int z;
+
+  t = (tiledir_t*) calloc( 1, sizeof(tiledir_t));
+  if ( t == NULL ) {
+    fputs( "tiledir: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  t->path = path;
+  t->fd = open( path, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( t->fd == -1 ) {
+    perror( path );
+    free( t );
+    return NULL;
+  }
+  for( z = 0; z < 30; ++z ) {
+    t->zfd[z] = -1;
+  }
+
+  td_scan( t );
+  if ( t->ext[0] == '\0' ) {
+    fprintf( stderr, "No tile file found in '%s'.\n", path );
+    close( t->fd );
+    free( t );
+    return NULL;
+  }
+  // metadata tells the row scheme
+  tiledir_tiles_json( t, NULL );
+  logger( "tiledir '%s' : zoom %d-%d, tiles '*%s'%s\n", path, t->minzoom, t->maxzoom, t->ext,
+	  t->tms ? ", TMS rows" : "" );
+  return (void*) t;
+}
+
+/* --------------------------------------------------------------------------
+ *  Close tile tree and its open directories
+ * --------------------------------------------------------------------------*/
+void tiledir_close( void *h )
+{
+  tiledir_t *t = (tiledir_t*) h;
+  int i;
+
+  if ( t == NULL ) return;
+  for( i = 0; i < t->ncols; ++i ) {
+    if ( t->cols[i].fd != -1 ) close( t->cols[i].fd );
+  }
+  for( i = 0; i < 30; ++i ) {
+    if ( t->zfd[i] != -1 ) close( t->zfd[i] );
+  }
+  close( t->fd );
+  free( t->buf );
+  free( t->tiles_json );
+  free( t );
+}
+
+/* --------------------------------------------------------------------------
+ *  Open columns list and hash table management
+ * --------------------------------------------------------------------------*/
+static tdcol_t **td_bucket( tiledir_t *t, uint64_t id )
+{
+  return t->buckets + (((id * 0x9E3779B97F4A7C15ULL) >> 32) % NBUCKETS);
+}
+
+static void td_unlink( tiledir_t *t, tdcol_t *c )
+{
+  if ( c->prev ) c->prev->next = c->next; else t->mru = c->next;
+  if ( c->next ) c->next->prev = c->prev; else t->lru = c->prev;
+  c->prev = c->next = NULL;
+}
+
+static void td_link( tiledir_t *t, tdcol_t *c )
+{
+  c->prev = NULL;
+  c->next = t->mru;
+  if ( t->mru ) t->mru->prev = c; else t->lru = c;
+  t->mru = c;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the directory of column x at zoom level z, opening it if
+ *  needed, or -1 if it is missing. When too many columns are open, the
+ *  least recently used one is closed.
+ * --------------------------------------------------------------------------*/
+static int td_column( tiledir_t *t, int z, int x, time_t now )
+{
+  uint64_t id = TILEID( z, x, 0 );
+  tdcol_t **b = td_bucket( t, id ), **p, *c;
+  char name[16];
+
+  for( c = *b; c && (c->id != id); c = c->hnext );
+  if ( c ) {
+    if ( t->mru != c ) {
+      td_unlink( t, c );
+      td_link( t, c );
+    }
+    if ( (c->fd != -1) || (now - c->stamp < TILEDIR_MISSTTL) ) {
+      return c->fd;
+    }
+  }
+  else {
+    if ( t->ncols < TILEDIR_MAXDIRS ) {
+      c = t->cols + t->ncols++;
+    }
+    else {
+      c = t->lru;
+      td_unlink( t, c );
+      for( p = td_bucket( t, c->id ); *p != c; p = &(*p)->hnext );
+      *p = c->hnext;
+      if ( c->fd != -1 ) close( c->fd );
+    }
+    c->id = id;
+    c->hnext = *b;
+    *b = c;
+    td_link( t, c );
+  }
+
+  if ( t->zfd[z] == -1 ) {
+    snprintf( name, sizeof(name), "%d", z );
+    t->zfd[z] = openat( t->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  }
+  snprintf( name, sizeof(name), "%d", x );
+  c->fd = (t->zfd[z] != -1) ? openat( t->zfd[z], name, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) : -1;
+  c->stamp = now;
+  return c->fd;
+}
+
+/* --------------------------------------------------------------------------
+ *  Opens the file of a tile, returning 1 and setting its descriptor and
+ *  size, or 0 if the tile is missing. The caller closes the descriptor.
+ * --------------------------------------------------------------------------*/
+int tiledir_tile_fd( void *h, int z, int x, int y, int *fd, int *len )
+{
+  tiledir_t *t = (tiledir_t*) h;
+  uint64_t id;
+  tdmiss_t *m;
+  struct stat st;
+  char name[32];
+  time_t now;
+  int cfd;
+
+  if ( !TILEVALID( z, x, y ) ) {
+    return 0;
+  }
+  id = TILEID( z, x, y );
+  m = t->miss + ((id * 0x9E3779B97F4A7C15ULL) >> 32) % TILEDIR_MISSES;
+  now = time( NULL );
+  if ( (m->id == id) && (now - m->stamp < TILEDIR_MISSTTL) ) {
+    return 0;
+  }
+
+  cfd = td_column( t, z, x, now );
+  if ( cfd != -1 ) {
+    snprintf( name, sizeof(name), "%d%s", t->tms ? (1 << z) - 1 - y : y, t->ext );
+    *fd = openat( cfd, name, O_RDONLY | O_CLOEXEC );
+    if ( *fd != -1 ) {
+      if ( (fstat( *fd, &st ) == 0) && S_ISREG( st.st_mode ) && (st.st_size < INT32_MAX) ) {
+	*len = (int) st.st_size;
+	return 1;
+      }
+      close( *fd );
+    }
+    else if ( errno != ENOENT ) {
+      perror( name );
+    }
+  }
+  m->id = id;
+  m->stamp = now;
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Reads a tile, data is valid until next call
+ * --------------------------------------------------------------------------*/
+char *tiledir_read( void *h, int z, int x, int y, int *len )
+{
+  tiledir_t *t = (tiledir_t*) h;
+  ssize_t n;
+  int fd, r = 0;
+
+  if ( !tiledir_tile_fd( h, z, x, y, &fd, len ) ) {
+    logger( "No tile %d/%d/%d\n", z, x, y );
+    *len = 0;
+    return NULL;
+  }
+  if ( *len >= t->bufsz ) {
+    free( t->buf );
+    t->bufsz = *len + 1;
+    t->buf = (char*) malloc( t->bufsz );
+    if ( t->buf == NULL ) {
+      fputs( "tiledir: memory allocation error.\n", stderr );
+      exit(1);
+    }
+  }
+  while( r < *len ) {
+    n = pread( fd, t->buf + r, *len - r, r );
+    if ( n <= 0 ) {
+      if ( (n < 0) && (errno == EINTR) ) continue;
+      break;
+    }
+    r += n;
+  }
+  close( fd );
+  if ( r < *len ) {
+    fprintf( stderr, "tiledir: short read of tile %d/%d/%d\n", z, x, y );
+    *len = 0;
+    return NULL;
+  }
+  return t->buf;
+}
+
+/* --------------------------------------------------------------------------
+ *  Generates 'tiles/tiles.json' from 'tiles.json' or 'metadata.json'
+ *  of the tree, missing format and zoom range are taken from the tree
+ * --------------------------------------------------------------------------*/
+char *tiledir_tiles_json( void *h, int *len )
+{
+  tiledir_t *t = (tiledir_t*) h;
+
+  if ( t->tiles_json == NULL ) {
+    mbtiles_meta_t meta = { .minzoom = -1, .maxzoom = -1 };
+    struct json_object *o;
+    char *name;
+
+    if ( td_meta( t, &meta, "tiles.json", 1 ) < 0 ) {
+      td_meta( t, &meta, "metadata.json", 0 );
+    }
+    if ( meta.name == NULL ) {
+      name = strrchr( t->path, '/' );
+      mbtiles_meta_set( &meta, "name", name && name[1] ? name + 1 : t->path );
+    }
+    if ( meta.format == NULL ) {
+      name = t->ext + 1;
+      if ( !strcmp( name, "mvt" ) ) name = "pbf";
+      if ( !strcmp( name, "jpeg" ) ) name = "jpg";
+      mbtiles_meta_set( &meta, "format", name );
+    }
+    if ( meta.minzoom < 0 ) meta.minzoom = t->minzoom;
+    if ( meta.maxzoom < 0 ) meta.maxzoom = t->maxzoom;
+
+    o = mbtiles_meta_object( &meta );
+    t->tiles_json = strdup( mbtiles_meta_json( o, &t->tjlen ));
+    json_object_put( o );
+    mbtiles_meta_clear( &meta );
+  }
+
+  if ( len != NULL ) {
+    *len = t->tjlen;
+  }
+  return t->tiles_json;
+}
@@ -0,0 +1,27 @@
+#ifndef __TILEDIR_H__
+#define __TILEDIR_H__
+
+/* --------------------------------------------------------------------------
+ *  Directory tree of tile files named 'z/x/y.ext', rows in XYZ scheme
+ *  unless tiles.json of the tree tells 'tms'. Column directories are
+ *  kept open so that a tile is a single openat, tiles found missing are
+ *  remembered for a while.
+ * --------------------------------------------------------------------------*/
+
+// max number of column directories kept open at the same time
+#define TILEDIR_MAXDIRS 64
+
+// number of slots of the missing tiles table
+#define TILEDIR_MISSES 4096
+
+// seconds during which a missing tile or column isn't looked up again
+#define TILEDIR_MISSTTL 10
+
+int   tiledir_probe( char *path );
+void *tiledir_open( char *path );
+void  tiledir_close( void *h );
+char *tiledir_read( void *h, int z, int x, int y, int *len );
+char *tiledir_tiles_json( void *h, int *len );
+int   tiledir_tile_fd( void *h, int z, int x, int y, int *fd, int *len );
+
+#endif
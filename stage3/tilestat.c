@@ -0,0 +1,545 @@
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "mvt.h"
+#include "sqlut.h"
+
+/* --------------------------------------------------------------------------
+ *  Tileset analyzer
+ *  Reads all the tiles of a mbtiles file with several threads, each
+ *  reading chunks of rowids with its own connection, and reports where
+ *  the bytes are : tile sizes by zoom level, bytes by vector tile layer,
+ *  largest tiles and duplicated tiles.
+ * --------------------------------------------------------------------------*/
+
+// rowids read by a worker at a time
+#define CHUNK 16384
+
+// max zoom level of tiles, as in TILEID
+#define MAXZOOM 29
+
+// size histogram buckets : a bucket for each size below 64, then 64
+// buckets for each power of two, so percentiles are within 1.6%
+#define NBUCKETS (27 * 64)
+
+// number of largest tiles reported
+#define NLARGEST 10
+
+// layer hash table size, a power of two
+#define NLHASH 256
+
+typedef struct zstat_s {
+  uint64_t count, bytes, raw;     // stored and uncompressed bytes
+  uint64_t dups;                  // tiles whose data is found before
+  uint32_t min, max;
+  uint64_t hist[NBUCKETS];
+} zstat_t;
+
+typedef struct lstat_s {
+  char *name;
+  uint64_t tiles, features, bytes;
+  int minzoom, maxzoom;
+  int next;                       // hash chain, -1 at end
+} lstat_t;
+
+typedef struct big_s {
+  int z, x, y;                    // XYZ row
+  uint32_t len;
+} big_t;
+
+typedef struct dup_s {
+  uint64_t h;                     // content hash
+  uint32_t len;
+  int z;
+} dup_t;
+
+typedef struct worker_s {
+  pthread_t th;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  zstat_t zs[MAXZOOM + 1];
+  lstat_t *layers;
+  int nlayers, lsize;
+  int lhash[NLHASH];
+  big_t big[NLARGEST];            // largest first
+  int nbig;
+  dup_t *dups;
+  size_t ndups, dsize;
+  mvtbuf_t buf;                   // inflated tile
+  int z;                          // zoom level of the walked tile
+  uint64_t bad;                   // tiles failing to decode
+} worker_t;
+
+// rowids not read yet, shared by workers
+static sqlite3_int64 g_next, g_last;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int g_vector = 0;          // tiles are decoded as vector tiles
+static int g_dups = 1;            // look for duplicated tiles
+
+/* --------------------------------------------------------------------------
+ *  Histogram bucket of size 'len' and smallest size of bucket 'b'
+ * --------------------------------------------------------------------------*/
+int bucket( uint32_t len )
+{
+  int e = 31 - __builtin_clz( len | 1 );
+  if ( len < 64 ) return len;
+  return 64 * (e - 5) + (int) ((len >> (e - 6)) - 64);
+}
+
+uint32_t bucket_size( int b )
+{
+  if ( b < 64 ) return b;
+  return (uint32_t) (b % 64 + 64) << (b / 64 - 1);
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns the statistics of layer 'name', adding it if needed
+ * --------------------------------------------------------------------------*/
+lstat_t *find_layer( worker_t *w, char *name, int len )
+{
+  uint32_t h = 2166136261u;
+  lstat_t *l;
+  int i;
+
+  for( i = 0; i < len; ++i ) {
+    h = (h ^ (unsigned char) name[i]) * 16777619u;
+  }
+  h &= NLHASH - 1;
+  for( i = w->lhash[h] - 1; i >= 0; i = w->layers[i].next ) {
+    l = w->layers + i;
+    if ( !strncmp( l->name, name, len ) && (l->name[len] == '\0') ) {
+      return l;
+    }
+  }
+
+  if ( w->nlayers == w->lsize ) {
+    w->lsize = w->lsize ? 2 * w->lsize : 32;
+    w->layers = (lstat_t*) realloc( w->layers, w->lsize * sizeof(lstat_t));
+    if ( w->layers == NULL ) {
+      fputs( "memory allocation error.\n", stderr );
+      exit(1);
+    }
+  }
+  l = w->layers + w->nlayers;
+  memset( l, 0, sizeof(lstat_t));
+  l->name = emalloc( len + 1 );
+  memcpy( l->name, name, len );
+  l->minzoom = MAXZOOM;
+  l->maxzoom = 0;
+  l->next = w->lhash[h] - 1;
+  w->lhash[h] = ++w->nlayers;
+  return l;
+}
+
+/* --------------------------------------------------------------------------
+ *  Accounts a layer of the walked tile
+ * --------------------------------------------------------------------------*/
+void count_layer( void *arg, mvtinfo_t *info )
+{
+  worker_t *w = (worker_t*) arg;
+  lstat_t *l = find_layer( w, info->name ? info->name : "", info->namelen );
+
+  l->tiles++;
+  l->features += info->nfeatures;
+  l->bytes += info->len;
+  if ( w->z < l->minzoom ) l->minzoom = w->z;
+  if ( w->z > l->maxzoom ) l->maxzoom = w->z;
+}
+
+/* --------------------------------------------------------------------------
+ *  Accounts a tile
+ * --------------------------------------------------------------------------*/
+void count_tile( worker_t *w, int z, int x, int y, char *data, uint32_t len )
+{
+  zstat_t *zs = w->zs + z;
+  int i;
+
+  if ( (zs->count == 0) || (len < zs->min) ) zs->min = len;
+  if ( len > zs->max ) zs->max = len;
+  zs->count++;
+  zs->bytes += len;
+  zs->hist[bucket( len )]++;
+
+  // largest tiles, kept sorted
+  if ( (w->nbig < NLARGEST) || (len > w->big[NLARGEST-1].len) ) {
+    i = (w->nbig < NLARGEST) ? w->nbig++ : NLARGEST - 1;
+    for( ; (i > 0) && (w->big[i-1].len < len); --i ) {
+      w->big[i] = w->big[i-1];
+    }
+    w->big[i].z = z;
+    w->big[i].x = x;
+    w->big[i].y = (1 << z) - 1 - y;
+    w->big[i].len = len;
+  }
+
+  if ( g_dups ) {
+    if ( w->ndups == w->dsize ) {
+      w->dsize = w->dsize ? 2 * w->dsize : 65536;
+      w->dups = (dup_t*) realloc( w->dups, w->dsize * sizeof(dup_t));
+      if ( w->dups == NULL ) {
+	fputs( "memory allocation error.\n", stderr );
+	exit(1);
+      }
+    }
+    w->dups[w->ndups].h = ((uint64_t) crc32( 0, (Bytef*) data, len ) << 32) |
+      adler32( 1, (Bytef*) data, len );
+    w->dups[w->ndups].len = len;
+    w->dups[w->ndups].z = z;
+    w->ndups++;
+  }
+
+  if ( !g_vector ) {
+    zs->raw += len;
+    return;
+  }
+  w->buf.len = 0;
+  w->z = z;
+  if ( (mvt_append( &w->buf, data, len ) < 0) ||
+       (mvt_walk( w->buf.data, w->buf.len, count_layer, w ) < 0) ) {
+    fprintf( stderr, "Cannot decode tile %d/%d/%d\n", z, x, (1 << z) - 1 - y );
+    w->bad++;
+  }
+  zs->raw += w->buf.len;
+}
+
+/* --------------------------------------------------------------------------
+ *  Worker thread : reads chunks of rowids until none is left
+ * --------------------------------------------------------------------------*/
+void *work( void *arg )
+{
+  worker_t *w = (worker_t*) arg;
+  sqlite3_int64 lo;
+  int z, x, y, len;
+
+  for( ;; ) {
+    pthread_mutex_lock( &g_lock );
+    lo = g_next;
+    g_next += CHUNK;
+    pthread_mutex_unlock( &g_lock );
+    if ( lo > g_last ) {
+      break;
+    }
+
+    sqlite3_bind_int64( w->stmt, 1, lo );
+    sqlite3_bind_int64( w->stmt, 2, lo + CHUNK - 1 );
+    while( sqlite3_step( w->stmt ) == SQLITE_ROW ) {
+      z = sqlite3_column_int( w->stmt, 0 );
+      x = sqlite3_column_int( w->stmt, 1 );
+      y = sqlite3_column_int( w->stmt, 2 );
+      len = sqlite3_column_bytes( w->stmt, 3 );
+      if ( (z < 0) || (z > MAXZOOM) || (x < 0) || (y < 0) || (x >> z) || (y >> z) ) {
+	fprintf( stderr, "Skipping invalid tile %d/%d/%d\n", z, x, y );
+	continue;
+      }
+      count_tile( w, z, x, y, (char*) sqlite3_column_blob( w->stmt, 3 ), len );
+    }
+    sqlite3_reset( w->stmt );
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Adds statistics of worker 'w' to those of worker 'to'
+ * --------------------------------------------------------------------------*/
+void merge( worker_t *to, worker_t *w )
+{
+  lstat_t *l, *s;
+  int i, z, b;
+
+  for( z = 0; z <= MAXZOOM; ++z ) {
+    zstat_t *d = to->zs + z, *zs = w->zs + z;
+    if ( zs->count == 0 ) continue;
+    if ( (d->count == 0) || (zs->min < d->min) ) d->min = zs->min;
+    if ( zs->max > d->max ) d->max = zs->max;
+    d->count += zs->count;
+    d->bytes += zs->bytes;
+    d->raw += zs->raw;
+    for( b = 0; b < NBUCKETS; ++b ) {
+      d->hist[b] += zs->hist[b];
+    }
+  }
+
+  for( i = 0; i < w->nlayers; ++i ) {
+    s = w->layers + i;
+    l = find_layer( to, s->name, strlen( s->name ));
+    l->tiles += s->tiles;
+    l->features += s->features;
+    l->bytes += s->bytes;
+    if ( s->minzoom < l->minzoom ) l->minzoom = s->minzoom;
+    if ( s->maxzoom > l->maxzoom ) l->maxzoom = s->maxzoom;
+    free( s->name );
+  }
+
+  for( i = 0; i < w->nbig; ++i ) {
+    big_t *t = w->big + i;
+    if ( (to->nbig < NLARGEST) || (t->len > to->big[NLARGEST-1].len) ) {
+      b = (to->nbig < NLARGEST) ? to->nbig++ : NLARGEST - 1;
+      for( ; (b > 0) && (to->big[b-1].len < t->len); --b ) {
+	to->big[b] = to->big[b-1];
+      }
+      to->big[b] = *t;
+    }
+  }
+
+  if ( w->ndups ) {
+    if ( to->ndups + w->ndups > to->dsize ) {
+      to->dsize = to->ndups + w->ndups;
+      to->dups = (dup_t*) realloc( to->dups, to->dsize * sizeof(dup_t));
+      if ( to->dups == NULL ) {
+	fputs( "memory allocation error.\n", stderr );
+	exit(1);
+      }
+    }
+    memcpy( to->dups + to->ndups, w->dups, w->ndups * sizeof(dup_t));
+    to->ndups += w->ndups;
+  }
+  to->bad += w->bad;
+}
+
+int dup_cmp( const void *a, const void *b )
+{
+  const dup_t *da = (const dup_t*) a, *db = (const dup_t*) b;
+  if ( da->h != db->h ) return (da->h > db->h) - (da->h < db->h);
+  if ( da->len != db->len ) return (da->len > db->len) - (da->len < db->len);
+  return da->z - db->z;
+}
+
+int layer_cmp( const void *a, const void *b )
+{
+  const lstat_t *la = (const lstat_t*) a, *lb = (const lstat_t*) b;
+  return (la->bytes < lb->bytes) - (la->bytes > lb->bytes);
+}
+
+/* --------------------------------------------------------------------------
+ *  Size below which 'p' percent of tiles of zoom level statistics 'zs' are
+ * --------------------------------------------------------------------------*/
+uint32_t percentile( zstat_t *zs, double p )
+{
+  uint64_t n = 0, k = (uint64_t) (p / 100.0 * zs->count);
+  uint32_t s;
+  int b;
+
+  for( b = 0; b < NBUCKETS - 1; ++b ) {
+    n += zs->hist[b];
+    if ( n > k ) break;
+  }
+  s = bucket_size( b );
+  if ( s < zs->min ) s = zs->min;
+  if ( s > zs->max ) s = zs->max;
+  return s;
+}
+
+/* --------------------------------------------------------------------------
+ *  Prints the report
+ * --------------------------------------------------------------------------*/
+void report( worker_t *all )
+{
+  zstat_t tot;
+  uint64_t ndups = 0, saved = 0;
+  size_t i;
+  int z;
+
+  // duplicates : tiles equal to a tile found before in sorted order
+  if ( g_dups && all->ndups ) {
+    qsort( all->dups, all->ndups, sizeof(dup_t), dup_cmp );
+    for( i = 1; i < all->ndups; ++i ) {
+      if ( (all->dups[i].h == all->dups[i-1].h) && (all->dups[i].len == all->dups[i-1].len) ) {
+	all->zs[all->dups[i].z].dups++;
+	ndups++;
+	saved += all->dups[i].len;
+      }
+    }
+  }
+
+  memset( &tot, 0, sizeof(tot));
+  printf( "\nzoom      tiles        bytes    raw bytes    min    p50    p90    p99      max  dups\n" );
+  for( z = 0; z <= MAXZOOM; ++z ) {
+    zstat_t *zs = all->zs + z;
+    if ( zs->count == 0 ) continue;
+    printf( "%4d %10llu %12llu %12llu %6u %6u %6u %6u %8u %4.1f%%\n", z,
+	    (unsigned long long) zs->count, (unsigned long long) zs->bytes,
+	    (unsigned long long) zs->raw, zs->min, percentile( zs, 50 ),
+	    percentile( zs, 90 ), percentile( zs, 99 ), zs->max,
+	    g_dups ? 100.0 * zs->dups / zs->count : 0.0 );
+    tot.count += zs->count;
+    tot.bytes += zs->bytes;
+    tot.raw += zs->raw;
+  }
+  printf( " all %10llu %12llu %12llu\n", (unsigned long long) tot.count,
+	  (unsigned long long) tot.bytes, (unsigned long long) tot.raw );
+
+  if ( all->nlayers ) {
+    qsort( all->layers, all->nlayers, sizeof(lstat_t), layer_cmp );
+    printf( "\nlayer                           tiles     features    raw bytes  share  zooms\n" );
+    for( i = 0; i < all->nlayers; ++i ) {
+      lstat_t *l = all->layers + i;
+      printf( "%-24s %12llu %12llu %12llu %5.1f%%  %d-%d\n", l->name,
+	      (unsigned long long) l->tiles, (unsigned long long) l->features,
+	      (unsigned long long) l->bytes, tot.raw ? 100.0 * l->bytes / tot.raw : 0.0,
+	      l->minzoom, l->maxzoom );
+    }
+  }
+
+  printf( "\nlargest tiles\n" );
+  for( i = 0; i < all->nbig; ++i ) {
+    printf( "  %d/%d/%d %u bytes\n", all->big[i].z, all->big[i].x, all->big[i].y, all->big[i].len );
+  }
+
+  if ( g_dups ) {
+    printf( "\n%llu distinct tiles, %llu duplicates (%.1f%%) holding %llu bytes (%.1f%%)\n",
+	    (unsigned long long) (tot.count - ndups), (unsigned long long) ndups,
+	    tot.count ? 100.0 * ndups / tot.count : 0.0, (unsigned long long) saved,
+	    tot.bytes ? 100.0 * saved / tot.bytes : 0.0 );
+  }
+  if ( all->bad ) {
+    printf( "%llu tiles could not be decoded\n", (unsigned long long) all->bad );
+  }
+}
+
+int usage( char *fmt, ... )
+{
+  FILE *fout = fmt ? stderr : stdout;
+  fprintf( fout, "usage: ");
+  if ( fmt ) {
+    va_list va;
+    va_start(va, fmt );
+    vfprintf( fout, fmt, va );
+    va_end(va);
+  }
+  else {
+    fputs( "tilestat -i input.mbtiles [-j threads] [-D]\n", fout );
+  }
+
+  fputs( "\t -h                  Prints this help message\n", fout );
+  fputs( "\t -i /path/to/input   mbtiles file to analyze\n", fout );
+  fputs( "\t -j threads          number of threads (default number of cpus)\n", fout );
+  fputs( "\t -D                  skips duplicate detection, which takes\n", fout );
+  fputs( "\t                     16 bytes of memory per tile\n", fout );
+
+  exit( fmt ? 1 : 0 );
+}
+
+int main( int argc, char **argv )
+{
+  char *ipath = NULL, *table, *query, format[16] = "";
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  worker_t *workers;
+  struct timespec t0, t1;
+  uint64_t bytes = 0;
+  double dt;
+  int opt, i, z, nth = 0;
+
+  while ((opt = getopt(argc, argv, "hi:j:D")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(NULL);
+      break;
+    case 'i':
+      if ( ipath  ) usage( "option '-%c' found more than once.\n", opt );
+      ipath = optarg;
+      break;
+    case 'j':
+      nth = atoi( optarg );
+      if ( nth <= 0 ) usage( "option '-%c' expects a number of threads.\n", opt );
+      break;
+    case 'D':
+      g_dups = 0;
+      break;
+    default: /* '?' */
+      usage( "unexpected value on command line '%s'.\n", optarg );
+    }
+  }
+  if ( !ipath ) {
+    usage( "option '-i' is mandatory.\n" );
+  }
+  if ( nth == 0 ) {
+    nth = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( nth <= 0 ) nth = 1;
+  }
+
+  if ( sqlite3_open_v2( ipath, &db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK ) {
+    fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  if ( has_table( db, "map" ) && has_table( db, "images" ) ) {
+    table = "map";
+    query = "SELECT map.zoom_level, map.tile_column, map.tile_row, images.tile_data "
+      "FROM map JOIN images ON images.tile_id = map.tile_id WHERE map.rowid BETWEEN ?1 AND ?2";
+  }
+  else if ( has_table( db, "tiles" ) ) {
+    table = "tiles";
+    query = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles WHERE rowid BETWEEN ?1 AND ?2";
+  }
+  else {
+    fprintf( stderr, "'%s' : unknown mbtiles schema.\n", ipath );
+    exit(1);
+  }
+
+  // vector tiles have their layers decoded
+  if ( has_table( db, "metadata" ) ) {
+    stmt = prepare( db, "SELECT value FROM metadata WHERE name = 'format'" );
+    if ( (sqlite3_step( stmt ) == SQLITE_ROW) && sqlite3_column_text( stmt, 0 ) ) {
+      snprintf( format, sizeof(format), "%s", sqlite3_column_text( stmt, 0 ));
+    }
+    sqlite3_finalize( stmt );
+  }
+  g_vector = !strcmp( format, "pbf" ) || !strcmp( format, "mvt" );
+
+  stmt = prepare( db, !strcmp( table, "map" ) ? "SELECT MIN(rowid), MAX(rowid) FROM map" :
+		  "SELECT MIN(rowid), MAX(rowid) FROM tiles" );
+  if ( (sqlite3_step( stmt ) != SQLITE_ROW) || (sqlite3_column_type( stmt, 0 ) == SQLITE_NULL) ) {
+    fprintf( stderr, "'%s' : no tiles found.\n", ipath );
+    exit(1);
+  }
+  g_next = sqlite3_column_int64( stmt, 0 );
+  g_last = sqlite3_column_int64( stmt, 1 );
+  sqlite3_finalize( stmt );
+
+  // each worker has its own read only connection
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  workers = (worker_t*) emalloc( nth * sizeof(worker_t));
+  for( i = 0; i < nth; ++i ) {
+    if ( sqlite3_open_v2( ipath, &workers[i].db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL ) != SQLITE_OK ) {
+      fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(workers[i].db));
+      exit(1);
+    }
+    workers[i].stmt = prepare( workers[i].db, query );
+    if ( pthread_create( &workers[i].th, NULL, work, workers + i ) ) {
+      perror( "pthread_create" );
+      exit(1);
+    }
+  }
+  for( i = 0; i < nth; ++i ) {
+    pthread_join( workers[i].th, NULL );
+    sqlite3_finalize( workers[i].stmt );
+    sqlite3_close( workers[i].db );
+    mvt_free( &workers[i].buf );
+    if ( i > 0 ) {
+      merge( workers, workers + i );
+      free( workers[i].layers );
+      free( workers[i].dups );
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  for( z = 0; z <= MAXZOOM; ++z ) {
+    bytes += workers->zs[z].bytes;
+  }
+  printf( "'%s' : %s tiles read in %.2f s by %d threads (%.1f MB/s)\n", ipath,
+	  format[0] ? format : "unknown", dt, nth, (dt > 0) ? bytes / dt / 1e6 : 0.0 );
+  report( workers );
+
+  sqlite3_close( db );
+  return 0;
+}
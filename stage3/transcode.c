@@ -0,0 +1,346 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <webp/encode.h>
+
+#include "transcode.h"
+#include "raster.h"
+
+extern void logger(const char *fmt, ...);
+
+#define JOB_FREE    0
+#define JOB_QUEUED  1
+#define JOB_RUNNING 2
+#define JOB_DONE    3
+
+typedef struct job_s {
+  uint64_t hash;
+  char *data;                 // source tile
+  int len;
+  char *out;                  // WebP tile, NULL if source is kept
+  int olen;
+  int state;
+  unsigned seq;               // jobs are run in submission order
+  double ms;                  // transcode time
+} job_t;
+
+static struct {
+  char *dir;
+  job_t jobs[TRANSCODE_MAXJOBS];
+  unsigned seq;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pfd[2];                 // workers notify main thread of done jobs
+  transcode_stats_t stats;
+} g_tc = { NULL, {{0}}, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { -1, -1 } };
+
+/* --------------------------------------------------------------------------
+ *  Builds path of cache file for tile hash 'h', files are spread in
+ *  256 directories. Returns length of directory part.
+ * --------------------------------------------------------------------------*/
+static int transcode_path( uint64_t h, char *path, int sz )
+{
+  int n = snprintf( path, sz, "%s/%02x/", g_tc.dir, (unsigned) (h >> 56) );
+  snprintf( path + n, sz - n, "%016llx.webp", (unsigned long long) h );
+  return n - 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Transcodes job tile and stores the result in disk cache.
+ *  Runs without lock, the job belongs to the calling worker.
+ * --------------------------------------------------------------------------*/
+static void transcode_job( job_t *j )
+{
+  struct timespec t0, t1;
+  char path[1024], tmp[1100];
+  uint8_t *webp = NULL;
+  image_t img;
+  size_t n = 0;
+  int fd, d;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  memset( &img, 0, sizeof(img));
+  j->out = NULL;
+  j->olen = 0;
+  if ( raster_decode( j->data, j->len, &img ) == 0 ) {
+    n = WebPEncodeRGBA( img.pix, img.w, img.h, 4 * img.w, TRANSCODE_QUALITY, &webp );
+  }
+  // keep source tile when transcoding doesn't pay
+  if ( (n > 0) && (n < (size_t) j->len) ) {
+    j->out = (char*) malloc( n );
+    if ( j->out == NULL ) {
+      fputs( "transcode: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    memcpy( j->out, webp, n );
+    j->olen = (int) n;
+  }
+  if ( webp ) {
+    WebPFree( webp );
+  }
+  raster_free( &img );
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  j->ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6;
+
+  // written under a temporary name so that readers never see partial files
+  d = transcode_path( j->hash, path, sizeof(path));
+  path[d] = 0;
+  if ( (mkdir( path, 0755 ) < 0) && (errno != EEXIST) ) {
+    perror( path );
+    return;
+  }
+  path[d] = '/';
+  snprintf( tmp, sizeof(tmp), "%s.%lx", path, (unsigned long) pthread_self());
+  fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 ) {
+    perror( tmp );
+    return;
+  }
+  if ( (j->olen > 0) && (write( fd, j->out, j->olen ) != j->olen) ) {
+    perror( tmp );
+    close( fd );
+    unlink( tmp );
+    return;
+  }
+  close( fd );
+  if ( rename( tmp, path ) < 0 ) {
+    perror( path );
+    unlink( tmp );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Worker thread, runs queued jobs in submission order
+ * --------------------------------------------------------------------------*/
+static void *transcode_work( void *arg )
+{
+  job_t *j;
+  int i;
+
+  for( ;; ) {
+    pthread_mutex_lock( &g_tc.lock );
+    for( ;; ) {
+      j = NULL;
+      for( i = 0; i < TRANSCODE_MAXJOBS; ++i ) {
+	if ( (g_tc.jobs[i].state == JOB_QUEUED) &&
+	     ((j == NULL) || ((int) (g_tc.jobs[i].seq - j->seq) < 0)) ) {
+	  j = g_tc.jobs + i;
+	}
+      }
+      if ( j ) break;
+      pthread_cond_wait( &g_tc.cond, &g_tc.lock );
+    }
+    j->state = JOB_RUNNING;
+    pthread_mutex_unlock( &g_tc.lock );
+
+    transcode_job( j );
+
+    pthread_mutex_lock( &g_tc.lock );
+    j->state = JOB_DONE;
+    pthread_mutex_unlock( &g_tc.lock );
+    if ( write( g_tc.pfd[1], "", 1 ) < 0 ) {
+      // pipe is full, main thread has pending wakeups anyway
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  Starts 'nworkers' threads transcoding tiles to disk cache 'dir'.
+ *  Returns a file descriptor readable when transcoded tiles are
+ *  available, -1 on error.
+ * --------------------------------------------------------------------------*/
+int transcode_init( char *dir, int nworkers )
+{
+  pthread_t th;
+  int i;
+
+  if ( (mkdir( dir, 0755 ) < 0) && (errno != EEXIST) ) {
+    perror( dir );
+    return -1;
+  }
+  if ( access( dir, W_OK | X_OK ) < 0 ) {
+    perror( dir );
+    return -1;
+  }
+  if ( pipe( g_tc.pfd ) < 0 ) {
+    perror( "pipe" );
+    return -1;
+  }
+  fcntl( g_tc.pfd[0], F_SETFL, fcntl( g_tc.pfd[0], F_GETFL, 0 ) | O_NONBLOCK );
+  fcntl( g_tc.pfd[1], F_SETFL, fcntl( g_tc.pfd[1], F_GETFL, 0 ) | O_NONBLOCK );
+  g_tc.dir = dir;
+
+  if ( nworkers > TRANSCODE_MAXWORKERS ) nworkers = TRANSCODE_MAXWORKERS;
+  if ( nworkers < 1 ) nworkers = 1;
+  for( i = 0; i < nworkers; ++i ) {
+    if ( pthread_create( &th, NULL, transcode_work, NULL ) ) {
+      perror( "pthread_create" );
+      return -1;
+    }
+    pthread_detach( th );
+  }
+  logger( "transcode : %d workers, cache in '%s'\n", nworkers, dir );
+  return g_tc.pfd[0];
+}
+
+/* --------------------------------------------------------------------------
+ *  Computes hash of source tile and looks for it in disk cache.
+ *  Returns 1 if found with 'out' set to malloc'ed WebP data, or to NULL
+ *  if source tile is kept, 0 if not found.
+ * --------------------------------------------------------------------------*/
+int transcode_lookup( char *data, int len, uint64_t *hash, char **out, int *olen )
+{
+  char path[1024];
+  struct stat st;
+  uint64_t h;
+  int fd, n, t = 0;
+
+  h = ((uint64_t) crc32( 0, (Bytef*) data, len ) << 32) | adler32( 1, (Bytef*) data, len );
+  *hash = h;
+  *out = NULL;
+  *olen = 0;
+
+  transcode_path( h, path, sizeof(path));
+  fd = open( path, O_RDONLY );
+  if ( fd < 0 ) {
+    return 0;
+  }
+  if ( fstat( fd, &st ) < 0 ) {
+    close( fd );
+    return 0;
+  }
+  if ( st.st_size > 0 ) {
+    *out = (char*) malloc( st.st_size );
+    if ( *out == NULL ) {
+      fputs( "transcode: memory allocation error.\n", stderr );
+      exit(1);
+    }
+    while( (t < st.st_size) && ((n = read( fd, *out + t, st.st_size - t )) > 0) ) {
+      t += n;
+    }
+    if ( t < st.st_size ) {
+      close( fd );
+      free( *out );
+      *out = NULL;
+      return 0;
+    }
+    *olen = t;
+  }
+  close( fd );
+  g_tc.stats.diskhits++;
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Queues source tile for transcoding, tiles already queued are only
+ *  transcoded once. Returns -1 if the queue is full.
+ * --------------------------------------------------------------------------*/
+int transcode_submit( uint64_t hash, char *data, int len )
+{
+  job_t *j = NULL;
+  int i;
+
+  pthread_mutex_lock( &g_tc.lock );
+  for( i = 0; i < TRANSCODE_MAXJOBS; ++i ) {
+    if ( g_tc.jobs[i].state == JOB_FREE ) {
+      if ( j == NULL ) j = g_tc.jobs + i;
+    }
+    else if ( g_tc.jobs[i].hash == hash ) {
+      pthread_mutex_unlock( &g_tc.lock );
+      return 0;
+    }
+  }
+  if ( j == NULL ) {
+    g_tc.stats.fallbacks++;
+    pthread_mutex_unlock( &g_tc.lock );
+    return -1;
+  }
+  j->data = (char*) malloc( len );
+  if ( j->data == NULL ) {
+    fputs( "transcode: memory allocation error.\n", stderr );
+    exit(1);
+  }
+  memcpy( j->data, data, len );
+  j->len = len;
+  j->hash = hash;
+  j->seq = g_tc.seq++;
+  j->state = JOB_QUEUED;
+  pthread_cond_signal( &g_tc.cond );
+  pthread_mutex_unlock( &g_tc.lock );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  Gets a transcoded tile, called by main thread when the descriptor
+ *  returned by transcode_init is readable. Returns 0 if no job is done,
+ *  otherwise 1 with 'out' set as for transcode_lookup.
+ * --------------------------------------------------------------------------*/
+int transcode_done( uint64_t *hash, char **out, int *olen )
+{
+  transcode_stats_t *st = &g_tc.stats;
+  char buf[64];
+  job_t *j = NULL;
+  int i;
+
+  while( read( g_tc.pfd[0], buf, sizeof(buf)) > 0 );
+
+  pthread_mutex_lock( &g_tc.lock );
+  for( i = 0; i < TRANSCODE_MAXJOBS; ++i ) {
+    if ( g_tc.jobs[i].state == JOB_DONE ) {
+      j = g_tc.jobs + i;
+      break;
+    }
+  }
+  if ( j == NULL ) {
+    pthread_mutex_unlock( &g_tc.lock );
+    return 0;
+  }
+  *hash = j->hash;
+  *out = j->out;
+  *olen = j->olen;
+  if ( j->out ) {
+    st->transcoded++;
+    st->inbytes += j->len;
+    st->outbytes += j->olen;
+  }
+  else {
+    st->kept++;
+  }
+  st->totalms += j->ms;
+  if ( j->ms > st->maxms ) {
+    st->maxms = j->ms;
+  }
+  free( j->data );
+  j->data = NULL;
+  j->state = JOB_FREE;
+  pthread_mutex_unlock( &g_tc.lock );
+  return 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Returns counters, updated by main thread only
+ * --------------------------------------------------------------------------*/
+transcode_stats_t *transcode_stats()
+{
+  int i;
+
+  g_tc.stats.queued = 0;
+  pthread_mutex_lock( &g_tc.lock );
+  for( i = 0; i < TRANSCODE_MAXJOBS; ++i ) {
+    if ( g_tc.jobs[i].state != JOB_FREE ) {
+      g_tc.stats.queued++;
+    }
+  }
+  pthread_mutex_unlock( &g_tc.lock );
+  return &g_tc.stats;
+}
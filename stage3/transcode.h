@@ -0,0 +1,39 @@
+#ifndef __TRANSCODE_H__
+#define __TRANSCODE_H__
+
+#include <stdint.h>
+
+/* --------------------------------------------------------------------------
+ *  Raster tiles transcoding to WebP by a pool of worker threads.
+ *  Results are stored in a disk cache keyed by a hash of the source
+ *  tile, an empty file tells the source tile is kept as is (it is
+ *  smaller or it can't be decoded).
+ * --------------------------------------------------------------------------*/
+
+// WebP quality factor
+#define TRANSCODE_QUALITY 75
+
+// max number of worker threads
+#define TRANSCODE_MAXWORKERS 8
+
+// max number of tiles queued or being transcoded
+#define TRANSCODE_MAXJOBS 64
+
+typedef struct transcode_stats_s {
+  unsigned long transcoded;   // tiles transcoded to WebP
+  unsigned long kept;         // tiles kept as is
+  unsigned long diskhits;     // tiles found in disk cache
+  unsigned long memhits;      // tiles found in memory, counted by caller
+  unsigned long fallbacks;    // tiles served as is because queue was full
+  unsigned long long inbytes, outbytes;  // sizes of transcoded tiles
+  double totalms, maxms;      // transcode latency
+  int queued;
+} transcode_stats_t;
+
+int   transcode_init( char *dir, int nworkers );
+int   transcode_lookup( char *data, int len, uint64_t *hash, char **out, int *olen );
+int   transcode_submit( uint64_t hash, char *data, int len );
+int   transcode_done( uint64_t *hash, char **out, int *olen );
+transcode_stats_t *transcode_stats();
+
+#endif